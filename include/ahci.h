@@ -0,0 +1,13 @@
+#ifndef _AHCI_H
+#define _AHCI_H 1
+
+/* SATA disks on AHCI controllers (e.g. QEMU's ich9-ahci). Every transfer
+ * is a DMA command with a scatter-gather PRD table; drives supporting
+ * native command queuing get up to 32 commands in flight at once through
+ * the block layer's start/reap interface. Disks are registered as
+ * sda, sdb, ... */
+
+/* Probe all AHCI controllers; returns the number of disks registered. */
+int ahci_init(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _ATA_H
+#define _ATA_H 1
+
+/* Parallel ATA disks on the IDE controller (legacy or PCI native ports).
+ * Transfers use bus-master DMA when the controller supports it and the
+ * firmware selected a DMA mode, otherwise PIO with READ/WRITE MULTIPLE;
+ * LBA48 commands are used on drives that support them. Drives are
+ * registered with the block layer as hda..hdd. */
+
+/* Probe both channels; returns the number of drives registered. */
+int ata_init(void);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef _BCACHE_H
+#define _BCACHE_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "blk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Buffer cache for block devices.
+ * Buffers are keyed by (device, block number, block size) and found through
+ * a hash table. Replacement is 2Q: blocks seen once wait in a FIFO (A1in);
+ * a block whose key is still remembered (A1out, keys only) after it was
+ * evicted from there, i.e. one that is used again, goes to an LRU list
+ * (Am) that scans cannot flush. Dirty buffers are written back when they
+ * are evicted, by bcache_sync, and by bcache_tick once they have waited
+ * BCACHE_WRITEBACK_MS; write-back goes through the request queue so
+ * adjacent blocks are merged. A device should be used with one block size
+ * at a time. */
+
+#define BCACHE_BLOCK_MAX    4096
+#define BCACHE_DEFAULT_BUFS 1024  /* 4 MiB */
+#define BCACHE_WRITEBACK_MS 5000
+
+#define BCACHE_VALID      0x01
+#define BCACHE_DIRTY      0x02
+#define BCACHE_PREFETCHED 0x04 /* read ahead and not used yet */
+
+struct bcache_buf {
+    struct blk_dev *dev;
+    uint64_t block;
+    unsigned int size;
+    uint8_t *data;    /* size bytes */
+    /* private to the cache */
+    unsigned int refs;
+    uint8_t flags;
+    uint8_t queue;
+    uint32_t dirtied; /* timer_ms when it became dirty */
+    struct bcache_buf *hnext, *prev, *next;
+};
+
+struct bcache_stats {
+    unsigned int capacity;   /* buffers */
+    unsigned int cached;     /* buffers holding a block */
+    unsigned int dirty;
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int ghost_hits; /* misses on recently evicted blocks, promoted to Am */
+    unsigned int evictions;
+    unsigned int writebacks; /* blocks written to devices */
+    unsigned int readahead;  /* blocks read ahead */
+    unsigned int ra_hits;    /* of those, blocks later found in the cache */
+};
+
+/* Allocate nbufs buffers; called with BCACHE_DEFAULT_BUFS on first use
+ * otherwise. Returns BLK_OK or BLK_EINVAL. */
+int bcache_init(unsigned int nbufs);
+
+/* Return the buffer for block (in units of size bytes, a power of two from
+ * 512 to BCACHE_BLOCK_MAX) with its contents read, pinned until
+ * bcache_put. NULL on I/O error or when every buffer is pinned. */
+struct bcache_buf *bcache_get(struct blk_dev *dev, uint64_t block, unsigned int size);
+/* The same for a block that will be overwritten completely: a block not in
+ * the cache is not read but zero filled. */
+struct bcache_buf *bcache_getblk(struct blk_dev *dev, uint64_t block, unsigned int size);
+void bcache_dirty(struct bcache_buf *b);
+void bcache_put(struct bcache_buf *b);
+
+/* Write back the dirty buffers of dev (NULL: all devices) and flush the
+ * device caches. Returns the number of blocks written or a blk_err. */
+int bcache_sync(struct blk_dev *dev);
+/* Periodic write-back: syncs if a buffer has been dirty for longer than
+ * BCACHE_WRITEBACK_MS. Called from the shell loop; cheap otherwise. */
+void bcache_tick(void);
+/* Write back and forget every block of dev. */
+int bcache_invalidate(struct blk_dev *dev);
+
+void bcache_stats(struct bcache_stats *st);
+
+/* Read the given device blocks into the cache as one batch of queued
+ * requests (merged where adjacent), without pinning them. Blocks already
+ * cached are skipped. Returns the number of blocks read or a blk_err. */
+int bcache_prefetch(struct blk_dev *dev, const uint64_t *blocks, unsigned int n, unsigned int size);
+
+/* Sequential read detection and adaptive readahead for one open file.
+ * A filesystem calls bcache_readahead before each read with the range of
+ * file blocks it is about to read. Reads continuing where the previous
+ * one ended grow the window from BCACHE_RA_MIN up to BCACHE_RA_MAX
+ * blocks; the next window is fetched while the reader is still inside the
+ * previous one, so a streaming reader keeps finding its blocks cached.
+ * Any other access resets the window. map translates a file block to a
+ * device block and returns nonzero for holes. Zero-initialise the state
+ * when the file is opened. */
+#define BCACHE_RA_MIN 4
+#define BCACHE_RA_MAX 64
+
+struct bcache_ra {
+    uint64_t next;     /* file block after the previous read */
+    uint64_t ahead;    /* file blocks below this were read ahead */
+    unsigned int window;  /* size of the next window */
+    unsigned int issued;  /* size of the last window */
+};
+
+typedef int (*bcache_map_fn)(void *arg, uint64_t file_block, uint64_t *dev_block);
+
+void bcache_readahead(struct bcache_ra *ra, struct blk_dev *dev, unsigned int size,
+                      uint64_t block, unsigned int count, uint64_t file_blocks,
+                      bcache_map_fn map, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BCACHE_H */
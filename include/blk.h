@@ -0,0 +1,110 @@
+#ifndef _BLK_H
+#define _BLK_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Block device layer.
+ * Drivers register a blk_dev with a transfer operation that moves a run of
+ * sectors to or from a list of memory segments in one device command.
+ * Callers either do synchronous I/O with blk_read/blk_write or queue
+ * requests with blk_submit; blk_run sorts the queue by LBA and merges
+ * requests for adjacent sectors in the same direction into one transfer
+ * (up to the device's max_sectors). Requests touching the same sectors as
+ * a queued write (or writes touching a queued read) are never reordered:
+ * the queue is run first. Devices that can keep several commands in flight
+ * (queue_depth > 1, start/reap) get up to queue_depth merged transfers
+ * issued at once and complete them in any order. All I/O is polled. */
+
+#define BLK_SECTOR     512
+#define BLK_MAX_SEGS   64  /* memory segments per transfer */
+#define BLK_QUEUE_MAX  64  /* requests waiting in a device queue */
+#define BLK_MAX_DEVS   8
+#define BLK_MAX_DEPTH  32  /* commands in flight per device */
+
+enum blk_err { BLK_OK = 0, BLK_EIO = -1, BLK_EINVAL = -2, BLK_ETIMEDOUT = -3, BLK_ENODEV = -4,
+               BLK_EBUSY = -5 /* start: no room until something is reaped */ };
+#define BLK_PENDING 1 /* blk_request.status while queued */
+
+struct blk_dev;
+
+struct blk_seg {
+    void *buf;
+    uint32_t sectors;
+};
+
+struct blk_ops {
+    /* Transfer count sectors starting at lba; the segments add up to count.
+     * count never exceeds dev->max_sectors. */
+    int (*transfer)(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                    const struct blk_seg *segs, unsigned int nsegs);
+    /* Write back the device's volatile cache; may be NULL. */
+    int (*flush)(struct blk_dev *dev);
+    /* Optional asynchronous interface, used by blk_run when queue_depth > 1.
+     * start issues a transfer like the one above and returns its tag
+     * (0 <= tag < BLK_MAX_DEPTH) or an error; the segments need not stay
+     * valid after it returns. BLK_EBUSY asks to reap first and retry.
+     * reap waits until a started transfer has finished and returns its
+     * tag with *status set; a failing device
+     * completes its outstanding transfers with errors. */
+    int (*start)(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                 const struct blk_seg *segs, unsigned int nsegs);
+    int (*reap)(struct blk_dev *dev, int *status);
+};
+
+struct blk_request {
+    uint64_t lba;
+    uint32_t count;  /* sectors */
+    int write;
+    void *buf;
+    int status;      /* BLK_PENDING until completed, then BLK_OK or an error */
+};
+
+struct blk_stats {
+    unsigned int requests;  /* requests completed through the queue */
+    unsigned int merged;    /* of those, requests merged into another's transfer */
+    unsigned int transfers; /* device commands issued */
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+};
+
+struct blk_dev {
+    char name[8];
+    uint64_t sectors;       /* capacity */
+    uint32_t max_sectors;   /* largest single transfer */
+    unsigned int queue_depth; /* transfers in flight with start/reap; 0 or 1: none */
+    unsigned int max_segs;  /* segments per transfer; 0: BLK_MAX_SEGS */
+    const struct blk_ops *ops;
+    void *priv;             /* driver data */
+    struct blk_request *queue[BLK_QUEUE_MAX];
+    unsigned int queued;
+    struct blk_stats stats;
+};
+
+/* Add a device; name, sectors, max_sectors and ops must be set. */
+int blk_register(struct blk_dev *dev);
+struct blk_dev *blk_find(const char *name);
+/* Enumerate registered devices by zero-based index; NULL past the end. */
+struct blk_dev *blk_device(unsigned int index);
+
+/* Queue a request; its status stays BLK_PENDING until blk_run. Returns
+ * BLK_OK or BLK_EINVAL (out of range, or more than max_sectors; use
+ * blk_read/blk_write for larger transfers). A full queue is run first. */
+int blk_submit(struct blk_dev *dev, struct blk_request *req);
+/* Issue every queued request; returns the number completed. */
+int blk_run(struct blk_dev *dev);
+
+/* Synchronous I/O; queued requests are run first. */
+int blk_read(struct blk_dev *dev, uint64_t lba, uint32_t count, void *buf);
+int blk_write(struct blk_dev *dev, uint64_t lba, uint32_t count, const void *buf);
+int blk_flush(struct blk_dev *dev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BLK_H */
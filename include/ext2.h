@@ -0,0 +1,30 @@
+#ifndef _EXT2_H
+#define _EXT2_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ext2 on a block device, mounted with fs_mount("ext2", devname, path)
+ * (see fs.h and vfs.h). Blocks go through the buffer cache, file reads
+ * get sequential readahead, and new blocks are allocated next to the
+ * previous block of the file so files stay contiguous within their block
+ * group. Indexed (htree) directories are searched through their hash
+ * index; adding an entry clears the index flag, since the index is not
+ * maintained here (e2fsck -D rebuilds it). Descriptors open on the same
+ * inode share one vnode and its readahead window. */
+
+#define EXT2_MAX_FILES 16  /* open vnodes */
+#define EXT2_MAX_MOUNTS 4
+
+extern const struct vfs_ops ext2_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EXT2_H */
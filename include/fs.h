@@ -14,20 +14,29 @@ extern "C" {
 #define FS_O_RDONLY 0x1
 
 typedef int fs_fd_t;
-enum fs_err { FS_OK = 0, FS_ENOENT = -1, FS_EIO = -2, FS_EINVAL = -3, FS_EMFILE = -4 };
+enum fs_err { FS_OK = 0, FS_ENOENT = -1, FS_EIO = -2, FS_EINVAL = -3, FS_EMFILE = -4,
+              FS_EDQUOT = -5 /* directory quota exceeded */,
+              FS_ECANCELED = -6 /* skipped: an earlier linked operation failed */,
+              FS_ESTALE = -7 /* descriptor's file was discarded, e.g. by fs_restore */ };
 
 struct fs_file {
     const char *name;       /* null-terminated path, e.g. "/README.txt" */
-    const uint8_t *data;   /* pointer to contents */
+    const uint8_t *data;   /* pointer to contents; NULL for directories and for
+                            * runtime (sparse) files, read those via fs_read */
     size_t size;           /* size in bytes */
     unsigned int uid;      /* owner uid (from packaging) */
     unsigned int gid;      /* owner gid */
     unsigned int mode;     /* permission bits (POSIX-like) */
 };
 
+/* Directory type bit reported in fs_stat.mode and fs_file.mode */
+#define FS_S_IFDIR 0x4000
+
 struct fs_stat {
     size_t size;    /* file size in bytes */
-    int is_dir;     /* 0 = file, 1 = directory (not used by ramfs) */
+    size_t allocated; /* bytes of memory backing the file; less than size for sparse
+                       * files, and shared pages are split between their users */
+    int is_dir;     /* 0 = file, 1 = directory */
     unsigned int uid; /* owner user id */
     unsigned int gid; /* owner group id */
     unsigned int mode; /* permission bits (POSIX-like) */
@@ -39,7 +48,8 @@ struct fs_stat {
  * success. */
 int fs_mount_initrd_embedded(void);
 
-/* Minimal file operations */
+/* Minimal file operations. The ramfs refuses to open paths of 256 bytes or
+ * more with FS_EINVAL. */
 fs_fd_t fs_open(const char *path, int flags);
 int fs_read(fs_fd_t fd, void *buf, size_t count);
 int fs_close(fs_fd_t fd);
@@ -53,33 +63,251 @@ int fs_stat(const char *path, struct fs_stat *st);
  * listing contents; it is intentionally minimal for Phase 1. */
 int fs_readdir(unsigned int index, const struct fs_file **out);
 
+/* Call cb for each overlay entry that fs_readdir returns after the initrd
+ * entries, in the same order (parents first), in one walk of the tree.
+ * A nonzero return from cb stops the walk and is returned; FS_OK once all
+ * entries were visited. */
+typedef int (*fs_overlay_cb)(const struct fs_file *f, void *arg);
+int fs_overlay_walk(fs_overlay_cb cb, void *arg);
+
 /* Phase 3: richer filesystem operations (hierarchical RAMFS overlay)
  * - fs_listdir(path, index, out) enumerates entries inside a directory
- * - fs_rename(oldpath, newpath) renames/moves a node
- * - fs_truncate(path, size) truncates or extends a file
+ * - fs_rename(oldpath, newpath) renames/moves a node; packaged files and
+ *   directories cannot be renamed, nor removed by fs_rmdir (FS_EINVAL)
+ * - fs_truncate(path, size) truncates or extends a file; extending leaves a
+ *   hole that reads back as zeros and takes no memory until written
  * - fs_rmdir(path) removes an empty directory
+ * - fs_copy(src, dst) copies a file or a whole directory tree to the new
+ *   path dst in one pass; file data is shared copy-on-write. fs_unlink
+ *   removes directories with everything below them.
  */
 int fs_listdir(const char *path, unsigned int index, const struct fs_file **out);
 int fs_rename(const char *oldpath, const char *newpath);
 int fs_truncate(const char *path, size_t size);
 int fs_rmdir(const char *path);
+int fs_copy(const char *src, const char *dst);
 /* Return 1 if path exists in the writable overlay, 0 otherwise */
 int fs_is_overlay(const char *path);
+/* Contents of a file that is held in one piece (a packaged initrd file not
+ * modified at runtime), valid until the file is next changed; NULL if the
+ * file has to be read through a descriptor. */
+const uint8_t *fs_map(const char *path, size_t *size);
 
-/* Permission and ownership helpers */
+/* Permission and ownership helpers. fs_chmod takes permission bits only
+ * and fails with FS_EINVAL for modes above 07777. */
 int fs_chmod(const char *path, unsigned int mode);
 int fs_chown(const char *path, unsigned int uid, unsigned int gid);
 
 /* Phase 2: writable in-memory file operations (simple ramfs overlay).
  * These are minimal helpers to create, write (append/overwrite), unlink
  * and create directories in a tiny dynamic ramfs that lives in kernel
- * memory. These do not persist across reboots.
+ * memory. They do not persist across reboots unless a journal device is
+ * attached (see journal.h).
  */
 int fs_create(const char *path, const uint8_t *data, size_t size);
 int fs_write(fs_fd_t fd, const void *buf, size_t count); /* append/write to an open fd */
 int fs_unlink(const char *path);
 int fs_mkdir(const char *path);
 
+/* A streaming transform for fs_splice, run over the source in order, one
+ * chunk at a time. run() turns len bytes at in into at most len * expand
+ * bytes at out and returns how many it produced, or a negative fs_err.
+ * out may be in itself, so a length-preserving transform must work in
+ * place; state carried between chunks lives behind arg. */
+struct fs_transform {
+    int (*run)(void *arg, const uint8_t *in, size_t len, uint8_t *out);
+    void *arg;
+    unsigned int expand;   /* most output bytes per input byte, 0 for 1 (at most 64) */
+};
+
+/* Append up to len bytes from the position of src_fd onwards to the file
+ * open on dst_fd, passed through t unless it is NULL; both positions
+ * advance. Within the ramfs no intermediate buffer is used: whole pages
+ * are shared copy-on-write with the source when nothing transforms them,
+ * anything else is copied or transformed straight from the source page
+ * into the destination page. Between filesystems the data goes through
+ * one kernel buffer. Returns the number of bytes appended to dst_fd. */
+int fs_splice(fs_fd_t src_fd, fs_fd_t dst_fd, size_t len, const struct fs_transform *t);
+
+/* Optional content-addressed deduplication of overlay file data. When
+ * enabled, file pages are hashed with SHA-256 once they are complete (or
+ * the file is created/closed) and identical pages are stored only once,
+ * shared copy-on-write. Disabling only stops new pages from being shared.
+ * The dedup ratio is block_refs / unique_blocks. */
+struct fs_dedup_stats {
+    int enabled;
+    unsigned int unique_blocks; /* distinct blocks held by the store */
+    unsigned int block_refs;    /* file pages referencing stored blocks */
+    unsigned int block_size;
+    size_t bytes_saved;
+};
+
+int fs_dedup_enable(int on);
+int fs_dedup_stats(struct fs_dedup_stats *st);
+
+/* Phase 4: snapshots of the whole ramfs tree.
+ * - fs_snapshot() records the current tree in O(1) and returns its id (>= 1),
+ *   or FS_EMFILE when all snapshot slots are taken. Later changes copy only
+ *   the nodes on the modified path; unchanged files and directories stay
+ *   shared between the snapshot and the live tree.
+ * - fs_restore(id) makes the snapshot the live tree again. The snapshot is
+ *   kept. Descriptors open on the discarded tree become stale: every call
+ *   on them except fs_close fails with FS_ESTALE.
+ * - fs_snapshot_drop(id) releases a snapshot and the nodes only it used.
+ * - fs_snapshot_list(index, id) enumerates the ids of kept snapshots.
+ */
+int fs_snapshot(void);
+int fs_restore(int id);
+int fs_snapshot_drop(int id);
+int fs_snapshot_list(unsigned int index, int *id);
+
+/* Aggregated usage of a subtree, maintained incrementally so queries are
+ * O(1). bytes is the logical size of all files below path (holes count);
+ * for a file path it is the file itself. A directory may carry a byte
+ * quota (0 = none); writes that would exceed the quota of any directory
+ * above the file fail with FS_EDQUOT. */
+struct fs_usage {
+    uint64_t bytes;
+    unsigned int files;
+    uint64_t quota;
+};
+
+int fs_usage(const char *path, struct fs_usage *u);
+int fs_set_quota(const char *path, uint64_t bytes);
+
+/* Find entries at or below dir whose basename matches the glob pattern
+ * (see glob.h), using a name index instead of listing directories. cb is
+ * called for each match, in basename order, with its full path; returning
+ * nonzero stops the search. Returns the number of matches or an fs_err. */
+typedef int (*fs_find_cb)(const char *path, int is_dir, void *arg);
+int fs_find(const char *dir, const char *pattern, fs_find_cb cb, void *arg);
+
+/* Full-text search over the contents of all files. query is a list of
+ * words and "quoted phrases"; a file matches when it contains all of them
+ * (words are letters, digits and '_', compared case-insensitively). An
+ * unquoted argument with punctuation, like a.b, is a phrase too. cb is
+ * called with the path of each matching file. An inverted index is built
+ * on the first search; later changes are indexed in a batch by the next
+ * one. Returns the number of matches or an fs_err. */
+int fs_search(const char *query, fs_find_cb cb, void *arg);
+
+/* Change notification. A watch on a path sees events for that path and
+ * everything below it. Events wait in a bounded ring; further changes to a
+ * path whose event is still queued are merged into it, so mask holds every
+ * kind of change seen since. A watch that lost events to a full ring gets
+ * an FS_EV_OVERFLOW event and should rescan. Watches with a callback have
+ * it run by fs_watch_dispatch(); the others read their events with
+ * fs_watch_read(), which returns 1 when an event was stored, 0 if none is
+ * queued, or an fs_err. */
+#define FS_EV_CREATE   0x01
+#define FS_EV_WRITE    0x02 /* contents changed: write, truncate, overwrite */
+#define FS_EV_UNLINK   0x04 /* unlink or rmdir */
+#define FS_EV_RENAME   0x08 /* path is the new name, from the old one */
+#define FS_EV_CHMOD    0x10 /* permissions or ownership changed */
+#define FS_EV_ALL      0x1f
+#define FS_EV_OVERFLOW 0x100
+
+#define FS_EVENT_PATH 128
+
+struct fs_event {
+    int wd;
+    unsigned int mask;
+    char path[FS_EVENT_PATH];
+    char from[FS_EVENT_PATH]; /* old path of a rename, otherwise empty */
+};
+
+typedef void (*fs_watch_cb)(const struct fs_event *ev, void *arg);
+
+/* Returns a watch descriptor (>= 0) or an fs_err. cb may be NULL. */
+int fs_watch(const char *path, unsigned int mask, fs_watch_cb cb, void *arg);
+int fs_unwatch(int wd);
+int fs_watch_read(int wd, struct fs_event *ev);
+int fs_watch_info(int wd, const char **path, unsigned int *mask);
+void fs_watch_dispatch(void);
+/* Report a change; called by the filesystem after each operation. */
+void fs_notify(unsigned int mask, const char *path, const char *from);
+
+/* Bracket a run of operations issued together. Inside a batch the ramfs
+ * keeps the last directory it resolved and reuses it for the next path in
+ * the same directory. Batches nest. */
+void fs_batch_begin(void);
+void fs_batch_end(void);
+
+/* Asynchronous-style submission and completion rings. Queue operations in
+ * entries from fs_ring_get_sqe(), run them with fs_ring_submit() and
+ * collect one completion per entry, in order, with fs_ring_reap().
+ * res is what the matching fs_* call returns. Entries flagged FS_SQE_LINK
+ * chain to the next one: after a failure the rest of the chain completes
+ * with FS_ECANCELED. FS_SQE_FD_LINK uses the descriptor opened earlier in
+ * the chain instead of fd. */
+enum fs_ring_op {
+    FS_OP_NOP,
+    FS_OP_OPEN,     /* path, len = flags */
+    FS_OP_CLOSE,    /* fd */
+    FS_OP_READ,     /* fd, buf, len */
+    FS_OP_WRITE,    /* fd, buf, len */
+    FS_OP_STAT,     /* path, buf = struct fs_stat * */
+    FS_OP_CREATE,   /* path, buf, len */
+    FS_OP_UNLINK,   /* path */
+    FS_OP_MKDIR,    /* path */
+    FS_OP_RMDIR,    /* path */
+    FS_OP_RENAME,   /* path, buf = new path */
+    FS_OP_TRUNCATE, /* path, len = size */
+    FS_OP_CHMOD     /* path, len = mode */
+};
+
+#define FS_SQE_LINK    0x01
+#define FS_SQE_FD_LINK 0x02
+
+#define FS_RING_MAX 1024
+
+struct fs_sqe {
+    uint8_t op;
+    uint8_t flags;
+    int fd;
+    const char *path;
+    void *buf;
+    size_t len;
+    uint64_t user_data; /* copied to the completion */
+};
+
+struct fs_cqe {
+    uint64_t user_data;
+    int res;
+};
+
+struct fs_ring {
+    unsigned int entries; /* power of two, for both rings */
+    unsigned int sq_head, sq_tail;
+    unsigned int cq_head, cq_tail;
+    struct fs_sqe *sq;
+    struct fs_cqe *cq;
+    int chain_failed;
+    int chain_fd;
+};
+
+int fs_ring_init(struct fs_ring *r, unsigned int entries);
+void fs_ring_free(struct fs_ring *r);
+/* Next free submission entry, zeroed, or NULL when the ring is full. */
+struct fs_sqe *fs_ring_get_sqe(struct fs_ring *r);
+/* Run queued entries; returns how many were consumed. */
+int fs_ring_submit(struct fs_ring *r);
+/* Pop the oldest completion into cqe; returns 1, or 0 if there is none. */
+int fs_ring_reap(struct fs_ring *r, struct fs_cqe *cqe);
+
+/* Phase 5: mounted filesystems (see vfs.h). fs_mount attaches a filesystem
+ * of the given type at path ("ext2": source is a block device, see blk.h;
+ * "proc": see procfs.h, source is ignored). The mount point is created in
+ * the filesystem below if needed; from then on every fs_* call on a path
+ * below it goes to the new filesystem. fs_umount writes everything back
+ * and detaches it. fs_mount_info enumerates the mount table, the ramfs at
+ * "/" first. fs_sync writes all dirty metadata and buffers and commits the
+ * overlay journal; it returns the number of blocks written or an fs_err. */
+int fs_mount(const char *type, const char *source, const char *path);
+int fs_umount(const char *path);
+int fs_mount_info(unsigned int index, const char **path, const char **type);
+int fs_sync(void);
+
 #ifdef __cplusplus
 }
 #endif
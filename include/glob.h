@@ -0,0 +1,76 @@
+#ifndef _GLOB_H
+#define _GLOB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shell-style wildcard patterns for a single name (no '/' handling):
+ *   *      any run of characters, including none
+ *   ?      any single character
+ *   [abc]  one of the listed characters; ranges like [a-z] and negation
+ *          with [!...] or [^...] are supported
+ *   \c     the character c literally
+ *
+ * A pattern is compiled once into a token list and matched by simulating
+ * all positions of the pattern at the same time (a bit set of states), so
+ * matching is O(name length * pattern tokens) with no backtracking.
+ */
+
+#define GLOB_MAX_TOKENS 63
+#define GLOB_MAX_CLASSES 8
+
+struct glob {
+    uint8_t ntok;
+    uint8_t type[GLOB_MAX_TOKENS];
+    uint8_t arg[GLOB_MAX_TOKENS];   /* literal character or class number */
+    uint8_t classes[GLOB_MAX_CLASSES][32]; /* 256-bit character sets */
+    uint8_t nclasses;
+    uint8_t prefix_len; /* leading literal characters, see glob_prefix */
+    char prefix[GLOB_MAX_TOKENS + 1];
+};
+
+/* Compile pattern into g. Returns 0, or -1 if the pattern has too many
+ * tokens or character classes, or an unterminated class. */
+int glob_compile(struct glob *g, const char *pattern);
+
+/* Return 1 if name matches the compiled pattern, 0 otherwise. */
+int glob_match(const struct glob *g, const char *name);
+
+/* Literal text every match must start with (may be empty). */
+const char *glob_prefix(const struct glob *g, size_t *len);
+
+/* Return 1 if s contains wildcard characters. */
+int glob_has_magic(const char *s);
+
+/* Argument vector filled by glob_expand. The storage is kept when the
+ * vector is reset, so expanding again reuses it. */
+struct glob_argv {
+    unsigned int argc;
+    char **argv;       /* argc strings followed by NULL */
+    unsigned int cap;  /* slots in argv */
+    char *strings;
+    size_t used, size;
+};
+
+void glob_argv_reset(struct glob_argv *av);
+void glob_argv_free(struct glob_argv *av);
+
+/* Append a copy of s. Returns 0, or -1 when out of memory. */
+int glob_argv_push(struct glob_argv *av, const char *s);
+
+/* Append the paths of existing files matching the absolute path pattern,
+ * in sorted order. Wildcards are matched one path component at a time
+ * against the entries of the directories matched so far, and a leading '*'
+ * or '?' does not match names starting with '.'. Returns the number of
+ * paths appended, or -1 on a bad pattern or when out of memory. */
+int glob_expand(struct glob_argv *av, const char *pattern);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _GLOB_H */
@@ -11,6 +11,8 @@
 /* The I/O port commands */
 #define FB_HIGH_BYTE_COMMAND 0x0e
 #define FB_LOW_BYTE_COMMAND 0x0f
+#define FB_START_HIGH_COMMAND 0x0c /* first cell displayed */
+#define FB_START_LOW_COMMAND 0x0d
 
 /* keyboard interface IO port: data and control
    READ:   status port
@@ -35,6 +37,12 @@ uint8_t input_bytes(uint16_t port);
 void output_bytes(uint16_t port, uint8_t val);
 uint8_t inw(uint16_t port);
 void outw(uint16_t port, uint16_t data);
+uint16_t input_word(uint16_t port);
+uint32_t input_dword(uint16_t port);
+void output_dword(uint16_t port, uint32_t val);
+/* String transfers of count 16-bit words (rep insw / rep outsw). */
+void input_words(uint16_t port, void *buf, uint32_t count);
+void output_words(uint16_t port, const void *buf, uint32_t count);
 uint8_t scan(void);
 void move_cursor(int row, int col);
 void move_cursor2(char c, enum vga_color char_color);
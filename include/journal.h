@@ -0,0 +1,89 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Write-ahead journal that makes the ramfs overlay persistent.
+ *
+ * Every change to the overlay is encoded as a record and collected in
+ * memory; fs_journal_commit() writes all records collected so far to the
+ * log on the journal device as one frame (one sequential write and a
+ * cache flush), so a batch of operations costs one write however many it
+ * holds. The shell commits once per command through fs_journal_tick().
+ * When the log is full, a checkpoint writes the whole overlay as a compact
+ * image to the spare image slot and starts an empty log; the superblock
+ * switches slots with a single sector write, so a crash leaves either the
+ * old image and log or the new image.
+ *
+ * fs_journal_attach() replays the image and then the log on top of the
+ * ramfs (normally right after boot, over the initrd) and keeps journaling
+ * to the device. The log ends at the first frame that is torn or belongs
+ * to an older generation. Paths below other mounts (see vfs.h) belong to
+ * those filesystems and are not journaled.
+ *
+ * All functions return FS_OK, a count, or a negative fs_err. */
+
+/* Prepare devname (see blk.h) as journal device, erasing it, and write
+ * the current overlay as its first image. */
+int fs_journal_format(const char *devname);
+/* Replay the journal on devname and keep journaling to it. FS_ENOENT if
+ * devname holds no journal. */
+int fs_journal_attach(const char *devname);
+/* Stop journaling after committing what is pending. */
+int fs_journal_detach(void);
+/* Write pending records; returns the number of records written. */
+int fs_journal_commit(void);
+/* Write the overlay as a new image and empty the log. */
+int fs_journal_checkpoint(void);
+/* Called by the shell after each command: commit the batch. */
+void fs_journal_tick(void);
+
+struct fs_journal_stats {
+    const char *dev;         /* NULL when not journaling */
+    unsigned int generation; /* checkpoints since the device was formatted */
+    unsigned int commits;    /* log frames written */
+    unsigned int records;    /* records logged */
+    unsigned int pending;    /* records waiting for the next commit */
+    unsigned int checkpoints;
+    unsigned int replayed;   /* records applied by the last attach */
+    uint64_t bytes;          /* bytes written to the log */
+    uint32_t log_used, log_size;        /* sectors */
+    uint32_t image_size, image_max;     /* sectors */
+};
+
+int fs_journal_stats(struct fs_journal_stats *st);
+
+/* Hooks for the ramfs: record one completed change. op is one of the
+ * JOURNAL_* values; path2 is the second path of a rename or copy, data
+ * the new contents (create) or appended bytes (write); arg/arg2 carry
+ * mode, uid/gid, size or quota (low and high word). */
+enum journal_op {
+    JOURNAL_CREATE = 1,
+    JOURNAL_APPEND,
+    JOURNAL_MKDIR,
+    JOURNAL_UNLINK,
+    JOURNAL_RMDIR,
+    JOURNAL_RENAME,
+    JOURNAL_COPY,
+    JOURNAL_TRUNCATE,
+    JOURNAL_CHMOD,
+    JOURNAL_CHOWN,
+    JOURNAL_QUOTA
+};
+
+void journal_log(enum journal_op op, const char *path, const char *path2,
+                 const void *data, size_t len, uint32_t arg, uint32_t arg2);
+/* The overlay changed in a way the log cannot express (a snapshot was
+ * restored): the next commit writes a full image instead. */
+void journal_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _JOURNAL_H */
@@ -44,6 +44,7 @@ int heap_create(struct heap *heap, void *ptr, void *end, struct heap_table *tabl
 void *memcpy(void *dest, const void *src, size_t n);
 void *heap_malloc(struct heap *heap, size_t size);
 void heap_free(struct heap *heap, void *ptr);
+uint32_t heap_used_blocks(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 
@@ -0,0 +1,54 @@
+#ifndef _MULTIBOOT_H
+#define _MULTIBOOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Multiboot (version 1) boot information, as far as the kernel uses it.
+ * The bootloader leaves MULTIBOOT_BOOTLOADER_MAGIC in eax and the address
+ * of struct multiboot_info in ebx; loader.s passes both to main. */
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MODS 0x00000008
+
+struct multiboot_info {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+} __attribute__((packed));
+
+struct multiboot_mod {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t cmdline;
+    uint32_t reserved;
+} __attribute__((packed));
+
+#define MULTIBOOT_MAX_MODULES 8
+#define MULTIBOOT_CMDLINE_MAX 64
+
+/* Record the modules passed by the bootloader. Must run before the heap
+ * is initialised: the boot information may lie in memory the heap table
+ * later overwrites. Modules overlapping the heap are ignored. Returns the
+ * number of usable modules. */
+int multiboot_init(uint32_t magic, uint32_t info_addr);
+
+unsigned int multiboot_module_count(void);
+
+/* Contents and command line of module index. Returns 0, or -1 if there is
+ * no such module. */
+int multiboot_module(unsigned int index, const uint8_t **data, size_t *size, const char **cmdline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MULTIBOOT_H */
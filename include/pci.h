@@ -0,0 +1,37 @@
+#ifndef _PCI_H
+#define _PCI_H 1
+
+#include "stdint.h"
+
+/* PCI configuration space access (mechanism #1, ports 0xCF8/0xCFC) and a
+ * scan of the buses for device drivers. */
+
+struct pci_dev {
+    uint8_t bus, slot, func;
+    uint16_t vendor, device;
+    uint8_t class_code, subclass, prog_if;
+    uint8_t irq;
+    uint32_t bar[6];
+};
+
+/* PCI_COMMAND bits */
+#define PCI_CMD_IO        0x0001
+#define PCI_CMD_MEMORY    0x0002
+#define PCI_CMD_BUSMASTER 0x0004
+
+uint32_t pci_read32(const struct pci_dev *d, uint8_t off);
+void pci_write32(const struct pci_dev *d, uint8_t off, uint32_t val);
+uint16_t pci_read16(const struct pci_dev *d, uint8_t off);
+void pci_write16(const struct pci_dev *d, uint8_t off, uint16_t val);
+
+/* Find the index-th function with the given class and subclass (prog_if
+ * 0xFF matches any). Returns 0 and fills out, or -1 if there is none. */
+int pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, unsigned int index, struct pci_dev *out);
+
+/* Find the index-th function with the given vendor and device id. */
+int pci_find_device(uint16_t vendor, uint16_t device, unsigned int index, struct pci_dev *out);
+
+/* Set bits in the command register (I/O, memory decoding, bus mastering). */
+void pci_enable(const struct pci_dev *d, uint16_t cmd_bits);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _PROCFS_H
+#define _PROCFS_H 1
+
+#include "vfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Live statistics as read-only text files, mounted at boot with
+ * fs_mount("proc", NULL, "/proc") (see fs.h and vfs.h):
+ *
+ *   /proc/meminfo    kernel heap size and use
+ *   /proc/uptime     seconds since boot
+ *   /proc/cpuinfo    CPUID vendor, model, clock and feature flags
+ *   /proc/fs/stats   mounts, ramfs usage, dedup, buffer cache, journal
+ *   /proc/net/fw     firewall rules, one per line
+ *
+ * Nothing is computed until a file is read: the first read of each open
+ * descriptor renders the file into a buffer of its own, so later reads of
+ * that descriptor see one consistent snapshot, and the buffer is freed
+ * with the descriptor. Files report size 0 and are read until fs_read
+ * returns 0. */
+
+#define PROCFS_MAX_FILES 8  /* open vnodes */
+
+extern const struct vfs_ops procfs_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PROCFS_H */
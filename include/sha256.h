@@ -2,12 +2,17 @@
 #define _SHA256_H 1
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* Compute SHA-256 digest for `message` and write a 64-character
  * lowercase hex string into `out` (must have at least 65 bytes).
- * Returns 0 on success. */
+ * Returns 0 on success, -1 for messages longer than 55 bytes. */
 int sha256_hex(const char *message, char *out, size_t out_len);
 
+/* Compute the raw 32-byte SHA-256 digest of len bytes at data.
+ * Returns 0 on success. */
+int sha256_digest(const void *data, size_t len, uint8_t out[32]);
+
 /* Legacy helper that prints the digest to the kernel console. Kept
  * for compatibility with existing callers. */
 void sha256(const char *message);
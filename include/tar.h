@@ -0,0 +1,39 @@
+#ifndef _TAR_H
+#define _TAR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ustar archive import/export for the ramfs.
+ * - Regular files and directories are supported, with GNU long names and
+ *   pax path records on input; links, devices and fifos are skipped.
+ * - Paths containing ".." are skipped; leading "/" and "./" are dropped, so
+ *   everything lands below the destination directory.
+ * All functions return FS_OK or a negative fs_err; the archive is processed
+ * as far as possible and the first error is reported. */
+
+struct tar_stats {
+    unsigned int files;   /* regular files written */
+    unsigned int dirs;    /* directories created */
+    unsigned int skipped; /* entries that were not extracted */
+    uint64_t bytes;       /* file data written */
+};
+
+/* Extract an archive held in memory (a packaged file or a boot module). */
+int tar_extract_mem(const uint8_t *data, size_t size, const char *dest, struct tar_stats *st);
+
+/* Extract the archive stored at path archive. */
+int tar_extract_file(const char *archive, const char *dest, struct tar_stats *st);
+
+/* Write the tree below dir to a new archive at path archive. */
+int tar_create(const char *dir, const char *archive, struct tar_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TAR_H */
@@ -0,0 +1,32 @@
+#ifndef _TIMER_H
+#define _TIMER_H 1
+
+#include "stdint.h"
+
+/* Time measurement with the CPU time stamp counter. There are no timer
+ * interrupts: timer_init() calibrates the counter once against PIT
+ * channel 2 (polled), after which elapsed times can be read at any point. */
+
+void timer_init(void);
+
+/* Current time stamp counter value. */
+uint64_t timer_ticks(void);
+
+/* Convert a tick count to microseconds / milliseconds (0 before timer_init). */
+uint64_t timer_us(uint64_t ticks);
+uint32_t timer_ms(uint64_t ticks);
+
+/* Time stamp counter frequency in kHz (0 before timer_init). */
+uint32_t timer_khz(void);
+
+/* Milliseconds since timer_init, that is since boot. */
+uint32_t timer_uptime_ms(void);
+
+/* amount per second over an interval of ticks, e.g. bytes/s or
+ * operations/s; saturates at 0xFFFFFFFF and is 0 before timer_init. */
+uint32_t timer_rate(uint64_t amount, uint64_t ticks);
+
+/* Busy-wait for the given number of microseconds. */
+void udelay(uint32_t us);
+
+#endif
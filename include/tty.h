@@ -31,6 +31,14 @@ extern enum vga_color default_font_color;
 
 void terminal_initialize(enum vga_color font_color, enum vga_color background_color);
 void terminal_set_colors(enum vga_color font_color, enum vga_color background_color);
+/* Copy the rows written since the last call to the screen (see tty.c). */
+void terminal_flush(void);
+/* Scroll the display back (pages > 0) or forward through the last few
+ * thousand lines, a screen less one line per page; 0 returns to the live
+ * screen, as any output does. */
+void terminal_scrollback(int pages);
+/* Cell of video memory for column x of row y of the live screen. */
+unsigned int terminal_cursor_cell(size_t x, size_t y);
 int printk(const char *format, ...);
 int get_terminal_row(void);
 int get_terminal_col(void);
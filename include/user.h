@@ -19,9 +19,12 @@ typedef struct user {
     char passwd[USER_PASS_MAX]; /* plaintext or hashed depending on system */
     unsigned int uid;
     unsigned int gid;
+    int runtime; /* added with user_add rather than read from the passwd file */
 } user_t;
 
-/* Initialize user subsystem by reading a passwd file in initrd. Returns 0 on success. */
+/* Initialize user subsystem by reading a passwd file in initrd. Returns 0 on success.
+ * The file is watched afterwards and read again whenever it is written or
+ * replaced; users added at runtime are kept. */
 int user_init_from_file(const char *path);
 
 /* Attempt login with username and password. Returns 0 on success, non-zero otherwise. */
@@ -0,0 +1,89 @@
+#ifndef _VFS_H
+#define _VFS_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Virtual filesystem switch.
+ * The path calls of fs.h go through a mount table: the mount whose mount
+ * point is the longest prefix of the path (ending at a component boundary)
+ * gets the call through its vfs_ops, with the part of the path below the
+ * mount point ("" for the mount point itself, otherwise "/..."). The ramfs
+ * is always mounted at "/" and receives paths unchanged, so a path that
+ * crosses no mount point costs one pass over the (usually empty) list of
+ * other mounts.
+ *
+ * Descriptors refer to vnodes, which hold what a backend keeps for an open
+ * file. Opening a file that is already open on the same mount shares its
+ * vnode (when the backend reports an identity for it), so descriptors of
+ * one file share backend state such as a readahead window; the vnode is
+ * released with its last descriptor. The file position belongs to the
+ * descriptor. */
+
+#define VFS_MAX_MOUNTS 8
+#define VFS_MAX_FDS    32
+#define VFS_SPLICE_CHUNK 16384 /* buffer of fs_splice between filesystems */
+
+struct vfs_mount;
+
+struct vnode {
+    struct vfs_mount *mnt;  /* NULL once its filesystem is unmounted */
+    uint64_t id;            /* set by open: identity of the file, 0 if not shareable */
+    void *priv;             /* set by open: backend data */
+    unsigned int refs;      /* descriptors open on it */
+};
+
+/* Operations of a filesystem type. fs is the instance returned by mount;
+ * paths are relative to the mount point as described above. Operations
+ * left NULL fail with FS_EINVAL. All return FS_OK, a count, or a negative
+ * fs_err. */
+struct vfs_ops {
+    const char *type;       /* name given to fs_mount, e.g. "ext2" */
+    /* Attach the filesystem on source (a block device name, ignored by
+     * filesystems without one) that is being mounted at path. */
+    int (*mount)(const char *source, const char *path, void **fs);
+    /* Write everything back and detach; no vnodes are open any more. */
+    int (*unmount)(void *fs);
+    /* Write back dirty metadata; data goes out with the buffer cache. */
+    int (*sync)(void *fs);
+
+    /* Set up vn->priv (and vn->id) for the file at path. */
+    int (*open)(void *fs, const char *path, int flags, struct vnode *vn);
+    int (*release)(struct vnode *vn);
+    int (*read)(struct vnode *vn, size_t pos, void *buf, size_t count);
+    /* Append; *end receives the new size of the file. */
+    int (*write)(struct vnode *vn, const void *buf, size_t count, size_t *end);
+    /* Append up to len bytes of src from *pos on to dst, both of this
+     * filesystem, through t if not NULL (see fs_splice). *pos advances by
+     * the bytes taken from src and *end receives the new size of dst.
+     * Without it fs_splice goes through read and write. */
+    int (*splice)(struct vnode *src, size_t *pos, struct vnode *dst, size_t len,
+                  const struct fs_transform *t, size_t *end);
+
+    int (*stat)(void *fs, const char *path, struct fs_stat *st);
+    /* Names in *out are full paths, as seen through the mount point. */
+    int (*listdir)(void *fs, const char *path, unsigned int index, const struct fs_file **out);
+    int (*create)(void *fs, const char *path, const uint8_t *data, size_t size);
+    int (*unlink)(void *fs, const char *path);
+    int (*mkdir)(void *fs, const char *path);
+    int (*rmdir)(void *fs, const char *path);
+    int (*rename)(void *fs, const char *oldpath, const char *newpath);
+    int (*truncate)(void *fs, const char *path, size_t size);
+    int (*chmod)(void *fs, const char *path, unsigned int mode);
+    int (*chown)(void *fs, const char *path, unsigned int uid, unsigned int gid);
+    int (*copy)(void *fs, const char *src, const char *dst);
+};
+
+/* The root filesystem; its instance pointer is NULL. */
+extern const struct vfs_ops ramfs_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _VFS_H */
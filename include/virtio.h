@@ -0,0 +1,14 @@
+#ifndef _VIRTIO_H
+#define _VIRTIO_H 1
+
+/* virtio-blk disks over the legacy (transitional) virtio PCI interface,
+ * as provided by QEMU's virtio-blk-pci. Requests are descriptor chains in
+ * a split virtqueue; a batch of requests is published with one avail ring
+ * update and at most one notification, and with VIRTIO_RING_F_EVENT_IDX
+ * the device is asked for a single completion event per batch. Disks are
+ * registered as vda, vdb, ... */
+
+/* Probe all virtio-blk devices; returns the number registered. */
+int virtio_blk_init(void);
+
+#endif
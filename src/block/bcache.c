@@ -0,0 +1,460 @@
+#include "../include/bcache.h"
+#include "../include/timer.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+#define BCACHE_HASH 1024
+
+enum { Q_FREE, Q_A1IN, Q_AM, Q_A1OUT };
+
+struct list {
+    struct bcache_buf *head, *tail; /* head: most recent */
+    unsigned int n;
+};
+
+static struct bcache_buf *bufs;   /* nbufs buffers */
+static struct bcache_buf *ghosts; /* nghosts keys of evicted A1in blocks */
+static uint8_t *arena;
+static unsigned int nbufs, nghosts;
+static unsigned int kin;          /* A1in target size */
+static struct bcache_buf *buf_hash[BCACHE_HASH];
+static struct bcache_buf *ghost_hash[BCACHE_HASH];
+static struct list freelist, a1in, am, a1out;
+static struct bcache_stats stats;
+static unsigned int dirty_count;
+static uint32_t oldest_dirty;     /* timer_ms of the first dirtying since the last sync */
+
+static unsigned int hash(const struct blk_dev *dev, uint64_t block)
+{
+    uint32_t h = (uint32_t)(uintptr_t)dev >> 4;
+    h ^= (uint32_t)block * 2654435761u;
+    h ^= (uint32_t)(block >> 32);
+    return (h ^ (h >> 16)) & (BCACHE_HASH - 1);
+}
+
+static void list_remove(struct list *l, struct bcache_buf *b)
+{
+    if (b->prev) b->prev->next = b->next;
+    else l->head = b->next;
+    if (b->next) b->next->prev = b->prev;
+    else l->tail = b->prev;
+    b->prev = b->next = NULL;
+    l->n--;
+}
+
+static void list_push(struct list *l, struct bcache_buf *b)
+{
+    b->prev = NULL;
+    b->next = l->head;
+    if (l->head) l->head->prev = b;
+    else l->tail = b;
+    l->head = b;
+    l->n++;
+}
+
+static struct list *queue_list(uint8_t queue)
+{
+    switch (queue) {
+    case Q_A1IN: return &a1in;
+    case Q_AM: return &am;
+    case Q_A1OUT: return &a1out;
+    default: return &freelist;
+    }
+}
+
+static struct bcache_buf *hash_find(struct bcache_buf **table, const struct blk_dev *dev, uint64_t block, unsigned int size)
+{
+    for (struct bcache_buf *b = table[hash(dev, block)]; b; b = b->hnext) {
+        if (b->dev == dev && b->block == block && b->size == size) return b;
+    }
+    return NULL;
+}
+
+static void hash_insert(struct bcache_buf **table, struct bcache_buf *b)
+{
+    unsigned int h = hash(b->dev, b->block);
+    b->hnext = table[h];
+    table[h] = b;
+}
+
+static void hash_remove(struct bcache_buf **table, struct bcache_buf *b)
+{
+    struct bcache_buf **pp = &table[hash(b->dev, b->block)];
+    while (*pp && *pp != b) pp = &(*pp)->hnext;
+    if (*pp) *pp = b->hnext;
+    b->hnext = NULL;
+}
+
+int bcache_init(unsigned int count)
+{
+    if (bufs || count < 8) return BLK_EINVAL;
+    unsigned int ng = count / 2;
+    bufs = kmalloc(count * sizeof(struct bcache_buf));
+    ghosts = kmalloc(ng * sizeof(struct bcache_buf));
+    /* one heap block per buffer keeps the data page aligned for DMA */
+    arena = kmalloc((size_t)count * BCACHE_BLOCK_MAX);
+    if (!bufs || !ghosts || !arena) {
+        if (bufs) kfree(bufs);
+        if (ghosts) kfree(ghosts);
+        if (arena) kfree(arena);
+        bufs = ghosts = NULL;
+        arena = NULL;
+        return BLK_EINVAL;
+    }
+    memset(bufs, 0, count * sizeof(struct bcache_buf));
+    memset(ghosts, 0, ng * sizeof(struct bcache_buf));
+    nbufs = count;
+    nghosts = ng;
+    kin = count / 4;
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = count;
+    for (unsigned int i = 0; i < count; ++i) {
+        bufs[i].data = arena + (size_t)i * BCACHE_BLOCK_MAX;
+        list_push(&freelist, &bufs[i]);
+    }
+    return BLK_OK;
+}
+
+static int write_one(struct bcache_buf *b)
+{
+    int res = blk_write(b->dev, b->block * (b->size / BLK_SECTOR), b->size / BLK_SECTOR, b->data);
+    if (res == BLK_OK) {
+        b->flags &= ~BCACHE_DIRTY;
+        dirty_count--;
+        stats.writebacks++;
+    }
+    return res;
+}
+
+/* Remember the key of a block evicted from A1in. */
+static void add_ghost(const struct bcache_buf *b)
+{
+    struct bcache_buf *g;
+    if (a1out.n < nghosts) {
+        g = &ghosts[a1out.n];
+    } else {
+        g = a1out.tail;
+        list_remove(&a1out, g);
+        hash_remove(ghost_hash, g);
+    }
+    g->dev = b->dev;
+    g->block = b->block;
+    g->size = b->size;
+    g->queue = Q_A1OUT;
+    hash_insert(ghost_hash, g);
+    list_push(&a1out, g);
+}
+
+/* Forget a remembered key, keeping ghosts[0, a1out.n) packed by moving
+ * the last one into the hole. */
+static void drop_ghost(struct bcache_buf *g)
+{
+    hash_remove(ghost_hash, g);
+    list_remove(&a1out, g);
+    struct bcache_buf *last = &ghosts[a1out.n];
+    if (last == g) return;
+    *g = *last;
+    if (g->prev) g->prev->next = g;
+    else a1out.head = g;
+    if (g->next) g->next->prev = g;
+    else a1out.tail = g;
+    hash_remove(ghost_hash, last);
+    hash_insert(ghost_hash, g);
+}
+
+/* Oldest unpinned buffer of l, NULL if there is none. */
+static struct bcache_buf *victim(struct list *l)
+{
+    for (struct bcache_buf *b = l->tail; b; b = b->prev) {
+        if (!b->refs) return b;
+    }
+    return NULL;
+}
+
+/* A buffer to load a new block into, detached from every list. */
+static struct bcache_buf *reclaim(void)
+{
+    struct bcache_buf *b = freelist.head;
+    if (b) {
+        list_remove(&freelist, b);
+        return b;
+    }
+    /* 2Q: shrink A1in down to kin before touching the hot blocks in Am */
+    if (a1in.n > kin || !am.n) {
+        b = victim(&a1in);
+        if (!b) b = victim(&am);
+    } else {
+        b = victim(&am);
+        if (!b) b = victim(&a1in);
+    }
+    if (!b) return NULL;
+    if ((b->flags & BCACHE_DIRTY) && write_one(b) != BLK_OK) return NULL;
+    if (b->queue == Q_A1IN) add_ghost(b);
+    list_remove(queue_list(b->queue), b);
+    hash_remove(buf_hash, b);
+    stats.evictions++;
+    stats.cached--;
+    b->flags = 0;
+    return b;
+}
+
+static struct bcache_buf *lookup(struct blk_dev *dev, uint64_t block, unsigned int size, int read)
+{
+    if (!dev || size < BLK_SECTOR || size > BCACHE_BLOCK_MAX || (size & (size - 1))) return NULL;
+    if (!bufs && bcache_init(BCACHE_DEFAULT_BUFS) != BLK_OK) return NULL;
+    struct bcache_buf *b = hash_find(buf_hash, dev, block, size);
+    if (b) {
+        stats.hits++;
+        if (b->flags & BCACHE_PREFETCHED) {
+            b->flags &= ~BCACHE_PREFETCHED;
+            stats.ra_hits++;
+        }
+        /* A1in is a FIFO: a second touch there is usually part of the same
+         * burst and proves nothing; Am is LRU */
+        if (b->queue == Q_AM) {
+            list_remove(&am, b);
+            list_push(&am, b);
+        }
+        b->refs++;
+        return b;
+    }
+    stats.misses++;
+    b = reclaim();
+    if (!b) return NULL;
+    b->dev = dev;
+    b->block = block;
+    b->size = size;
+    if (read) {
+        if (blk_read(dev, block * (size / BLK_SECTOR), size / BLK_SECTOR, b->data) != BLK_OK) {
+            b->queue = Q_FREE;
+            list_push(&freelist, b);
+            return NULL;
+        }
+    } else {
+        memset(b->data, 0, size);
+    }
+    b->flags = BCACHE_VALID;
+    b->refs = 1;
+    struct bcache_buf *g = hash_find(ghost_hash, dev, block, size);
+    if (g) {
+        /* evicted from A1in but wanted again: this one is hot */
+        stats.ghost_hits++;
+        drop_ghost(g);
+        b->queue = Q_AM;
+        list_push(&am, b);
+    } else {
+        b->queue = Q_A1IN;
+        list_push(&a1in, b);
+    }
+    hash_insert(buf_hash, b);
+    stats.cached++;
+    return b;
+}
+
+struct bcache_buf *bcache_get(struct blk_dev *dev, uint64_t block, unsigned int size)
+{
+    return lookup(dev, block, size, 1);
+}
+
+struct bcache_buf *bcache_getblk(struct blk_dev *dev, uint64_t block, unsigned int size)
+{
+    return lookup(dev, block, size, 0);
+}
+
+void bcache_dirty(struct bcache_buf *b)
+{
+    if (b->flags & BCACHE_DIRTY) return;
+    b->flags |= BCACHE_DIRTY;
+    b->dirtied = timer_ms(timer_ticks());
+    if (dirty_count++ == 0) oldest_dirty = b->dirtied;
+}
+
+void bcache_put(struct bcache_buf *b)
+{
+    if (b && b->refs) b->refs--;
+}
+
+/* Write back the dirty buffers of one device in batches through the
+ * request queue, which sorts and merges them. */
+static int sync_device(struct blk_dev *dev)
+{
+    struct blk_request reqs[BLK_QUEUE_MAX];
+    struct bcache_buf *owner[BLK_QUEUE_MAX];
+    unsigned int n = 0;
+    int written = 0, err = BLK_OK;
+    for (unsigned int i = 0; i <= nbufs; ++i) {
+        struct bcache_buf *b = i < nbufs ? &bufs[i] : NULL;
+        if (b && (b->dev != dev || !(b->flags & BCACHE_DIRTY) || b->queue == Q_FREE)) continue;
+        if (b) {
+            reqs[n].lba = b->block * (b->size / BLK_SECTOR);
+            reqs[n].count = b->size / BLK_SECTOR;
+            reqs[n].write = 1;
+            reqs[n].buf = b->data;
+            owner[n] = b;
+            blk_submit(dev, &reqs[n]);
+            n++;
+        }
+        if (n == BLK_QUEUE_MAX || (!b && n > 0)) {
+            blk_run(dev);
+            for (unsigned int k = 0; k < n; ++k) {
+                if (reqs[k].status != BLK_OK) {
+                    err = reqs[k].status;
+                    continue;
+                }
+                owner[k]->flags &= ~BCACHE_DIRTY;
+                dirty_count--;
+                stats.writebacks++;
+                written++;
+            }
+            n = 0;
+        }
+    }
+    int res = blk_flush(dev);
+    if (err == BLK_OK) err = res;
+    return err == BLK_OK ? written : err;
+}
+
+int bcache_sync(struct blk_dev *dev)
+{
+    if (!bufs) return 0;
+    if (dev) return sync_device(dev);
+    int written = 0, err = BLK_OK;
+    struct blk_dev *d;
+    for (unsigned int i = 0; (d = blk_device(i)) != NULL; ++i) {
+        int res = sync_device(d);
+        if (res < 0) err = res;
+        else written += res;
+    }
+    if (!dirty_count) oldest_dirty = 0;
+    return err == BLK_OK ? written : err;
+}
+
+void bcache_tick(void)
+{
+    if (!dirty_count) return;
+    if (timer_ms(timer_ticks()) - oldest_dirty < BCACHE_WRITEBACK_MS) return;
+    bcache_sync(NULL);
+    /* whatever failed to write gets another period */
+    if (dirty_count) oldest_dirty = timer_ms(timer_ticks());
+}
+
+int bcache_invalidate(struct blk_dev *dev)
+{
+    if (!bufs) return BLK_OK;
+    int res = sync_device(dev);
+    for (unsigned int i = 0; i < nbufs; ++i) {
+        struct bcache_buf *b = &bufs[i];
+        if (b->dev != dev || b->queue == Q_FREE || b->refs || (b->flags & BCACHE_DIRTY)) continue;
+        list_remove(queue_list(b->queue), b);
+        hash_remove(buf_hash, b);
+        b->flags = 0;
+        b->queue = Q_FREE;
+        b->dev = NULL;
+        list_push(&freelist, b);
+        stats.cached--;
+    }
+    for (unsigned int i = 0; i < a1out.n;) {
+        struct bcache_buf *g = &ghosts[i];
+        if (g->dev != dev) i++;
+        else drop_ghost(g);
+    }
+    return res < 0 ? res : BLK_OK;
+}
+
+int bcache_prefetch(struct blk_dev *dev, const uint64_t *blocks, unsigned int n, unsigned int size)
+{
+    if (!dev || size < BLK_SECTOR || size > BCACHE_BLOCK_MAX || (size & (size - 1))) return BLK_EINVAL;
+    if (!bufs && bcache_init(BCACHE_DEFAULT_BUFS) != BLK_OK) return BLK_EINVAL;
+    struct blk_request reqs[BLK_QUEUE_MAX];
+    struct bcache_buf *owner[BLK_QUEUE_MAX];
+    unsigned int sectors = size / BLK_SECTOR;
+    int done = 0;
+    for (unsigned int i = 0; i < n;) {
+        unsigned int q = 0;
+        for (; i < n && q < BLK_QUEUE_MAX; ++i) {
+            if (hash_find(buf_hash, dev, blocks[i], size)) continue;
+            int dup = 0;
+            for (unsigned int k = 0; k < q && !dup; ++k) dup = owner[k]->block == blocks[i];
+            if (dup) continue;
+            /* buffers taken here are on no list, so reclaim cannot pick
+             * them again for this batch */
+            struct bcache_buf *b = reclaim();
+            if (!b) break;
+            b->dev = dev;
+            b->block = blocks[i];
+            b->size = size;
+            reqs[q].lba = blocks[i] * sectors;
+            reqs[q].count = sectors;
+            reqs[q].write = 0;
+            reqs[q].buf = b->data;
+            owner[q] = b;
+            if (blk_submit(dev, &reqs[q]) != BLK_OK) {
+                b->queue = Q_FREE;
+                list_push(&freelist, b);
+                continue;
+            }
+            q++;
+        }
+        if (q == 0) break;
+        blk_run(dev);
+        for (unsigned int k = 0; k < q; ++k) {
+            struct bcache_buf *b = owner[k];
+            if (reqs[k].status != BLK_OK) {
+                b->queue = Q_FREE;
+                list_push(&freelist, b);
+                continue;
+            }
+            /* a prefetch is not a use: it enters A1in, ghost or not */
+            b->flags = BCACHE_VALID | BCACHE_PREFETCHED;
+            b->refs = 0;
+            b->queue = Q_A1IN;
+            list_push(&a1in, b);
+            hash_insert(buf_hash, b);
+            stats.cached++;
+            stats.readahead++;
+            done++;
+        }
+    }
+    return done;
+}
+
+void bcache_readahead(struct bcache_ra *ra, struct blk_dev *dev, unsigned int size,
+                      uint64_t block, unsigned int count, uint64_t file_blocks,
+                      bcache_map_fn map, void *arg)
+{
+    uint64_t end = block + count;
+    /* a read may start inside the last block of the previous one */
+    int sequential = block == ra->next || block + 1 == ra->next;
+    if (!sequential && block != 0) {
+        /* random access: no readahead until it looks sequential again */
+        ra->window = BCACHE_RA_MIN;
+        ra->ahead = end;
+        ra->next = end;
+        return;
+    }
+    if (block == 0 && ra->next != 0) ra->ahead = 0; /* rewound */
+    if (!ra->window) ra->window = BCACHE_RA_MIN;
+    ra->next = end;
+    /* start the next window once the reader is in the second half of the
+     * current one, so it is cached before it is needed */
+    if (ra->ahead > end && ra->ahead - end > ra->issued / 2) return;
+    uint64_t start = ra->ahead > end ? ra->ahead : end;
+    if (start >= file_blocks) return;
+    unsigned int n = ra->window;
+    if (start + n > file_blocks) n = (unsigned int)(file_blocks - start);
+    uint64_t blocks[BCACHE_RA_MAX];
+    unsigned int m = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        if (map(arg, start + i, &blocks[m]) == 0) m++;
+    }
+    bcache_prefetch(dev, blocks, m, size);
+    ra->ahead = start + n;
+    ra->issued = n;
+    if (ra->window < BCACHE_RA_MAX) ra->window *= 2;
+}
+
+void bcache_stats(struct bcache_stats *st)
+{
+    *st = stats;
+    st->dirty = dirty_count;
+}
@@ -0,0 +1,214 @@
+#include "../include/blk.h"
+#include "../include/string.h"
+
+static struct blk_dev *devices[BLK_MAX_DEVS];
+static unsigned int device_count = 0;
+
+int blk_register(struct blk_dev *dev)
+{
+    if (!dev || !dev->ops || !dev->ops->transfer || !dev->max_sectors) return BLK_EINVAL;
+    if (device_count >= BLK_MAX_DEVS) return BLK_ENODEV;
+    dev->queued = 0;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    devices[device_count++] = dev;
+    return BLK_OK;
+}
+
+struct blk_dev *blk_find(const char *name)
+{
+    for (unsigned int i = 0; i < device_count; ++i) {
+        if (strcmp(devices[i]->name, name) == 0) return devices[i];
+    }
+    return NULL;
+}
+
+struct blk_dev *blk_device(unsigned int index)
+{
+    return index < device_count ? devices[index] : NULL;
+}
+
+static int in_range(const struct blk_dev *dev, uint64_t lba, uint32_t count)
+{
+    return count > 0 && lba < dev->sectors && count <= dev->sectors - lba;
+}
+
+static int overlaps(const struct blk_request *a, const struct blk_request *b)
+{
+    return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+int blk_submit(struct blk_dev *dev, struct blk_request *req)
+{
+    /* blk_run merges requests but never splits one */
+    if (!in_range(dev, req->lba, req->count) || req->count > dev->max_sectors) {
+        req->status = BLK_EINVAL;
+        return BLK_EINVAL;
+    }
+    int conflict = dev->queued >= BLK_QUEUE_MAX;
+    for (unsigned int i = 0; i < dev->queued && !conflict; ++i) {
+        const struct blk_request *q = dev->queue[i];
+        /* reads may pass reads, nothing passes a write to the same sectors */
+        if ((q->write || req->write) && overlaps(q, req)) conflict = 1;
+    }
+    if (conflict) blk_run(dev);
+    req->status = BLK_PENDING;
+    dev->queue[dev->queued++] = req;
+    return BLK_OK;
+}
+
+/* Describe queue[first, last) as the segments of one transfer. */
+static uint32_t build_segs(const struct blk_dev *dev, unsigned int first, unsigned int last, struct blk_seg *segs)
+{
+    uint32_t count = 0;
+    for (unsigned int i = first, n = 0; i < last; ++i, ++n) {
+        segs[n].buf = dev->queue[i]->buf;
+        segs[n].sectors = dev->queue[i]->count;
+        count += segs[n].sectors;
+    }
+    return count;
+}
+
+/* Finish the requests queue[first, last) of one transfer with status res. */
+static void complete(struct blk_dev *dev, unsigned int first, unsigned int last, int res)
+{
+    const struct blk_request *head = dev->queue[first];
+    unsigned int n = last - first;
+    dev->stats.requests += n;
+    dev->stats.merged += n - 1;
+    if (res == BLK_OK) {
+        uint32_t count = 0;
+        for (unsigned int i = first; i < last; ++i) count += dev->queue[i]->count;
+        if (head->write) dev->stats.sectors_written += count;
+        else dev->stats.sectors_read += count;
+    }
+    for (unsigned int i = first; i < last; ++i) dev->queue[i]->status = res;
+}
+
+int blk_run(struct blk_dev *dev)
+{
+    unsigned int n = dev->queued;
+    if (n == 0) return 0;
+    /* Stable insertion sort by LBA: the queue is short, and requests for
+     * the same sectors keep their submission order (overlapping writes
+     * never share a queue, see blk_submit). */
+    for (unsigned int i = 1; i < n; ++i) {
+        struct blk_request *r = dev->queue[i];
+        unsigned int j = i;
+        while (j > 0 && dev->queue[j - 1]->lba > r->lba) {
+            dev->queue[j] = dev->queue[j - 1];
+            j--;
+        }
+        dev->queue[j] = r;
+    }
+    /* Split the sorted queue into transfers: group g is
+     * queue[start[g], start[g + 1]). */
+    uint8_t start[BLK_QUEUE_MAX + 1];
+    unsigned int groups = 0;
+    unsigned int max_segs = dev->max_segs && dev->max_segs < BLK_MAX_SEGS ? dev->max_segs : BLK_MAX_SEGS;
+    uint32_t count = 0;
+    for (unsigned int i = 0; i < n; ++i) {
+        const struct blk_request *r = dev->queue[i];
+        if (i > 0) {
+            const struct blk_request *prev = dev->queue[i - 1];
+            if (r->write == prev->write && r->lba == prev->lba + prev->count &&
+                count + r->count <= dev->max_sectors && i - start[groups - 1] < max_segs) {
+                count += r->count;
+                continue;
+            }
+        }
+        start[groups++] = (uint8_t)i;
+        count = r->count;
+    }
+    start[groups] = (uint8_t)n;
+
+    struct blk_seg segs[BLK_MAX_SEGS];
+    if (!dev->ops->start || dev->queue_depth <= 1) {
+        for (unsigned int g = 0; g < groups; ++g) {
+            uint32_t total = build_segs(dev, start[g], start[g + 1], segs);
+            const struct blk_request *head = dev->queue[start[g]];
+            int res = dev->ops->transfer(dev, head->lba, total, head->write, segs, start[g + 1] - start[g]);
+            dev->stats.transfers++;
+            complete(dev, start[g], start[g + 1], res);
+        }
+        dev->queued = 0;
+        return (int)n;
+    }
+
+    /* keep up to queue_depth transfers in flight; they finish in any order */
+    int tag_group[BLK_MAX_DEPTH];
+    for (unsigned int t = 0; t < BLK_MAX_DEPTH; ++t) tag_group[t] = -1;
+    unsigned int depth = dev->queue_depth < BLK_MAX_DEPTH ? dev->queue_depth : BLK_MAX_DEPTH;
+    unsigned int next = 0, inflight = 0;
+    while (next < groups || inflight > 0) {
+        while (next < groups && inflight < depth) {
+            uint32_t total = build_segs(dev, start[next], start[next + 1], segs);
+            const struct blk_request *head = dev->queue[start[next]];
+            int tag = dev->ops->start(dev, head->lba, total, head->write, segs, start[next + 1] - start[next]);
+            if (tag == BLK_EBUSY && inflight > 0) break;
+            dev->stats.transfers++;
+            if (tag < 0 || tag >= BLK_MAX_DEPTH) {
+                complete(dev, start[next], start[next + 1], tag < 0 ? tag : BLK_EIO);
+            } else {
+                tag_group[tag] = (int)next;
+                inflight++;
+            }
+            next++;
+        }
+        if (inflight == 0) continue;
+        int status;
+        int tag = dev->ops->reap(dev, &status);
+        if (tag < 0 || tag >= BLK_MAX_DEPTH || tag_group[tag] < 0) {
+            /* the driver lost track: fail whatever is still in flight */
+            for (unsigned int t = 0; t < BLK_MAX_DEPTH; ++t) {
+                if (tag_group[t] < 0) continue;
+                complete(dev, start[tag_group[t]], start[tag_group[t] + 1], BLK_EIO);
+                tag_group[t] = -1;
+            }
+            inflight = 0;
+            continue;
+        }
+        complete(dev, start[tag_group[tag]], start[tag_group[tag] + 1], status);
+        tag_group[tag] = -1;
+        inflight--;
+    }
+    dev->queued = 0;
+    return (int)n;
+}
+
+static int blk_sync(struct blk_dev *dev, uint64_t lba, uint32_t count, int write, void *buf)
+{
+    if (!dev) return BLK_ENODEV;
+    if (!in_range(dev, lba, count)) return BLK_EINVAL;
+    blk_run(dev);
+    uint8_t *p = buf;
+    while (count > 0) {
+        uint32_t n = count < dev->max_sectors ? count : dev->max_sectors;
+        struct blk_seg seg = { p, n };
+        int res = dev->ops->transfer(dev, lba, n, write, &seg, 1);
+        dev->stats.transfers++;
+        if (res != BLK_OK) return res;
+        if (write) dev->stats.sectors_written += n;
+        else dev->stats.sectors_read += n;
+        lba += n;
+        count -= n;
+        p += (size_t)n * BLK_SECTOR;
+    }
+    return BLK_OK;
+}
+
+int blk_read(struct blk_dev *dev, uint64_t lba, uint32_t count, void *buf)
+{
+    return blk_sync(dev, lba, count, 0, buf);
+}
+
+int blk_write(struct blk_dev *dev, uint64_t lba, uint32_t count, const void *buf)
+{
+    return blk_sync(dev, lba, count, 1, (void *)buf);
+}
+
+int blk_flush(struct blk_dev *dev)
+{
+    if (!dev) return BLK_ENODEV;
+    blk_run(dev);
+    return dev->ops->flush ? dev->ops->flush(dev) : BLK_OK;
+}
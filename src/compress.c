@@ -81,6 +81,15 @@ int decompress_rle(const uint8_t *input, size_t input_len,
     return (int)out_idx;
 }
 
+/* fs_splice transform: each chunk is encoded on its own, a run cut at a
+ * chunk boundary just becomes two pairs. */
+static int compress_run(void *arg, const uint8_t *in, size_t len, uint8_t *out)
+{
+    (void)arg;
+    int r = compress_rle(in, len, out, len * 2);
+    return r < 0 ? FS_EINVAL : r;
+}
+
 /* Compress entire file */
 int compress_file(const char *src_path, const char *dst_path)
 {
@@ -107,47 +116,15 @@ int compress_file(const char *src_path, const char *dst_path)
         return -3;
     }
     
-    /* Buffer for file I/O */
-    uint8_t input_buf[1024];
-    uint8_t output_buf[2048]; /* RLE can expand data */
-    int total_compressed = 0;
-    
-    /* Read and compress in chunks */
-    int bytes_read;
-    while (1) {
-        bytes_read = fs_read(src_fd, input_buf, sizeof(input_buf));
-        if (bytes_read < 0) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -4;
-        }
-        if (bytes_read == 0) {
-            break;
-        }
-        
-        /* Compress this chunk */
-        int compressed_len = compress_rle(input_buf, bytes_read, output_buf, sizeof(output_buf));
-        if (compressed_len < 0) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -5;
-        }
-        
-        /* Write compressed data */
-        int written = fs_write(dst_fd, output_buf, compressed_len);
-        if (written < 0 || written != compressed_len) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -6;
-        }
-        
-        total_compressed += written;
-    }
+    /* Encode straight from the source into the destination (RLE at most
+     * doubles the data) */
+    const struct fs_transform rle = { compress_run, NULL, 2 };
+    int total_compressed = fs_splice(src_fd, dst_fd, (size_t)-1, &rle);
     
     fs_close(src_fd);
     fs_close(dst_fd);
     
-    return total_compressed;
+    return total_compressed < 0 ? -4 : total_compressed;
 }
 
 /* Decompress entire file */
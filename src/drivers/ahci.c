@@ -0,0 +1,375 @@
+#include "../include/ahci.h"
+#include "../include/blk.h"
+#include "../include/pci.h"
+#include "../include/timer.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+/* HBA registers (32-bit words of the ABAR) */
+#define HBA_CAP   (0x00 / 4)
+#define HBA_GHC   (0x04 / 4)
+#define HBA_IS    (0x08 / 4)
+#define HBA_PI    (0x0C / 4)
+#define HBA_CAP_SNCQ (1u << 30)
+#define HBA_GHC_AE   (1u << 31)
+
+/* port registers, at ABAR + 0x100 + port * 0x80 */
+#define PX_CLB  (0x00 / 4)
+#define PX_CLBU (0x04 / 4)
+#define PX_FB   (0x08 / 4)
+#define PX_FBU  (0x0C / 4)
+#define PX_IS   (0x10 / 4)
+#define PX_IE   (0x14 / 4)
+#define PX_CMD  (0x18 / 4)
+#define PX_TFD  (0x20 / 4)
+#define PX_SIG  (0x24 / 4)
+#define PX_SSTS (0x28 / 4)
+#define PX_SERR (0x30 / 4)
+#define PX_SACT (0x34 / 4)
+#define PX_CI   (0x38 / 4)
+
+#define PX_CMD_ST  (1u << 0)
+#define PX_CMD_FRE (1u << 4)
+#define PX_CMD_FR  (1u << 14)
+#define PX_CMD_CR  (1u << 15)
+#define PX_IS_TFES (1u << 30) /* task file error */
+#define PX_IS_ERRORS 0x7D800010u /* TFES, HBFS, HBDS, IFS, OFS, UFS */
+#define PX_TFD_ERR 0x01
+#define PX_TFD_DRQ 0x08
+#define PX_TFD_BSY 0x80
+
+#define SATA_SIG_ATA 0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_FLUSH_EXT       0xEA
+#define ATA_CMD_IDENTIFY        0xEC
+
+#define AHCI_MAX_PORTS  8
+#define AHCI_SLOTS      32
+#define AHCI_PRDS       BLK_MAX_SEGS /* one entry per segment (up to 4 MiB each) */
+#define AHCI_TIMEOUT_MS 5000
+
+struct ahci_cmd_header {
+    uint16_t flags;   /* bits 0-4: FIS length in dwords, bit 6: write */
+    uint16_t prdtl;   /* PRD entries */
+    volatile uint32_t prdbc; /* bytes transferred */
+    uint32_t ctba;
+    uint32_t ctbau;
+    uint32_t reserved[4];
+};
+
+struct ahci_prd {
+    uint32_t dba;
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;     /* byte count - 1, bit 31: interrupt on completion */
+};
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDS];
+};
+
+struct ahci_port {
+    struct blk_dev blk;
+    volatile uint32_t *regs;
+    struct ahci_cmd_header *clist; /* 32 headers, 1 KiB aligned */
+    uint8_t *fis;                  /* received FIS area, 256 byte aligned */
+    struct ahci_cmd_table *tables; /* one per slot, 128 byte aligned */
+    uint32_t slots;                /* mask of usable command slots */
+    uint32_t busy;                 /* slots with a command in flight */
+    uint32_t done;                 /* finished, waiting to be reaped */
+    uint32_t failed;               /* of those, finished with an error */
+    uint32_t timed_out;            /* of those, abandoned after a timeout */
+    int ncq;
+};
+
+static struct ahci_port ports[AHCI_MAX_PORTS];
+static unsigned int port_count = 0;
+
+static int wait_clear(volatile uint32_t *reg, uint32_t bits)
+{
+    uint64_t start = timer_ticks();
+    for (uint32_t spins = 0; *reg & bits; ++spins) {
+        if ((spins & 0xFF) == 0 && spins && timer_ms(timer_ticks() - start) >= AHCI_TIMEOUT_MS) return BLK_ETIMEDOUT;
+        if (spins >= (1u << 28)) return BLK_ETIMEDOUT;
+    }
+    return BLK_OK;
+}
+
+static void port_stop(volatile uint32_t *regs)
+{
+    regs[PX_CMD] &= ~PX_CMD_ST;
+    wait_clear(&regs[PX_CMD], PX_CMD_CR);
+    regs[PX_CMD] &= ~PX_CMD_FRE;
+    wait_clear(&regs[PX_CMD], PX_CMD_FR);
+}
+
+static int port_start(volatile uint32_t *regs)
+{
+    if (wait_clear(&regs[PX_TFD], PX_TFD_BSY | PX_TFD_DRQ) != BLK_OK) return BLK_ETIMEDOUT;
+    regs[PX_CMD] |= PX_CMD_FRE;
+    regs[PX_CMD] |= PX_CMD_ST;
+    return BLK_OK;
+}
+
+/* Fill slot's command header and table. Returns 0 or BLK_EINVAL if a
+ * segment cannot be described (odd address or length). */
+static int build_command(struct ahci_port *p, unsigned int slot, uint8_t cmd, uint64_t lba, uint32_t count,
+                         int write, const struct blk_seg *segs, unsigned int nsegs)
+{
+    struct ahci_cmd_table *t = &p->tables[slot];
+    struct ahci_cmd_header *h = &p->clist[slot];
+    if (nsegs > AHCI_PRDS) return BLK_EINVAL;
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        uint32_t addr = (uint32_t)(uintptr_t)segs[i].buf;
+        if (addr & 1) return BLK_EINVAL;
+        t->prdt[i].dba = addr;
+        t->prdt[i].dbau = 0;
+        t->prdt[i].reserved = 0;
+        t->prdt[i].dbc = segs[i].sectors * BLK_SECTOR - 1;
+    }
+    uint8_t *fis = t->cfis;
+    memset(fis, 0, 20);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80; /* command, not control */
+    fis[2] = cmd;
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = 0x40; /* LBA mode */
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    if (cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA) {
+        /* queued commands carry the count in the features registers and
+         * the tag in the count register */
+        fis[3] = (uint8_t)count;
+        fis[11] = (uint8_t)(count >> 8);
+        fis[12] = (uint8_t)(slot << 3);
+    } else {
+        fis[12] = (uint8_t)count;
+        fis[13] = (uint8_t)(count >> 8);
+    }
+    h->flags = (uint16_t)(5 | (write ? 1 << 6 : 0));
+    h->prdtl = (uint16_t)nsegs;
+    h->prdbc = 0;
+    return BLK_OK;
+}
+
+/* Mark the in-flight slots that have finished. A task file error stops
+ * the port; everything still outstanding fails and the port restarts. */
+static void port_update(struct ahci_port *p)
+{
+    volatile uint32_t *regs = p->regs;
+    uint32_t is = regs[PX_IS];
+    regs[PX_IS] = is;
+    if (is & PX_IS_ERRORS) {
+        uint32_t lost = p->busy;
+        port_stop(regs);
+        regs[PX_SERR] = 0xFFFFFFFFu;
+        regs[PX_IS] = 0xFFFFFFFFu;
+        port_start(regs);
+        p->done |= lost;
+        p->failed |= lost;
+        p->busy = 0;
+        return;
+    }
+    /* a queued command is finished when its SACT bit drops (CI clears as
+     * soon as the drive accepts it); others when CI clears */
+    uint32_t active = regs[PX_CI] | (p->ncq ? regs[PX_SACT] : 0);
+    uint32_t finished = p->busy & ~active;
+    p->done |= finished;
+    p->busy &= ~finished;
+}
+
+static int ahci_start(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                      const struct blk_seg *segs, unsigned int nsegs)
+{
+    struct ahci_port *p = dev->priv;
+    uint32_t free = p->slots & ~(p->busy | p->done);
+    /* without NCQ the drive takes one command at a time */
+    if (!free || (!p->ncq && p->busy)) return BLK_EBUSY;
+    unsigned int slot = 0;
+    while (!(free & (1u << slot))) slot++;
+    uint8_t cmd;
+    if (p->ncq) cmd = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+    else cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    int res = build_command(p, slot, cmd, lba, count, write, segs, nsegs);
+    if (res != BLK_OK) return res;
+    p->busy |= 1u << slot;
+    if (p->ncq) p->regs[PX_SACT] = 1u << slot;
+    p->regs[PX_CI] = 1u << slot;
+    return (int)slot;
+}
+
+static int ahci_reap(struct blk_dev *dev, int *status)
+{
+    struct ahci_port *p = dev->priv;
+    uint64_t start = timer_ticks();
+    for (uint32_t spins = 0; !p->done; ++spins) {
+        if (!p->busy) return BLK_EINVAL;
+        port_update(p);
+        if ((spins & 0xFF) == 0 && spins && timer_ms(timer_ticks() - start) >= AHCI_TIMEOUT_MS) {
+            /* give up on everything in flight and reset the port */
+            p->timed_out |= p->busy;
+            p->done |= p->busy;
+            p->busy = 0;
+            port_stop(p->regs);
+            p->regs[PX_SERR] = 0xFFFFFFFFu;
+            p->regs[PX_IS] = 0xFFFFFFFFu;
+            port_start(p->regs);
+        }
+    }
+    unsigned int slot = 0;
+    while (!(p->done & (1u << slot))) slot++;
+    uint32_t bit = 1u << slot;
+    if (p->timed_out & bit) *status = BLK_ETIMEDOUT;
+    else if (p->failed & bit) *status = BLK_EIO;
+    else *status = BLK_OK;
+    p->done &= ~bit;
+    p->failed &= ~bit;
+    p->timed_out &= ~bit;
+    return (int)slot;
+}
+
+/* Run one non-queued command to completion. */
+static int ahci_exec(struct ahci_port *p, uint8_t cmd, uint64_t lba, uint32_t count, int write,
+                     const struct blk_seg *segs, unsigned int nsegs)
+{
+    /* drain queued commands first: NCQ and non-queued commands don't mix */
+    int status;
+    while (p->busy || p->done) ahci_reap(&p->blk, &status);
+    unsigned int slot = 0;
+    int res = build_command(p, slot, cmd, lba, count, write, segs, nsegs);
+    if (res != BLK_OK) return res;
+    p->busy = 1u << slot;
+    p->regs[PX_CI] = 1u << slot;
+    int ncq = p->ncq;
+    p->ncq = 0;
+    ahci_reap(&p->blk, &status);
+    p->ncq = ncq;
+    return status;
+}
+
+static int ahci_transfer(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                         const struct blk_seg *segs, unsigned int nsegs)
+{
+    struct ahci_port *p = dev->priv;
+    if (p->ncq) {
+        int status;
+        while (p->busy || p->done) ahci_reap(dev, &status);
+        int slot = ahci_start(dev, lba, count, write, segs, nsegs);
+        if (slot < 0) return slot;
+        ahci_reap(dev, &status);
+        return status;
+    }
+    return ahci_exec(p, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT, lba, count, write, segs, nsegs);
+}
+
+static int ahci_flush(struct blk_dev *dev)
+{
+    return ahci_exec(dev->priv, ATA_CMD_FLUSH_EXT, 0, 0, 0, NULL, 0);
+}
+
+static const struct blk_ops ahci_ops = {
+    .transfer = ahci_transfer,
+    .flush = ahci_flush,
+    .start = ahci_start,
+    .reap = ahci_reap,
+};
+
+static void port_init(volatile uint32_t *hba, unsigned int n, uint32_t cap)
+{
+    volatile uint32_t *regs = hba + (0x100 + n * 0x80) / 4;
+    /* device present and the link up, with an ATA (not ATAPI) signature */
+    if ((regs[PX_SSTS] & 0x0F) != 3 || regs[PX_SIG] != SATA_SIG_ATA) return;
+    if (port_count >= AHCI_MAX_PORTS) return;
+    struct ahci_port *p = &ports[port_count];
+    memset(p, 0, sizeof(*p));
+    p->regs = regs;
+
+    /* heap blocks are page aligned: the command list takes the first 1 KiB
+     * of one, the received FIS area the next 256 bytes */
+    uint8_t *mem = kmalloc(4096);
+    p->tables = kmalloc(AHCI_SLOTS * sizeof(struct ahci_cmd_table));
+    if (!mem || !p->tables) {
+        if (mem) kfree(mem);
+        if (p->tables) kfree(p->tables);
+        return;
+    }
+    memset(mem, 0, 4096);
+    memset(p->tables, 0, AHCI_SLOTS * sizeof(struct ahci_cmd_table));
+    p->clist = (struct ahci_cmd_header *)mem;
+    p->fis = mem + 1024;
+    for (unsigned int s = 0; s < AHCI_SLOTS; ++s) p->clist[s].ctba = (uint32_t)(uintptr_t)&p->tables[s];
+
+    port_stop(regs);
+    regs[PX_CLB] = (uint32_t)(uintptr_t)p->clist;
+    regs[PX_CLBU] = 0;
+    regs[PX_FB] = (uint32_t)(uintptr_t)p->fis;
+    regs[PX_FBU] = 0;
+    regs[PX_SERR] = 0xFFFFFFFFu;
+    regs[PX_IS] = 0xFFFFFFFFu;
+    regs[PX_IE] = 0; /* completions are polled */
+    if (port_start(regs) != BLK_OK) goto fail;
+
+    unsigned int nslots = ((cap >> 8) & 0x1F) + 1;
+    p->slots = nslots == 32 ? 0xFFFFFFFFu : (1u << nslots) - 1;
+
+    static uint16_t id[256];
+    struct blk_seg seg = { id, 1 };
+    if (ahci_exec(p, ATA_CMD_IDENTIFY, 0, 0, 0, &seg, 1) != BLK_OK) goto fail;
+    if (!(id[83] & (1 << 10))) goto fail; /* AHCI disks without LBA48 don't exist in practice */
+    uint64_t sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) | ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    if (!sectors) goto fail;
+
+    unsigned int depth = 1;
+    if ((cap & HBA_CAP_SNCQ) && (id[76] & (1 << 8))) {
+        depth = (id[75] & 0x1F) + 1;
+        if (depth > nslots) depth = nslots;
+        p->ncq = depth > 1;
+    }
+    p->blk.name[0] = 's';
+    p->blk.name[1] = 'd';
+    p->blk.name[2] = (char)('a' + port_count);
+    p->blk.name[3] = '\0';
+    p->blk.sectors = sectors;
+    p->blk.max_sectors = 2048;
+    p->blk.queue_depth = p->ncq ? depth : 1;
+    p->blk.ops = &ahci_ops;
+    p->blk.priv = p;
+    if (blk_register(&p->blk) != BLK_OK) goto fail;
+    port_count++;
+    return;
+fail:
+    port_stop(regs);
+    kfree(mem);
+    kfree(p->tables);
+}
+
+int ahci_init(void)
+{
+    unsigned int before = port_count;
+    struct pci_dev pci;
+    for (unsigned int i = 0; pci_find_class(0x01, 0x06, 0x01, i, &pci) == 0; ++i) {
+        if (pci.bar[5] & 1) continue; /* ABAR must be memory mapped */
+        pci_enable(&pci, PCI_CMD_MEMORY | PCI_CMD_BUSMASTER);
+        volatile uint32_t *hba = (volatile uint32_t *)(uintptr_t)(pci.bar[5] & ~0xFu);
+        hba[HBA_GHC] |= HBA_GHC_AE;
+        uint32_t cap = hba[HBA_CAP];
+        uint32_t pi = hba[HBA_PI];
+        for (unsigned int n = 0; n < 32; ++n) {
+            if (pi & (1u << n)) port_init(hba, n, cap);
+        }
+        hba[HBA_IS] = hba[HBA_IS];
+    }
+    return (int)(port_count - before);
+}
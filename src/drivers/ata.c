@@ -0,0 +1,371 @@
+#include "../include/ata.h"
+#include "../include/blk.h"
+#include "../include/pci.h"
+#include "../include/io.h"
+#include "../include/timer.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+/* command block registers, relative to the channel base */
+#define ATA_REG_DATA     0
+#define ATA_REG_ERROR    1
+#define ATA_REG_FEATURES 1
+#define ATA_REG_COUNT    2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7
+#define ATA_REG_COMMAND  7
+
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_DF   0x20
+#define ATA_SR_BSY  0x80
+
+#define ATA_CTL_NIEN 0x02 /* no interrupts: everything is polled */
+
+#define ATA_CMD_READ_PIO         0x20
+#define ATA_CMD_READ_PIO_EXT     0x24
+#define ATA_CMD_READ_DMA_EXT     0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_PIO        0x30
+#define ATA_CMD_WRITE_PIO_EXT    0x34
+#define ATA_CMD_WRITE_DMA_EXT    0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE    0xC4
+#define ATA_CMD_WRITE_MULTIPLE   0xC5
+#define ATA_CMD_SET_MULTIPLE     0xC6
+#define ATA_CMD_READ_DMA         0xC8
+#define ATA_CMD_WRITE_DMA        0xCA
+#define ATA_CMD_FLUSH            0xE7
+#define ATA_CMD_FLUSH_EXT        0xEA
+#define ATA_CMD_IDENTIFY         0xEC
+
+/* bus master registers, relative to the channel's bus master base */
+#define BM_COMMAND 0
+#define BM_STATUS  2
+#define BM_PRDT    4
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08 /* device to memory */
+#define BM_SR_ACTIVE 0x01
+#define BM_SR_ERR    0x02
+#define BM_SR_IRQ    0x04
+
+#define ATA_TIMEOUT_MS 5000
+#define ATA_MAX_SPINS  (1u << 26)
+#define PRD_MAX        512 /* one page of 8-byte entries */
+#define PRD_EOT        0x8000
+
+struct prd {
+    uint32_t addr;
+    uint16_t bytes; /* 0 means 64 KiB */
+    uint16_t flags;
+} __attribute__((packed));
+
+struct ata_channel {
+    uint16_t base;
+    uint16_t ctrl;
+    uint16_t bm;    /* 0: no bus mastering */
+    struct prd *prdt;
+};
+
+struct ata_drive {
+    struct blk_dev blk;
+    struct ata_channel *ch;
+    uint8_t slave;
+    uint8_t lba48;
+    uint8_t dma;
+    uint16_t multiple; /* sectors per DRQ block; 1 = plain PIO commands */
+};
+
+static struct ata_channel channels[2];
+static struct ata_drive drives[4];
+
+/* The alternate status register does not acknowledge anything; four reads
+ * give the drive the 400ns it needs after a command or drive select. */
+static uint8_t ata_delay(const struct ata_channel *ch)
+{
+    uint8_t st = 0;
+    for (int i = 0; i < 4; ++i) st = input_bytes(ch->ctrl);
+    return st;
+}
+
+/* Wait for BSY to clear and (status & mask) == want. */
+static int ata_wait(const struct ata_channel *ch, uint8_t mask, uint8_t want)
+{
+    uint64_t start = timer_ticks();
+    for (uint32_t spins = 0;; ++spins) {
+        uint8_t st = input_bytes(ch->ctrl);
+        if (!(st & ATA_SR_BSY)) {
+            if (st & (ATA_SR_ERR | ATA_SR_DF)) return BLK_EIO;
+            if ((st & mask) == want) return BLK_OK;
+        }
+        if ((spins & 0xFF) == 0 && spins &&
+            (timer_ms(timer_ticks() - start) >= ATA_TIMEOUT_MS || spins >= ATA_MAX_SPINS))
+            return BLK_ETIMEDOUT;
+    }
+}
+
+/* bits: 0x40 for LBA addressing, plus LBA bits 24-27 for LBA28 commands */
+static void ata_select(const struct ata_drive *d, uint8_t bits)
+{
+    output_bytes(d->ch->base + ATA_REG_DRIVE, (uint8_t)(0xA0 | (d->slave << 4) | bits));
+    ata_delay(d->ch);
+}
+
+/* Load the task file for a transfer and issue cmd. */
+static int ata_command(struct ata_drive *d, uint8_t cmd, uint64_t lba, uint32_t count)
+{
+    uint16_t base = d->ch->base;
+    if (ata_wait(d->ch, 0, 0) == BLK_ETIMEDOUT) return BLK_ETIMEDOUT;
+    if (d->lba48) {
+        ata_select(d, 0x40);
+        /* high order bytes first, each register is a two-deep FIFO */
+        output_bytes(base + ATA_REG_COUNT, (uint8_t)(count >> 8));
+        output_bytes(base + ATA_REG_LBA0, (uint8_t)(lba >> 24));
+        output_bytes(base + ATA_REG_LBA1, (uint8_t)(lba >> 32));
+        output_bytes(base + ATA_REG_LBA2, (uint8_t)(lba >> 40));
+    } else {
+        ata_select(d, (uint8_t)(0x40 | ((lba >> 24) & 0x0F)));
+    }
+    output_bytes(base + ATA_REG_COUNT, (uint8_t)count);
+    output_bytes(base + ATA_REG_LBA0, (uint8_t)lba);
+    output_bytes(base + ATA_REG_LBA1, (uint8_t)(lba >> 8));
+    output_bytes(base + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+    output_bytes(base + ATA_REG_COMMAND, cmd);
+    ata_delay(d->ch);
+    return BLK_OK;
+}
+
+static int ata_pio(struct ata_drive *d, uint64_t lba, uint32_t count, int write,
+                   const struct blk_seg *segs, unsigned int nsegs)
+{
+    uint8_t cmd;
+    if (d->multiple > 1) {
+        if (d->lba48) cmd = write ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE_EXT;
+        else cmd = write ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_READ_MULTIPLE;
+    } else {
+        if (d->lba48) cmd = write ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_READ_PIO_EXT;
+        else cmd = write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO;
+    }
+    int res = ata_command(d, cmd, lba, count);
+    if (res != BLK_OK) return res;
+    unsigned int seg = 0;
+    uint32_t seg_done = 0;
+    while (count > 0) {
+        /* one DRQ block of up to d->multiple sectors */
+        res = ata_wait(d->ch, ATA_SR_DRQ, ATA_SR_DRQ);
+        if (res != BLK_OK) return res;
+        uint32_t block = count < d->multiple ? count : d->multiple;
+        for (uint32_t s = 0; s < block; ++s) {
+            uint8_t *p = (uint8_t *)segs[seg].buf + (size_t)seg_done * BLK_SECTOR;
+            if (write) output_words(d->ch->base + ATA_REG_DATA, p, BLK_SECTOR / 2);
+            else input_words(d->ch->base + ATA_REG_DATA, p, BLK_SECTOR / 2);
+            if (++seg_done == segs[seg].sectors && seg + 1 < nsegs) {
+                seg++;
+                seg_done = 0;
+            }
+        }
+        count -= block;
+        ata_delay(d->ch);
+    }
+    return ata_wait(d->ch, ATA_SR_DRQ, 0);
+}
+
+/* Describe the segments in the channel's PRD table. Returns 0 if a buffer
+ * cannot be used for DMA (odd address) or the table is too small. */
+static int build_prdt(struct ata_channel *ch, const struct blk_seg *segs, unsigned int nsegs)
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        uint32_t addr = (uint32_t)(uintptr_t)segs[i].buf;
+        uint32_t left = segs[i].sectors * BLK_SECTOR;
+        if (addr & 1) return 0;
+        while (left > 0) {
+            /* an entry must not cross a 64 KiB boundary */
+            uint32_t room = 0x10000 - (addr & 0xFFFF);
+            uint32_t len = left < room ? left : room;
+            if (n >= PRD_MAX) return 0;
+            ch->prdt[n].addr = addr;
+            ch->prdt[n].bytes = (uint16_t)len;
+            ch->prdt[n].flags = 0;
+            n++;
+            addr += len;
+            left -= len;
+        }
+    }
+    ch->prdt[n - 1].flags = PRD_EOT;
+    return 1;
+}
+
+static int ata_dma(struct ata_drive *d, uint64_t lba, uint32_t count, int write,
+                   const struct blk_seg *segs, unsigned int nsegs)
+{
+    struct ata_channel *ch = d->ch;
+    if (!build_prdt(ch, segs, nsegs)) return BLK_EINVAL;
+    output_bytes(ch->bm + BM_COMMAND, 0);
+    output_dword(ch->bm + BM_PRDT, (uint32_t)(uintptr_t)ch->prdt);
+    /* the error and interrupt bits are cleared by writing ones */
+    output_bytes(ch->bm + BM_STATUS, input_bytes(ch->bm + BM_STATUS) | BM_SR_ERR | BM_SR_IRQ);
+    output_bytes(ch->bm + BM_COMMAND, write ? 0 : BM_CMD_READ);
+    uint8_t cmd;
+    if (d->lba48) cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    else cmd = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+    int res = ata_command(d, cmd, lba, count);
+    if (res != BLK_OK) return res;
+    output_bytes(ch->bm + BM_COMMAND, (write ? 0 : BM_CMD_READ) | BM_CMD_START);
+    uint64_t start = timer_ticks();
+    uint8_t bst;
+    for (uint32_t spins = 0;; ++spins) {
+        bst = input_bytes(ch->bm + BM_STATUS);
+        if (!(bst & BM_SR_ACTIVE) || (bst & (BM_SR_ERR | BM_SR_IRQ))) break;
+        if ((spins & 0xFF) == 0 && spins &&
+            (timer_ms(timer_ticks() - start) >= ATA_TIMEOUT_MS || spins >= ATA_MAX_SPINS)) {
+            res = BLK_ETIMEDOUT;
+            break;
+        }
+    }
+    output_bytes(ch->bm + BM_COMMAND, write ? 0 : BM_CMD_READ);
+    if (res == BLK_OK) res = ata_wait(ch, ATA_SR_DRQ, 0);
+    output_bytes(ch->bm + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    if (res == BLK_OK && (bst & BM_SR_ERR)) res = BLK_EIO;
+    return res;
+}
+
+static int ata_transfer(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                        const struct blk_seg *segs, unsigned int nsegs)
+{
+    struct ata_drive *d = dev->priv;
+    if (d->dma) {
+        int res = ata_dma(d, lba, count, write, segs, nsegs);
+        if (res != BLK_EIO) {
+            if (res != BLK_EINVAL) return res;
+            /* unaligned buffer: this transfer goes through PIO */
+        } else {
+            /* the controller or drive rejected DMA: stay with PIO */
+            d->dma = 0;
+        }
+    }
+    return ata_pio(d, lba, count, write, segs, nsegs);
+}
+
+static int ata_flush(struct blk_dev *dev)
+{
+    struct ata_drive *d = dev->priv;
+    int res = ata_command(d, d->lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH, 0, 0);
+    if (res != BLK_OK) return res;
+    return ata_wait(d->ch, ATA_SR_DRQ, 0);
+}
+
+static const struct blk_ops ata_ops = { .transfer = ata_transfer, .flush = ata_flush };
+
+/* IDENTIFY DEVICE; returns 0 with the 256 words in id for an ATA disk. */
+static int ata_identify(struct ata_drive *d, uint16_t *id)
+{
+    uint16_t base = d->ch->base;
+    output_bytes(base + ATA_REG_DRIVE, (uint8_t)(0xA0 | (d->slave << 4)));
+    ata_delay(d->ch);
+    /* a floating bus reads 0xFF */
+    if (input_bytes(base + ATA_REG_STATUS) == 0xFF) return -1;
+    output_bytes(base + ATA_REG_COUNT, 0);
+    output_bytes(base + ATA_REG_LBA0, 0);
+    output_bytes(base + ATA_REG_LBA1, 0);
+    output_bytes(base + ATA_REG_LBA2, 0);
+    output_bytes(base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (ata_delay(d->ch) == 0) return -1; /* no drive */
+    uint64_t start = timer_ticks();
+    for (uint32_t spins = 0; input_bytes(d->ch->ctrl) & ATA_SR_BSY; ++spins) {
+        if ((spins & 0xFF) == 0 && spins &&
+            (timer_ms(timer_ticks() - start) >= ATA_TIMEOUT_MS || spins >= ATA_MAX_SPINS)) return -1;
+    }
+    /* ATAPI and SATA devices abort with their signature in LBA1/LBA2 */
+    if (input_bytes(base + ATA_REG_LBA1) || input_bytes(base + ATA_REG_LBA2)) return -1;
+    if (ata_wait(d->ch, ATA_SR_DRQ, ATA_SR_DRQ) != BLK_OK) return -1;
+    input_words(base + ATA_REG_DATA, id, 256);
+    return 0;
+}
+
+static void ata_probe(struct ata_channel *ch, uint8_t slave, unsigned int index)
+{
+    static uint16_t id[256];
+    struct ata_drive *d = &drives[index];
+    memset(d, 0, sizeof(*d));
+    d->ch = ch;
+    d->slave = slave;
+    if (ata_identify(d, id) != 0) return;
+    if (!(id[49] & (1 << 9))) return; /* no LBA */
+    d->lba48 = (id[83] & (1 << 10)) != 0;
+    uint64_t sectors;
+    if (d->lba48) {
+        sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) | ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        sectors = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+    }
+    if (!sectors) return;
+
+    /* READ/WRITE MULTIPLE moves several sectors per DRQ interrupt/poll */
+    d->multiple = 1;
+    uint8_t max_multiple = (uint8_t)id[47];
+    if (max_multiple > 1) {
+        ata_command(d, ATA_CMD_SET_MULTIPLE, 0, max_multiple);
+        if (ata_wait(ch, 0, 0) == BLK_OK) d->multiple = max_multiple;
+    }
+    /* DMA needs a bus master and a mode the firmware already selected on
+     * both the drive and the controller */
+    int mode_selected = ((id[88] >> 8) & 0x7F) || ((id[63] >> 8) & 0x07);
+    d->dma = ch->bm && ch->prdt && (id[49] & (1 << 8)) && mode_selected;
+
+    d->blk.name[0] = 'h';
+    d->blk.name[1] = 'd';
+    d->blk.name[2] = (char)('a' + index);
+    d->blk.name[3] = '\0';
+    d->blk.sectors = sectors;
+    /* LBA28 commands count up to 256 sectors; keep LBA48 transfers to
+     * 1 MiB so the PRD table never runs out of entries */
+    d->blk.max_sectors = d->lba48 ? 2048 : 256;
+    d->blk.ops = &ata_ops;
+    d->blk.priv = d;
+    blk_register(&d->blk);
+}
+
+int ata_init(void)
+{
+    struct pci_dev pci;
+    int have_pci = pci_find_class(0x01, 0x01, 0xFF, 0, &pci) == 0;
+    channels[0].base = 0x1F0;
+    channels[0].ctrl = 0x3F6;
+    channels[1].base = 0x170;
+    channels[1].ctrl = 0x376;
+    channels[0].bm = channels[1].bm = 0;
+    if (have_pci) {
+        /* prog_if bits 0 and 2: channel in PCI native mode, ports in BARs */
+        if ((pci.prog_if & 0x01) && (pci.bar[0] & 1)) {
+            channels[0].base = (uint16_t)(pci.bar[0] & ~3u);
+            channels[0].ctrl = (uint16_t)((pci.bar[1] & ~3u) + 2);
+        }
+        if ((pci.prog_if & 0x04) && (pci.bar[2] & 1)) {
+            channels[1].base = (uint16_t)(pci.bar[2] & ~3u);
+            channels[1].ctrl = (uint16_t)((pci.bar[3] & ~3u) + 2);
+        }
+        if ((pci.prog_if & 0x80) && (pci.bar[4] & 1) && (pci.bar[4] & ~3u)) {
+            channels[0].bm = (uint16_t)(pci.bar[4] & ~3u);
+            channels[1].bm = (uint16_t)(channels[0].bm + 8);
+            pci_enable(&pci, PCI_CMD_IO | PCI_CMD_BUSMASTER);
+        }
+    }
+    int found = 0;
+    for (unsigned int c = 0; c < 2; ++c) {
+        struct ata_channel *ch = &channels[c];
+        /* the PRD table must be dword aligned and not cross 64 KiB: one
+         * heap block satisfies both */
+        if (ch->bm && !ch->prdt) ch->prdt = kmalloc(PRD_MAX * sizeof(struct prd));
+        output_bytes(ch->ctrl, ATA_CTL_NIEN);
+        for (uint8_t s = 0; s < 2; ++s) {
+            unsigned int index = c * 2 + s;
+            ata_probe(ch, s, index);
+            if (drives[index].blk.ops) found++;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,112 @@
+#include "../include/pci.h"
+#include "../include/io.h"
+#include "../include/string.h"
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+static uint32_t config_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off)
+{
+    return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (off & 0xFC);
+}
+
+static uint32_t read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t off)
+{
+    output_dword(PCI_CONFIG_ADDRESS, config_address(bus, slot, func, off));
+    return input_dword(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read32(const struct pci_dev *d, uint8_t off)
+{
+    return read_config(d->bus, d->slot, d->func, off);
+}
+
+void pci_write32(const struct pci_dev *d, uint8_t off, uint32_t val)
+{
+    output_dword(PCI_CONFIG_ADDRESS, config_address(d->bus, d->slot, d->func, off));
+    output_dword(PCI_CONFIG_DATA, val);
+}
+
+uint16_t pci_read16(const struct pci_dev *d, uint8_t off)
+{
+    return (uint16_t)(pci_read32(d, off) >> ((off & 2) * 8));
+}
+
+void pci_write16(const struct pci_dev *d, uint8_t off, uint16_t val)
+{
+    uint32_t v = pci_read32(d, off);
+    unsigned int shift = (off & 2) * 8;
+    v = (v & ~(0xFFFFu << shift)) | ((uint32_t)val << shift);
+    pci_write32(d, off, v);
+}
+
+static void fill_dev(uint8_t bus, uint8_t slot, uint8_t func, struct pci_dev *out)
+{
+    uint32_t id = read_config(bus, slot, func, 0x00);
+    uint32_t cls = read_config(bus, slot, func, 0x08);
+    out->bus = bus;
+    out->slot = slot;
+    out->func = func;
+    out->vendor = (uint16_t)id;
+    out->device = (uint16_t)(id >> 16);
+    out->class_code = (uint8_t)(cls >> 24);
+    out->subclass = (uint8_t)(cls >> 16);
+    out->prog_if = (uint8_t)(cls >> 8);
+    out->irq = (uint8_t)read_config(bus, slot, func, 0x3C);
+    for (int i = 0; i < 6; ++i) out->bar[i] = read_config(bus, slot, func, (uint8_t)(0x10 + 4 * i));
+}
+
+/* Visit every present function until match returns nonzero for the
+ * index-th time. */
+static int pci_scan(int (*match)(const struct pci_dev *, const void *), const void *arg,
+                    unsigned int index, struct pci_dev *out)
+{
+    struct pci_dev d;
+    for (unsigned int bus = 0; bus < 256; ++bus) {
+        for (uint8_t slot = 0; slot < 32; ++slot) {
+            uint32_t id = read_config((uint8_t)bus, slot, 0, 0x00);
+            if ((id & 0xFFFF) == 0xFFFF) continue;
+            /* only multi-function devices have functions beyond 0 */
+            uint8_t nfunc = (read_config((uint8_t)bus, slot, 0, 0x0C) >> 16) & 0x80 ? 8 : 1;
+            for (uint8_t func = 0; func < nfunc; ++func) {
+                if (func && (read_config((uint8_t)bus, slot, func, 0x00) & 0xFFFF) == 0xFFFF) continue;
+                fill_dev((uint8_t)bus, slot, func, &d);
+                if (!match(&d, arg)) continue;
+                if (index-- == 0) {
+                    *out = d;
+                    return 0;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+static int match_class(const struct pci_dev *d, const void *arg)
+{
+    const uint8_t *want = arg;
+    return d->class_code == want[0] && d->subclass == want[1] && (want[2] == 0xFF || d->prog_if == want[2]);
+}
+
+static int match_id(const struct pci_dev *d, const void *arg)
+{
+    const uint16_t *want = arg;
+    return d->vendor == want[0] && d->device == want[1];
+}
+
+int pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, unsigned int index, struct pci_dev *out)
+{
+    uint8_t want[3] = { class_code, subclass, prog_if };
+    return pci_scan(match_class, want, index, out);
+}
+
+int pci_find_device(uint16_t vendor, uint16_t device, unsigned int index, struct pci_dev *out)
+{
+    uint16_t want[2] = { vendor, device };
+    return pci_scan(match_id, want, index, out);
+}
+
+void pci_enable(const struct pci_dev *d, uint16_t cmd_bits)
+{
+    pci_write16(d, 0x04, pci_read16(d, 0x04) | cmd_bits);
+}
@@ -0,0 +1,380 @@
+#include "../include/virtio.h"
+#include "../include/blk.h"
+#include "../include/pci.h"
+#include "../include/io.h"
+#include "../include/timer.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+#define VIRTIO_VENDOR     0x1AF4
+#define VIRTIO_BLK_LEGACY 0x1001
+
+/* legacy register block in BAR0 (I/O space) */
+#define VIRTIO_DEVICE_FEATURES 0x00
+#define VIRTIO_GUEST_FEATURES  0x04
+#define VIRTIO_QUEUE_PFN       0x08
+#define VIRTIO_QUEUE_SIZE      0x0C
+#define VIRTIO_QUEUE_SELECT    0x0E
+#define VIRTIO_QUEUE_NOTIFY    0x10
+#define VIRTIO_STATUS          0x12
+#define VIRTIO_CONFIG          0x14 /* without MSI-X */
+
+#define STATUS_ACKNOWLEDGE 0x01
+#define STATUS_DRIVER      0x02
+#define STATUS_DRIVER_OK   0x04
+#define STATUS_FAILED      0x80
+
+#define VIRTIO_BLK_F_SIZE_MAX   (1u << 1)
+#define VIRTIO_BLK_F_SEG_MAX    (1u << 2)
+#define VIRTIO_BLK_F_RO         (1u << 5)
+#define VIRTIO_BLK_F_FLUSH      (1u << 9)
+#define VIRTIO_RING_F_EVENT_IDX (1u << 29)
+
+/* config space offsets */
+#define BLK_CFG_CAPACITY 0
+#define BLK_CFG_SIZE_MAX 8
+#define BLK_CFG_SEG_MAX  12
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VRING_DESC_F_NEXT  1
+#define VRING_DESC_F_WRITE 2 /* device writes the buffer */
+#define VRING_USED_F_NO_NOTIFY 1
+
+#define VIRTIO_MAX_DEVS   4
+#define VIRTIO_TIMEOUT_MS 5000
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[]; /* queue size entries, then used_event */
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[]; /* queue size entries, then avail_event */
+};
+
+struct virtio_blk_req {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+struct virtio_blk {
+    struct blk_dev blk;
+    uint16_t io;
+    uint16_t qsize;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    volatile struct vring_used *used;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t avail_idx;  /* next avail slot; avail->idx lags until published */
+    uint16_t last_used;  /* next used entry to consume */
+    int event_idx;
+    int can_flush;
+    int broken;          /* reset after a timeout; everything fails */
+    uint32_t size_max;   /* bytes per descriptor; 0: no limit */
+    uint32_t tags;       /* in flight */
+    uint32_t failed;     /* abandoned, reported by the next reaps */
+    uint16_t head[BLK_MAX_DEPTH];
+    uint8_t *tag_of;     /* chain head descriptor -> tag */
+    struct virtio_blk_req req[BLK_MAX_DEPTH];
+    volatile uint8_t status[BLK_MAX_DEPTH];
+};
+
+static struct virtio_blk devices[VIRTIO_MAX_DEVS];
+static unsigned int device_count = 0;
+
+/* Full fence: the avail index store must be visible before the device's
+ * event index is read. */
+static void mb(void)
+{
+    __asm__ __volatile__("lock; addl $0, (%%esp)" ::: "memory");
+}
+
+static uint16_t *used_event(struct virtio_blk *v)
+{
+    return &v->avail->ring[v->qsize];
+}
+
+static volatile uint16_t *avail_event(struct virtio_blk *v)
+{
+    return (volatile uint16_t *)&v->used->ring[v->qsize];
+}
+
+/* Make the requests added since the last call visible and notify the
+ * device if it asked to be told. */
+static void publish(struct virtio_blk *v)
+{
+    uint16_t old = v->avail->idx;
+    if (old == v->avail_idx) return;
+    /* one completion event for the whole batch: when the last request in
+     * flight is used */
+    unsigned int inflight = 0;
+    for (uint32_t t = v->tags & ~v->failed; t; t &= t - 1) inflight++;
+    *used_event(v) = (uint16_t)(v->last_used + inflight - 1);
+    __asm__ __volatile__("" ::: "memory");
+    *(volatile uint16_t *)&v->avail->idx = v->avail_idx;
+    mb();
+    int notify;
+    if (v->event_idx) {
+        uint16_t event = *avail_event(v);
+        notify = (uint16_t)(v->avail_idx - event - 1) < (uint16_t)(v->avail_idx - old);
+    } else {
+        notify = !(v->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+    if (notify) outw(v->io + VIRTIO_QUEUE_NOTIFY, 0);
+}
+
+static uint16_t alloc_desc(struct virtio_blk *v)
+{
+    uint16_t d = v->free_head;
+    v->free_head = v->desc[d].next;
+    v->num_free--;
+    return d;
+}
+
+static void free_chain(struct virtio_blk *v, uint16_t head)
+{
+    uint16_t d = head;
+    for (;;) {
+        v->num_free++;
+        if (!(v->desc[d].flags & VRING_DESC_F_NEXT)) break;
+        d = v->desc[d].next;
+    }
+    v->desc[d].next = v->free_head;
+    v->free_head = head;
+}
+
+static int vblk_queue(struct virtio_blk *v, uint32_t type, uint64_t lba, const struct blk_seg *segs, unsigned int nsegs)
+{
+    if (v->broken) return BLK_EIO;
+    /* header + data (split at size_max) + status */
+    uint32_t needed = 2;
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        uint32_t bytes = segs[i].sectors * BLK_SECTOR;
+        needed += v->size_max ? (bytes + v->size_max - 1) / v->size_max : 1;
+    }
+    if (needed > v->qsize) return BLK_EINVAL;
+    uint32_t free_tags = ~v->tags & (v->blk.queue_depth >= 32 ? 0xFFFFFFFFu : (1u << v->blk.queue_depth) - 1);
+    if (needed > v->num_free || !free_tags) return BLK_EBUSY;
+    unsigned int tag = 0;
+    while (!(free_tags & (1u << tag))) tag++;
+
+    v->req[tag].type = type;
+    v->req[tag].reserved = 0;
+    v->req[tag].sector = lba;
+    v->status[tag] = 0xFF;
+    uint16_t head = alloc_desc(v), d = head;
+    v->desc[d].addr = (uint32_t)(uintptr_t)&v->req[tag];
+    v->desc[d].len = sizeof(struct virtio_blk_req);
+    v->desc[d].flags = VRING_DESC_F_NEXT;
+    uint16_t data_flags = type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0;
+    for (unsigned int i = 0; i < nsegs; ++i) {
+        uint32_t addr = (uint32_t)(uintptr_t)segs[i].buf;
+        uint32_t left = segs[i].sectors * BLK_SECTOR;
+        while (left > 0) {
+            uint32_t len = v->size_max && left > v->size_max ? v->size_max : left;
+            uint16_t n = alloc_desc(v);
+            v->desc[d].next = n;
+            d = n;
+            v->desc[d].addr = addr;
+            v->desc[d].len = len;
+            v->desc[d].flags = data_flags | VRING_DESC_F_NEXT;
+            addr += len;
+            left -= len;
+        }
+    }
+    uint16_t n = alloc_desc(v);
+    v->desc[d].next = n;
+    d = n;
+    v->desc[d].addr = (uint32_t)(uintptr_t)&v->status[tag];
+    v->desc[d].len = 1;
+    v->desc[d].flags = VRING_DESC_F_WRITE;
+
+    v->head[tag] = head;
+    v->tag_of[head] = (uint8_t)tag;
+    v->tags |= 1u << tag;
+    /* published in a batch by the next reap */
+    v->avail->ring[v->avail_idx % v->qsize] = head;
+    v->avail_idx++;
+    return (int)tag;
+}
+
+static int vblk_start(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                      const struct blk_seg *segs, unsigned int nsegs)
+{
+    (void)count;
+    return vblk_queue(dev->priv, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, segs, nsegs);
+}
+
+/* Stop the device and fail everything in flight. */
+static void vblk_reset(struct virtio_blk *v)
+{
+    output_bytes(v->io + VIRTIO_STATUS, 0);
+    v->broken = 1;
+    v->failed |= v->tags;
+}
+
+static int vblk_reap(struct blk_dev *dev, int *status)
+{
+    struct virtio_blk *v = dev->priv;
+    if (!v->tags) return BLK_EINVAL;
+    publish(v);
+    uint64_t start = timer_ticks();
+    for (uint32_t spins = 0; !v->failed && v->used->idx == v->last_used; ++spins) {
+        if ((spins & 0xFF) == 0 && spins &&
+            (timer_ms(timer_ticks() - start) >= VIRTIO_TIMEOUT_MS || spins >= (1u << 28))) vblk_reset(v);
+    }
+    if (v->failed) {
+        unsigned int tag = 0;
+        while (!(v->failed & (1u << tag))) tag++;
+        v->failed &= ~(1u << tag);
+        v->tags &= ~(1u << tag);
+        *status = BLK_ETIMEDOUT;
+        return (int)tag;
+    }
+    __asm__ __volatile__("" ::: "memory");
+    uint16_t head = (uint16_t)v->used->ring[v->last_used % v->qsize].id;
+    v->last_used++;
+    unsigned int tag = v->tag_of[head];
+    free_chain(v, head);
+    v->tags &= ~(1u << tag);
+    *status = v->status[tag] == 0 ? BLK_OK : BLK_EIO;
+    return (int)tag;
+}
+
+/* Queue one request and wait for it. */
+static int vblk_sync(struct virtio_blk *v, uint32_t type, uint64_t lba, const struct blk_seg *segs, unsigned int nsegs)
+{
+    int status;
+    while (v->tags) vblk_reap(&v->blk, &status);
+    int tag = vblk_queue(v, type, lba, segs, nsegs);
+    if (tag < 0) return tag;
+    vblk_reap(&v->blk, &status);
+    return status;
+}
+
+static int vblk_transfer(struct blk_dev *dev, uint64_t lba, uint32_t count, int write,
+                         const struct blk_seg *segs, unsigned int nsegs)
+{
+    (void)count;
+    return vblk_sync(dev->priv, write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, lba, segs, nsegs);
+}
+
+static int vblk_flush(struct blk_dev *dev)
+{
+    struct virtio_blk *v = dev->priv;
+    if (!v->can_flush) return BLK_OK;
+    return vblk_sync(v, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+}
+
+static const struct blk_ops vblk_ops = {
+    .transfer = vblk_transfer,
+    .flush = vblk_flush,
+    .start = vblk_start,
+    .reap = vblk_reap,
+};
+
+static int vblk_probe(const struct pci_dev *pci)
+{
+    if (!(pci->bar[0] & 1) || device_count >= VIRTIO_MAX_DEVS) return -1;
+    struct virtio_blk *v = &devices[device_count];
+    memset(v, 0, sizeof(*v));
+    v->io = (uint16_t)(pci->bar[0] & ~3u);
+    pci_enable(pci, PCI_CMD_IO | PCI_CMD_BUSMASTER);
+
+    output_bytes(v->io + VIRTIO_STATUS, 0);
+    output_bytes(v->io + VIRTIO_STATUS, STATUS_ACKNOWLEDGE);
+    output_bytes(v->io + VIRTIO_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER);
+    uint32_t features = input_dword(v->io + VIRTIO_DEVICE_FEATURES);
+    features &= VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_FLUSH | VIRTIO_RING_F_EVENT_IDX;
+    output_dword(v->io + VIRTIO_GUEST_FEATURES, features);
+    v->event_idx = (features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    v->can_flush = (features & VIRTIO_BLK_F_FLUSH) != 0;
+
+    outw(v->io + VIRTIO_QUEUE_SELECT, 0);
+    v->qsize = input_word(v->io + VIRTIO_QUEUE_SIZE);
+    if (v->qsize < 3 || v->qsize > 32768) goto fail;
+    /* legacy layout: descriptors and avail ring, then the used ring on the
+     * next page */
+    uint32_t avail_end = 16u * v->qsize + 6 + 2u * v->qsize;
+    uint32_t used_off = (avail_end + 4095) & ~4095u;
+    uint32_t size = used_off + 6 + 8u * v->qsize;
+    uint8_t *ring = kmalloc(size);
+    v->tag_of = kmalloc(v->qsize);
+    if (!ring || !v->tag_of) {
+        if (ring) kfree(ring);
+        if (v->tag_of) kfree(v->tag_of);
+        goto fail;
+    }
+    memset(ring, 0, size);
+    v->desc = (struct vring_desc *)ring;
+    v->avail = (struct vring_avail *)(ring + 16u * v->qsize);
+    v->used = (volatile struct vring_used *)(ring + used_off);
+    for (uint16_t i = 0; i < v->qsize; ++i) v->desc[i].next = (uint16_t)(i + 1);
+    v->free_head = 0;
+    v->num_free = v->qsize;
+    output_dword(v->io + VIRTIO_QUEUE_PFN, (uint32_t)(uintptr_t)ring >> 12);
+
+    uint32_t cap_lo = input_dword(v->io + VIRTIO_CONFIG + BLK_CFG_CAPACITY);
+    uint32_t cap_hi = input_dword(v->io + VIRTIO_CONFIG + BLK_CFG_CAPACITY + 4);
+    unsigned int max_segs = BLK_MAX_SEGS;
+    if (features & VIRTIO_BLK_F_SIZE_MAX) v->size_max = input_dword(v->io + VIRTIO_CONFIG + BLK_CFG_SIZE_MAX) & ~(BLK_SECTOR - 1u);
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = input_dword(v->io + VIRTIO_CONFIG + BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < max_segs) max_segs = seg_max;
+    }
+    if (max_segs > (unsigned int)v->qsize - 2) max_segs = v->qsize - 2;
+    output_bytes(v->io + VIRTIO_STATUS, STATUS_ACKNOWLEDGE | STATUS_DRIVER | STATUS_DRIVER_OK);
+
+    v->blk.name[0] = 'v';
+    v->blk.name[1] = 'd';
+    v->blk.name[2] = (char)('a' + device_count);
+    v->blk.name[3] = '\0';
+    v->blk.sectors = ((uint64_t)cap_hi << 32) | cap_lo;
+    v->blk.max_sectors = 2048;
+    v->blk.max_segs = max_segs;
+    /* small requests take three descriptors */
+    v->blk.queue_depth = v->qsize / 3 < BLK_MAX_DEPTH ? v->qsize / 3 : BLK_MAX_DEPTH;
+    v->blk.ops = &vblk_ops;
+    v->blk.priv = v;
+    if (!v->blk.sectors || blk_register(&v->blk) != BLK_OK) {
+        output_bytes(v->io + VIRTIO_STATUS, 0);
+        kfree(ring);
+        kfree(v->tag_of);
+        return -1;
+    }
+    device_count++;
+    return 0;
+fail:
+    output_bytes(v->io + VIRTIO_STATUS, STATUS_FAILED);
+    return -1;
+}
+
+int virtio_blk_init(void)
+{
+    int found = 0;
+    struct pci_dev pci;
+    for (unsigned int i = 0; pci_find_device(VIRTIO_VENDOR, VIRTIO_BLK_LEGACY, i, &pci) == 0; ++i) {
+        if (vblk_probe(&pci) == 0) found++;
+    }
+    return found;
+}
@@ -33,83 +33,34 @@ int decrypt_xor(const uint8_t *input, size_t input_len,
     return encrypt_xor(input, input_len, output, output_len, key, key_len);
 }
 
-/* Encrypt entire file */
-int encrypt_file(const char *src_path, const char *dst_path, const char *key)
+/* Files are enciphered in blocks, each starting again at the first key
+ * byte; files encrypted so far were written that way. */
+#define ENCRYPT_BLOCK 1024
+
+struct xor_stream {
+    const char *key;
+    size_t key_len;
+    size_t k;     /* next key byte */
+    size_t pos;   /* position within the block */
+};
+
+/* fs_splice transform; works in place. */
+static int xor_run(void *arg, const uint8_t *in, size_t len, uint8_t *out)
 {
-    if (!src_path || !dst_path || !key) {
-        return -1;
-    }
-    
-    size_t key_len = strlen(key);
-    if (key_len == 0 || key_len > ENCRYPT_KEY_MAX) {
-        return -2;
-    }
-    
-    /* Open source file for reading */
-    int src_fd = fs_open(src_path, FS_O_RDONLY);
-    if (src_fd < 0) {
-        return -3;
-    }
-    
-    /* Create destination file (write via fs_create then fs_open/fs_write) */
-    int c = fs_create(dst_path, (const uint8_t *)"", 0);
-    if (c != FS_OK) {
-        fs_close(src_fd);
-        return -4;
-    }
-    
-    int dst_fd = fs_open(dst_path, FS_O_RDONLY);
-    if (dst_fd < 0) {
-        fs_close(src_fd);
-        return -4;
-    }
-    
-    /* Buffer for file I/O */
-    uint8_t input_buf[1024];
-    uint8_t output_buf[1024];
-    int total_encrypted = 0;
-    
-    /* Read and encrypt in chunks */
-    int bytes_read;
-    while (1) {
-        bytes_read = fs_read(src_fd, input_buf, sizeof(input_buf));
-        if (bytes_read < 0) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -5;
-        }
-        if (bytes_read == 0) {
-            break;
+    struct xor_stream *x = arg;
+    for (size_t i = 0; i < len; i++) {
+        out[i] = in[i] ^ (uint8_t)x->key[x->k];
+        if (++x->k == x->key_len) x->k = 0;
+        if (++x->pos == ENCRYPT_BLOCK) {
+            x->pos = 0;
+            x->k = 0;
         }
-        
-        /* Encrypt this chunk */
-        int encrypted_len = encrypt_xor(input_buf, bytes_read, output_buf, sizeof(output_buf),
-                                       key, key_len);
-        if (encrypted_len < 0) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -6;
-        }
-        
-        /* Write encrypted data */
-        int written = fs_write(dst_fd, output_buf, encrypted_len);
-        if (written < 0 || written != encrypted_len) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -7;
-        }
-        
-        total_encrypted += written;
     }
-    
-    fs_close(src_fd);
-    fs_close(dst_fd);
-    
-    return total_encrypted;
+    return (int)len;
 }
 
-/* Decrypt entire file */
-int decrypt_file(const char *src_path, const char *dst_path, const char *key)
+/* Encrypt or decrypt a whole file: XOR is its own inverse */
+static int xor_file(const char *src_path, const char *dst_path, const char *key)
 {
     if (!src_path || !dst_path || !key) {
         return -1;
@@ -126,7 +77,7 @@ int decrypt_file(const char *src_path, const char *dst_path, const char *key)
         return -3;
     }
     
-    /* Create destination file */
+    /* Create destination file (write via fs_create then fs_open/fs_splice) */
     int c = fs_create(dst_path, (const uint8_t *)"", 0);
     if (c != FS_OK) {
         fs_close(src_fd);
@@ -139,46 +90,25 @@ int decrypt_file(const char *src_path, const char *dst_path, const char *key)
         return -4;
     }
     
-    /* Buffer for file I/O */
-    uint8_t input_buf[1024];
-    uint8_t output_buf[1024];
-    int total_decrypted = 0;
-    
-    /* Read and decrypt in chunks */
-    int bytes_read;
-    while (1) {
-        bytes_read = fs_read(src_fd, input_buf, sizeof(input_buf));
-        if (bytes_read < 0) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -5;
-        }
-        if (bytes_read == 0) {
-            break;
-        }
-        
-        /* Decrypt this chunk (same as encrypt for XOR) */
-        int decrypted_len = decrypt_xor(input_buf, bytes_read, output_buf, sizeof(output_buf),
-                                        key, key_len);
-        if (decrypted_len < 0) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -6;
-        }
-        
-        /* Write decrypted data */
-        int written = fs_write(dst_fd, output_buf, decrypted_len);
-        if (written < 0 || written != decrypted_len) {
-            fs_close(src_fd);
-            fs_close(dst_fd);
-            return -7;
-        }
-        
-        total_decrypted += written;
-    }
+    /* Each byte is read from the source and written to the destination once */
+    struct xor_stream x = { key, key_len, 0, 0 };
+    const struct fs_transform xor = { xor_run, &x, 1 };
+    int total = fs_splice(src_fd, dst_fd, (size_t)-1, &xor);
     
     fs_close(src_fd);
     fs_close(dst_fd);
     
-    return total_decrypted;
+    return total < 0 ? -5 : total;
+}
+
+/* Encrypt entire file */
+int encrypt_file(const char *src_path, const char *dst_path, const char *key)
+{
+    return xor_file(src_path, dst_path, key);
+}
+
+/* Decrypt entire file */
+int decrypt_file(const char *src_path, const char *dst_path, const char *key)
+{
+    return xor_file(src_path, dst_path, key);
 }
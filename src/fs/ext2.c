@@ -0,0 +1,1560 @@
+#include "../include/ext2.h"
+#include "../include/bcache.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+#define EXT2_MAGIC 0xEF53
+#define EXT2_ROOT_INO 2
+#define EXT2_NDIR_BLOCKS 12
+
+/* feature bits */
+#define EXT2_COMPAT_DIR_INDEX     0x0020
+#define EXT2_INCOMPAT_FILETYPE    0x0002
+#define EXT2_RO_COMPAT_SPARSE     0x0001
+#define EXT2_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT2_FLAGS_UNSIGNED_HASH  0x0002
+
+#define EXT2_INDEX_FL 0x00001000 /* directory has an htree index */
+
+#define EXT2_S_IFMT  0xF000
+#define EXT2_S_IFDIR 0x4000
+#define EXT2_S_IFREG 0x8000
+
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR      2
+
+#define EXT2_NAME_MAX 255
+
+struct ext2_super {
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t r_blocks_count;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;
+    uint32_t log_block_size;
+    uint32_t log_frag_size;
+    uint32_t blocks_per_group;
+    uint32_t frags_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mtime;
+    uint32_t wtime;
+    uint16_t mnt_count;
+    uint16_t max_mnt_count;
+    uint16_t magic;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_rev_level;
+    uint32_t lastcheck;
+    uint32_t checkinterval;
+    uint32_t creator_os;
+    uint32_t rev_level;
+    uint16_t def_resuid;
+    uint16_t def_resgid;
+    /* revision 1 */
+    uint32_t first_ino;
+    uint16_t inode_size;
+    uint16_t block_group_nr;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    uint8_t uuid[16];
+    char volume_name[16];
+    char last_mounted[64];
+    uint32_t algo_bitmap;
+    uint8_t prealloc_blocks;
+    uint8_t prealloc_dir_blocks;
+    uint16_t reserved_gdt_blocks;
+    uint8_t journal_uuid[16];
+    uint32_t journal_inum;
+    uint32_t journal_dev;
+    uint32_t last_orphan;
+    uint32_t hash_seed[4];
+    uint8_t def_hash_version;
+    uint8_t jnl_backup_type;
+    uint16_t desc_size;
+    uint32_t default_mount_opts;
+    uint32_t first_meta_bg;
+    uint32_t mkfs_time;
+    uint32_t jnl_blocks[17];
+    uint32_t blocks_count_hi;
+    uint32_t r_blocks_count_hi;
+    uint32_t free_blocks_hi;
+    uint16_t min_extra_isize;
+    uint16_t want_extra_isize;
+    uint32_t flags;
+    uint8_t unused[1024 - 356];
+};
+
+struct ext2_group {
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint16_t free_blocks_count;
+    uint16_t free_inodes_count;
+    uint16_t used_dirs_count;
+    uint16_t pad;
+    uint32_t reserved[3];
+};
+
+struct ext2_inode {
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t blocks;      /* 512-byte units */
+    uint32_t flags;
+    uint32_t osd1;
+    uint32_t block[15];
+    uint32_t generation;
+    uint32_t file_acl;
+    uint32_t size_high;
+    uint32_t faddr;
+    uint8_t frag;
+    uint8_t fsize;
+    uint16_t pad1;
+    uint16_t uid_high;
+    uint16_t gid_high;
+    uint32_t reserved2;
+};
+
+struct ext2_dirent {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    char name[];
+};
+
+struct ext2_fs {
+    int used;
+    struct blk_dev *dev;
+    char mount[128];
+    struct ext2_super sb;
+    struct ext2_group *gd;
+    unsigned int block_size;
+    unsigned int inode_size;
+    unsigned int groups;
+    unsigned int per_block;    /* block numbers per indirect block */
+    unsigned int gd_per_block;
+    uint32_t gdt_block;
+    int readonly;
+    int sb_dirty;
+};
+
+/* Backend data of an open vnode. */
+struct ext2_file {
+    int used;
+    struct ext2_fs *fs;
+    uint32_t ino;
+    struct bcache_ra ra;
+};
+
+static struct ext2_fs mounts[EXT2_MAX_MOUNTS];
+static struct ext2_file files[EXT2_MAX_FILES];
+static uint32_t dir_stamp; /* bumped by every directory change, for the listing cursor */
+
+/* ---- blocks, group descriptors and inodes ---- */
+
+static struct bcache_buf *bget(struct ext2_fs *fs, uint32_t block)
+{
+    return bcache_get(fs->dev, block, fs->block_size);
+}
+
+static uint32_t rd32(const void *p)
+{
+    const uint8_t *b = p;
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static int super_write(struct ext2_fs *fs)
+{
+    if (fs->readonly || !fs->sb_dirty) return FS_OK;
+    /* the primary superblock always sits at byte 1024 */
+    if (blk_write(fs->dev, 1024 / BLK_SECTOR, sizeof(fs->sb) / BLK_SECTOR, &fs->sb) != BLK_OK) return FS_EIO;
+    fs->sb_dirty = 0;
+    return FS_OK;
+}
+
+/* Store group descriptor g back into its table block. */
+static void group_write(struct ext2_fs *fs, unsigned int g)
+{
+    struct bcache_buf *b = bget(fs, fs->gdt_block + g / fs->gd_per_block);
+    if (!b) return;
+    memcpy(b->data + (g % fs->gd_per_block) * sizeof(struct ext2_group), &fs->gd[g], sizeof(struct ext2_group));
+    bcache_dirty(b);
+    bcache_put(b);
+    fs->sb_dirty = 1;
+}
+
+static int inode_locate(struct ext2_fs *fs, uint32_t ino, uint32_t *block, unsigned int *offset)
+{
+    if (ino == 0 || ino > fs->sb.inodes_count) return FS_EINVAL;
+    uint32_t g = (ino - 1) / fs->sb.inodes_per_group;
+    uint32_t index = (ino - 1) % fs->sb.inodes_per_group;
+    uint32_t byte = index * fs->inode_size;
+    *block = fs->gd[g].inode_table + byte / fs->block_size;
+    *offset = byte % fs->block_size;
+    return FS_OK;
+}
+
+static int inode_read(struct ext2_fs *fs, uint32_t ino, struct ext2_inode *in)
+{
+    uint32_t block;
+    unsigned int offset;
+    if (inode_locate(fs, ino, &block, &offset) != FS_OK) return FS_EINVAL;
+    struct bcache_buf *b = bget(fs, block);
+    if (!b) return FS_EIO;
+    memcpy(in, b->data + offset, sizeof(*in));
+    bcache_put(b);
+    return FS_OK;
+}
+
+static int inode_write(struct ext2_fs *fs, uint32_t ino, const struct ext2_inode *in)
+{
+    uint32_t block;
+    unsigned int offset;
+    if (inode_locate(fs, ino, &block, &offset) != FS_OK) return FS_EINVAL;
+    struct bcache_buf *b = bget(fs, block);
+    if (!b) return FS_EIO;
+    /* larger on-disk inodes keep their extra fields */
+    memcpy(b->data + offset, in, sizeof(*in));
+    bcache_dirty(b);
+    bcache_put(b);
+    return FS_OK;
+}
+
+/* There is no wall clock: timestamps reuse the last write time recorded by
+ * whoever wrote the filesystem before. Never below inodes_count, so a
+ * deletion time cannot be mistaken for an orphan list link. */
+static uint32_t timestamp(const struct ext2_fs *fs)
+{
+    uint32_t t = fs->sb.wtime ? fs->sb.wtime : fs->sb.mkfs_time;
+    return t > fs->sb.inodes_count ? t : fs->sb.inodes_count;
+}
+
+/* ---- allocation ---- */
+
+/* First clear bit in [from, nbits) of bitmap, or -1. */
+static int find_zero(const uint8_t *bitmap, unsigned int from, unsigned int nbits)
+{
+    for (unsigned int i = from; i < nbits;) {
+        if ((i & 7) == 0 && bitmap[i >> 3] == 0xFF) { i += 8; continue; }
+        if (!(bitmap[i >> 3] & (1u << (i & 7)))) return (int)i;
+        i++;
+    }
+    return -1;
+}
+
+static unsigned int group_blocks(const struct ext2_fs *fs, unsigned int g)
+{
+    uint32_t start = fs->sb.first_data_block + g * fs->sb.blocks_per_group;
+    uint32_t left = fs->sb.blocks_count - start;
+    return left < fs->sb.blocks_per_group ? left : fs->sb.blocks_per_group;
+}
+
+/* Allocate a block, as close after goal as possible: the goal itself,
+ * then the rest of its group, then the following groups. 0 if full. */
+static uint32_t block_alloc(struct ext2_fs *fs, uint32_t goal)
+{
+    if (goal < fs->sb.first_data_block || goal >= fs->sb.blocks_count) goal = fs->sb.first_data_block;
+    unsigned int g0 = (goal - fs->sb.first_data_block) / fs->sb.blocks_per_group;
+    for (unsigned int i = 0; i <= fs->groups; ++i) {
+        unsigned int g = (g0 + i) % fs->groups;
+        if (fs->gd[g].free_blocks_count == 0) continue;
+        struct bcache_buf *b = bget(fs, fs->gd[g].block_bitmap);
+        if (!b) return 0;
+        unsigned int nbits = group_blocks(fs, g);
+        int bit = -1;
+        if (i == 0) {
+            unsigned int start = (goal - fs->sb.first_data_block) % fs->sb.blocks_per_group;
+            bit = find_zero(b->data, start, nbits);
+        }
+        /* the goal's group is visited again last for the part before goal */
+        if (bit < 0) bit = find_zero(b->data, 0, nbits);
+        if (bit < 0) {
+            bcache_put(b);
+            continue;
+        }
+        b->data[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+        bcache_dirty(b);
+        bcache_put(b);
+        fs->gd[g].free_blocks_count--;
+        fs->sb.free_blocks_count--;
+        group_write(fs, g);
+        return fs->sb.first_data_block + g * fs->sb.blocks_per_group + (uint32_t)bit;
+    }
+    return 0;
+}
+
+static void block_free(struct ext2_fs *fs, uint32_t block)
+{
+    if (block < fs->sb.first_data_block || block >= fs->sb.blocks_count) return;
+    unsigned int g = (block - fs->sb.first_data_block) / fs->sb.blocks_per_group;
+    unsigned int bit = (block - fs->sb.first_data_block) % fs->sb.blocks_per_group;
+    struct bcache_buf *b = bget(fs, fs->gd[g].block_bitmap);
+    if (!b) return;
+    if (b->data[bit >> 3] & (1u << (bit & 7))) {
+        b->data[bit >> 3] &= (uint8_t)~(1u << (bit & 7));
+        bcache_dirty(b);
+        fs->gd[g].free_blocks_count++;
+        fs->sb.free_blocks_count++;
+        group_write(fs, g);
+    }
+    bcache_put(b);
+}
+
+/* Allocate an inode. Directories go to a group with an above average
+ * share of free inodes and the most free blocks, spreading the tree;
+ * files stay in their directory's group. 0 if none is free. */
+static uint32_t inode_alloc(struct ext2_fs *fs, uint32_t parent, int is_dir)
+{
+    unsigned int g0 = (parent - 1) / fs->sb.inodes_per_group;
+    if (is_dir) {
+        uint32_t avg = fs->sb.free_inodes_count / fs->groups;
+        int best = -1;
+        for (unsigned int g = 0; g < fs->groups; ++g) {
+            if (fs->gd[g].free_inodes_count == 0 || fs->gd[g].free_inodes_count < avg) continue;
+            if (best < 0 || fs->gd[g].free_blocks_count > fs->gd[best].free_blocks_count) best = (int)g;
+        }
+        if (best >= 0) g0 = (unsigned int)best;
+    }
+    for (unsigned int i = 0; i < fs->groups; ++i) {
+        unsigned int g = (g0 + i) % fs->groups;
+        if (fs->gd[g].free_inodes_count == 0) continue;
+        struct bcache_buf *b = bget(fs, fs->gd[g].inode_bitmap);
+        if (!b) return 0;
+        int bit = find_zero(b->data, 0, fs->sb.inodes_per_group);
+        uint32_t ino = bit < 0 ? 0 : g * fs->sb.inodes_per_group + (uint32_t)bit + 1;
+        if (bit < 0 || ino < fs->sb.first_ino) {
+            bcache_put(b);
+            continue;
+        }
+        b->data[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+        bcache_dirty(b);
+        bcache_put(b);
+        fs->gd[g].free_inodes_count--;
+        if (is_dir) fs->gd[g].used_dirs_count++;
+        fs->sb.free_inodes_count--;
+        group_write(fs, g);
+        return ino;
+    }
+    return 0;
+}
+
+static void inode_free(struct ext2_fs *fs, uint32_t ino, int is_dir)
+{
+    unsigned int g = (ino - 1) / fs->sb.inodes_per_group;
+    unsigned int bit = (ino - 1) % fs->sb.inodes_per_group;
+    struct bcache_buf *b = bget(fs, fs->gd[g].inode_bitmap);
+    if (!b) return;
+    if (b->data[bit >> 3] & (1u << (bit & 7))) {
+        b->data[bit >> 3] &= (uint8_t)~(1u << (bit & 7));
+        bcache_dirty(b);
+        fs->gd[g].free_inodes_count++;
+        if (is_dir && fs->gd[g].used_dirs_count) fs->gd[g].used_dirs_count--;
+        fs->sb.free_inodes_count++;
+        group_write(fs, g);
+    }
+    bcache_put(b);
+}
+
+/* ---- block maps ---- */
+
+/* Path through the block map to file block fb: the index in i_block and
+ * in each indirect level. Returns the number of levels below i_block, or
+ * -1 if fb is out of range. */
+static int map_path(const struct ext2_fs *fs, uint64_t fb64, unsigned int *first, uint32_t *offsets)
+{
+    /* per is at most 1024, so every level fits 32-bit arithmetic */
+    uint32_t per = fs->per_block;
+    if (fb64 >> 32) return -1;
+    uint32_t fb = (uint32_t)fb64;
+    if (fb < EXT2_NDIR_BLOCKS) {
+        *first = fb;
+        return 0;
+    }
+    fb -= EXT2_NDIR_BLOCKS;
+    if (fb < per) {
+        *first = 12;
+        offsets[0] = fb;
+        return 1;
+    }
+    fb -= per;
+    if (fb < per * per) {
+        *first = 13;
+        offsets[0] = fb / per;
+        offsets[1] = fb % per;
+        return 2;
+    }
+    fb -= per * per;
+    if (fb < per * per * per) {
+        *first = 14;
+        offsets[0] = fb / (per * per);
+        offsets[1] = fb / per % per;
+        offsets[2] = fb % per;
+        return 3;
+    }
+    return -1;
+}
+
+/* Device block of file block fb, 0 for a hole. With create, missing
+ * blocks are allocated next to goal; *fresh is set when the data block
+ * is new: it holds stale data and must be initialised completely. */
+static uint32_t bmap(struct ext2_fs *fs, struct ext2_inode *in, uint64_t fb, int create, uint32_t goal, int *fresh)
+{
+    unsigned int first;
+    uint32_t offsets[3];
+    int levels = map_path(fs, fb, &first, offsets);
+    if (fresh) *fresh = 0;
+    if (levels < 0) return 0;
+    uint32_t *slot = &in->block[first];
+    struct bcache_buf *held = NULL;
+    for (int level = 0;; ++level) {
+        uint32_t block = *slot;
+        if (!block) {
+            if (!create || fs->readonly) break;
+            block = block_alloc(fs, goal);
+            if (!block) break;
+            goal = block + 1;
+            in->blocks += fs->block_size / BLK_SECTOR;
+            if (level < levels) {
+                /* a new indirect block starts out empty; the cache may
+                 * still hold the old contents of a freed block */
+                struct bcache_buf *nb = bcache_getblk(fs->dev, block, fs->block_size);
+                if (!nb) {
+                    block_free(fs, block);
+                    in->blocks -= fs->block_size / BLK_SECTOR;
+                    break;
+                }
+                memset(nb->data, 0, fs->block_size);
+                bcache_dirty(nb);
+                bcache_put(nb);
+            } else if (fresh) {
+                *fresh = 1;
+            }
+            *slot = block;
+            if (held) bcache_dirty(held);
+        }
+        if (level == levels) {
+            if (held) bcache_put(held);
+            return block;
+        }
+        struct bcache_buf *b = bget(fs, block);
+        if (held) bcache_put(held);
+        held = b;
+        if (!b) return 0;
+        slot = (uint32_t *)b->data + offsets[level];
+    }
+    if (held) bcache_put(held);
+    return 0;
+}
+
+/* Block to allocate file block fb near: right after the block before it,
+ * or at the start of the inode's group. */
+static uint32_t alloc_goal(struct ext2_fs *fs, struct ext2_inode *in, uint32_t ino, uint64_t fb)
+{
+    if (fb > 0) {
+        uint32_t prev = bmap(fs, in, fb - 1, 0, 0, NULL);
+        if (prev) return prev + 1;
+    }
+    unsigned int g = (ino - 1) / fs->sb.inodes_per_group;
+    return fs->sb.first_data_block + g * fs->sb.blocks_per_group;
+}
+
+/* Free the blocks of the subtree at block (level 0: a data block) that
+ * hold file blocks >= keep; the subtree covers file blocks from base.
+ * Returns 1 if block itself was freed. */
+static int free_subtree(struct ext2_fs *fs, struct ext2_inode *in, uint32_t block, int level, uint64_t base, uint64_t keep)
+{
+    if (!block) return 0;
+    if (level > 0) {
+        uint64_t span = 1;
+        for (int i = 1; i < level; ++i) span *= fs->per_block;
+        if (base + span * fs->per_block <= keep) return 0;
+        struct bcache_buf *b = bget(fs, block);
+        if (!b) return 0;
+        uint32_t *e = (uint32_t *)b->data;
+        for (unsigned int i = 0; i < fs->per_block; ++i) {
+            uint64_t child = base + i * span;
+            if (child + span <= keep || !e[i]) continue;
+            if (free_subtree(fs, in, e[i], level - 1, child, keep)) {
+                e[i] = 0;
+                bcache_dirty(b);
+            }
+        }
+        bcache_put(b);
+    }
+    if (base < keep) return 0;
+    block_free(fs, block);
+    in->blocks -= fs->block_size / BLK_SECTOR;
+    return 1;
+}
+
+/* Release every block that maps file blocks >= keep. */
+static void free_blocks_from(struct ext2_fs *fs, struct ext2_inode *in, uint64_t keep)
+{
+    uint64_t per = fs->per_block;
+    for (unsigned int i = 0; i < EXT2_NDIR_BLOCKS; ++i) {
+        if (free_subtree(fs, in, in->block[i], 0, i, keep)) in->block[i] = 0;
+    }
+    uint64_t base = EXT2_NDIR_BLOCKS;
+    uint64_t span = per;
+    for (int level = 1; level <= 3; ++level) {
+        if (free_subtree(fs, in, in->block[11 + level], level, base, keep)) in->block[11 + level] = 0;
+        base += span;
+        span *= per;
+    }
+}
+
+/* ---- directory hashing (htree) ---- */
+
+static void str2hashbuf(const char *msg, int len, uint32_t *buf, int num, int unsigned_chars)
+{
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    uint32_t val = pad;
+    if (len > num * 4) len = num * 4;
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) *buf++ = val;
+    while (--num >= 0) *buf++ = pad;
+}
+
+static uint32_t dx_hack_hash(const char *name, int len, int unsigned_chars)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    while (len--) {
+        int c = unsigned_chars ? (int)(unsigned char)*name++ : (int)(signed char)*name++;
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        if (hash & 0x80000000) hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    for (int n = 0; n < 16; ++n) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL32(a, s))
+#define MD4_K2 013240474631u
+#define MD4_K3 015666365641u
+
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/* Hash of a name as stored in the index (version 0 legacy, 1 half MD4,
+ * 2 TEA; 3-5 the same over unsigned chars). */
+static uint32_t dx_hash(const struct ext2_fs *fs, unsigned int version, const char *name, int len)
+{
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    const uint32_t *seed = fs->sb.hash_seed;
+    if (seed[0] || seed[1] || seed[2] || seed[3]) memcpy(buf, seed, sizeof(buf));
+    int unsigned_chars = version >= 3;
+    uint32_t hash;
+    switch (version % 3) {
+    case 1:
+        for (const char *p = name; len > 0; len -= 32, p += 32) {
+            str2hashbuf(p, len, in, 8, unsigned_chars);
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case 2:
+        for (const char *p = name; len > 0; len -= 16, p += 16) {
+            str2hashbuf(p, len, in, 4, unsigned_chars);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        hash = dx_hack_hash(name, len, unsigned_chars);
+        break;
+    }
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1)) hash = (0x7fffffffu - 1) << 1;
+    return hash;
+}
+
+/* ---- directories ---- */
+
+static unsigned int rec_size(unsigned int name_len)
+{
+    return (8 + name_len + 3) & ~3u;
+}
+
+/* Look for name in one directory block. Returns its inode or 0. */
+static uint32_t block_find(struct ext2_fs *fs, uint32_t block, const char *name, size_t len, uint8_t *type)
+{
+    struct bcache_buf *b = bget(fs, block);
+    if (!b) return 0;
+    uint32_t found = 0;
+    for (unsigned int off = 0; off + 8 <= fs->block_size;) {
+        const struct ext2_dirent *de = (const struct ext2_dirent *)(b->data + off);
+        if (de->rec_len < 8 || off + de->rec_len > fs->block_size) break;
+        if (de->inode && de->name_len == len && memcmp(de->name, name, len) == 0) {
+            found = de->inode;
+            if (type) *type = de->file_type;
+            break;
+        }
+        off += de->rec_len;
+    }
+    bcache_put(b);
+    return found;
+}
+
+/* htree lookup: follow the index to the leaf blocks that can hold name.
+ * Returns the inode, 0 if not there, or (uint32_t)-1 if the index cannot
+ * be used. */
+static uint32_t dx_find(struct ext2_fs *fs, struct ext2_inode *dir, const char *name, size_t len, uint8_t *type)
+{
+    uint32_t root = bmap(fs, dir, 0, 0, 0, NULL);
+    struct bcache_buf *b = root ? bget(fs, root) : NULL;
+    if (!b) return (uint32_t)-1;
+    /* "." (12 bytes), ".." then the root info at byte 24 */
+    unsigned int version = b->data[28];
+    unsigned int info_len = b->data[29];
+    unsigned int levels = b->data[30];
+    if (rd32(b->data + 24) != 0 || info_len != 8 || levels > 2 || version > 2) {
+        bcache_put(b);
+        return (uint32_t)-1;
+    }
+    if (fs->sb.flags & EXT2_FLAGS_UNSIGNED_HASH) version += 3;
+    uint32_t hash = dx_hash(fs, version, name, (int)len);
+    /* the path taken from the root: index block, offset of its entries,
+     * their count and the entry followed at each level */
+    uint32_t node[3], pos[3], cnt[3];
+    unsigned int at[3];
+    uint32_t leaf = 0;
+    node[0] = root;
+    at[0] = 32;
+    for (unsigned int level = 0;; ++level) {
+        const uint8_t *cl = b->data + at[level];
+        unsigned int count = cl[2] | (cl[3] << 8);
+        unsigned int limit = cl[0] | (cl[1] << 8);
+        if (count == 0 || count > limit || at[level] + count * 8 > fs->block_size) {
+            bcache_put(b);
+            return (uint32_t)-1;
+        }
+        /* entry 0 has no hash (it covers everything below entry 1) */
+        unsigned int lo = 1, hi = count;
+        while (lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+            if (rd32(cl + mid * 8) <= hash) lo = mid + 1;
+            else hi = mid;
+        }
+        pos[level] = lo - 1;
+        cnt[level] = count;
+        uint32_t child = rd32(cl + pos[level] * 8 + 4) & 0x0FFFFFFF;
+        bcache_put(b);
+        if (level == levels) {
+            leaf = child;
+            break;
+        }
+        uint32_t block = bmap(fs, dir, child, 0, 0, NULL);
+        b = block ? bget(fs, block) : NULL;
+        if (!b) return (uint32_t)-1;
+        node[level + 1] = block;
+        at[level + 1] = 8; /* interior nodes start with an empty dirent */
+    }
+    for (;;) {
+        uint32_t block = bmap(fs, dir, leaf, 0, 0, NULL);
+        uint32_t ino = block ? block_find(fs, block, name, len, type) : 0;
+        if (ino) return ino;
+        /* names with the same hash may continue in the leaf of the next
+         * index entry, marked by bit 0 of that entry's hash; the next entry
+         * may belong to an index block further up */
+        int level = (int)levels;
+        while (level >= 0 && pos[level] + 1 >= cnt[level]) level--;
+        if (level < 0) return 0;
+        pos[level]++;
+        struct bcache_buf *ib = bget(fs, node[level]);
+        if (!ib) return (uint32_t)-1;
+        const uint8_t *e = ib->data + at[level] + pos[level] * 8;
+        uint32_t next_hash = rd32(e);
+        uint32_t child = rd32(e + 4) & 0x0FFFFFFF;
+        bcache_put(ib);
+        if ((next_hash & ~1u) != hash || !(next_hash & 1)) return 0;
+        /* down the first entries to the leaf */
+        while (level < (int)levels) {
+            uint32_t blk = bmap(fs, dir, child, 0, 0, NULL);
+            ib = blk ? bget(fs, blk) : NULL;
+            if (!ib) return (uint32_t)-1;
+            const uint8_t *cl = ib->data + 8;
+            unsigned int count = cl[2] | (cl[3] << 8);
+            unsigned int limit = cl[0] | (cl[1] << 8);
+            if (count == 0 || count > limit || 8 + count * 8 > fs->block_size) {
+                bcache_put(ib);
+                return (uint32_t)-1;
+            }
+            level++;
+            node[level] = blk;
+            at[level] = 8;
+            pos[level] = 0;
+            cnt[level] = count;
+            child = rd32(cl + 4) & 0x0FFFFFFF;
+            bcache_put(ib);
+        }
+        leaf = child;
+    }
+}
+
+/* Inode of name in directory dir, 0 if absent. */
+static uint32_t dir_find(struct ext2_fs *fs, uint32_t dir, const char *name, size_t len, uint8_t *type)
+{
+    struct ext2_inode in;
+    if (inode_read(fs, dir, &in) != FS_OK || (in.mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return 0;
+    if ((in.flags & EXT2_INDEX_FL) && (fs->sb.feature_compat & EXT2_COMPAT_DIR_INDEX)) {
+        uint32_t ino = dx_find(fs, &in, name, len, type);
+        if (ino != (uint32_t)-1 && ino != 0) return ino;
+        /* a miss falls through to the linear scan, which cannot be fooled
+         * by an index that went stale */
+    }
+    uint64_t nblocks = in.size / fs->block_size;
+    for (uint64_t fb = 0; fb < nblocks; ++fb) {
+        uint32_t block = bmap(fs, &in, fb, 0, 0, NULL);
+        if (!block) continue;
+        uint32_t ino = block_find(fs, block, name, len, type);
+        if (ino) return ino;
+    }
+    return 0;
+}
+
+/* Resolve a path relative to the filesystem root. */
+static uint32_t namei(struct ext2_fs *fs, const char *path)
+{
+    uint32_t ino = EXT2_ROOT_INO;
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        if (!*p) return ino;
+        size_t len = 0;
+        while (p[len] && p[len] != '/') len++;
+        if (len > EXT2_NAME_MAX) return 0;
+        ino = dir_find(fs, ino, p, len, NULL);
+        if (!ino) return 0;
+        p += len;
+    }
+}
+
+/* Split path into its parent directory inode and last component. */
+static uint32_t namei_parent(struct ext2_fs *fs, const char *path, char *name)
+{
+    size_t end = strlen(path);
+    while (end > 0 && path[end - 1] == '/') end--;
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/') start--;
+    if (start == end || end - start > EXT2_NAME_MAX) return 0;
+    memcpy(name, path + start, end - start);
+    name[end - start] = '\0';
+    char parent[256];
+    if (start >= sizeof(parent)) return 0;
+    memcpy(parent, path, start);
+    parent[start] = '\0';
+    return namei(fs, parent);
+}
+
+static uint8_t file_type(const struct ext2_fs *fs, int is_dir)
+{
+    if (!(fs->sb.feature_incompat & EXT2_INCOMPAT_FILETYPE)) return 0;
+    return is_dir ? EXT2_FT_DIR : EXT2_FT_REG_FILE;
+}
+
+/* Add an entry to directory dir: into the first gap large enough, or a
+ * new block at the end. */
+static int dir_add(struct ext2_fs *fs, uint32_t dir, const char *name, uint32_t ino, uint8_t type)
+{
+    struct ext2_inode in;
+    if (inode_read(fs, dir, &in) != FS_OK) return FS_EIO;
+    size_t len = strlen(name);
+    unsigned int need = rec_size((unsigned int)len);
+    uint64_t nblocks = in.size / fs->block_size;
+    /* the hash index would go stale */
+    in.flags &= ~EXT2_INDEX_FL;
+    for (uint64_t fb = 0; fb <= nblocks; ++fb) {
+        struct bcache_buf *b;
+        int fresh = 0;
+        if (fb == nblocks) {
+            uint32_t block = bmap(fs, &in, fb, 1, alloc_goal(fs, &in, dir, fb), &fresh);
+            if (!block) return FS_EIO;
+            b = bcache_getblk(fs->dev, block, fs->block_size);
+            if (!b) return FS_EIO;
+            struct ext2_dirent *de = (struct ext2_dirent *)b->data;
+            de->inode = 0;
+            de->rec_len = (uint16_t)fs->block_size;
+            in.size += fs->block_size;
+        } else {
+            uint32_t block = bmap(fs, &in, fb, 0, 0, NULL);
+            if (!block) continue;
+            b = bget(fs, block);
+            if (!b) return FS_EIO;
+        }
+        for (unsigned int off = 0; off + 8 <= fs->block_size;) {
+            struct ext2_dirent *de = (struct ext2_dirent *)(b->data + off);
+            if (de->rec_len < 8 || off + de->rec_len > fs->block_size) break;
+            unsigned int used = de->inode ? rec_size(de->name_len) : 0;
+            if (de->rec_len - used >= need) {
+                if (used) {
+                    /* split: the new entry takes the tail */
+                    unsigned int rest = de->rec_len - used;
+                    de->rec_len = (uint16_t)used;
+                    de = (struct ext2_dirent *)(b->data + off + used);
+                    de->rec_len = (uint16_t)rest;
+                }
+                de->inode = ino;
+                de->name_len = (uint8_t)len;
+                de->file_type = type;
+                memcpy(de->name, name, len);
+                bcache_dirty(b);
+                bcache_put(b);
+                dir_stamp++;
+                return inode_write(fs, dir, &in);
+            }
+            off += de->rec_len;
+        }
+        bcache_put(b);
+    }
+    return FS_EIO;
+}
+
+/* Remove name from directory dir. */
+static int dir_remove(struct ext2_fs *fs, uint32_t dir, const char *name)
+{
+    struct ext2_inode in;
+    if (inode_read(fs, dir, &in) != FS_OK) return FS_EIO;
+    size_t len = strlen(name);
+    uint64_t nblocks = in.size / fs->block_size;
+    for (uint64_t fb = 0; fb < nblocks; ++fb) {
+        uint32_t block = bmap(fs, &in, fb, 0, 0, NULL);
+        struct bcache_buf *b = block ? bget(fs, block) : NULL;
+        if (!b) continue;
+        struct ext2_dirent *prev = NULL;
+        for (unsigned int off = 0; off + 8 <= fs->block_size;) {
+            struct ext2_dirent *de = (struct ext2_dirent *)(b->data + off);
+            if (de->rec_len < 8 || off + de->rec_len > fs->block_size) break;
+            if (de->inode && de->name_len == len && memcmp(de->name, name, len) == 0) {
+                /* merge into the previous entry; the first one of a
+                 * block is only marked unused */
+                if (prev) prev->rec_len = (uint16_t)(prev->rec_len + de->rec_len);
+                else de->inode = 0;
+                bcache_dirty(b);
+                bcache_put(b);
+                dir_stamp++;
+                if (in.flags & EXT2_INDEX_FL) {
+                    in.flags &= ~EXT2_INDEX_FL;
+                    return inode_write(fs, dir, &in);
+                }
+                return FS_OK;
+            }
+            prev = de;
+            off += de->rec_len;
+        }
+        bcache_put(b);
+    }
+    return FS_ENOENT;
+}
+
+/* Whether a directory holds nothing but "." and "..". */
+static int dir_empty(struct ext2_fs *fs, struct ext2_inode *in)
+{
+    uint64_t nblocks = in->size / fs->block_size;
+    for (uint64_t fb = 0; fb < nblocks; ++fb) {
+        uint32_t block = bmap(fs, in, fb, 0, 0, NULL);
+        struct bcache_buf *b = block ? bget(fs, block) : NULL;
+        if (!b) continue;
+        for (unsigned int off = 0; off + 8 <= fs->block_size;) {
+            const struct ext2_dirent *de = (const struct ext2_dirent *)(b->data + off);
+            if (de->rec_len < 8 || off + de->rec_len > fs->block_size) break;
+            int dot = de->name_len == 1 && de->name[0] == '.';
+            int dotdot = de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.';
+            if (de->inode && !dot && !dotdot) {
+                bcache_put(b);
+                return 0;
+            }
+            off += de->rec_len;
+        }
+        bcache_put(b);
+    }
+    return 1;
+}
+
+/* ---- mounting ---- */
+
+static int ext2_mount(const char *source, const char *path, void **out)
+{
+    struct blk_dev *dev = blk_find(source);
+    if (!dev) return FS_ENOENT;
+    if (strlen(path) >= sizeof(mounts[0].mount)) return FS_EINVAL;
+    struct ext2_fs *fs = NULL;
+    for (int i = 0; i < EXT2_MAX_MOUNTS; ++i) {
+        if (mounts[i].used && mounts[i].dev == dev) return FS_EINVAL;
+        if (!mounts[i].used && !fs) fs = &mounts[i];
+    }
+    if (!fs) return FS_EMFILE;
+    memset(fs, 0, sizeof(*fs));
+    fs->dev = dev;
+    if (blk_read(dev, 1024 / BLK_SECTOR, sizeof(fs->sb) / BLK_SECTOR, &fs->sb) != BLK_OK) return FS_EIO;
+    struct ext2_super *sb = &fs->sb;
+    if (sb->magic != EXT2_MAGIC || sb->log_block_size > 2 || !sb->blocks_per_group || !sb->inodes_per_group) return FS_EINVAL;
+    /* only the filetype feature changes the on-disk format we write */
+    if (sb->rev_level >= 1 && (sb->feature_incompat & ~EXT2_INCOMPAT_FILETYPE)) return FS_EINVAL;
+    fs->block_size = 1024u << sb->log_block_size;
+    fs->inode_size = sb->rev_level >= 1 ? sb->inode_size : 128;
+    if (sb->rev_level < 1) sb->first_ino = 11;
+    if (fs->inode_size < 128 || fs->inode_size > fs->block_size) return FS_EINVAL;
+    fs->readonly = sb->rev_level >= 1 && (sb->feature_ro_compat & ~(EXT2_RO_COMPAT_SPARSE | EXT2_RO_COMPAT_LARGE_FILE));
+    /* at least one group, or the allocators would divide by zero */
+    if (sb->blocks_count <= sb->first_data_block) return FS_EINVAL;
+    fs->groups = (sb->blocks_count - sb->first_data_block + sb->blocks_per_group - 1) / sb->blocks_per_group;
+    fs->per_block = fs->block_size / 4;
+    fs->gd_per_block = fs->block_size / sizeof(struct ext2_group);
+    fs->gdt_block = sb->first_data_block + 1;
+    if ((uint64_t)sb->blocks_count * (fs->block_size / BLK_SECTOR) > dev->sectors) return FS_EINVAL;
+    fs->gd = kmalloc(fs->groups * sizeof(struct ext2_group));
+    if (!fs->gd) return FS_EIO;
+    for (unsigned int g = 0; g < fs->groups; ++g) {
+        struct bcache_buf *b = bget(fs, fs->gdt_block + g / fs->gd_per_block);
+        if (!b) {
+            kfree(fs->gd);
+            return FS_EIO;
+        }
+        memcpy(&fs->gd[g], b->data + (g % fs->gd_per_block) * sizeof(struct ext2_group), sizeof(struct ext2_group));
+        bcache_put(b);
+    }
+    /* kept for the full paths of listings and change events */
+    strcpy(fs->mount, path);
+    fs->used = 1;
+    if (!fs->readonly) {
+        sb->mnt_count++;
+        fs->sb_dirty = 1;
+        super_write(fs);
+    }
+    *out = fs;
+    return FS_OK;
+}
+
+static int ext2_unmount(void *instance)
+{
+    struct ext2_fs *fs = instance;
+    int r = super_write(fs);
+    int s = bcache_invalidate(fs->dev);
+    kfree(fs->gd);
+    fs->used = 0;
+    dir_stamp++;
+    if (r == FS_OK && s != BLK_OK) r = FS_EIO;
+    return r;
+}
+
+static int ext2_sync(void *instance)
+{
+    return super_write(instance);
+}
+
+/* Report a change with the full path, as seen through the mount point. */
+static void notify(struct ext2_fs *fs, unsigned int mask, const char *path, const char *from)
+{
+    char full[256], old[256];
+    size_t len = strlen(fs->mount);
+    if (len + strlen(path) >= sizeof(full)) return;
+    strcpy(full, fs->mount);
+    strcpy(full + len, path);
+    if (from) {
+        if (len + strlen(from) >= sizeof(old)) return;
+        strcpy(old, fs->mount);
+        strcpy(old + len, from);
+    }
+    fs_notify(mask, full, from ? old : NULL);
+}
+
+/* ---- file data ---- */
+
+struct map_arg {
+    struct ext2_fs *fs;
+    struct ext2_inode *in;
+};
+
+static int ra_map(void *arg, uint64_t file_block, uint64_t *dev_block)
+{
+    struct map_arg *m = arg;
+    uint32_t block = bmap(m->fs, m->in, file_block, 0, 0, NULL);
+    *dev_block = block;
+    return block ? 0 : -1;
+}
+
+static size_t read_at(struct ext2_fs *fs, struct ext2_inode *in, struct bcache_ra *ra, size_t pos, uint8_t *buf, size_t count)
+{
+    if (pos >= in->size) return 0;
+    if (count > in->size - pos) count = in->size - pos;
+    unsigned int bs = fs->block_size;
+    if (ra && count) {
+        struct map_arg m = { fs, in };
+        uint64_t first = pos / bs, last = (pos + count - 1) / bs;
+        bcache_readahead(ra, fs->dev, bs, first, (unsigned int)(last - first + 1),
+                         (in->size + bs - 1) / bs, ra_map, &m);
+    }
+    size_t done = 0;
+    while (done < count) {
+        uint64_t fb = (pos + done) / bs;
+        unsigned int off = (pos + done) % bs;
+        size_t n = bs - off;
+        if (n > count - done) n = count - done;
+        uint32_t block = bmap(fs, in, fb, 0, 0, NULL);
+        if (!block) {
+            memset(buf + done, 0, n); /* hole */
+        } else {
+            struct bcache_buf *b = bget(fs, block);
+            if (!b) break;
+            memcpy(buf + done, b->data + off, n);
+            bcache_put(b);
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int write_at(struct ext2_fs *fs, struct ext2_inode *in, uint32_t ino, size_t pos, const uint8_t *buf, size_t count)
+{
+    if (fs->readonly) return FS_EIO;
+    unsigned int bs = fs->block_size;
+    size_t done = 0;
+    uint32_t goal = 0;
+    while (done < count) {
+        uint64_t fb = (pos + done) / bs;
+        unsigned int off = (pos + done) % bs;
+        size_t n = bs - off;
+        if (n > count - done) n = count - done;
+        if (!goal) goal = alloc_goal(fs, in, ino, fb);
+        int fresh;
+        uint32_t block = bmap(fs, in, fb, 1, goal, &fresh);
+        if (!block) break;
+        goal = block + 1;
+        /* a new block, or one overwritten completely, is not read first */
+        struct bcache_buf *b = (fresh || n == bs) ? bcache_getblk(fs->dev, block, bs) : bget(fs, block);
+        if (!b) break;
+        if (fresh && n < bs) memset(b->data, 0, bs);
+        memcpy(b->data + off, buf + done, n);
+        bcache_dirty(b);
+        bcache_put(b);
+        done += n;
+    }
+    if (pos + done > in->size) in->size = (uint32_t)(pos + done);
+    int r = inode_write(fs, ino, in);
+    if (done < count) return FS_EIO;
+    return r;
+}
+
+/* Cut a file to size, zeroing the tail of a partial last block so a later
+ * extension reads zeros. */
+static int truncate_inode(struct ext2_fs *fs, struct ext2_inode *in, uint32_t ino, size_t size)
+{
+    unsigned int bs = fs->block_size;
+    if (size < in->size) {
+        uint64_t keep = (size + bs - 1) / bs;
+        free_blocks_from(fs, in, keep);
+        if (size % bs) {
+            uint32_t block = bmap(fs, in, size / bs, 0, 0, NULL);
+            struct bcache_buf *b = block ? bget(fs, block) : NULL;
+            if (b) {
+                memset(b->data + size % bs, 0, bs - size % bs);
+                bcache_dirty(b);
+                bcache_put(b);
+            }
+        }
+    }
+    in->size = (uint32_t)size;
+    return inode_write(fs, ino, in);
+}
+
+/* ---- operations ---- */
+
+static int ext2_open(void *instance, const char *path, int flags, struct vnode *vn)
+{
+    struct ext2_fs *fs = instance;
+    (void)flags;
+    uint32_t ino = namei(fs, path);
+    if (!ino) return FS_ENOENT;
+    for (int i = 0; i < EXT2_MAX_FILES; ++i) {
+        if (files[i].used) continue;
+        memset(&files[i], 0, sizeof(files[i]));
+        files[i].used = 1;
+        files[i].fs = fs;
+        files[i].ino = ino;
+        vn->id = ino;
+        vn->priv = &files[i];
+        return FS_OK;
+    }
+    return FS_EMFILE;
+}
+
+static int ext2_release(struct vnode *vn)
+{
+    struct ext2_file *f = vn->priv;
+    f->used = 0;
+    return FS_OK;
+}
+
+static int ext2_read(struct vnode *vn, size_t pos, void *buf, size_t count)
+{
+    struct ext2_file *f = vn->priv;
+    struct ext2_inode in;
+    if (inode_read(f->fs, f->ino, &in) != FS_OK) return FS_EIO;
+    return (int)read_at(f->fs, &in, &f->ra, pos, buf, count);
+}
+
+static int ext2_write(struct vnode *vn, const void *buf, size_t count, size_t *end)
+{
+    struct ext2_file *f = vn->priv;
+    struct ext2_inode in;
+    if (inode_read(f->fs, f->ino, &in) != FS_OK) return FS_EIO;
+    if ((in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) return FS_EIO;
+    /* like the ramfs, writes through a descriptor append */
+    int r = write_at(f->fs, &in, f->ino, in.size, buf, count);
+    if (r != FS_OK) return r;
+    *end = in.size;
+    return (int)count;
+}
+
+static int ext2_stat(void *instance, const char *path, struct fs_stat *st)
+{
+    struct ext2_fs *fs = instance;
+    uint32_t ino = namei(fs, path);
+    struct ext2_inode in;
+    if (!ino || inode_read(fs, ino, &in) != FS_OK) return FS_ENOENT;
+    if (st) {
+        st->is_dir = (in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+        st->size = st->is_dir ? 0 : in.size;
+        st->allocated = (size_t)in.blocks * BLK_SECTOR;
+        st->uid = in.uid | ((unsigned int)in.uid_high << 16);
+        st->gid = in.gid | ((unsigned int)in.gid_high << 16);
+        st->mode = (in.mode & 07777) | (st->is_dir ? FS_S_IFDIR : 0);
+    }
+    return FS_OK;
+}
+
+static int ext2_listdir(void *instance, const char *path, unsigned int index, const struct fs_file **out)
+{
+    struct ext2_fs *fs = instance;
+    static struct fs_file temp;
+    static char name[512];
+    /* resume after the previous entry while the directory is unchanged */
+    static struct { struct ext2_fs *fs; uint32_t dir, stamp; unsigned int index; uint64_t fb; unsigned int off; } cursor;
+    uint32_t dir = namei(fs, path);
+    struct ext2_inode in;
+    if (!dir || inode_read(fs, dir, &in) != FS_OK || (in.mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return FS_ENOENT;
+    unsigned int found = 0;
+    uint64_t fb = 0;
+    unsigned int off = 0;
+    if (cursor.fs == fs && cursor.dir == dir && cursor.stamp == dir_stamp && cursor.index <= index) {
+        found = cursor.index;
+        fb = cursor.fb;
+        off = cursor.off;
+    }
+    uint64_t nblocks = in.size / fs->block_size;
+    for (; fb < nblocks; ++fb, off = 0) {
+        uint32_t block = bmap(fs, &in, fb, 0, 0, NULL);
+        struct bcache_buf *b = block ? bget(fs, block) : NULL;
+        if (!b) continue;
+        while (off + 8 <= fs->block_size) {
+            const struct ext2_dirent *de = (const struct ext2_dirent *)(b->data + off);
+            if (de->rec_len < 8 || off + de->rec_len > fs->block_size) break;
+            int dot = de->name_len == 1 && de->name[0] == '.';
+            int dotdot = de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.';
+            if (!de->inode || dot || dotdot) {
+                off += de->rec_len;
+                continue;
+            }
+            if (found++ < index) {
+                off += de->rec_len;
+                continue;
+            }
+            cursor.fs = fs;
+            cursor.dir = dir;
+            cursor.stamp = dir_stamp;
+            cursor.index = index;
+            cursor.fb = fb;
+            cursor.off = off;
+            size_t mlen = strlen(fs->mount), plen = strlen(path);
+            while (plen > 0 && path[plen - 1] == '/') plen--;
+            if (mlen + plen + 1 + de->name_len >= sizeof(name)) {
+                bcache_put(b);
+                return FS_EINVAL;
+            }
+            memcpy(name, fs->mount, mlen);
+            memcpy(name + mlen, path, plen);
+            name[mlen + plen] = '/';
+            memcpy(name + mlen + plen + 1, de->name, de->name_len);
+            name[mlen + plen + 1 + de->name_len] = '\0';
+            uint32_t ino = de->inode;
+            bcache_put(b);
+            struct ext2_inode child;
+            if (inode_read(fs, ino, &child) != FS_OK) return FS_EIO;
+            int is_dir = (child.mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+            temp.name = name;
+            temp.data = NULL;
+            temp.size = is_dir ? 0 : child.size;
+            temp.uid = child.uid | ((unsigned int)child.uid_high << 16);
+            temp.gid = child.gid | ((unsigned int)child.gid_high << 16);
+            temp.mode = (child.mode & 07777) | (is_dir ? FS_S_IFDIR : 0);
+            if (out) *out = &temp;
+            return FS_OK;
+        }
+        bcache_put(b);
+    }
+    return FS_ENOENT;
+}
+
+/* New inode of the given type, linked into its parent. */
+static uint32_t make_node(struct ext2_fs *fs, const char *path, int is_dir, struct ext2_inode *in)
+{
+    char name[EXT2_NAME_MAX + 1];
+    uint32_t parent = namei_parent(fs, path, name);
+    if (!parent || dir_find(fs, parent, name, strlen(name), NULL)) return 0;
+    uint32_t ino = inode_alloc(fs, parent, is_dir);
+    if (!ino) return 0;
+    struct ext2_inode pin;
+    if (inode_read(fs, parent, &pin) != FS_OK) {
+        inode_free(fs, ino, is_dir);
+        return 0;
+    }
+    memset(in, 0, sizeof(*in));
+    in->mode = (uint16_t)(is_dir ? EXT2_S_IFDIR | 0755 : EXT2_S_IFREG | 0644);
+    in->uid = pin.uid;
+    in->gid = pin.gid;
+    in->links_count = is_dir ? 2 : 1;
+    in->atime = in->ctime = in->mtime = timestamp(fs);
+    if (is_dir) {
+        /* "." and ".." fill the first block */
+        int fresh;
+        uint32_t block = bmap(fs, in, 0, 1, alloc_goal(fs, in, ino, 0), &fresh);
+        struct bcache_buf *b = block ? bcache_getblk(fs->dev, block, fs->block_size) : NULL;
+        if (!b) {
+            if (block) free_blocks_from(fs, in, 0);
+            inode_free(fs, ino, is_dir);
+            return 0;
+        }
+        memset(b->data, 0, fs->block_size);
+        struct ext2_dirent *de = (struct ext2_dirent *)b->data;
+        de->inode = ino;
+        de->rec_len = 12;
+        de->name_len = 1;
+        de->file_type = file_type(fs, 1);
+        de->name[0] = '.';
+        de = (struct ext2_dirent *)(b->data + 12);
+        de->inode = parent;
+        de->rec_len = (uint16_t)(fs->block_size - 12);
+        de->name_len = 2;
+        de->file_type = file_type(fs, 1);
+        de->name[0] = de->name[1] = '.';
+        bcache_dirty(b);
+        bcache_put(b);
+        in->size = fs->block_size;
+    }
+    if (inode_write(fs, ino, in) != FS_OK || dir_add(fs, parent, name, ino, file_type(fs, is_dir)) != FS_OK) {
+        free_blocks_from(fs, in, 0);
+        inode_free(fs, ino, is_dir);
+        return 0;
+    }
+    if (is_dir) {
+        inode_read(fs, parent, &pin);
+        pin.links_count++;
+        inode_write(fs, parent, &pin);
+    }
+    return ino;
+}
+
+static int ext2_create(void *instance, const char *path, const uint8_t *data, size_t size)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    uint32_t ino = namei(fs, path);
+    struct ext2_inode in;
+    unsigned int ev = FS_EV_WRITE;
+    if (ino) {
+        if (inode_read(fs, ino, &in) != FS_OK) return FS_EIO;
+        if ((in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) return FS_EINVAL;
+        if (truncate_inode(fs, &in, ino, 0) != FS_OK) return FS_EIO;
+    } else {
+        ino = make_node(fs, path, 0, &in);
+        if (!ino) return FS_EINVAL;
+        ev |= FS_EV_CREATE;
+    }
+    int r = size ? write_at(fs, &in, ino, 0, data, size) : FS_OK;
+    notify(fs, ev, path, NULL);
+    return r;
+}
+
+static int ext2_mkdir(void *instance, const char *path)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    uint32_t ino = namei(fs, path);
+    struct ext2_inode in;
+    if (ino) {
+        /* like the ramfs: an existing directory is fine */
+        if (inode_read(fs, ino, &in) != FS_OK) return FS_EIO;
+        return (in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR ? FS_OK : FS_EINVAL;
+    }
+    if (!make_node(fs, path, 1, &in)) return FS_EINVAL;
+    notify(fs, FS_EV_CREATE, path, NULL);
+    return FS_OK;
+}
+
+/* Unlink name (inode ino) from parent and release the inode once its last
+ * link is gone. Directories are emptied first, everything below them
+ * included. */
+static int remove_entry(struct ext2_fs *fs, uint32_t parent, const char *name, uint32_t ino)
+{
+    struct ext2_inode in;
+    if (inode_read(fs, ino, &in) != FS_OK) return FS_EIO;
+    int is_dir = (in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+    if (is_dir) {
+        /* take out the children one at a time; each pass rescans, which
+         * keeps the stack bounded by the tree depth */
+        for (;;) {
+            char child[EXT2_NAME_MAX + 1];
+            uint32_t cino = 0;
+            uint64_t nblocks = in.size / fs->block_size;
+            for (uint64_t fb = 0; fb < nblocks && !cino; ++fb) {
+                uint32_t block = bmap(fs, &in, fb, 0, 0, NULL);
+                struct bcache_buf *b = block ? bget(fs, block) : NULL;
+                if (!b) continue;
+                for (unsigned int off = 0; off + 8 <= fs->block_size;) {
+                    const struct ext2_dirent *de = (const struct ext2_dirent *)(b->data + off);
+                    if (de->rec_len < 8 || off + de->rec_len > fs->block_size) break;
+                    int dot = de->name_len == 1 && de->name[0] == '.';
+                    int dotdot = de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.';
+                    if (de->inode && !dot && !dotdot) {
+                        cino = de->inode;
+                        memcpy(child, de->name, de->name_len);
+                        child[de->name_len] = '\0';
+                        break;
+                    }
+                    off += de->rec_len;
+                }
+                bcache_put(b);
+            }
+            if (!cino) break;
+            if (remove_entry(fs, ino, child, cino) != FS_OK) return FS_EIO;
+            if (inode_read(fs, ino, &in) != FS_OK) return FS_EIO;
+        }
+    }
+    if (dir_remove(fs, parent, name) != FS_OK) return FS_EIO;
+    if (is_dir) {
+        struct ext2_inode pin;
+        if (inode_read(fs, parent, &pin) == FS_OK && pin.links_count > 2) {
+            pin.links_count--;
+            inode_write(fs, parent, &pin);
+        }
+        in.links_count = 0;
+    } else if (in.links_count) {
+        in.links_count--;
+    }
+    if (in.links_count == 0) {
+        free_blocks_from(fs, &in, 0);
+        in.size = 0;
+        in.dtime = timestamp(fs);
+        inode_write(fs, ino, &in);
+        inode_free(fs, ino, is_dir);
+    } else {
+        inode_write(fs, ino, &in);
+    }
+    return FS_OK;
+}
+
+static int ext2_unlink(void *instance, const char *path)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    char name[EXT2_NAME_MAX + 1];
+    uint32_t parent = namei_parent(fs, path, name);
+    uint32_t ino = parent ? dir_find(fs, parent, name, strlen(name), NULL) : 0;
+    if (!ino) return FS_ENOENT;
+    int r = remove_entry(fs, parent, name, ino);
+    if (r == FS_OK) notify(fs, FS_EV_UNLINK, path, NULL);
+    return r;
+}
+
+static int ext2_rmdir(void *instance, const char *path)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    char name[EXT2_NAME_MAX + 1];
+    uint32_t parent = namei_parent(fs, path, name);
+    uint32_t ino = parent ? dir_find(fs, parent, name, strlen(name), NULL) : 0;
+    struct ext2_inode in;
+    if (!ino) return FS_ENOENT;
+    if (inode_read(fs, ino, &in) != FS_OK) return FS_EIO;
+    if ((in.mode & EXT2_S_IFMT) != EXT2_S_IFDIR || !dir_empty(fs, &in)) return FS_EINVAL;
+    int r = remove_entry(fs, parent, name, ino);
+    if (r == FS_OK) notify(fs, FS_EV_UNLINK, path, NULL);
+    return r;
+}
+
+static int ext2_rename(void *instance, const char *oldpath, const char *newpath)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    char oname[EXT2_NAME_MAX + 1], nname[EXT2_NAME_MAX + 1];
+    uint32_t oparent = namei_parent(fs, oldpath, oname);
+    uint8_t type = 0;
+    uint32_t ino = oparent ? dir_find(fs, oparent, oname, strlen(oname), &type) : 0;
+    if (!ino) return FS_ENOENT;
+    uint32_t nparent = namei_parent(fs, newpath, nname);
+    if (!nparent || dir_find(fs, nparent, nname, strlen(nname), NULL)) return FS_EINVAL;
+    struct ext2_inode in;
+    if (inode_read(fs, ino, &in) != FS_OK) return FS_EIO;
+    int is_dir = (in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+    if (is_dir) {
+        /* refuse to move a directory below itself */
+        for (uint32_t d = nparent; d != EXT2_ROOT_INO;) {
+            if (d == ino) return FS_EINVAL;
+            d = dir_find(fs, d, "..", 2, NULL);
+            if (!d) return FS_EIO;
+        }
+    }
+    if (dir_add(fs, nparent, nname, ino, type) != FS_OK) return FS_EIO;
+    if (dir_remove(fs, oparent, oname) != FS_OK) return FS_EIO;
+    if (is_dir && oparent != nparent) {
+        /* repoint ".." (the second entry of the first block) */
+        uint32_t block = bmap(fs, &in, 0, 0, 0, NULL);
+        struct bcache_buf *b = block ? bget(fs, block) : NULL;
+        if (b) {
+            struct ext2_dirent *de = (struct ext2_dirent *)(b->data + ((struct ext2_dirent *)b->data)->rec_len);
+            de->inode = nparent;
+            bcache_dirty(b);
+            bcache_put(b);
+        }
+        struct ext2_inode pin;
+        if (inode_read(fs, oparent, &pin) == FS_OK) {
+            pin.links_count--;
+            inode_write(fs, oparent, &pin);
+        }
+        if (inode_read(fs, nparent, &pin) == FS_OK) {
+            pin.links_count++;
+            inode_write(fs, nparent, &pin);
+        }
+    }
+    notify(fs, FS_EV_RENAME, newpath, oldpath);
+    return FS_OK;
+}
+
+static int ext2_truncate(void *instance, const char *path, size_t size)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    uint32_t ino = namei(fs, path);
+    struct ext2_inode in;
+    if (!ino || inode_read(fs, ino, &in) != FS_OK) return FS_ENOENT;
+    if ((in.mode & EXT2_S_IFMT) == EXT2_S_IFDIR) return FS_EINVAL;
+    int r = truncate_inode(fs, &in, ino, size);
+    if (r == FS_OK) notify(fs, FS_EV_WRITE, path, NULL);
+    return r;
+}
+
+static int ext2_chmod(void *instance, const char *path, unsigned int mode)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    uint32_t ino = namei(fs, path);
+    struct ext2_inode in;
+    if (!ino || inode_read(fs, ino, &in) != FS_OK) return FS_ENOENT;
+    in.mode = (uint16_t)((in.mode & EXT2_S_IFMT) | (mode & 07777));
+    int r = inode_write(fs, ino, &in);
+    if (r == FS_OK) notify(fs, FS_EV_CHMOD, path, NULL);
+    return r;
+}
+
+static int ext2_chown(void *instance, const char *path, unsigned int uid, unsigned int gid)
+{
+    struct ext2_fs *fs = instance;
+    if (fs->readonly) return FS_EIO;
+    uint32_t ino = namei(fs, path);
+    struct ext2_inode in;
+    if (!ino || inode_read(fs, ino, &in) != FS_OK) return FS_ENOENT;
+    in.uid = (uint16_t)uid;
+    in.uid_high = (uint16_t)(uid >> 16);
+    in.gid = (uint16_t)gid;
+    in.gid_high = (uint16_t)(gid >> 16);
+    int r = inode_write(fs, ino, &in);
+    if (r == FS_OK) notify(fs, FS_EV_CHMOD, path, NULL);
+    return r;
+}
+
+const struct vfs_ops ext2_ops = {
+    .type = "ext2",
+    .mount = ext2_mount,
+    .unmount = ext2_unmount,
+    .sync = ext2_sync,
+    .open = ext2_open,
+    .release = ext2_release,
+    .read = ext2_read,
+    .write = ext2_write,
+    .stat = ext2_stat,
+    .listdir = ext2_listdir,
+    .create = ext2_create,
+    .unlink = ext2_unlink,
+    .mkdir = ext2_mkdir,
+    .rmdir = ext2_rmdir,
+    .rename = ext2_rename,
+    .truncate = ext2_truncate,
+    .chmod = ext2_chmod,
+    .chown = ext2_chown,
+};
@@ -0,0 +1,539 @@
+#include "../include/journal.h"
+#include "../include/fs.h"
+#include "../include/blk.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+/*
+ * Journal device layout, in sectors:
+ *
+ *   0                          superblock
+ *   slot_start[0], [1]         two image slots of slot_sectors each
+ *   log_start                  the log, log_sectors long
+ *
+ * Images and the log are sequences of frames. A frame is a header and up
+ * to JOURNAL_FRAME bytes of records, padded to whole sectors and written
+ * with one request. Frames carry the generation of the image they belong
+ * to and a sequence number, so a reader stops at the first frame that is
+ * torn (bad checksum), stale (older generation) or out of order. A batch
+ * too large for one frame spans several; only its last frame is flagged
+ * FRAME_COMMIT, and replay ignores frames after the last commit.
+ */
+
+extern const struct fs_file initrd_files[];
+extern const unsigned int initrd_files_count;
+
+#define JOURNAL_MAGIC   0x4C4E4A52u /* "RJNL" */
+#define JOURNAL_VERSION 1
+#define FRAME_MAGIC     0x4D415246u /* "FRAM" */
+#define FRAME_COMMIT    1
+
+#define JOURNAL_FRAME       (64 * 1024)  /* bytes per frame, header included */
+#define JOURNAL_MIN_SECTORS 2048         /* 1 MiB */
+#define JOURNAL_LOG_MAX     (32 * 1024)  /* sectors: a 16 MiB log at most */
+
+struct journal_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation;    /* of the current image */
+    uint32_t slot;          /* slot holding the current image */
+    uint32_t image_sectors;
+    uint32_t slot_sectors;
+    uint32_t log_sectors;
+    uint32_t reserved;
+    uint64_t slot_start[2];
+    uint64_t log_start;
+    uint32_t crc;           /* of everything above */
+    uint8_t pad[BLK_SECTOR - 60];
+};
+
+struct frame_head {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t seq;
+    uint32_t bytes;     /* records following the header */
+    uint32_t crc;       /* of the records */
+    uint32_t flags;
+    uint32_t head_crc;  /* of the fields above */
+};
+
+/* Records are 4-byte aligned; the paths are stored with their NULs. */
+struct record_head {
+    uint8_t op;
+    uint8_t reserved;
+    uint16_t path_len;
+    uint16_t path2_len;
+    uint16_t reserved2;
+    uint32_t arg;
+    uint32_t arg2;
+    uint32_t len;
+};
+
+static struct blk_dev *jdev;
+static struct journal_super jsb;
+static uint8_t *frame;      /* records waiting to be written, after the header */
+static size_t frame_used;
+static unsigned int pending;
+static int replaying;
+static int need_checkpoint;
+static char devname[8];
+
+/* Where frame_flush writes: the log, or an image slot during a checkpoint. */
+static uint64_t target_start;
+static uint32_t *target_pos, *target_seq, target_limit, target_gen;
+static uint32_t log_head, log_seq;
+
+static struct fs_journal_stats stats;
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(const void *data, size_t len)
+{
+    if (!crc_table[1]) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+    const uint8_t *p = data;
+    uint32_t c = 0xFFFFFFFFu;
+    while (len--) c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+static int super_write(void)
+{
+    jsb.crc = crc32(&jsb, offsetof(struct journal_super, crc));
+    if (blk_write(jdev, 0, 1, &jsb) != BLK_OK) return FS_EIO;
+    return blk_flush(jdev) == BLK_OK ? FS_OK : FS_EIO;
+}
+
+static void target_log(void)
+{
+    target_start = jsb.log_start;
+    target_pos = &log_head;
+    target_seq = &log_seq;
+    target_limit = jsb.log_sectors;
+    target_gen = jsb.generation;
+}
+
+static void frame_reset(void)
+{
+    frame_used = sizeof(struct frame_head);
+    pending = 0;
+}
+
+/* Write the collected records as the next frame of the target area;
+ * commit marks the end of a batch. FS_EDQUOT when the area is full. */
+static int frame_flush(uint32_t flags)
+{
+    if (frame_used == sizeof(struct frame_head)) return FS_OK;
+    uint32_t sectors = (uint32_t)((frame_used + BLK_SECTOR - 1) / BLK_SECTOR);
+    if (*target_pos + sectors > target_limit) return FS_EDQUOT;
+    memset(frame + frame_used, 0, sectors * BLK_SECTOR - frame_used);
+    struct frame_head *h = (struct frame_head *)frame;
+    h->magic = FRAME_MAGIC;
+    h->generation = target_gen;
+    h->seq = *target_seq;
+    h->bytes = (uint32_t)(frame_used - sizeof(*h));
+    h->crc = crc32(frame + sizeof(*h), h->bytes);
+    h->flags = flags;
+    h->head_crc = crc32(h, offsetof(struct frame_head, head_crc));
+    if (blk_write(jdev, target_start + *target_pos, sectors, frame) != BLK_OK) return FS_EIO;
+    *target_pos += sectors;
+    (*target_seq)++;
+    if (target_pos == &log_head) stats.bytes += sectors * BLK_SECTOR;
+    frame_reset();
+    return FS_OK;
+}
+
+/* Append a record, flushing full frames as needed. Data that does not fit
+ * one frame is split: a create continues with appends. */
+static int put(enum journal_op op, const char *path, const char *path2,
+               const void *data, size_t len, uint32_t arg, uint32_t arg2)
+{
+    size_t plen = strlen(path) + 1;
+    size_t p2len = path2 ? strlen(path2) + 1 : 0;
+    size_t fixed = sizeof(struct record_head) + plen + p2len;
+    if (plen > 0xFFFF || p2len > 0xFFFF || sizeof(struct frame_head) + fixed + BLK_SECTOR > JOURNAL_FRAME) return FS_EINVAL;
+    const uint8_t *p = data;
+    for (;;) {
+        size_t avail = JOURNAL_FRAME - frame_used;
+        /* no tiny fragments of data: start a new frame instead */
+        size_t want = len < BLK_SECTOR ? len : BLK_SECTOR;
+        if (avail < fixed + want + 3) {
+            int r = frame_flush(0);
+            if (r != FS_OK) return r;
+            continue;
+        }
+        size_t chunk = avail - fixed - 3;
+        if (chunk > len) chunk = len;
+        struct record_head *h = (struct record_head *)(frame + frame_used);
+        h->op = (uint8_t)op;
+        h->reserved = 0;
+        h->path_len = (uint16_t)plen;
+        h->path2_len = (uint16_t)p2len;
+        h->reserved2 = 0;
+        h->arg = arg;
+        h->arg2 = arg2;
+        h->len = (uint32_t)chunk;
+        uint8_t *out = (uint8_t *)(h + 1);
+        memcpy(out, path, plen);
+        if (p2len) memcpy(out + plen, path2, p2len);
+        if (chunk) memcpy(out + plen + p2len, p, chunk);
+        frame_used += (fixed + chunk + 3) & ~(size_t)3;
+        p += chunk;
+        len -= chunk;
+        if (len == 0) return FS_OK;
+        if (op == JOURNAL_CREATE) op = JOURNAL_APPEND;
+    }
+}
+
+void journal_log(enum journal_op op, const char *path, const char *path2,
+                 const void *data, size_t len, uint32_t arg, uint32_t arg2)
+{
+    /* after a failure everything goes into the next image anyway */
+    if (!jdev || replaying || need_checkpoint) return;
+    if (put(op, path, path2, data, len, arg, arg2) != FS_OK) {
+        /* the log is full (or failed): write an image on the next commit */
+        need_checkpoint = 1;
+        frame_reset();
+        return;
+    }
+    pending++;
+    stats.records++;
+}
+
+void journal_reset(void)
+{
+    if (!jdev || replaying) return;
+    need_checkpoint = 1;
+    frame_reset();
+}
+
+/* ---- checkpoints ---- */
+
+#define COPY_CHUNK (32 * 1024)
+
+/* Records that rebuild one overlay entry; arg is a COPY_CHUNK buffer. */
+static int image_entry(const struct fs_file *f, void *arg)
+{
+    uint8_t *chunk = arg;
+    int r;
+    if (f->mode & FS_S_IFDIR) {
+        r = put(JOURNAL_MKDIR, f->name, NULL, NULL, 0, 0, 0);
+    } else {
+        fs_fd_t fd = fs_open(f->name, FS_O_RDONLY);
+        if (fd < 0) return fd;
+        enum journal_op op = JOURNAL_CREATE;
+        int n;
+        r = FS_OK;
+        /* an empty file still needs its create */
+        while (r == FS_OK && ((n = fs_read(fd, chunk, COPY_CHUNK)) > 0 || op == JOURNAL_CREATE)) {
+            if (n < 0) {
+                r = n;
+                break;
+            }
+            r = put(op, f->name, NULL, chunk, (size_t)n, 0, 0);
+            op = JOURNAL_APPEND;
+        }
+        fs_close(fd);
+    }
+    if (r == FS_OK) r = put(JOURNAL_CHMOD, f->name, NULL, NULL, 0, f->mode & 07777, 0);
+    if (r == FS_OK) r = put(JOURNAL_CHOWN, f->name, NULL, NULL, 0, f->uid, f->gid);
+    return r;
+}
+
+/* Quota of one overlay directory. */
+static int image_quota(const struct fs_file *f, void *arg)
+{
+    struct fs_usage u;
+    (void)arg;
+    if (!(f->mode & FS_S_IFDIR) || fs_usage(f->name, &u) != FS_OK || !u.quota) return FS_OK;
+    return put(JOURNAL_QUOTA, f->name, NULL, NULL, 0, (uint32_t)u.quota, (uint32_t)(u.quota >> 32));
+}
+
+/* Write the overlay as a sequence of records to the target area. Packaged
+ * paths are never removed or renamed (see fs_rename), so the image only
+ * adds to the initrd it is replayed over. */
+static int image_write(void)
+{
+    uint8_t *chunk = kmalloc(COPY_CHUNK);
+    if (!chunk) return FS_EIO;
+    const struct fs_file *f;
+    struct fs_stat st;
+    /* overlay entries, parents first */
+    int r = fs_overlay_walk(image_entry, chunk);
+    /* packaged files keep their contents but may have new attributes */
+    for (unsigned int i = 0; r == FS_OK && i < initrd_files_count; ++i) {
+        f = &initrd_files[i];
+        if (fs_is_overlay(f->name) || fs_stat(f->name, &st) != FS_OK) continue;
+        if ((st.mode & 07777) != (f->mode & 07777)) r = put(JOURNAL_CHMOD, f->name, NULL, NULL, 0, st.mode & 07777, 0);
+        if (r == FS_OK && (st.uid != f->uid || st.gid != f->gid)) r = put(JOURNAL_CHOWN, f->name, NULL, NULL, 0, st.uid, st.gid);
+    }
+    /* quotas last, so replaying the files cannot exceed them */
+    if (r == FS_OK) r = fs_overlay_walk(image_quota, NULL);
+    kfree(chunk);
+    if (r == FS_OK) r = frame_flush(FRAME_COMMIT);
+    return r;
+}
+
+int fs_journal_checkpoint(void)
+{
+    if (!jdev) return FS_EINVAL;
+    /* the image holds every change so far, pending ones included */
+    frame_reset();
+    uint32_t slot = jsb.slot ^ 1;
+    uint32_t pos = 0, seq = 0;
+    target_start = jsb.slot_start[slot];
+    target_pos = &pos;
+    target_seq = &seq;
+    target_limit = jsb.slot_sectors;
+    target_gen = jsb.generation + 1;
+    int r = image_write();
+    if (r == FS_OK && blk_flush(jdev) != BLK_OK) r = FS_EIO;
+    if (r == FS_OK) {
+        /* switching the superblock commits the new image and empties the log */
+        struct journal_super old = jsb;
+        jsb.generation++;
+        jsb.slot = slot;
+        jsb.image_sectors = pos;
+        r = super_write();
+        if (r != FS_OK) jsb = old;
+    }
+    frame_reset();
+    if (r != FS_OK) {
+        need_checkpoint = 1;
+        target_log();
+        return r == FS_EDQUOT ? FS_EIO : r;
+    }
+    need_checkpoint = 0;
+    log_head = 0;
+    log_seq = 0;
+    target_log();
+    stats.checkpoints++;
+    return FS_OK;
+}
+
+int fs_journal_commit(void)
+{
+    if (!jdev) return 0;
+    if (!need_checkpoint && pending) {
+        unsigned int n = pending;
+        int r = frame_flush(FRAME_COMMIT);
+        if (r == FS_OK && blk_flush(jdev) == BLK_OK) {
+            stats.commits++;
+            return (int)n;
+        }
+        need_checkpoint = 1;
+    }
+    if (need_checkpoint) return fs_journal_checkpoint();
+    return 0;
+}
+
+void fs_journal_tick(void)
+{
+    if (jdev && (pending || need_checkpoint)) fs_journal_commit();
+}
+
+/* ---- replay ---- */
+
+static void apply(const struct record_head *h)
+{
+    const char *path = (const char *)(h + 1);
+    const char *path2 = path + h->path_len;
+    const uint8_t *data = (const uint8_t *)path2 + h->path2_len;
+    fs_fd_t fd;
+    switch (h->op) {
+    case JOURNAL_CREATE:
+        fs_create(path, data, h->len);
+        break;
+    case JOURNAL_APPEND:
+        fd = fs_open(path, 0);
+        if (fd >= 0) {
+            fs_write(fd, data, h->len);
+            fs_close(fd);
+        }
+        break;
+    case JOURNAL_MKDIR:
+        fs_mkdir(path);
+        break;
+    case JOURNAL_UNLINK:
+        fs_unlink(path);
+        break;
+    case JOURNAL_RMDIR:
+        fs_rmdir(path);
+        break;
+    case JOURNAL_RENAME:
+        fs_rename(path, path2);
+        break;
+    case JOURNAL_COPY:
+        fs_copy(path, path2);
+        break;
+    case JOURNAL_TRUNCATE:
+        fs_truncate(path, h->arg);
+        break;
+    case JOURNAL_CHMOD:
+        fs_chmod(path, h->arg);
+        break;
+    case JOURNAL_CHOWN:
+        fs_chown(path, h->arg, h->arg2);
+        break;
+    case JOURNAL_QUOTA:
+        fs_set_quota(path, h->arg | ((uint64_t)h->arg2 << 32));
+        break;
+    }
+    stats.replayed++;
+}
+
+/* Read and check the frame at sector pos of an area, and with apply_records
+ * apply its records. Returns its length in sectors, or 0 if there is no
+ * valid frame. */
+static uint32_t replay_frame(uint64_t start, uint32_t pos, uint32_t limit, uint32_t gen, uint32_t seq,
+                             int apply_records, uint32_t *flags)
+{
+    if (pos >= limit || blk_read(jdev, start + pos, 1, frame) != BLK_OK) return 0;
+    const struct frame_head *h = (const struct frame_head *)frame;
+    if (h->magic != FRAME_MAGIC || h->head_crc != crc32(h, offsetof(struct frame_head, head_crc))) return 0;
+    if (h->generation != gen || h->seq != seq || h->bytes > JOURNAL_FRAME - sizeof(*h)) return 0;
+    uint32_t sectors = (uint32_t)((sizeof(*h) + h->bytes + BLK_SECTOR - 1) / BLK_SECTOR);
+    if (pos + sectors > limit) return 0;
+    if (sectors > 1 && blk_read(jdev, start + pos + 1, sectors - 1, frame + BLK_SECTOR) != BLK_OK) return 0;
+    if (h->crc != crc32(frame + sizeof(*h), h->bytes)) return 0;
+    *flags = h->flags;
+    if (!apply_records) return sectors;
+    size_t off = sizeof(*h), end = sizeof(*h) + h->bytes;
+    while (off + sizeof(struct record_head) <= end) {
+        const struct record_head *r = (const struct record_head *)(frame + off);
+        size_t size = sizeof(*r) + r->path_len + r->path2_len + r->len;
+        if (off + size > end || r->path_len == 0) break;
+        const char *path = (const char *)(r + 1);
+        if (path[r->path_len - 1] != '\0' || (r->path2_len && path[r->path_len + r->path2_len - 1] != '\0')) break;
+        apply(r);
+        off += (size + 3) & ~(size_t)3;
+    }
+    return sectors;
+}
+
+static int journal_open(const char *name)
+{
+    struct blk_dev *dev = blk_find(name);
+    if (!dev) return FS_ENOENT;
+    if (jdev) return FS_EINVAL;
+    if (!frame) frame = kmalloc(JOURNAL_FRAME);
+    if (!frame) return FS_EIO;
+    jdev = dev;
+    strncpy(devname, dev->name, sizeof(devname) - 1);
+    memset(&stats, 0, sizeof(stats));
+    frame_reset();
+    need_checkpoint = 0;
+    return FS_OK;
+}
+
+int fs_journal_attach(const char *name)
+{
+    int r = journal_open(name);
+    if (r != FS_OK) return r;
+    if (blk_read(jdev, 0, 1, &jsb) != BLK_OK) {
+        jdev = NULL;
+        return FS_EIO;
+    }
+    uint64_t end = jsb.log_start + jsb.log_sectors;
+    if (jsb.magic != JOURNAL_MAGIC || jsb.version != JOURNAL_VERSION || jsb.slot > 1 ||
+        jsb.crc != crc32(&jsb, offsetof(struct journal_super, crc)) || end > jdev->sectors ||
+        jsb.image_sectors > jsb.slot_sectors) {
+        jdev = NULL;
+        return FS_ENOENT;
+    }
+    replaying = 1;
+    fs_batch_begin();
+    /* the image must be complete; the log ends wherever it stops making sense */
+    uint32_t pos = 0, seq = 0, flags = 0;
+    while (pos < jsb.image_sectors) {
+        uint32_t n = replay_frame(jsb.slot_start[jsb.slot], pos, jsb.image_sectors, jsb.generation, seq++, 1, &flags);
+        if (!n) break;
+        pos += n;
+    }
+    if (pos == jsb.image_sectors) {
+        /* find the end of the last complete batch, then apply up to it */
+        uint32_t end = 0, frames = 0;
+        pos = 0;
+        for (seq = 0;; ++seq) {
+            uint32_t n = replay_frame(jsb.log_start, pos, jsb.log_sectors, jsb.generation, seq, 0, &flags);
+            if (!n) break;
+            pos += n;
+            if (flags & FRAME_COMMIT) {
+                end = pos;
+                frames = seq + 1;
+            }
+        }
+        for (log_head = 0, log_seq = 0; log_seq < frames; ++log_seq) {
+            log_head += replay_frame(jsb.log_start, log_head, end, jsb.generation, log_seq, 1, &flags);
+        }
+        pos = jsb.image_sectors;
+    }
+    fs_batch_end();
+    replaying = 0;
+    frame_reset();
+    if (pos != jsb.image_sectors) {
+        jdev = NULL;
+        return FS_EIO;
+    }
+    target_log();
+    return FS_OK;
+}
+
+int fs_journal_format(const char *name)
+{
+    int r = journal_open(name);
+    if (r != FS_OK) return r;
+    struct blk_dev *dev = jdev;
+    if (dev->sectors < JOURNAL_MIN_SECTORS || dev->sectors >> 32) {
+        jdev = NULL;
+        return FS_EINVAL;
+    }
+    /* continue the generations of an earlier journal so none of its
+     * frames can pass for new ones */
+    uint32_t gen = 0;
+    if (blk_read(dev, 0, 1, &jsb) == BLK_OK && jsb.magic == JOURNAL_MAGIC &&
+        jsb.crc == crc32(&jsb, offsetof(struct journal_super, crc))) gen = jsb.generation + 1;
+    uint32_t sectors = (uint32_t)dev->sectors;
+    memset(&jsb, 0, sizeof(jsb));
+    jsb.magic = JOURNAL_MAGIC;
+    jsb.version = JOURNAL_VERSION;
+    jsb.generation = gen;
+    jsb.slot = 1; /* the first image goes to slot 0 */
+    jsb.log_sectors = sectors / 4 < JOURNAL_LOG_MAX ? sectors / 4 : JOURNAL_LOG_MAX;
+    jsb.slot_sectors = (sectors - 1 - jsb.log_sectors) / 2;
+    jsb.slot_start[0] = 1;
+    jsb.slot_start[1] = 1 + jsb.slot_sectors;
+    jsb.log_start = 1 + 2 * (uint64_t)jsb.slot_sectors;
+    r = fs_journal_checkpoint();
+    if (r != FS_OK) jdev = NULL;
+    return r;
+}
+
+int fs_journal_detach(void)
+{
+    if (!jdev) return FS_EINVAL;
+    int r = fs_journal_commit();
+    jdev = NULL;
+    frame_reset();
+    return r < 0 ? r : FS_OK;
+}
+
+int fs_journal_stats(struct fs_journal_stats *st)
+{
+    *st = stats;
+    st->dev = jdev ? devname : NULL;
+    st->pending = pending;
+    if (jdev) {
+        st->generation = jsb.generation;
+        st->log_used = log_head;
+        st->log_size = jsb.log_sectors;
+        st->image_size = jsb.image_sectors;
+        st->image_max = jsb.slot_sectors;
+    }
+    return FS_OK;
+}
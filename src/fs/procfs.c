@@ -0,0 +1,387 @@
+#include "../include/procfs.h"
+#include "../include/bcache.h"
+#include "../include/journal.h"
+#include "../include/netsec.h"
+#include "../include/timer.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+/*
+ * The files are a fixed table; each one has a function that renders its
+ * text. An open descriptor only records which file it is: the text is
+ * rendered by the first read into a buffer owned by the descriptor and
+ * freed on close, so an idle /proc costs nothing.
+ */
+
+struct proc_buf {
+    char *data;
+    size_t len, cap;
+    int failed;     /* out of memory: the text is cut short */
+};
+
+struct proc_entry {
+    const char *path;   /* below the mount point */
+    void (*show)(struct proc_buf *b);   /* NULL for directories */
+};
+
+struct proc_file {
+    int used;
+    const struct proc_entry *entry;
+    int rendered;
+    struct proc_buf buf;
+};
+
+static void show_cpuinfo(struct proc_buf *b);
+static void show_fs_stats(struct proc_buf *b);
+static void show_meminfo(struct proc_buf *b);
+static void show_net_fw(struct proc_buf *b);
+static void show_uptime(struct proc_buf *b);
+
+/* Sorted, every directory before its entries. */
+static const struct proc_entry entries[] = {
+    { "/cpuinfo", show_cpuinfo },
+    { "/fs", NULL },
+    { "/fs/stats", show_fs_stats },
+    { "/meminfo", show_meminfo },
+    { "/net", NULL },
+    { "/net/fw", show_net_fw },
+    { "/uptime", show_uptime },
+};
+#define NENTRIES (sizeof(entries) / sizeof(entries[0]))
+
+static struct proc_file files[PROCFS_MAX_FILES];
+static char mount_path[128];
+static int mounted;
+
+/* ---- rendering ---- */
+
+static void buf_put(struct proc_buf *b, const char *s, size_t len)
+{
+    if (b->failed) return;
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : HEAP_BLOCK_SIZE;
+        while (cap < b->len + len) cap *= 2;
+        char *data = kmalloc(cap);
+        if (!data) {
+            b->failed = 1;
+            return;
+        }
+        if (b->data) {
+            memcpy(data, b->data, b->len);
+            kfree(b->data);
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+}
+
+/* Append formatted text; one call renders at most one short line. */
+static void buf_printf(struct proc_buf *b, const char *fmt, ...)
+{
+    char line[256];
+    va_list va;
+    va_start(va, fmt);
+    int n = vsprintf(line, fmt, va);
+    va_end(va);
+    if (n > 0) buf_put(b, line, (size_t)n);
+}
+
+static void show_meminfo(struct proc_buf *b)
+{
+    uint32_t total = HEAP_SIZE_BYTES / HEAP_BLOCK_SIZE;
+    uint32_t used = heap_used_blocks();
+    uint32_t kb = HEAP_BLOCK_SIZE / 1024;
+    buf_printf(b, "MemTotal:  %u kB\n", total * kb);
+    buf_printf(b, "MemUsed:   %u kB\n", used * kb);
+    buf_printf(b, "MemFree:   %u kB\n", (total - used) * kb);
+    buf_printf(b, "BlockSize: %u\n", (unsigned int)HEAP_BLOCK_SIZE);
+}
+
+static void show_uptime(struct proc_buf *b)
+{
+    uint32_t ms = timer_uptime_ms();
+    buf_printf(b, "%u.%02u\n", ms / 1000, ms % 1000 / 10);
+}
+
+static void cpuid(uint32_t leaf, uint32_t *r)
+{
+    __asm__ __volatile__("cpuid" : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3]) : "a"(leaf), "c"(0));
+}
+
+/* CPUID exists when the ID flag in EFLAGS can be toggled. */
+static int has_cpuid(void)
+{
+    uint32_t before, after;
+    __asm__ __volatile__("pushfl\n\t"
+                         "popl %0\n\t"
+                         "movl %0, %1\n\t"
+                         "xorl $0x200000, %1\n\t"
+                         "pushl %1\n\t"
+                         "popfl\n\t"
+                         "pushfl\n\t"
+                         "popl %1\n\t"
+                         "pushl %0\n\t"
+                         "popfl"
+                         : "=&r"(before), "=&r"(after));
+    return ((before ^ after) & 0x200000) != 0;
+}
+
+static const char *const edx_flags[32] = {
+    "fpu", "vme", "de", "pse", "tsc", "msr", "pae", "mce", "cx8", "apic", NULL, "sep",
+    "mtrr", "pge", "mca", "cmov", "pat", "pse36", "psn", "clflush", NULL, "ds", "acpi", "mmx",
+    "fxsr", "sse", "sse2", "ss", "ht", "tm", "ia64", "pbe",
+};
+static const char *const ecx_flags[32] = {
+    "pni", "pclmulqdq", "dtes64", "monitor", "ds_cpl", "vmx", "smx", "est", "tm2", "ssse3", "cid", "sdbg",
+    "fma", "cx16", "xtpr", "pdcm", NULL, "pcid", "dca", "sse4_1", "sse4_2", "x2apic", "movbe", "popcnt",
+    "tsc_deadline_timer", "aes", "xsave", "osxsave", "avx", "f16c", "rdrand", "hypervisor",
+};
+
+static void show_cpuinfo(struct proc_buf *b)
+{
+    if (!has_cpuid()) {
+        buf_printf(b, "vendor_id\t: unknown\n");
+        return;
+    }
+    uint32_t r[4];
+    char vendor[13];
+    cpuid(0, r);
+    uint32_t max_leaf = r[0];
+    memcpy(vendor, &r[1], 4);
+    memcpy(vendor + 4, &r[3], 4);
+    memcpy(vendor + 8, &r[2], 4);
+    vendor[12] = '\0';
+    buf_printf(b, "vendor_id\t: %s\n", vendor);
+    uint32_t sig = 0, ecx = 0, edx = 0;
+    if (max_leaf >= 1) {
+        cpuid(1, r);
+        sig = r[0];
+        ecx = r[2];
+        edx = r[3];
+    }
+    unsigned int family = (sig >> 8) & 0xF, model = (sig >> 4) & 0xF;
+    if (family == 0xF) family += (sig >> 20) & 0xFF;
+    if (family == 0x6 || family >= 0xF) model += ((sig >> 16) & 0xF) << 4;
+    buf_printf(b, "cpu family\t: %u\n", family);
+    buf_printf(b, "model\t\t: %u\n", model);
+    cpuid(0x80000000u, r);
+    if (r[0] >= 0x80000004u) {
+        char brand[49];
+        for (uint32_t i = 0; i < 3; ++i) {
+            cpuid(0x80000002u + i, r);
+            memcpy(brand + i * 16, r, 16);
+        }
+        brand[48] = '\0';
+        const char *name = brand;
+        while (*name == ' ') name++;
+        buf_printf(b, "model name\t: %s\n", name);
+    }
+    buf_printf(b, "stepping\t: %u\n", sig & 0xF);
+    uint32_t khz = timer_khz();
+    buf_printf(b, "cpu MHz\t\t: %u.%03u\n", khz / 1000, khz % 1000);
+    buf_printf(b, "flags\t\t:");
+    for (int i = 0; i < 32; ++i) {
+        if ((edx >> i) & 1 && edx_flags[i]) buf_printf(b, " %s", edx_flags[i]);
+    }
+    for (int i = 0; i < 32; ++i) {
+        if ((ecx >> i) & 1 && ecx_flags[i]) buf_printf(b, " %s", ecx_flags[i]);
+    }
+    buf_printf(b, "\n");
+}
+
+static void show_fs_stats(struct proc_buf *b)
+{
+    const char *path, *type;
+    for (unsigned int i = 0; fs_mount_info(i, &path, &type) == FS_OK; ++i) {
+        buf_printf(b, "mount %s %s\n", type, path);
+    }
+    struct fs_usage u;
+    if (fs_usage("/", &u) == FS_OK) {
+        buf_printf(b, "ramfs_files %u\n", u.files);
+        buf_printf(b, "ramfs_kb %u\n", (uint32_t)(u.bytes >> 10));
+    }
+    struct fs_dedup_stats ds;
+    if (fs_dedup_stats(&ds) == FS_OK) {
+        buf_printf(b, "dedup_enabled %d\n", ds.enabled);
+        buf_printf(b, "dedup_blocks %u\n", ds.unique_blocks);
+        buf_printf(b, "dedup_refs %u\n", ds.block_refs);
+        buf_printf(b, "dedup_saved_kb %u\n", (uint32_t)(ds.bytes_saved >> 10));
+    }
+    struct bcache_stats bs;
+    bcache_stats(&bs);
+    buf_printf(b, "bcache_buffers %u\n", bs.capacity);
+    buf_printf(b, "bcache_cached %u\n", bs.cached);
+    buf_printf(b, "bcache_dirty %u\n", bs.dirty);
+    buf_printf(b, "bcache_hits %u\n", bs.hits);
+    buf_printf(b, "bcache_misses %u\n", bs.misses);
+    buf_printf(b, "bcache_evictions %u\n", bs.evictions);
+    buf_printf(b, "bcache_writebacks %u\n", bs.writebacks);
+    buf_printf(b, "bcache_readahead %u\n", bs.readahead);
+    buf_printf(b, "bcache_readahead_hits %u\n", bs.ra_hits);
+    struct fs_journal_stats js;
+    fs_journal_stats(&js);
+    buf_printf(b, "journal_dev %s\n", js.dev ? js.dev : "none");
+    if (js.dev) {
+        buf_printf(b, "journal_generation %u\n", js.generation);
+        buf_printf(b, "journal_commits %u\n", js.commits);
+        buf_printf(b, "journal_records %u\n", js.records);
+        buf_printf(b, "journal_pending %u\n", js.pending);
+        buf_printf(b, "journal_checkpoints %u\n", js.checkpoints);
+        buf_printf(b, "journal_log_sectors %u %u\n", js.log_used, js.log_size);
+    }
+}
+
+static void show_net_fw(struct proc_buf *b)
+{
+    struct fw_rule rules[MAX_RULES];
+    int n = netsec_list_rules(rules, MAX_RULES);
+    for (int i = 0; i < n; ++i) {
+        const struct fw_rule *r = &rules[i];
+        buf_printf(b, "%d %s ", i, r->type == RULE_ALLOW ? "ALLOW" : "DENY");
+        switch (r->target_type) {
+        case TARGET_PORT:
+            buf_printf(b, "PORT %u\n", r->port);
+            break;
+        case TARGET_ADDRESS:
+            buf_printf(b, "IP %u.%u.%u.%u/%u.%u.%u.%u\n",
+                       (r->address >> 24) & 0xFF, (r->address >> 16) & 0xFF,
+                       (r->address >> 8) & 0xFF, r->address & 0xFF,
+                       (r->mask >> 24) & 0xFF, (r->mask >> 16) & 0xFF,
+                       (r->mask >> 8) & 0xFF, r->mask & 0xFF);
+            break;
+        default:
+            buf_printf(b, "ANY\n");
+            break;
+        }
+    }
+}
+
+/* ---- filesystem operations ---- */
+
+/* The entry for path, or NULL; *root is set for the mount point itself. */
+static const struct proc_entry *lookup(const char *path, int *root)
+{
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') len--;
+    *root = len == 0;
+    for (size_t i = 0; i < NENTRIES; ++i) {
+        if (strncmp(entries[i].path, path, len) == 0 && entries[i].path[len] == '\0') return &entries[i];
+    }
+    return NULL;
+}
+
+static int procfs_mount(const char *source, const char *path, void **fs)
+{
+    (void)source;
+    if (mounted || strlen(path) >= sizeof(mount_path)) return FS_EINVAL;
+    strcpy(mount_path, path);
+    mounted = 1;
+    *fs = NULL;
+    return FS_OK;
+}
+
+static int procfs_unmount(void *fs)
+{
+    (void)fs;
+    mounted = 0;
+    return FS_OK;
+}
+
+static int procfs_open(void *fs, const char *path, int flags, struct vnode *vn)
+{
+    (void)fs;
+    (void)flags;
+    int root;
+    const struct proc_entry *e = lookup(path, &root);
+    if (!e || !e->show) return (root || e) ? FS_EINVAL : FS_ENOENT;
+    for (int i = 0; i < PROCFS_MAX_FILES; ++i) {
+        if (files[i].used) continue;
+        memset(&files[i], 0, sizeof(files[i]));
+        files[i].used = 1;
+        files[i].entry = e;
+        /* vn->id stays 0: every descriptor gets its own snapshot */
+        vn->priv = &files[i];
+        return FS_OK;
+    }
+    return FS_EMFILE;
+}
+
+static int procfs_release(struct vnode *vn)
+{
+    struct proc_file *f = vn->priv;
+    if (f->buf.data) kfree(f->buf.data);
+    f->used = 0;
+    return FS_OK;
+}
+
+static int procfs_read(struct vnode *vn, size_t pos, void *buf, size_t count)
+{
+    struct proc_file *f = vn->priv;
+    if (!f->rendered) {
+        f->entry->show(&f->buf);
+        f->rendered = 1;
+    }
+    if (pos >= f->buf.len) return 0;
+    if (count > f->buf.len - pos) count = f->buf.len - pos;
+    memcpy(buf, f->buf.data + pos, count);
+    return (int)count;
+}
+
+static int procfs_stat(void *fs, const char *path, struct fs_stat *st)
+{
+    (void)fs;
+    int root;
+    const struct proc_entry *e = lookup(path, &root);
+    if (!e && !root) return FS_ENOENT;
+    if (st) {
+        st->is_dir = !e || !e->show;
+        st->size = 0;
+        st->allocated = 0;
+        st->uid = 0;
+        st->gid = 0;
+        st->mode = st->is_dir ? (0555 | FS_S_IFDIR) : 0444;
+    }
+    return FS_OK;
+}
+
+static int procfs_listdir(void *fs, const char *path, unsigned int index, const struct fs_file **out)
+{
+    (void)fs;
+    static struct fs_file temp;
+    static char name[256];
+    int root;
+    const struct proc_entry *dir = lookup(path, &root);
+    if (!root && (!dir || dir->show)) return FS_ENOENT;
+    size_t dlen = root ? 0 : strlen(dir->path);
+    for (size_t i = 0; i < NENTRIES; ++i) {
+        const char *p = entries[i].path;
+        /* immediate children: "<dir>/<name>" without a further '/' */
+        if (strncmp(p, root ? "" : dir->path, dlen) != 0 || p[dlen] != '/' || strchr(p + dlen + 1, '/')) continue;
+        if (index-- > 0) continue;
+        if (strlen(mount_path) + strlen(p) >= sizeof(name)) return FS_EINVAL;
+        strcpy(name, mount_path);
+        strcat(name, p);
+        temp.name = name;
+        temp.data = NULL;
+        temp.size = 0;
+        temp.uid = 0;
+        temp.gid = 0;
+        temp.mode = entries[i].show ? 0444 : (0555 | FS_S_IFDIR);
+        if (out) *out = &temp;
+        return FS_OK;
+    }
+    return FS_ENOENT;
+}
+
+const struct vfs_ops procfs_ops = {
+    .type = "proc",
+    .mount = procfs_mount,
+    .unmount = procfs_unmount,
+    .open = procfs_open,
+    .release = procfs_release,
+    .read = procfs_read,
+    .stat = procfs_stat,
+    .listdir = procfs_listdir,
+};
@@ -2,190 +2,479 @@
 #include "../include/tty.h"
 #include "../include/memory.h"
 #include "../include/string.h"
+#include "../include/sha256.h"
+#include "../include/glob.h"
+#include "../include/vfs.h"
+#include "../include/journal.h"
 
 /*
- * Phase 3 (begin): In-memory hierarchical node tree for ramfs.
- * We're adding lightweight node structures and helpers to gradually
- * migrate from flat overlay string semantics to a tree. This file will
- * continue to support existing overlay APIs while providing utilities
- * for future refactors.
+ * In-memory hierarchical node tree for ramfs.
+ *
+ * Every file and directory (packaged or created at runtime) is a fixed-size
+ * ram_node living in a chunked node pool and addressed by a 32-bit index.
+ * Index 0 is never handed out and acts as the "no node" value. Names of up
+ * to RAM_NAME_INLINE-1 bytes are stored inside the node; longer names go to
+ * a shared append-only string arena. Runtime-created or modified entries
+ * (formerly a separate 64-slot overlay table) are marked with RN_OVERLAY.
+ *
+ * Overlay file contents are sparse: data is kept in RAM_PAGE_SIZE pages
+ * reached through a per-file page table, and pages that were never written
+ * are NULL holes that read back as zeros. With deduplication enabled,
+ * complete pages are hashed with SHA-256 and identical pages are stored once
+ * in a refcounted block store and shared copy-on-write between files.
+ *
+ * The tree is persistent: fs_snapshot() only records the current root and
+ * bumps a generation counter. Nodes whose generation is not newer than the
+ * latest snapshot are frozen and never modified again; a mutation copies the
+ * frozen nodes on its path (path copying) and leaves the rest shared. There
+ * are no parent pointers, since a shared node can have several parents.
+ *
+ * Every directory carries a usage record with the logical bytes and number
+ * of files in its subtree, kept up to date along the path of each mutation,
+ * so du and per-directory quotas never walk a subtree.
+ *
+ * A name index of the live tree (see "Name index" below) answers find
+ * queries without listing directories, and a full-text index keyed on it
+ * answers content searches without reading the files.
  */
 
+#define RAM_NIL 0u
+#define RAM_NAME_INLINE 20
+
+/* node pool: 1024 nodes (64 KiB) per chunk, up to 1M nodes */
+#define RAM_POOL_CHUNK_SHIFT 10
+#define RAM_POOL_CHUNK (1u << RAM_POOL_CHUNK_SHIFT)
+#define RAM_POOL_MAX_CHUNKS 1024
+
+/* string arena for long names: 64 KiB chunks, offsets are chunk << 16 | off */
+#define RAM_ARENA_CHUNK_SHIFT 16
+#define RAM_ARENA_CHUNK (1u << RAM_ARENA_CHUNK_SHIFT)
+#define RAM_ARENA_MAX_CHUNKS 256
+
+/* file data pages: one heap block each */
+#define RAM_PAGE_SIZE HEAP_BLOCK_SIZE
+
+/* ram_node.flags */
+#define RN_USED     0x0001
+#define RN_DIR      0x0002
+#define RN_OVERLAY  0x0004 /* created or modified at runtime */
+#define RN_LOADED   0x0008 /* packaged children already expanded */
+#define RN_LONGNAME 0x0010 /* name lives in the string arena */
+#define RN_MARK     0x0020 /* reachable, used while collecting garbage */
+
+/* snapshots kept at the same time */
+#define RAM_MAX_SNAPSHOTS 16
+
+/* deepest path handled (see path_to_components) */
+#define RAM_MAX_DEPTH 32
+
+/* dedup block store: hash buckets keyed by the first digest word */
+#define DD_BUCKETS 1024
+
+/* Page table of an overlay file. pg[i] covers bytes
+ * [i * RAM_PAGE_SIZE, (i + 1) * RAM_PAGE_SIZE). An entry is 0 for a hole,
+ * a private page pointer (pages are block aligned, so bit 0 is clear), or
+ * (dedup block index << 1) | 1 for a page shared through the block store. */
+#define PTE_SHARED 1u
+
+struct ram_pages {
+    uint32_t cap;       /* entries in pg[] */
+    uint32_t allocated; /* non-hole entries */
+    uint32_t refs;      /* nodes sharing this table (snapshot copies) */
+    uintptr_t pg[];
+};
+
+struct dd_block {
+    uint8_t hash[32];
+    uint8_t *page;
+    uint32_t refs;
+    uint32_t next;   /* bucket chain, or free list when refs == 0 */
+    uint32_t hashed; /* 0: private page shared between snapshot copies only */
+};
+
 struct ram_node {
-    char *name; /* local name of this node (not full path), e.g. "etc" */
-    struct ram_node *parent;
-    struct ram_node *first_child;
-    struct ram_node *next_sibling;
-    uint8_t *data; /* owned copy for overlay-created files, NULL for packaged files */
-    size_t size;
-    int is_dir;
-    unsigned int uid;
-    unsigned int gid;
-    unsigned int mode;
-    const struct fs_file *packaged; /* pointer to packaged file if present */
+    uint32_t gen;          /* fs_epoch when created; frozen once <= frozen_gen */
+    uint32_t first_child;
+    uint32_t next_sibling; /* also links free pool slots */
+    uint16_t flags;
+    uint16_t mode;         /* permission bits, at most 07777 */
+    uint32_t uid;
+    uint32_t gid;
+    union {
+        uint32_t size;  /* files: logical size */
+        uint32_t usage; /* dirs: index of the subtree usage record */
+    };
+    struct ram_pages *pages; /* overlay file data, NULL when backed by packaged data or empty */
+    union {
+        uint32_t pk; /* files: sorted packaged index + 1, 0 if none */
+        /* Lazy materialization: a directory's packaged children live in the
+         * contiguous range [lo, hi) of the sorted packaged index. Children
+         * are only turned into nodes the first time the directory is looked
+         * into (RN_LOADED afterwards). */
+        struct { uint32_t lo, hi; } range;
+    } u;
+    uint16_t pk_off;   /* dirs: offset of the child component in packaged names */
+    uint16_t name_len;
+    union {
+        char inline_name[RAM_NAME_INLINE];
+        uint32_t arena_off;
+    } name;
+};
+
+/* Aggregated usage of a directory subtree. Records are kept in a growable
+ * array and referenced by index from the directory node; a copied directory
+ * gets its own record. */
+struct ram_usage {
+    uint64_t bytes;  /* logical size of all files below */
+    uint32_t files;  /* regular files below */
+    uint32_t next;   /* free list link */
+    uint64_t quota;  /* byte limit for the subtree, 0 for none */
+    uint32_t name_ent; /* the directory's name index entry */
+};
+
+/* Directories from the root down to the parent of the node being changed,
+ * as visited by a writable walk. All of them are writable. */
+struct ram_walk {
+    int depth;
+    uint32_t dir[RAM_MAX_DEPTH];
 };
 
+static struct ram_node *node_chunks[RAM_POOL_MAX_CHUNKS];
+static uint32_t node_chunk_count = 0;
+static uint32_t node_free_list = RAM_NIL;
+static uint32_t node_next_unused = 1; /* slot 0 is RAM_NIL */
+
+static char *arena_chunks[RAM_ARENA_MAX_CHUNKS];
+static uint32_t arena_chunk_count = 0;
+static uint32_t arena_used = RAM_ARENA_CHUNK; /* forces a chunk on first use */
+
 /* Root of the in-memory tree (represents "/"). Lazily initialised. */
-static struct ram_node *ram_root = NULL;
+static uint32_t ram_root = RAM_NIL;
 
-/* helpers using kernel allocator (kmalloc/kfree) */
-static char *kstrdup(const char *s);
-static void *krealloc(void *old, size_t oldsz, size_t newsz);
+struct ram_snapshot {
+    uint32_t root;
+    uint32_t gen;
+    int used;
+};
+
+static struct ram_snapshot snapshots[RAM_MAX_SNAPSHOTS];
+
+static struct ram_usage *usage_recs = NULL; /* slot 0 unused */
+static uint32_t usage_cap = 0;
+static uint32_t usage_next_unused = 1;
+static uint32_t usage_free_list = 0;
+
+/* Bumped whenever nodes may move or disappear, so cached walks are redone. */
+static uint32_t ram_tree_stamp = 0;
+/* Bumped whenever a directory is removed or moved. */
+static uint32_t ram_dir_stamp = 0;
+/* Bumped whenever a node is allocated or a child list changes. */
+static uint32_t ram_list_stamp = 0;
+static uint32_t fs_epoch = 1;   /* generation given to new nodes */
+static uint32_t frozen_gen = 0; /* newest live snapshot generation, 0 if none */
 
 /* Forward declarations for functions used before their definitions. */
 static void build_tree_from_initrd_if_needed(void);
-static int path_to_components(const char *path, char components[][128], int max_comps);
-static struct ram_node *find_child(struct ram_node *parent, const char *name);
-static struct ram_node *insert_child(struct ram_node *parent, const char *name, int is_dir);
+static void dir_materialize(uint32_t dir);
+static void *krealloc(void *old, size_t oldsz, size_t newsz);
+static void pages_put(struct ram_pages *pt);
+static size_t node_size(const struct ram_node *n);
+static int node_make_overlay(uint32_t idx);
+static uint32_t ni_add(uint32_t parent, const char *name, size_t len, int is_dir, int stable);
+static uint32_t ni_find(uint32_t parent, const char *name, size_t len);
+static int ni_ready; /* defined with the name index */
+static void ft_forget(uint32_t ent);
+static int ft_ready; /* defined with the full-text index */
 
 /* The packer will generate these symbols in src/initrd_data.c */
-/* (declarations are already provided above) */
+extern const struct fs_file initrd_files[];
+extern const unsigned int initrd_files_count;
 
-/* Simple dynamic ramfs overlay structures for Phase 2 */
-#define OVERLAY_MAX_FILES 64
+static inline struct ram_node *rn(uint32_t idx)
+{
+    return &node_chunks[idx >> RAM_POOL_CHUNK_SHIFT][idx & (RAM_POOL_CHUNK - 1)];
+}
 
-struct overlay_file {
-    char *name;
-    uint8_t *data;
-    size_t size;
-    int is_dir;
-    int used;
-    unsigned int uid;
-    unsigned int gid;
-    unsigned int mode; /* permission bits */
-};
+static uint32_t node_alloc(void)
+{
+    uint32_t idx = node_free_list;
+    if (idx != RAM_NIL) {
+        node_free_list = rn(idx)->next_sibling;
+    } else {
+        if ((node_next_unused >> RAM_POOL_CHUNK_SHIFT) >= node_chunk_count) {
+            if (node_chunk_count >= RAM_POOL_MAX_CHUNKS) return RAM_NIL;
+            struct ram_node *chunk = kmalloc(RAM_POOL_CHUNK * sizeof(struct ram_node));
+            if (!chunk) return RAM_NIL;
+            node_chunks[node_chunk_count++] = chunk;
+        }
+        idx = node_next_unused++;
+    }
+    memset(rn(idx), 0, sizeof(struct ram_node));
+    ram_list_stamp++;
+    return idx;
+}
 
-static struct overlay_file overlay[OVERLAY_MAX_FILES];
+static uint32_t usage_alloc(void)
+{
+    uint32_t u = usage_free_list;
+    if (u) {
+        usage_free_list = usage_recs[u].next;
+    } else {
+        if (usage_next_unused >= usage_cap) {
+            uint32_t ncap = usage_cap ? usage_cap * 2 : HEAP_BLOCK_SIZE / sizeof(struct ram_usage);
+            struct ram_usage *nu = krealloc(usage_recs, usage_cap * sizeof(*nu), ncap * sizeof(*nu));
+            if (!nu) return 0;
+            usage_recs = nu;
+            usage_cap = ncap;
+        }
+        u = usage_next_unused++;
+    }
+    memset(&usage_recs[u], 0, sizeof(struct ram_usage));
+    return u;
+}
 
-static int overlay_find(const char *path);
-static int overlay_alloc(const char *path, const uint8_t *data, size_t size, int is_dir);
-static void overlay_free(int idx);
+static void usage_free(uint32_t u)
+{
+    if (!u) return;
+    usage_recs[u].next = usage_free_list;
+    usage_free_list = u;
+}
 
+static inline struct ram_usage *node_usage(const struct ram_node *n)
+{
+    return &usage_recs[n->usage];
+}
 
-static struct ram_node *node_create(const char *name, int is_dir)
+static void node_release(uint32_t idx)
 {
-    struct ram_node *n = kmalloc(sizeof(*n));
-    if (!n) return NULL;
-    memset(n, 0, sizeof(*n));
-    if (name) n->name = kstrdup(name);
-    else n->name = kstrdup("/");
-    n->is_dir = is_dir;
+    struct ram_node *n = rn(idx);
+    if (n->flags & RN_DIR) usage_free(n->usage);
+    n->flags = 0;
+    n->next_sibling = node_free_list;
+    node_free_list = idx;
+}
+
+/* Copy a long name into the arena and return its offset (0xFFFFFFFF on failure).
+ * The arena is append-only: names of freed nodes are not reclaimed. */
+static uint32_t arena_store(const char *s, size_t len)
+{
+    if (arena_used + len + 1 > RAM_ARENA_CHUNK) {
+        if (arena_chunk_count >= RAM_ARENA_MAX_CHUNKS) return 0xFFFFFFFFu;
+        char *chunk = kmalloc(RAM_ARENA_CHUNK);
+        if (!chunk) return 0xFFFFFFFFu;
+        arena_chunks[arena_chunk_count++] = chunk;
+        arena_used = 0;
+    }
+    uint32_t chunk_idx = arena_chunk_count - 1;
+    char *dst = arena_chunks[chunk_idx] + arena_used;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    uint32_t off = (chunk_idx << RAM_ARENA_CHUNK_SHIFT) | arena_used;
+    arena_used += len + 1;
+    return off;
+}
+
+static const char *node_name(const struct ram_node *n)
+{
+    if (n->flags & RN_LONGNAME)
+        return arena_chunks[n->name.arena_off >> RAM_ARENA_CHUNK_SHIFT] + (n->name.arena_off & (RAM_ARENA_CHUNK - 1));
+    return n->name.inline_name;
+}
+
+static int node_set_name(struct ram_node *n, const char *name)
+{
+    size_t len = strlen(name);
+    if (len < RAM_NAME_INLINE) {
+        memcpy(n->name.inline_name, name, len + 1);
+        n->flags &= ~RN_LONGNAME;
+    } else {
+        uint32_t off = arena_store(name, len);
+        if (off == 0xFFFFFFFFu) return -1;
+        n->name.arena_off = off;
+        n->flags |= RN_LONGNAME;
+    }
+    n->name_len = (uint16_t)len;
+    return 0;
+}
+
+static uint32_t node_create(const char *name, int is_dir)
+{
+    uint32_t idx = node_alloc();
+    if (idx == RAM_NIL) return RAM_NIL;
+    struct ram_node *n = rn(idx);
+    if (node_set_name(n, name ? name : "/") != 0) { node_release(idx); return RAM_NIL; }
+    if (is_dir) {
+        n->usage = usage_alloc();
+        if (!n->usage) { node_release(idx); return RAM_NIL; }
+        n = rn(idx);
+    }
+    /* nodes created at runtime have no packaged subtree to expand */
+    n->flags |= RN_USED | RN_LOADED | (is_dir ? RN_DIR : 0);
     n->uid = 0; n->gid = 0; n->mode = is_dir ? 0755 : 0644;
-    return n;
+    n->gen = fs_epoch;
+    return idx;
 }
 
-static void node_free_recursive(struct ram_node *n)
+/* A frozen node may be shared with a snapshot and must not be modified. */
+static inline int node_frozen(uint32_t idx)
 {
-    if (!n) return;
-    struct ram_node *c = n->first_child;
-    while (c) {
-        struct ram_node *next = c->next_sibling;
-        node_free_recursive(c);
-        c = next;
+    return rn(idx)->gen <= frozen_gen;
+}
+
+/* Writable copy of a frozen node. Children, the name and the page table are
+ * shared with the original. */
+static uint32_t node_clone(uint32_t idx)
+{
+    uint32_t c = node_alloc();
+    if (c == RAM_NIL) return RAM_NIL;
+    if (rn(idx)->flags & RN_DIR) {
+        uint32_t u = usage_alloc();
+        if (!u) { node_release(c); return RAM_NIL; }
+        usage_recs[u] = usage_recs[rn(idx)->usage];
+        memcpy(rn(c), rn(idx), sizeof(struct ram_node));
+        rn(c)->usage = u;
+    } else {
+        memcpy(rn(c), rn(idx), sizeof(struct ram_node));
     }
-    if (n->name) kfree(n->name);
-    if (n->data) kfree(n->data);
-    kfree(n);
+    rn(c)->gen = fs_epoch;
+    if (rn(c)->pages) rn(c)->pages->refs++;
+    return c;
 }
 
-/* Remove node from its parent child list and free it recursively. */
-static void remove_node(struct ram_node *n)
+/* Free a node and the part of its subtree owned by the live tree only. Frozen
+ * nodes are still referenced by a snapshot and are left to the collector.
+ * Nodes waiting to be freed are chained through their sibling links, which
+ * only the live tree follows, so no stack is needed however deep the tree. */
+static void node_free_recursive(uint32_t idx)
 {
-    if (!n || !n->parent) { node_free_recursive(n); return; }
-    struct ram_node *p = n->parent;
-    struct ram_node **slot = &p->first_child;
-    while (*slot) {
-        if (*slot == n) {
-            *slot = n->next_sibling;
-            node_free_recursive(n);
-            return;
+    if (idx == RAM_NIL || node_frozen(idx)) return;
+    uint32_t pending = RAM_NIL;
+    for (;;) {
+        uint32_t c = rn(idx)->first_child;
+        while (c != RAM_NIL) {
+            uint32_t next = rn(c)->next_sibling;
+            if (!node_frozen(c)) {
+                rn(c)->next_sibling = pending;
+                pending = c;
+            }
+            c = next;
         }
-        slot = &((*slot)->next_sibling);
+        pages_put(rn(idx)->pages);
+        node_release(idx);
+        if (pending == RAM_NIL) return;
+        idx = pending;
+        pending = rn(idx)->next_sibling;
     }
 }
 
-/* Detach node from its parent but don't free it. Caller must reattach or free later. */
-static void detach_node(struct ram_node *n)
+/* Writable copy of one node under a new name (NULL keeps the name), without
+ * children. File data is shared copy-on-write with the original; packaged
+ * contents are copied up, since the copy must be an overlay file. */
+static uint32_t node_copy(uint32_t idx, const char *name)
 {
-    if (!n || !n->parent) return;
-    struct ram_node *p = n->parent;
-    struct ram_node **slot = &p->first_child;
-    while (*slot) {
-        if (*slot == n) {
-            *slot = n->next_sibling;
-            n->next_sibling = NULL;
-            n->parent = NULL;
-            return;
-        }
-        slot = &((*slot)->next_sibling);
+    uint32_t c = node_alloc();
+    if (c == RAM_NIL) return RAM_NIL;
+    struct ram_node *n = rn(c);
+    memcpy(n, rn(idx), sizeof(struct ram_node));
+    n->first_child = RAM_NIL;
+    n->next_sibling = RAM_NIL;
+    n->gen = fs_epoch;
+    n->flags = (n->flags & (RN_USED | RN_DIR | RN_OVERLAY | RN_LONGNAME)) | RN_LOADED;
+    if (n->flags & RN_DIR) {
+        n->usage = 0;
+        uint32_t u = usage_alloc();
+        if (!u) { node_release(c); return RAM_NIL; }
+        usage_recs[u] = usage_recs[rn(idx)->usage];
+        usage_recs[u].quota = 0;
+        usage_recs[u].name_ent = 0;
+        n->usage = u;
+        n->flags |= RN_OVERLAY;
+    } else if (n->flags & RN_OVERLAY) {
+        if (n->pages) n->pages->refs++;
+    } else {
+        n->pages = NULL;
+        if (node_make_overlay(c) != 0) { node_release(c); return RAM_NIL; }
+        /* not a runtime version of a packaged file: unlink removes it */
+        n->u.pk = 0;
+    }
+    if (name && node_set_name(n, name) != 0) {
+        node_free_recursive(c);
+        return RAM_NIL;
     }
+    return c;
 }
 
-/* Build full path of a node into a static buffer and return it. */
-static const char *node_fullpath(const struct ram_node *n)
+/* Link in the child list of the writable directory parent that leads to
+ * child. Frozen siblings in front of child are copied first so that the link
+ * itself is writable. Returns NULL when out of nodes or if child is missing. */
+static uint32_t *child_slot(uint32_t parent, uint32_t child)
 {
-    static char buf[1024];
-    if (!n) { buf[0] = '\0'; return buf; }
-    /* collect components up to root */
-    const struct ram_node *stack[64];
-    int top = 0;
-    const struct ram_node *cur = n;
-    while (cur && cur->parent) {
-        stack[top++] = cur;
-        cur = cur->parent;
-        if (top >= (int)(sizeof(stack)/sizeof(stack[0]))-1) break;
-    }
-    /* root path */
-    if (top == 0) { strcpy(buf, "/"); return buf; }
-    buf[0] = '\0';
-    for (int i = top - 1; i >= 0; --i) {
-        strcat(buf, "/");
-        strcat(buf, stack[i]->name ? stack[i]->name : "");
+    uint32_t *slot = &rn(parent)->first_child;
+    while (*slot != child) {
+        uint32_t cur = *slot;
+        if (cur == RAM_NIL) return NULL;
+        if (node_frozen(cur)) {
+            cur = node_clone(cur);
+            if (cur == RAM_NIL) return NULL;
+            *slot = cur;
+        }
+        slot = &rn(cur)->next_sibling;
     }
-    return buf;
+    return slot;
+}
+
+/* Return a writable version of child, a child of the writable directory
+ * parent, replacing a frozen child by a copy. RAM_NIL when out of nodes. */
+static uint32_t child_writable(uint32_t parent, uint32_t child)
+{
+    if (!node_frozen(child)) return child;
+    uint32_t *slot = child_slot(parent, child);
+    if (!slot) return RAM_NIL;
+    uint32_t c = node_clone(child);
+    if (c == RAM_NIL) return RAM_NIL;
+    *slot = c;
+    return c;
 }
 
-/* Insert overlay-backed node for given path and overlay index. Creates intermediate directories as needed. */
-static int insert_overlay_node_for_index(const char *path, int overlay_idx, int is_dir)
+/* Writable root, copied if it is part of a snapshot. */
+static uint32_t root_writable(void)
 {
-    if (!path) return -1;
     build_tree_from_initrd_if_needed();
-    char comps[32][128];
-    int c = path_to_components(path, comps, 32);
-    struct ram_node *cur = ram_root;
-    if (!cur) return -1;
-    for (int i = 0; i < c; ++i) {
-        int last = (i == c-1);
-        struct ram_node *n = find_child(cur, comps[i]);
-        if (!n) {
-            n = insert_child(cur, comps[i], last ? is_dir : 1);
-            if (!n) return -1;
-        }
-        cur = n;
-    }
-    /* attach overlay data */
-    cur->data = overlay[overlay_idx].data;
-    cur->size = overlay[overlay_idx].size;
-    cur->uid = overlay[overlay_idx].uid;
-    cur->gid = overlay[overlay_idx].gid;
-    cur->mode = overlay[overlay_idx].mode;
-    cur->is_dir = overlay[overlay_idx].is_dir;
-    cur->packaged = NULL;
+    if (ram_root != RAM_NIL && node_frozen(ram_root)) {
+        uint32_t c = node_clone(ram_root);
+        if (c == RAM_NIL) return RAM_NIL;
+        ram_root = c;
+    }
+    return ram_root;
+}
+
+/* Unlink idx from the child list of the writable directory parent. A frozen
+ * idx keeps its own link, which a snapshot may still follow. */
+static int detach_node(uint32_t parent, uint32_t idx)
+{
+    uint32_t *slot = child_slot(parent, idx);
+    if (!slot) return -1;
+    *slot = rn(idx)->next_sibling;
+    if (!node_frozen(idx)) rn(idx)->next_sibling = RAM_NIL;
+    ram_list_stamp++;
     return 0;
 }
 
-/* split path into components starting after leading '/'. Returns count (0 for root).
- * components is an array of char[128] entries. max_comps must be >0. */
-/* Forward declarations for functions used before their definitions below. */
-static void build_tree_from_initrd_if_needed(void);
-static int path_to_components(const char *path, char components[][128], int max_comps);
-static struct ram_node *find_child(struct ram_node *parent, const char *name);
-static struct ram_node *insert_child(struct ram_node *parent, const char *name, int is_dir);
+/* Remove child from the writable directory parent and free it recursively. */
+static void remove_node(uint32_t parent, uint32_t idx)
+{
+    if (detach_node(parent, idx) == 0) node_free_recursive(idx);
+}
 
-/* The packer will generate these symbols in src/initrd_data.c */
-extern const struct fs_file initrd_files[];
-extern const unsigned int initrd_files_count;
+static void attach_node(uint32_t parent, uint32_t idx)
+{
+    rn(idx)->next_sibling = rn(parent)->first_child;
+    rn(parent)->first_child = idx;
+    ram_list_stamp++;
+}
 
+/* split path into components starting after leading '/'. Returns count (0 for root).
+ * components is an array of char[128] entries. max_comps must be >0. */
 static int path_to_components(const char *path, char components[][128], int max_comps)
 {
     if (!path || path[0] != '/') return -1;
@@ -206,601 +495,2694 @@ static int path_to_components(const char *path, char components[][128], int max_
 }
 
 /* Find a child with given name under parent (non-recursive). */
-static struct ram_node *find_child(struct ram_node *parent, const char *name)
+static uint32_t find_child(uint32_t parent, const char *name)
 {
-    if (!parent) return NULL;
-    struct ram_node *c = parent->first_child;
-    while (c) {
-        if (c->name && strcmp(c->name, name) == 0) return c;
-        c = c->next_sibling;
+    if (parent == RAM_NIL) return RAM_NIL;
+    dir_materialize(parent);
+    size_t len = strlen(name);
+    uint32_t c = rn(parent)->first_child;
+    while (c != RAM_NIL) {
+        const struct ram_node *n = rn(c);
+        if (n->name_len == len && strcmp(node_name(n), name) == 0) return c;
+        c = n->next_sibling;
     }
-    return NULL;
+    return RAM_NIL;
 }
 
 /* Insert a node as a child of parent. Returns the new node or existing one. */
-static struct ram_node *insert_child(struct ram_node *parent, const char *name, int is_dir)
+static uint32_t insert_child(uint32_t parent, const char *name, int is_dir)
 {
-    struct ram_node *exist = find_child(parent, name);
-    if (exist) return exist;
-    struct ram_node *n = node_create(name, is_dir);
-    if (!n) return NULL;
-    n->next_sibling = parent->first_child;
-    parent->first_child = n;
-    n->parent = parent;
+    uint32_t exist = find_child(parent, name);
+    if (exist != RAM_NIL) return exist;
+    uint32_t n = node_create(name, is_dir);
+    if (n == RAM_NIL) return RAM_NIL;
+    attach_node(parent, n);
+    if (ni_ready) {
+        uint32_t e = ni_add(node_usage(rn(parent))->name_ent, name, strlen(name), is_dir, 0);
+        if (is_dir) node_usage(rn(n))->name_ent = e;
+    }
     return n;
 }
 
-/* Find node by absolute path in the in-memory tree. Returns NULL if not found. */
-static struct ram_node *find_node_by_path(const char *path)
+/* Last directory resolved inside a batch (fs_batch_begin), so a run of
+ * operations in one directory walks its path once. Only directories of the
+ * live tree that are not frozen are kept: those stay put until a directory
+ * is removed or moved. */
+static struct {
+    uint32_t node;   /* RAM_NIL when empty */
+    uint32_t stamp;  /* ram_dir_stamp when recorded */
+    int has_walk;    /* node was made writable and w leads to it */
+    struct ram_walk w;
+    size_t len;
+    char dir[256];
+} dir_cache;
+static int batch_depth = 0;
+
+/* Length of the directory part of path, with *base pointing at the last
+ * component, or -1 if path does not end in a name. */
+static int path_split(const char *path, const char **base)
+{
+    const char *slash = NULL;
+    for (const char *p = path; *p; ++p) {
+        if (*p == '/') slash = p;
+    }
+    if (!slash || slash[1] == '\0' || strlen(slash + 1) > 127) return -1;
+    *base = slash + 1;
+    return (int)(slash - path);
+}
+
+static uint32_t dir_cache_get(const char *path, struct ram_walk *w, const char **base)
+{
+    if (!batch_depth || dir_cache.node == RAM_NIL) return RAM_NIL;
+    int len = path_split(path, base);
+    if (len < 0 || (size_t)len != dir_cache.len || strncmp(path, dir_cache.dir, (size_t)len) != 0) return RAM_NIL;
+    if (dir_cache.stamp != ram_dir_stamp || node_frozen(dir_cache.node)) return RAM_NIL;
+    if (w) {
+        if (!dir_cache.has_walk) return RAM_NIL;
+        *w = dir_cache.w;
+    }
+    return dir_cache.node;
+}
+
+/* Remember dir as the parent of path; w is NULL for a read-only lookup. */
+static void dir_cache_put(const char *path, uint32_t dir, const struct ram_walk *w)
+{
+    const char *base;
+    int len = path_split(path, &base);
+    if (!batch_depth || len < 0 || (size_t)len >= sizeof(dir_cache.dir)) return;
+    if (dir == RAM_NIL || node_frozen(dir)) return;
+    if (!w && dir_cache.node == dir && dir_cache.has_walk && dir_cache.stamp == ram_dir_stamp) return;
+    memcpy(dir_cache.dir, path, (size_t)len);
+    dir_cache.dir[len] = '\0';
+    dir_cache.len = (size_t)len;
+    dir_cache.node = dir;
+    dir_cache.stamp = ram_dir_stamp;
+    dir_cache.has_walk = w != NULL;
+    if (w) dir_cache.w = *w;
+}
+
+/* Find node by absolute path in the in-memory tree. Returns RAM_NIL if not found. */
+static uint32_t find_node_by_path(const char *path)
 {
-    if (!path) return NULL;
+    if (!path) return RAM_NIL;
+    build_tree_from_initrd_if_needed();
     if (strcmp(path, "/") == 0) return ram_root;
+    const char *base;
+    uint32_t dir = dir_cache_get(path, NULL, &base);
+    if (dir != RAM_NIL) return find_child(dir, base);
     char comps[32][128];
     int c = path_to_components(path, comps, 32);
-    if (c <= 0) return ram_root;
-    struct ram_node *cur = ram_root;
-    for (int i = 0; i < c && cur; ++i) {
+    if (c < 0) return RAM_NIL;
+    uint32_t cur = ram_root, parent = RAM_NIL;
+    for (int i = 0; i < c && cur != RAM_NIL; ++i) {
+        parent = cur;
         cur = find_child(cur, comps[i]);
     }
+    if (cur != RAM_NIL && batch_depth) dir_cache_put(path, parent, NULL);
     return cur;
 }
 
-/* Lazily build a minimal tree from packaged initrd_entries so tools can inspect it.
- * This is conservative: it only adds nodes representing packaged paths and does
- * not remove or modify overlay array behaviour. It is safe to call multiple times. */
-static void build_tree_from_initrd_if_needed(void)
+/* Resolve the parent directory of path for a mutation and copy the final
+ * component into basename. Frozen directories on the way are copied so the
+ * result is writable; intermediate directories are created when create is
+ * set. The directories visited, root to parent, are recorded in w. */
+static uint32_t find_parent_by_path(const char *path, char *basename, int create, struct ram_walk *w)
 {
-    if (ram_root) return;
-    ram_root = node_create("/", 1);
-    if (!ram_root) return;
-    for (unsigned int i = 0; i < initrd_files_count; ++i) {
-        const struct fs_file *f = &initrd_files[i];
-        if (!f || !f->name) continue;
-        /* ignore empty names */
-        if (strcmp(f->name, "/") == 0) continue;
-        char comps[32][128];
-        int c = path_to_components(f->name, comps, 32);
-        struct ram_node *cur = ram_root;
-        for (int j = 0; j < c; ++j) {
-            int is_last = (j == c-1);
-            struct ram_node *n = insert_child(cur, comps[j], is_last ? (f->data == NULL ? 1 : 0) : 1);
-            if (!n) break;
-            cur = n;
-        }
-        if (cur) cur->packaged = f;
+    const char *cbase;
+    uint32_t dir = dir_cache_get(path, w, &cbase);
+    if (dir != RAM_NIL) {
+        strcpy(basename, cbase);
+        return dir;
     }
+    char comps[RAM_MAX_DEPTH][128];
+    int c = path_to_components(path, comps, RAM_MAX_DEPTH);
+    if (c <= 0) return RAM_NIL;
+    uint32_t cur = root_writable();
+    w->depth = 0;
+    for (int i = 0; i < c-1 && cur != RAM_NIL; ++i) {
+        w->dir[w->depth++] = cur;
+        uint32_t n = create ? insert_child(cur, comps[i], 1) : find_child(cur, comps[i]);
+        if (n != RAM_NIL && !(rn(n)->flags & RN_DIR)) return RAM_NIL;
+        cur = n != RAM_NIL ? child_writable(cur, n) : RAM_NIL;
+    }
+    if (cur != RAM_NIL) w->dir[w->depth++] = cur;
+    strcpy(basename, comps[c-1]);
+    if (cur != RAM_NIL && batch_depth) dir_cache_put(path, cur, w);
+    return cur;
 }
 
-/* helpers using kernel allocator (kmalloc/kfree) */
-static char *kstrdup(const char *s)
+/* Like find_node_by_path, but the node and every directory above it are made
+ * writable first. w receives the directories above the node. */
+static uint32_t find_node_writable(const char *path, struct ram_walk *w)
 {
-    if (!s) return NULL;
-    size_t l = strlen(s) + 1;
-    char *d = kmalloc(l);
-    if (!d) return NULL;
-    memcpy(d, (void *)s, l);
-    return d;
+    if (!path) return RAM_NIL;
+    if (strcmp(path, "/") == 0) { w->depth = 0; return root_writable(); }
+    char base[128];
+    uint32_t parent = find_parent_by_path(path, base, 0, w);
+    if (parent == RAM_NIL) return RAM_NIL;
+    uint32_t n = find_child(parent, base);
+    return n != RAM_NIL ? child_writable(parent, n) : RAM_NIL;
 }
 
-static void *krealloc(void *old, size_t oldsz, size_t newsz)
+/* Bytes and files a node contributes to the usage of its ancestors. */
+static void node_contrib(const struct ram_node *n, uint64_t *bytes, uint32_t *files)
 {
-    void *n = kmalloc(newsz);
-    if (!n) return NULL;
-    if (old && oldsz) memcpy(n, old, oldsz < newsz ? oldsz : newsz);
-    if (old) kfree(old);
-    return n;
+    if (n->flags & RN_DIR) {
+        *bytes = node_usage(n)->bytes;
+        *files = node_usage(n)->files;
+    } else {
+        *bytes = node_size(n);
+        *files = 1;
+    }
 }
 
-/* Overlay helper implementations (defined once). */
-static int overlay_find(const char *path)
+/* Apply a usage change to the directories of a walk from depth from on. */
+static void usage_add(const struct ram_walk *w, int from, uint64_t bytes, uint32_t files)
 {
-    if (!path) return -1;
-    for (int i = 0; i < OVERLAY_MAX_FILES; ++i) {
-        if (overlay[i].used && overlay[i].name && strcmp(overlay[i].name, path) == 0) return i;
+    for (int i = from; i < w->depth; ++i) {
+        struct ram_usage *u = node_usage(rn(w->dir[i]));
+        u->bytes += bytes;
+        u->files += files;
     }
-    return -1;
 }
 
-static int overlay_alloc(const char *path, const uint8_t *data, size_t size, int is_dir)
+static void usage_sub(const struct ram_walk *w, int from, uint64_t bytes, uint32_t files)
 {
-    for (int i = 0; i < OVERLAY_MAX_FILES; ++i) {
-        if (!overlay[i].used) {
-            overlay[i].used = 1;
-            overlay[i].name = kstrdup(path);
-            if (!overlay[i].name) { overlay[i].used = 0; return -1; }
-            if (size) {
-                overlay[i].data = kmalloc(size);
-                if (!overlay[i].data) { kfree(overlay[i].name); overlay[i].used = 0; return -1; }
-                memcpy(overlay[i].data, (void *)data, size);
-                overlay[i].size = size;
-            } else {
-                overlay[i].data = NULL;
-                overlay[i].size = 0;
-            }
-            overlay[i].is_dir = is_dir;
-            /* default ownership and permissions */
-            overlay[i].uid = 0;
-            overlay[i].gid = 0;
-            overlay[i].mode = is_dir ? 0755 : 0644;
-            return i;
-        }
+    for (int i = from; i < w->depth; ++i) {
+        struct ram_usage *u = node_usage(rn(w->dir[i]));
+        u->bytes -= bytes;
+        u->files -= files;
     }
-    return -1;
 }
 
-static void overlay_free(int idx)
+/* Whether growing the directories of a walk (from depth from on) by grow
+ * bytes keeps them within their quotas. */
+static int usage_fits(const struct ram_walk *w, int from, uint64_t grow)
 {
-    if (idx < 0 || idx >= OVERLAY_MAX_FILES) return;
-    if (!overlay[idx].used) return;
-    if (overlay[idx].name) kfree(overlay[idx].name);
-    if (overlay[idx].data) kfree(overlay[idx].data);
-    overlay[idx].used = 0;
+    for (int i = from; i < w->depth; ++i) {
+        const struct ram_usage *u = node_usage(rn(w->dir[i]));
+        if (u->quota && u->bytes + grow > u->quota) return 0;
+    }
+    return 1;
 }
 
+/* Sorted view of the packaged initrd entries. tools/mkinitrd.py emits the
+ * table already sorted by path, in which case initrd_files is used as-is;
+ * otherwise a sorted pointer array is built on first use. Every directory's
+ * descendants then form one contiguous range of the index. */
+static const struct fs_file **pk_sorted = NULL;
+static int pk_ready = 0;
+/* Prefix sums over the sorted index: entries [lo, hi) hold
+ * pk_bytes[hi] - pk_bytes[lo] bytes in pk_files[hi] - pk_files[lo] files,
+ * which gives the usage of a packaged subtree without expanding it. */
+static uint64_t *pk_bytes = NULL;
+static uint32_t *pk_files = NULL;
 
-/* The packer will generate these symbols in src/initrd_data.c */
-extern const struct fs_file initrd_files[];
-extern const unsigned int initrd_files_count;
+static const struct fs_file *pk_entry(unsigned int i)
+{
+    return pk_sorted ? pk_sorted[i] : &initrd_files[i];
+}
 
-/* Simple fd table */
-#define MAX_FDS 16
-struct open_file {
-    const struct fs_file *f;
-    size_t pos;
-    int flags;
-    int used;
-};
+static int pk_sort(unsigned int n)
+{
+    unsigned int i;
+    pk_sorted = kmalloc(n * sizeof(*pk_sorted));
+    if (!pk_sorted) return -1;
+    for (i = 0; i < n; ++i) pk_sorted[i] = &initrd_files[i];
+    /* shell sort: no extra memory and fine for initrd-sized tables */
+    for (unsigned int gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; ++i) {
+            const struct fs_file *t = pk_sorted[i];
+            unsigned int j = i;
+            while (j >= gap && strcmp(pk_sorted[j-gap]->name, t->name) > 0) {
+                pk_sorted[j] = pk_sorted[j-gap];
+                j -= gap;
+            }
+            pk_sorted[j] = t;
+        }
+    }
+    return 0;
+}
 
-static struct open_file fd_table[MAX_FDS];
+/* Set up the index on first use. An unsorted table cannot be searched
+ * without pk_sorted: if that allocation fails the failure is reported
+ * and the root gets an empty range, leaving the packaged files out of
+ * the tree rather than splitting the unsorted table into wrong ranges.
+ * Without the prefix sums only the usage totals of packaged directories
+ * are missing. */
+static int pk_index_init(void)
+{
+    static int pk_failed = 0;
+    if (pk_ready) return pk_failed;
+    pk_ready = 1;
+    unsigned int n = initrd_files_count;
+    unsigned int i;
+    for (i = 1; i < n; ++i) {
+        if (strcmp(initrd_files[i-1].name, initrd_files[i].name) > 0) break;
+    }
+    if (i < n && pk_sort(n) != 0) { /* not sorted by the packer */
+        printk("\nramfs: no memory to sort %u initrd entries, packaged files unavailable", n);
+        pk_failed = -1;
+        return pk_failed;
+    }
+    pk_bytes = kmalloc((n + 1) * sizeof(*pk_bytes));
+    pk_files = kmalloc((n + 1) * sizeof(*pk_files));
+    if (!pk_bytes || !pk_files) return 0;
+    pk_bytes[0] = 0;
+    pk_files[0] = 0;
+    for (i = 0; i < n; ++i) {
+        const struct fs_file *f = pk_entry(i);
+        pk_bytes[i+1] = pk_bytes[i] + (f->data ? f->size : 0);
+        pk_files[i+1] = pk_files[i] + (f->data ? 1 : 0);
+    }
+    return 0;
+}
 
-int fs_mount_initrd_embedded(void)
+/* Initialise the usage record of a packaged directory from its range. */
+static void usage_init_packaged(uint32_t dir)
 {
-    /* clear fd table */
-    for (int i = 0; i < MAX_FDS; ++i) fd_table[i].used = 0;
-    /* clear overlay */
-    for (int i = 0; i < OVERLAY_MAX_FILES; ++i) overlay[i].used = 0;
-    /* rebuild tree helper state if needed */
-    if (ram_root) { node_free_recursive(ram_root); ram_root = NULL; }
-    build_tree_from_initrd_if_needed();
-    /* sanity check: at least zero files ok */
-    return FS_OK;
+    struct ram_node *d = rn(dir);
+    struct ram_usage *u = node_usage(d);
+    if (!pk_bytes || !pk_files) return;
+    u->bytes = pk_bytes[d->u.range.hi] - pk_bytes[d->u.range.lo];
+    u->files = pk_files[d->u.range.hi] - pk_files[d->u.range.lo];
 }
 
-static const struct fs_file *find_file(const char *path)
+/* First index in [lo, hi) whose name does not start with prefix[0..plen).
+ * Entries sharing the prefix are contiguous because the index is sorted. */
+static unsigned int pk_prefix_end(unsigned int lo, unsigned int hi, const char *prefix, size_t plen)
 {
-    /* overlay entries take precedence */
-    int oi = overlay_find(path);
-    if (oi >= 0) {
-        /* construct a temporary fs_file mapping to overlay data */
-        static struct fs_file temp;
-        temp.name = overlay[oi].name;
-        temp.data = overlay[oi].data;
-        temp.size = overlay[oi].size;
-        temp.uid = overlay[oi].uid;
-        temp.gid = overlay[oi].gid;
-        temp.mode = overlay[oi].mode;
-        return &temp;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (strncmp(pk_entry(mid)->name, prefix, plen) == 0) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
 
-    /* Next, consult the in-memory node tree (built from packaged entries
-     * and updated when overlay entries are created). This lets us return
-     * either overlay-backed nodes or packaged nodes represented in the tree. */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (n) {
-        static struct fs_file temp;
-        /* prefer node-owned data if present */
-        if (n->data) {
-            temp.name = node_fullpath(n); /* returns owned buffer? we'll implement stack-safe version below */
-            /* node_fullpath will write into a static buffer */
-            temp.data = n->data;
-            temp.size = n->size;
-            temp.uid = n->uid;
-            temp.gid = n->gid;
-            temp.mode = n->mode;
-            return &temp;
-        }
-        if (n->packaged) return n->packaged;
+/* Whether some packaged entry starts with key[0..klen) followed by next. */
+static int pk_has(const char *key, size_t klen, char next)
+{
+    unsigned int lo = 0, hi = initrd_files_count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        const char *name = pk_entry(mid)->name;
+        int c = strncmp(name, key, klen);
+        if (c == 0) c = (unsigned char)name[klen] - (unsigned char)next;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
     }
+    if (lo == initrd_files_count) return 0;
+    const char *name = pk_entry(lo)->name;
+    return strncmp(name, key, klen) == 0 && name[klen] == next;
+}
 
-    /* fallback: scan packaged initrd entries (compat) */
-    for (unsigned int i = 0; i < initrd_files_count; ++i) {
-        if (initrd_files[i].name && strcmp(initrd_files[i].name, path) == 0) return &initrd_files[i];
-    }
-    return NULL;
+/* Whether path is a packaged file or directory. */
+static int pk_path(const char *path)
+{
+    if (pk_index_init() != 0) return 0;
+    size_t len = strlen(path);
+    return pk_has(path, len, '\0') || pk_has(path, len, '/');
 }
 
-fs_fd_t fs_open(const char *path, int flags)
+/* Packaged file backing a node, or NULL for runtime-only nodes. */
+static const struct fs_file *node_packaged(const struct ram_node *n)
 {
-    const struct fs_file *f = find_file(path);
-    if (!f) return FS_ENOENT;
-    for (int i = 0; i < MAX_FDS; ++i) {
-        if (!fd_table[i].used) {
-            fd_table[i].used = 1;
-            fd_table[i].f = f;
-            fd_table[i].pos = 0;
-            fd_table[i].flags = flags;
-            return i;
-        }
-    }
-    return FS_EMFILE; /* no descriptors */
+    if ((n->flags & RN_DIR) || n->u.pk == 0) return NULL;
+    return pk_entry(n->u.pk - 1);
 }
 
-/* Phase 2: create a file in the overlay. Overwrites if exists. */
-int fs_create(const char *path, const uint8_t *data, size_t size)
-{
-    int oi = overlay_find(path);
-    if (oi >= 0) {
-        /* replace existing */
-        kfree(overlay[oi].data);
-        overlay[oi].data = NULL;
-        if (size) {
-            overlay[oi].data = kmalloc(size);
-            if (!overlay[oi].data) return FS_EIO;
-            memcpy(overlay[oi].data, (void *)data, size);
-            overlay[oi].size = size;
+/* Contiguous packaged data of a node that has not been copied up yet. */
+static const uint8_t *node_data(const struct ram_node *n)
+{
+    if (n->flags & RN_OVERLAY) return NULL;
+    const struct fs_file *f = node_packaged(n);
+    return f ? f->data : NULL;
+}
+
+static size_t node_size(const struct ram_node *n)
+{
+    if (n->flags & RN_DIR) return 0;
+    if (n->flags & RN_OVERLAY) return n->size;
+    const struct fs_file *f = node_packaged(n);
+    return f ? f->size : 0;
+}
+
+/* Expand the immediate packaged children of a directory node. Subdirectories
+ * are created unloaded and carry their own sub-range, so the cost of a lookup
+ * is proportional to the entries of the directories actually visited.
+ * Expansion does not change what the directory contains, so it is done in
+ * place even on frozen nodes; the new children inherit the directory's
+ * generation and are frozen along with it. */
+static void dir_materialize(uint32_t dir)
+{
+    if (dir == RAM_NIL || (rn(dir)->flags & RN_LOADED)) return;
+    rn(dir)->flags |= RN_LOADED;
+    pk_index_init();
+    unsigned int i = rn(dir)->u.range.lo;
+    unsigned int hi = rn(dir)->u.range.hi;
+    size_t off = rn(dir)->pk_off;
+    while (i < hi) {
+        const struct fs_file *f = pk_entry(i);
+        const char *comp = f->name + off;
+        const char *slash = strchr(comp, '/');
+        size_t len = slash ? (size_t)(slash - comp) : strlen(comp);
+        if (len == 0 || len > 127) { i++; continue; }
+        char name[128];
+        memcpy(name, comp, len);
+        name[len] = '\0';
+        if (slash) {
+            /* intermediate directory: claim every entry below it */
+            size_t plen = off + len + 1;
+            unsigned int end = pk_prefix_end(i, hi, f->name, plen);
+            uint32_t sub = node_create(name, 1);
+            if (sub != RAM_NIL) {
+                rn(sub)->u.range.lo = i;
+                rn(sub)->u.range.hi = end;
+                rn(sub)->pk_off = (uint16_t)plen;
+                rn(sub)->flags &= ~RN_LOADED;
+                rn(sub)->gen = rn(dir)->gen;
+                usage_init_packaged(sub);
+                if (ni_ready) node_usage(rn(sub))->name_ent = ni_find(node_usage(rn(dir))->name_ent, name, len);
+                attach_node(dir, sub);
+            }
+            i = end;
         } else {
-            overlay[oi].size = 0;
+            /* packaged names are unique and an unloaded directory has no
+             * other children yet, so no duplicate check is needed */
+            uint32_t n = node_create(name, f->data == NULL ? 1 : 0);
+            if (n != RAM_NIL) {
+                if (!(rn(n)->flags & RN_DIR)) rn(n)->u.pk = i + 1;
+                else if (ni_ready) node_usage(rn(n))->name_ent = ni_find(node_usage(rn(dir))->name_ent, name, len);
+                rn(n)->gen = rn(dir)->gen;
+                attach_node(dir, n);
+            }
+            i++;
         }
-        return FS_OK;
-    }
-    int idx = overlay_alloc(path, data, size, 0);
-    if (idx >= 0) {
-        /* insert node in tree for this overlay-backed file */
-        insert_overlay_node_for_index(path, idx, 0);
-        return FS_OK;
     }
-    return FS_EMFILE;
 }
 
-/* write to an open file descriptor (append). */
-int fs_write(fs_fd_t fd, const void *buf, size_t count)
+/* Create the root node of the tree. The packaged entries are not walked here:
+ * the root covers the whole sorted index and is expanded on first lookup. */
+static void build_tree_from_initrd_if_needed(void)
 {
-    if (fd < 0 || fd >= MAX_FDS) return FS_EINVAL;
-    if (!fd_table[fd].used) return FS_EINVAL;
-    const struct fs_file *f = fd_table[fd].f;
-    /* only overlay files are writable */
-    int oi = overlay_find(f->name);
-    if (oi < 0) return FS_EIO;
-    size_t newsize = overlay[oi].size + count;
-    uint8_t *ndata = krealloc(overlay[oi].data, overlay[oi].size, newsize);
-    if (!ndata) return FS_EIO;
-    memcpy(ndata + overlay[oi].size, (void *)buf, count);
-    overlay[oi].data = ndata;
-    overlay[oi].size = newsize;
-    fd_table[fd].pos = overlay[oi].size; /* move pos to end */
-    return (int)count;
+    if (ram_root != RAM_NIL) return;
+    ram_root = node_create("/", 1);
+    if (ram_root == RAM_NIL) return;
+    rn(ram_root)->u.range.lo = 0;
+    rn(ram_root)->u.range.hi = initrd_files_count;
+    rn(ram_root)->pk_off = 1;
+    rn(ram_root)->flags &= ~RN_LOADED;
+    if (pk_index_init() != 0) rn(ram_root)->u.range.hi = 0;
+    usage_init_packaged(ram_root);
 }
 
-int fs_unlink(const char *path)
+static void *krealloc(void *old, size_t oldsz, size_t newsz)
 {
-    int oi = overlay_find(path);
-    if (oi < 0) return FS_ENOENT;
-    overlay_free(oi);
-    /* update tree: if a node exists for this path, remove overlay backing */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (n) {
-        /* if packaged exists, restore packaged backing; otherwise remove node */
-        if (n->packaged) {
-            n->data = NULL;
-            n->size = n->packaged->size;
+    void *n = kmalloc(newsz);
+    if (!n) return NULL;
+    if (old && oldsz) memcpy(n, old, oldsz < newsz ? oldsz : newsz);
+    if (old) kfree(old);
+    return n;
+}
+
+/*
+ * Name index.
+ *
+ * Every path of the live tree is an entry (parent entry, basename). Entries
+ * are hashed by (parent, name) for updates and listed in a table sorted by
+ * basename, so find narrows a pattern's literal prefix by binary search and
+ * tests each distinct basename once. Entries do not reference nodes: path
+ * copying and lazy expansion leave them alone, and renaming a directory only
+ * rewrites its own entry. Removed entries are flagged and their descendants
+ * dropped when the table is next sorted. The index is built from the live
+ * tree on first use, indexing unexpanded packaged directories straight from
+ * the sorted initrd table, and rebuilt after a snapshot is restored.
+ */
+#define NI_USED   0x01
+#define NI_DIR    0x02
+#define NI_DEAD   0x04 /* removed, descendants pending */
+#define NI_HASHED 0x08
+#define NI_LIVE   0x10 /* scratch flags used while compacting */
+#define NI_GONE   0x20
+
+/* index-private string storage, reset when the index is rebuilt */
+#define NI_STR_CHUNK 65536
+#define NI_STR_MAX_CHUNKS 256
+
+struct ni_entry {
+    const char *name; /* NUL terminated */
+    uint32_t parent;  /* entry of the containing directory, 0 for the root */
+    uint32_t hnext;   /* hash chain, or free list */
+    uint16_t name_len;
+    uint16_t flags;
+};
+
+static struct ni_entry *ni_ents = NULL; /* slot 0 unused */
+static uint32_t ni_cap = 0;
+static uint32_t ni_next_unused = 1;
+static uint32_t ni_free_list = 0;
+static uint32_t ni_count = 0;
+static uint32_t *ni_heads = NULL;
+static uint32_t ni_hsize = 0;
+static uint32_t *ni_sorted = NULL; /* [0, ni_nsorted) sorted, rest appended */
+static uint32_t ni_sorted_cap = 0;
+static uint32_t ni_nsorted = 0;
+static uint32_t ni_len = 0;
+static uint32_t ni_dead = 0;
+static int ni_resort = 0; /* a name changed: the whole table needs sorting */
+static int ni_ready = 0;
+
+static char *ni_str_chunks[NI_STR_MAX_CHUNKS];
+static uint32_t ni_str_count = 0;
+static uint32_t ni_str_cur = 0;
+static uint32_t ni_str_used = NI_STR_CHUNK;
+
+static const char *ni_strdup(const char *s, size_t len)
+{
+    if (ni_str_used + len + 1 > NI_STR_CHUNK) {
+        if (ni_str_cur + 1 < ni_str_count) {
+            ni_str_cur++;
         } else {
-            remove_node(n);
+            if (ni_str_count >= NI_STR_MAX_CHUNKS) return NULL;
+            char *chunk = kmalloc(NI_STR_CHUNK);
+            if (!chunk) return NULL;
+            ni_str_chunks[ni_str_count] = chunk;
+            ni_str_cur = ni_str_count++;
         }
+        ni_str_used = 0;
     }
-    return FS_OK;
+    char *dst = ni_str_chunks[ni_str_cur] + ni_str_used;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    ni_str_used += len + 1;
+    return dst;
 }
 
-int fs_mkdir(const char *path)
+static uint32_t ni_hash(uint32_t parent, const char *name, size_t len)
 {
-    /* very small behaviour: create an overlay directory entry */
-    int oi = overlay_find(path);
-    if (oi >= 0) return FS_OK; /* already exists */
-    int idx = overlay_alloc(path, NULL, 0, 1);
-    if (idx >= 0) {
-        insert_overlay_node_for_index(path, idx, 1);
-        return FS_OK;
+    uint32_t h = 2166136261u ^ (parent * 16777619u);
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
     }
-    return FS_EMFILE;
+    return h;
 }
 
-int fs_read(fs_fd_t fd, void *buf, size_t count)
+static void ni_hash_insert(uint32_t e)
 {
-    if (fd < 0 || fd >= MAX_FDS) return FS_EINVAL;
-    if (!fd_table[fd].used) return FS_EINVAL;
-    const struct fs_file *f = fd_table[fd].f;
-    size_t remain = f->size - fd_table[fd].pos;
-    size_t need = (count < remain) ? count : remain;
-    if (need == 0) return 0;
-    memcpy(buf, f->data + fd_table[fd].pos, need);
-    fd_table[fd].pos += need;
-    return (int)need;
+    struct ni_entry *n = &ni_ents[e];
+    uint32_t b = ni_hash(n->parent, n->name, n->name_len) & (ni_hsize - 1);
+    n->hnext = ni_heads[b];
+    ni_heads[b] = e;
+    n->flags |= NI_HASHED;
 }
 
-int fs_close(fs_fd_t fd)
+static void ni_unhash(uint32_t e)
 {
-    if (fd < 0 || fd >= MAX_FDS) return FS_EINVAL;
-    if (!fd_table[fd].used) return FS_EINVAL;
-    fd_table[fd].used = 0;
-    return FS_OK;
+    struct ni_entry *n = &ni_ents[e];
+    if (!(n->flags & NI_HASHED)) return;
+    uint32_t *slot = &ni_heads[ni_hash(n->parent, n->name, n->name_len) & (ni_hsize - 1)];
+    while (*slot && *slot != e) slot = &ni_ents[*slot].hnext;
+    if (*slot) *slot = n->hnext;
+    n->flags &= ~NI_HASHED;
 }
 
-int fs_stat(const char *path, struct fs_stat *st)
+/* Keep the chains short: double the bucket array once it is full. */
+static int ni_hash_grow(void)
 {
-    /* check overlay first for metadata */
-    int oi = overlay_find(path);
-    if (oi >= 0) {
-        if (st) {
-            st->size = overlay[oi].size;
-            st->is_dir = overlay[oi].is_dir;
-            st->uid = overlay[oi].uid;
-            st->gid = overlay[oi].gid;
-            st->mode = overlay[oi].mode;
-        }
-        return FS_OK;
-    }
-    /* consult node tree (which includes packaged entries) for accurate dir/file info */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (n) {
-        if (st) {
-            st->size = n->data ? n->size : (n->packaged ? n->packaged->size : 0);
-            st->is_dir = n->is_dir ? 1 : 0;
-            st->uid = n->uid; st->gid = n->gid; st->mode = n->mode;
-        }
-        return FS_OK;
+    if (ni_count < ni_hsize) return 0;
+    uint32_t nsize = ni_hsize ? ni_hsize * 2 : 1024;
+    uint32_t *heads = kmalloc(nsize * sizeof(uint32_t));
+    if (!heads) return ni_heads ? 0 : -1;
+    memset(heads, 0, nsize * sizeof(uint32_t));
+    if (ni_heads) kfree(ni_heads);
+    ni_heads = heads;
+    ni_hsize = nsize;
+    for (uint32_t e = 1; e < ni_next_unused; ++e) {
+        if (ni_ents[e].flags & NI_HASHED) ni_hash_insert(e);
     }
-    const struct fs_file *f = find_file(path);
-    if (!f) return FS_ENOENT;
-    if (st) {
-        st->size = f->size;
-        st->is_dir = 0;
-        st->uid = 0; st->gid = 0; st->mode = 0644; /* defaults for packaged files */
+    return 0;
+}
+
+static uint32_t ni_find(uint32_t parent, const char *name, size_t len)
+{
+    if (!ni_hsize) return 0;
+    for (uint32_t e = ni_heads[ni_hash(parent, name, len) & (ni_hsize - 1)]; e; e = ni_ents[e].hnext) {
+        const struct ni_entry *n = &ni_ents[e];
+        if (n->parent == parent && n->name_len == len && memcmp(n->name, name, len) == 0) return e;
     }
-    return FS_OK;
+    return 0;
 }
 
-int fs_chmod(const char *path, unsigned int mode)
+/* Add an entry. stable means name is NUL terminated at len and outlives the
+ * index (packaged names, long names in the node arena), so it is not copied. */
+static uint32_t ni_add(uint32_t parent, const char *name, size_t len, int is_dir, int stable)
 {
-    /* prefer overlay entry */
-    int oi = overlay_find(path);
-    if (oi >= 0) {
-        overlay[oi].mode = mode;
-        /* mirror into node tree */
-        build_tree_from_initrd_if_needed();
-        insert_overlay_node_for_index(path, oi, 0);
-        return FS_OK;
+    if (ni_hash_grow() != 0) return 0;
+    if (ni_len >= ni_sorted_cap) {
+        uint32_t ncap = ni_sorted_cap ? ni_sorted_cap * 2 : HEAP_BLOCK_SIZE / sizeof(uint32_t);
+        uint32_t *ns = krealloc(ni_sorted, ni_sorted_cap * sizeof(uint32_t), ncap * sizeof(uint32_t));
+        if (!ns) return 0;
+        ni_sorted = ns;
+        ni_sorted_cap = ncap;
     }
-    /* try node tree (packaged or overlay-mirrored) */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (n) {
-        n->mode = mode;
-        return FS_OK;
+    const char *str = stable ? name : ni_strdup(name, len);
+    if (!str) return 0;
+    uint32_t e = ni_free_list;
+    if (e) {
+        ni_free_list = ni_ents[e].hnext;
+    } else {
+        if (ni_next_unused >= ni_cap) {
+            uint32_t ncap = ni_cap ? ni_cap * 2 : HEAP_BLOCK_SIZE / sizeof(struct ni_entry);
+            struct ni_entry *ne = krealloc(ni_ents, ni_cap * sizeof(*ne), ncap * sizeof(*ne));
+            if (!ne) return 0;
+            ni_ents = ne;
+            ni_cap = ncap;
+        }
+        e = ni_next_unused++;
     }
-    /* packaged file: create overlay copy to store metadata */
-    const struct fs_file *f = find_file(path);
-    if (!f) return FS_ENOENT;
-    int idx = overlay_alloc(path, f->data, f->size, 0);
-    if (idx < 0) return FS_EIO;
-    overlay[idx].mode = mode;
-    insert_overlay_node_for_index(path, idx, 0);
-    return FS_OK;
+    struct ni_entry *n = &ni_ents[e];
+    n->name = str;
+    n->name_len = (uint16_t)len;
+    n->parent = parent;
+    n->flags = NI_USED | (is_dir ? NI_DIR : 0);
+    ni_hash_insert(e);
+    ni_sorted[ni_len++] = e;
+    ni_count++;
+    return e;
 }
 
-int fs_chown(const char *path, unsigned int uid, unsigned int gid)
+/* Drop an entry; a directory's descendants go with it on the next sort. */
+static void ni_remove(uint32_t e)
 {
-    int oi = overlay_find(path);
-    if (oi >= 0) {
-        overlay[oi].uid = uid;
-        overlay[oi].gid = gid;
-        build_tree_from_initrd_if_needed();
-        insert_overlay_node_for_index(path, oi, 0);
-        return FS_OK;
-    }
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (n) {
-        n->uid = uid; n->gid = gid; return FS_OK;
-    }
-    const struct fs_file *f = find_file(path);
-    if (!f) return FS_ENOENT;
-    int idx = overlay_alloc(path, f->data, f->size, 0);
-    if (idx < 0) return FS_EIO;
-    overlay[idx].uid = uid;
-    overlay[idx].gid = gid;
-    insert_overlay_node_for_index(path, idx, 0);
-    return FS_OK;
+    if (!e || (ni_ents[e].flags & NI_DEAD)) return;
+    ni_unhash(e);
+    ni_ents[e].flags |= NI_DEAD;
+    ni_dead++;
 }
 
-int fs_readdir(unsigned int index, const struct fs_file **out)
+static void ni_move(uint32_t e, uint32_t parent, const char *name)
 {
-    /* first return packaged initrd entries */
-    if (index < initrd_files_count) {
-        if (out) *out = &initrd_files[index];
-        return FS_OK;
-    }
-    /* then overlay entries */
-    unsigned int idx = index - initrd_files_count;
-    unsigned int found = 0;
-    static struct fs_file temp;
-    for (int i = 0; i < OVERLAY_MAX_FILES; ++i) {
-        if (!overlay[i].used) continue;
-        if (found == idx) {
-            if (out) {
-                temp.name = overlay[i].name;
-                temp.data = overlay[i].data;
-                temp.size = overlay[i].size;
-                *out = &temp;
-            }
-            return FS_OK;
+    if (!e) return;
+    struct ni_entry *n = &ni_ents[e];
+    size_t len = strlen(name);
+    ni_unhash(e);
+    if (n->name_len != len || memcmp(n->name, name, len) != 0) {
+        const char *str = ni_strdup(name, len);
+        if (str) {
+            n->name = str;
+            n->name_len = (uint16_t)len;
+            ni_resort = 1;
         }
-        found++;
     }
-    return FS_ENOENT;
+    n->parent = parent;
+    ni_hash_insert(e);
 }
 
-/* Phase 3: list directory entries under `path`. Index enumerates entries.
- * We implement this by scanning overlay for names that start with path + '/'
- * and returning the Nth matching entry (non-recursive single path component).
- */
-int fs_listdir(const char *path, unsigned int index, const struct fs_file **out)
+/* Free removed entries and everything below them. */
+static void ni_compact(void)
 {
-    /* New: use in-memory node tree for directory listing */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *d = find_node_by_path(path);
-    if (!d) return FS_ENOENT;
-    if (!d->is_dir) return FS_ENOENT;
+    for (uint32_t e = 1; e < ni_next_unused; ++e) {
+        if (!(ni_ents[e].flags & NI_USED) || (ni_ents[e].flags & (NI_LIVE | NI_GONE))) continue;
+        /* find the nearest ancestor whose fate is known or that was removed */
+        uint32_t x = e;
+        while (x && !(ni_ents[x].flags & (NI_LIVE | NI_GONE | NI_DEAD))) x = ni_ents[x].parent;
+        int gone = x && (ni_ents[x].flags & (NI_GONE | NI_DEAD));
+        for (uint32_t y = e; y != x; y = ni_ents[y].parent) ni_ents[y].flags |= gone ? NI_GONE : NI_LIVE;
+        if (x && !(ni_ents[x].flags & (NI_LIVE | NI_GONE))) ni_ents[x].flags |= NI_GONE;
+    }
+    for (uint32_t e = 1; e < ni_next_unused; ++e) {
+        struct ni_entry *n = &ni_ents[e];
+        if (!(n->flags & NI_USED)) continue;
+        if (n->flags & NI_GONE) {
+            ni_unhash(e);
+            ft_forget(e);
+            n->flags = 0;
+            n->hnext = ni_free_list;
+            ni_free_list = e;
+            ni_count--;
+        } else {
+            n->flags &= ~NI_LIVE;
+        }
+    }
+    uint32_t out = 0, nsorted = 0;
+    for (uint32_t i = 0; i < ni_len; ++i) {
+        if (!(ni_ents[ni_sorted[i]].flags & NI_USED)) continue;
+        if (i < ni_nsorted) nsorted++;
+        ni_sorted[out++] = ni_sorted[i];
+    }
+    ni_len = out;
+    ni_nsorted = nsorted;
+    ni_dead = 0;
+}
+
+static void ni_sort(uint32_t *a, uint32_t n)
+{
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; ++i) {
+            uint32_t t = a[i];
+            uint32_t j = i;
+            while (j >= gap && strcmp(ni_ents[a[j-gap]].name, ni_ents[t].name) > 0) {
+                a[j] = a[j-gap];
+                j -= gap;
+            }
+            a[j] = t;
+        }
+    }
+}
+
+/* Bring the sorted table up to date before a query: drop removed entries,
+ * sort the entries added since the last query and merge them in. */
+static void ni_prepare(void)
+{
+    if (ni_dead) ni_compact();
+    if (ni_resort) {
+        ni_sort(ni_sorted, ni_len);
+        ni_nsorted = ni_len;
+        ni_resort = 0;
+    }
+    if (ni_nsorted == ni_len) return;
+    ni_sort(ni_sorted + ni_nsorted, ni_len - ni_nsorted);
+    uint32_t *merged = kmalloc(ni_sorted_cap * sizeof(uint32_t));
+    if (!merged) {
+        ni_sort(ni_sorted, ni_len);
+    } else {
+        uint32_t i = 0, j = ni_nsorted, k = 0;
+        while (i < ni_nsorted && j < ni_len) {
+            if (strcmp(ni_ents[ni_sorted[j]].name, ni_ents[ni_sorted[i]].name) < 0) merged[k++] = ni_sorted[j++];
+            else merged[k++] = ni_sorted[i++];
+        }
+        while (i < ni_nsorted) merged[k++] = ni_sorted[i++];
+        while (j < ni_len) merged[k++] = ni_sorted[j++];
+        kfree(ni_sorted);
+        ni_sorted = merged;
+    }
+    ni_nsorted = ni_len;
+}
+
+/* Index the packaged entries [lo, hi) below the directory entry parent.
+ * Names are relative from offset off; the sorted order lets a stack of
+ * open directories replace any lookups. */
+static void ni_index_packaged(unsigned int lo, unsigned int hi, size_t off, uint32_t parent)
+{
+    uint32_t st_ent[RAM_MAX_DEPTH];
+    const char *st_name[RAM_MAX_DEPTH];
+    size_t st_len[RAM_MAX_DEPTH];
+    int depth = 0;
+    for (unsigned int i = lo; i < hi; ++i) {
+        const struct fs_file *f = pk_entry(i);
+        const char *p = f->name + off;
+        int level = 0;
+        for (;;) {
+            const char *slash = strchr(p, '/');
+            size_t len = slash ? (size_t)(slash - p) : strlen(p);
+            if (len == 0 || len > 127) break;
+            int is_dir = slash || f->data == NULL;
+            if (is_dir && level < depth && st_len[level] == len && memcmp(st_name[level], p, len) == 0) {
+                /* directory already open */
+                level++;
+            } else if (!is_dir) {
+                ni_add(level ? st_ent[level-1] : parent, p, len, 0, 1);
+            } else {
+                if (level >= RAM_MAX_DEPTH) break;
+                depth = level;
+                st_ent[depth] = ni_add(level ? st_ent[level-1] : parent, p, len, 1, 0);
+                st_name[depth] = p;
+                st_len[depth] = len;
+                depth++;
+                level++;
+            }
+            if (!slash) break;
+            p = slash + 1;
+        }
+    }
+}
+
+static void ni_index_dir(uint32_t dir, uint32_t ent)
+{
+    const struct ram_node *d = rn(dir);
+    if (!(d->flags & RN_LOADED)) {
+        ni_index_packaged(d->u.range.lo, d->u.range.hi, d->pk_off, ent);
+        return;
+    }
+    for (uint32_t c = d->first_child; c != RAM_NIL; c = rn(c)->next_sibling) {
+        const struct ram_node *n = rn(c);
+        uint32_t e = ni_add(ent, node_name(n), n->name_len, n->flags & RN_DIR, n->flags & RN_LONGNAME);
+        if (e && (n->flags & RN_DIR)) {
+            node_usage(n)->name_ent = e;
+            ni_index_dir(c, e);
+        }
+    }
+}
+
+/* (Re)build the index from the live tree. */
+static void ni_build(void)
+{
+    build_tree_from_initrd_if_needed();
+    if (ram_root == RAM_NIL) return;
+    ni_next_unused = 1;
+    ni_free_list = 0;
+    ni_count = 0;
+    ni_len = 0;
+    ni_nsorted = 0;
+    ni_dead = 0;
+    ni_str_cur = 0;
+    ni_str_used = ni_str_count ? 0 : NI_STR_CHUNK;
+    if (ni_heads) memset(ni_heads, 0, ni_hsize * sizeof(uint32_t));
+    /* entries are renumbered: the full-text index is keyed on them */
+    ft_ready = 0;
+    uint32_t root = ni_add(0, "", 0, 1, 1);
+    if (!root) return;
+    node_usage(rn(ram_root))->name_ent = root;
+    ni_index_dir(ram_root, root);
+    ni_resort = 1;
+    ni_ready = 1;
+}
+
+/* Whether entry e lies at or below entry top. */
+static int ni_below(uint32_t e, uint32_t top)
+{
+    for (uint32_t x = e; x; x = ni_ents[x].parent) {
+        if (ni_ents[x].flags & NI_DEAD) return 0;
+        if (x == top) return 1;
+    }
+    return 0;
+}
+
+static const char *ni_path(uint32_t e)
+{
+    static char buf[1024];
+    uint32_t chain[RAM_MAX_DEPTH + 1];
+    int n = 0;
+    for (uint32_t x = e; x && ni_ents[x].parent && n < RAM_MAX_DEPTH + 1; x = ni_ents[x].parent) chain[n++] = x;
+    if (n == 0) return "/";
+    size_t pos = 0;
+    while (n-- > 0) {
+        const struct ni_entry *ent = &ni_ents[chain[n]];
+        if (pos + 1 + ent->name_len >= sizeof(buf)) break;
+        buf[pos++] = '/';
+        memcpy(buf + pos, ent->name, ent->name_len);
+        pos += ent->name_len;
+    }
+    buf[pos] = '\0';
+    return buf;
+}
+
+/* Entry of an absolute path, 0 if it is not indexed. */
+static uint32_t ni_lookup(const char *path)
+{
+    uint32_t e = node_usage(rn(ram_root))->name_ent;
+    const char *p = path;
+    while (e) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        e = ni_find(e, p, len);
+        p += len;
+    }
+    return e;
+}
+
+static struct dd_block *dd_blocks = NULL; /* slot 0 unused */
+static uint32_t dd_cap = 0;
+static uint32_t dd_next_unused = 1;
+static uint32_t dd_free_list = 0;
+static uint32_t dd_heads[DD_BUCKETS];
+static int dd_enabled = 0;
+static uint32_t dd_unique = 0; /* blocks held by the store */
+static uint32_t dd_refs = 0;   /* page table entries pointing into it */
+
+static inline uint8_t *pte_page(uintptr_t e)
+{
+    if (e & PTE_SHARED) return dd_blocks[e >> 1].page;
+    return (uint8_t *)e;
+}
+
+static void dd_put(uint32_t b)
+{
+    struct dd_block *blk = &dd_blocks[b];
+    if (blk->hashed) dd_refs--;
+    if (--blk->refs) return;
+    if (blk->hashed) {
+        uint32_t *slot = &dd_heads[(blk->hash[0] | blk->hash[1] << 8) % DD_BUCKETS];
+        while (*slot != b) slot = &dd_blocks[*slot].next;
+        *slot = blk->next;
+        dd_unique--;
+    }
+    kfree(blk->page);
+    blk->page = NULL;
+    blk->next = dd_free_list;
+    dd_free_list = b;
+}
+
+static void pte_release(uintptr_t e)
+{
+    if (!e) return;
+    if (e & PTE_SHARED) dd_put((uint32_t)(e >> 1));
+    else kfree((uint8_t *)e);
+}
+
+/* Take a free block store slot, growing the block array if needed. */
+static uint32_t dd_alloc(void)
+{
+    uint32_t b = dd_free_list;
+    if (b) {
+        dd_free_list = dd_blocks[b].next;
+        return b;
+    }
+    if (dd_next_unused >= dd_cap) {
+        uint32_t ncap = dd_cap ? dd_cap * 2 : HEAP_BLOCK_SIZE / sizeof(struct dd_block);
+        struct dd_block *nb = krealloc(dd_blocks, dd_cap * sizeof(*nb), ncap * sizeof(*nb));
+        if (!nb) return 0;
+        dd_blocks = nb;
+        dd_cap = ncap;
+    }
+    return dd_next_unused++;
+}
+
+/* Hand a private page over to the block store. If an identical block is
+ * already stored the page is freed and the existing block referenced.
+ * Returns the new page table entry, or the old one if the store is full. */
+static uintptr_t dd_share(uintptr_t e)
+{
+    if (!e || (e & PTE_SHARED)) return e;
+    uint8_t *page = (uint8_t *)e;
+    uint8_t hash[32];
+    sha256_digest(page, RAM_PAGE_SIZE, hash);
+    uint32_t bucket = (hash[0] | hash[1] << 8) % DD_BUCKETS;
+    for (uint32_t b = dd_heads[bucket]; b; b = dd_blocks[b].next) {
+        struct dd_block *blk = &dd_blocks[b];
+        if (memcmp(blk->hash, hash, sizeof(hash)) == 0 && memcmp(blk->page, page, RAM_PAGE_SIZE) == 0) {
+            blk->refs++;
+            dd_refs++;
+            kfree(page);
+            return ((uintptr_t)b << 1) | PTE_SHARED;
+        }
+    }
+    uint32_t b = dd_alloc();
+    if (!b) return e;
+    struct dd_block *blk = &dd_blocks[b];
+    memcpy(blk->hash, hash, sizeof(hash));
+    blk->page = page;
+    blk->refs = 1;
+    blk->hashed = 1;
+    blk->next = dd_heads[bucket];
+    dd_heads[bucket] = b;
+    dd_unique++;
+    dd_refs++;
+    return ((uintptr_t)b << 1) | PTE_SHARED;
+}
+
+/* Move the private pages [first, last) of a file into the block store. */
+static void pages_dedup(struct ram_pages *pt, uint32_t first, uint32_t last)
+{
+    if (!dd_enabled || !pt) return;
+    if (last > pt->cap) last = pt->cap;
+    for (uint32_t i = first; i < last; ++i) pt->pg[i] = dd_share(pt->pg[i]);
+}
+
+static void pages_free(struct ram_pages *pt)
+{
+    if (!pt) return;
+    for (uint32_t i = 0; i < pt->cap; ++i) pte_release(pt->pg[i]);
+    kfree(pt);
+}
+
+/* Drop one node's reference to a page table. */
+static void pages_put(struct ram_pages *pt)
+{
+    if (pt && --pt->refs == 0) pages_free(pt);
+}
+
+/* Another reference to page pg of pt, for a second page table. A private
+ * page is first moved into an unhashed block of the block store, which
+ * changes how pt refers to it but not its contents. Returns 0 if the store
+ * is full. */
+static uintptr_t pte_share(struct ram_pages *pt, uint32_t pg)
+{
+    uintptr_t e = pt->pg[pg];
+    if (!(e & PTE_SHARED)) {
+        uint32_t b = dd_alloc();
+        if (!b) return 0;
+        struct dd_block *blk = &dd_blocks[b];
+        blk->page = (uint8_t *)e;
+        blk->refs = 1;
+        blk->hashed = 0;
+        blk->next = 0;
+        e = ((uintptr_t)b << 1) | PTE_SHARED;
+        pt->pg[pg] = e;
+    }
+    struct dd_block *blk = &dd_blocks[e >> 1];
+    blk->refs++;
+    if (blk->hashed) dd_refs++;
+    return e;
+}
+
+/* Give n a page table of its own before it is modified. A table still shared
+ * with a snapshot copy is duplicated entry by entry with pte_share, so both
+ * tables reference the same pages without copying any file data. */
+static int pages_own(struct ram_node *n)
+{
+    struct ram_pages *pt = n->pages;
+    if (!pt || pt->refs == 1) return 0;
+    size_t bytes = sizeof(struct ram_pages) + pt->cap * sizeof(uintptr_t);
+    struct ram_pages *np = kmalloc(bytes);
+    if (!np) return -1;
+    for (uint32_t i = 0; i < pt->cap; ++i) {
+        uintptr_t e = pt->pg[i] ? pte_share(pt, i) : 0;
+        if (pt->pg[i] && !e) {
+            for (uint32_t j = 0; j < i; ++j) pte_release(np->pg[j]);
+            kfree(np);
+            return -1;
+        }
+        np->pg[i] = e;
+    }
+    np->cap = pt->cap;
+    np->allocated = pt->allocated;
+    np->refs = 1;
+    pt->refs--;
+    n->pages = np;
+    return 0;
+}
+
+/* Drop every page at or beyond first_pg. */
+static void pages_trim(struct ram_pages *pt, uint32_t first_pg)
+{
+    if (!pt) return;
+    for (uint32_t i = first_pg; i < pt->cap; ++i) {
+        if (pt->pg[i]) { pte_release(pt->pg[i]); pt->pg[i] = 0; pt->allocated--; }
+    }
+}
+
+/* Return a private, writable copy of page pg, allocating a zeroed page for
+ * a hole and breaking sharing for a deduplicated block. A block that was
+ * only shared with a since discarded snapshot is taken back without copying. */
+static uint8_t *page_writable(struct ram_pages *pt, uint32_t pg)
+{
+    uintptr_t e = pt->pg[pg];
+    if (e && !(e & PTE_SHARED)) return (uint8_t *)e;
+    uint8_t *page;
+    if (e && !dd_blocks[e >> 1].hashed && dd_blocks[e >> 1].refs == 1) {
+        struct dd_block *blk = &dd_blocks[e >> 1];
+        page = blk->page;
+        blk->page = NULL;
+        blk->refs = 0;
+        blk->next = dd_free_list;
+        dd_free_list = (uint32_t)(e >> 1);
+        pt->pg[pg] = (uintptr_t)page;
+        return page;
+    }
+    page = kmalloc(RAM_PAGE_SIZE);
+    if (!page) return NULL;
+    if (e) {
+        memcpy(page, pte_page(e), RAM_PAGE_SIZE);
+        dd_put((uint32_t)(e >> 1));
+    } else {
+        memset(page, 0, RAM_PAGE_SIZE);
+        pt->allocated++;
+    }
+    pt->pg[pg] = (uintptr_t)page;
+    return page;
+}
+
+/* Make sure the page table of n is private and has room for npages entries.
+ * Only the pointer array grows; the pages themselves are allocated on write. */
+static int pages_reserve(struct ram_node *n, uint32_t npages)
+{
+    if (pages_own(n) != 0) return -1;
+    uint32_t cap = n->pages ? n->pages->cap : 0;
+    if (npages <= cap) return 0;
+    /* grow to fill whole heap blocks, the allocator rounds up anyway */
+    size_t bytes = sizeof(struct ram_pages) + npages * sizeof(uintptr_t);
+    bytes = (bytes + HEAP_BLOCK_SIZE - 1) / HEAP_BLOCK_SIZE * HEAP_BLOCK_SIZE;
+    uint32_t newcap = (uint32_t)((bytes - sizeof(struct ram_pages)) / sizeof(uintptr_t));
+    size_t oldbytes = n->pages ? sizeof(struct ram_pages) + cap * sizeof(uintptr_t) : 0;
+    struct ram_pages *pt = krealloc(n->pages, oldbytes, bytes);
+    if (!pt) return -1;
+    if (!oldbytes) { pt->allocated = 0; pt->refs = 1; }
+    for (uint32_t i = cap; i < newcap; ++i) pt->pg[i] = 0;
+    pt->cap = newcap;
+    n->pages = pt;
+    return 0;
+}
+
+/* Copy up to count bytes at off into buf; holes read back as zeros. */
+static size_t file_read_at(const struct ram_node *n, size_t off, void *buf, size_t count)
+{
+    size_t size = node_size(n);
+    if (off >= size) return 0;
+    if (count > size - off) count = size - off;
+    const uint8_t *flat = node_data(n);
+    if (flat) {
+        memcpy(buf, flat + off, count);
+        return count;
+    }
+    uint8_t *dst = buf;
+    size_t done = 0;
+    while (done < count) {
+        uint32_t pg = (uint32_t)((off + done) / RAM_PAGE_SIZE);
+        size_t pgoff = (off + done) % RAM_PAGE_SIZE;
+        size_t chunk = RAM_PAGE_SIZE - pgoff;
+        if (chunk > count - done) chunk = count - done;
+        uintptr_t e = (n->pages && pg < n->pages->cap) ? n->pages->pg[pg] : 0;
+        if (e) memcpy(dst + done, pte_page(e) + pgoff, chunk);
+        else memset(dst + done, 0, chunk);
+        done += chunk;
+    }
+    return count;
+}
+
+/* Write count bytes at off into an overlay file, allocating only the pages
+ * actually touched and extending the logical size if needed. Pages that
+ * the write completes are offered to the dedup store. */
+static int file_write_at(struct ram_node *n, size_t off, const void *buf, size_t count)
+{
+    if (count == 0) return 0;
+    if (pages_reserve(n, (uint32_t)((off + count + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE)) != 0) return -1;
+    const uint8_t *src = buf;
+    size_t done = 0;
+    while (done < count) {
+        uint32_t pg = (uint32_t)((off + done) / RAM_PAGE_SIZE);
+        size_t pgoff = (off + done) % RAM_PAGE_SIZE;
+        size_t chunk = RAM_PAGE_SIZE - pgoff;
+        if (chunk > count - done) chunk = count - done;
+        uint8_t *page = page_writable(n->pages, pg);
+        if (!page) return -1;
+        memcpy(page + pgoff, src + done, chunk);
+        done += chunk;
+    }
+    if (off + count > n->size) n->size = (uint32_t)(off + count);
+    pages_dedup(n->pages, (uint32_t)(off / RAM_PAGE_SIZE), (uint32_t)((off + count) / RAM_PAGE_SIZE));
+    return 0;
+}
+
+/* Change the logical size of an overlay file. Growing only records the new
+ * size (the tail is a hole); shrinking frees whole pages past the end and
+ * clears the rest of the last partial page so a later extension reads zeros. */
+static int file_resize(struct ram_node *n, size_t size)
+{
+    if (size > n->size) {
+        n->size = (uint32_t)size;
+        return 0;
+    }
+    if (pages_own(n) != 0) return -1;
+    uint32_t keep = (uint32_t)((size + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE);
+    pages_trim(n->pages, keep);
+    if (n->pages && (size % RAM_PAGE_SIZE) && n->pages->pg[keep-1]) {
+        size_t tail = size % RAM_PAGE_SIZE;
+        uint8_t *page = page_writable(n->pages, keep-1);
+        if (!page) return -1;
+        memset(page + tail, 0, RAM_PAGE_SIZE - tail);
+    }
+    if (size == 0 && n->pages) { pages_put(n->pages); n->pages = NULL; }
+    n->size = (uint32_t)size;
+    return 0;
+}
+
+/* Bytes of memory actually backing a node's contents. A page shared through
+ * the block store, or a page table shared by snapshot copies, is split
+ * between the nodes referencing it, so the charges of all nodes add up to
+ * the memory in use instead of counting a shared page once per reference. */
+static size_t node_allocated(const struct ram_node *n)
+{
+    if (n->flags & RN_DIR) return 0;
+    if (!(n->flags & RN_OVERLAY)) return node_size(n);
+    const struct ram_pages *pt = n->pages;
+    if (!pt) return 0;
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < pt->cap; ++i) {
+        uintptr_t e = pt->pg[i];
+        if (!e) continue;
+        if (e & PTE_SHARED) bytes += RAM_PAGE_SIZE / dd_blocks[e >> 1].refs;
+        else bytes += RAM_PAGE_SIZE;
+    }
+    return bytes / pt->refs;
+}
+
+/* Give a writable file node its own copy of the data (copy-up from the
+ * packaged backing) and mark it as part of the overlay. */
+static int node_make_overlay(uint32_t idx)
+{
+    struct ram_node *n = rn(idx);
+    if (n->flags & RN_OVERLAY) return 0;
+    if (!(n->flags & RN_DIR)) {
+        const struct fs_file *f = node_packaged(n);
+        n->size = 0;
+        if (f && f->size && file_write_at(n, 0, f->data, f->size) != 0) {
+            pages_put(n->pages);
+            n->pages = NULL;
+            n->size = 0;
+            return -1;
+        }
+        if (n->pages) pages_dedup(n->pages, 0, n->pages->cap);
+    }
+    n->flags |= RN_OVERLAY;
+    return 0;
+}
+
+/* Fill a shared fs_file view of a node for callers of the legacy API. Nodes
+ * have no parent links, so the caller supplies the full path. */
+static const struct fs_file *node_as_file(uint32_t idx, const char *path, struct fs_file *out)
+{
+    const struct ram_node *n = rn(idx);
+    out->name = path;
+    out->data = (n->flags & RN_DIR) ? NULL : node_data(n);
+    out->size = (n->flags & RN_DIR) ? 0 : node_size(n);
+    out->uid = n->uid;
+    out->gid = n->gid;
+    out->mode = n->mode | ((n->flags & RN_DIR) ? FS_S_IFDIR : 0);
+    return out;
+}
+
+/* If path names dir itself or something below it, return the rest of path
+ * after dir's components ("" or "/..."); NULL otherwise. */
+static const char *path_within(const char *path, const char *dir)
+{
+    for (;;) {
+        while (*dir == '/') dir++;
+        if (*dir == '\0') return path;
+        while (*path == '/') path++;
+        const char *de = dir, *pe = path;
+        while (*de && *de != '/') de++;
+        while (*pe && *pe != '/') pe++;
+        if (de - dir != pe - path || strncmp(dir, path, (size_t)(de - dir)) != 0) return NULL;
+        dir = de;
+        path = pe;
+    }
+}
+
+/*
+ * Full-text index.
+ *
+ * Maps every word of every regular file to a posting list of (document, word
+ * position). Words are runs of letters, digits and '_', lowercased and cut
+ * to FT_TERM_MAX characters. A document is one version of a file, found
+ * through the file's name index entry: writes only queue the entry, and the
+ * queued files are indexed again as new documents in one batch before the
+ * next search, their previous documents being marked dead. Postings of dead
+ * documents are skipped by queries and squeezed out once they outnumber the
+ * live ones. New documents get increasing ids, so each posting list stays
+ * sorted and AND and phrase queries are merges of sorted lists. The index
+ * is built from the whole tree on the first search and dropped along with
+ * the name index it is keyed on.
+ */
+#define FT_TERM_MAX 31
+#define FT_BLOCK_POSTINGS 7   /* 64-byte posting blocks */
+#define FT_BLOCK_CHUNK 1024   /* blocks per 64 KiB chunk */
+#define FT_MAX_CHUNKS 512
+#define FT_PENDING 0x80000000u
+#define FT_MAX_QUERY_TERMS 16
+
+struct ft_posting {
+    uint32_t doc;
+    uint32_t pos; /* word number within the document */
+};
+
+struct ft_block {
+    uint32_t next;
+    uint32_t n;
+    struct ft_posting p[FT_BLOCK_POSTINGS];
+};
+
+struct ft_term {
+    char text[FT_TERM_MAX + 1];
+    uint32_t hnext;
+    uint32_t head, tail; /* chain of posting blocks, 0 if empty */
+};
+
+struct ft_doc {
+    uint32_t ent;      /* name index entry, 0 once the document is dead */
+    uint32_t postings;
+};
+
+static struct ft_block *ft_chunks[FT_MAX_CHUNKS];
+static uint32_t ft_chunk_count = 0;
+static uint32_t ft_block_next = 1; /* block 0 means none */
+static uint32_t ft_block_free = 0;
+static struct ft_term *ft_terms = NULL; /* slot 0 unused */
+static uint32_t ft_term_cap = 0;
+static uint32_t ft_nterms = 1;
+static uint32_t *ft_heads = NULL;
+static uint32_t ft_hsize = 0;
+static struct ft_doc *ft_docs = NULL; /* slot 0 unused */
+static uint32_t ft_doc_cap = 0;
+static uint32_t ft_ndocs = 1;
+static uint32_t ft_dead_docs = 0;
+static uint32_t *ft_ent_doc = NULL; /* per name index entry: doc | FT_PENDING */
+static uint32_t ft_ent_cap = 0;
+static uint32_t *ft_queue = NULL;   /* entries waiting to be indexed */
+static uint32_t ft_queue_cap = 0;
+static uint32_t ft_queue_len = 0;
+static uint32_t ft_live_postings = 0;
+static uint32_t ft_dead_postings = 0;
+static int ft_ready = 0;
+
+static inline struct ft_block *ft_block(uint32_t b)
+{
+    return &ft_chunks[b / FT_BLOCK_CHUNK][b % FT_BLOCK_CHUNK];
+}
+
+static uint32_t ft_block_alloc(void)
+{
+    uint32_t b = ft_block_free;
+    if (b) {
+        ft_block_free = ft_block(b)->next;
+    } else {
+        if (ft_block_next / FT_BLOCK_CHUNK >= ft_chunk_count) {
+            if (ft_chunk_count >= FT_MAX_CHUNKS) return 0;
+            struct ft_block *chunk = kmalloc(FT_BLOCK_CHUNK * sizeof(struct ft_block));
+            if (!chunk) return 0;
+            ft_chunks[ft_chunk_count++] = chunk;
+        }
+        b = ft_block_next++;
+    }
+    ft_block(b)->next = 0;
+    ft_block(b)->n = 0;
+    return b;
+}
+
+static void ft_block_release(uint32_t b)
+{
+    ft_block(b)->next = ft_block_free;
+    ft_block_free = b;
+}
+
+static uint32_t ft_term_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t ft_term_find(const char *s, size_t len)
+{
+    if (!ft_hsize) return 0;
+    for (uint32_t t = ft_heads[ft_term_hash(s, len) & (ft_hsize - 1)]; t; t = ft_terms[t].hnext) {
+        if (strncmp(ft_terms[t].text, s, len) == 0 && ft_terms[t].text[len] == '\0') return t;
+    }
+    return 0;
+}
+
+/* Find a term or add it with an empty posting list. */
+static uint32_t ft_term_get(const char *s, size_t len)
+{
+    uint32_t t = ft_term_find(s, len);
+    if (t) return t;
+    if (ft_nterms >= ft_hsize) {
+        uint32_t nsize = ft_hsize ? ft_hsize * 2 : 1024;
+        uint32_t *heads = kmalloc(nsize * sizeof(uint32_t));
+        if (!heads) return 0;
+        memset(heads, 0, nsize * sizeof(uint32_t));
+        for (uint32_t i = 1; i < ft_nterms; ++i) {
+            uint32_t b = ft_term_hash(ft_terms[i].text, strlen(ft_terms[i].text)) & (nsize - 1);
+            ft_terms[i].hnext = heads[b];
+            heads[b] = i;
+        }
+        if (ft_heads) kfree(ft_heads);
+        ft_heads = heads;
+        ft_hsize = nsize;
+    }
+    if (ft_nterms >= ft_term_cap) {
+        uint32_t ncap = ft_term_cap ? ft_term_cap * 2 : HEAP_BLOCK_SIZE / sizeof(struct ft_term);
+        struct ft_term *nt = krealloc(ft_terms, ft_term_cap * sizeof(*nt), ncap * sizeof(*nt));
+        if (!nt) return 0;
+        ft_terms = nt;
+        ft_term_cap = ncap;
+    }
+    t = ft_nterms++;
+    memcpy(ft_terms[t].text, s, len);
+    ft_terms[t].text[len] = '\0';
+    ft_terms[t].head = ft_terms[t].tail = 0;
+    uint32_t b = ft_term_hash(s, len) & (ft_hsize - 1);
+    ft_terms[t].hnext = ft_heads[b];
+    ft_heads[b] = t;
+    return t;
+}
+
+static int ft_post(uint32_t t, uint32_t doc, uint32_t pos)
+{
+    uint32_t b = ft_terms[t].tail;
+    if (!b || ft_block(b)->n == FT_BLOCK_POSTINGS) {
+        uint32_t nb = ft_block_alloc();
+        if (!nb) return -1;
+        if (b) ft_block(b)->next = nb;
+        else ft_terms[t].head = nb;
+        ft_terms[t].tail = b = nb;
+    }
+    struct ft_block *blk = ft_block(b);
+    blk->p[blk->n].doc = doc;
+    blk->p[blk->n].pos = pos;
+    blk->n++;
+    return 0;
+}
+
+/* Word splitter state, kept across the buffers of one text. */
+struct ft_scanner {
+    char word[FT_TERM_MAX + 1];
+    size_t len;
+    int in_word;
+    int (*fn)(const char *word, size_t len, void *arg);
+    void *arg;
+};
+
+static int ft_word_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+/* Feed n bytes of text; fn runs for every completed word. At the end of the
+ * text call it once more with final set. Stops early if fn fails. */
+static int ft_scan(struct ft_scanner *sc, const uint8_t *s, size_t n, int final)
+{
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if (ft_word_char(c)) {
+            if (c >= 'A' && c <= 'Z') c = (unsigned char)(c - 'A' + 'a');
+            if (sc->len < FT_TERM_MAX) sc->word[sc->len++] = (char)c;
+            sc->in_word = 1;
+        } else if (sc->in_word) {
+            sc->in_word = 0;
+            if (sc->fn(sc->word, sc->len, sc->arg) != 0) return -1;
+            sc->len = 0;
+        }
+    }
+    if (final && sc->in_word) {
+        sc->in_word = 0;
+        if (sc->fn(sc->word, sc->len, sc->arg) != 0) return -1;
+        sc->len = 0;
+    }
+    return 0;
+}
+
+/* Grow a uint32_t array to hold at least need entries; new entries are 0. */
+static int ft_reserve(uint32_t **a, uint32_t *cap, uint32_t need)
+{
+    if (need <= *cap) return 0;
+    uint32_t ncap = *cap ? *cap : HEAP_BLOCK_SIZE / sizeof(uint32_t);
+    while (ncap < need) ncap *= 2;
+    uint32_t *na = krealloc(*a, *cap * sizeof(uint32_t), ncap * sizeof(uint32_t));
+    if (!na) return -1;
+    memset(na + *cap, 0, (ncap - *cap) * sizeof(uint32_t));
+    *a = na;
+    *cap = ncap;
+    return 0;
+}
+
+static void ft_doc_retire(uint32_t doc)
+{
+    if (!doc || !ft_docs[doc].ent) return;
+    ft_docs[doc].ent = 0;
+    ft_live_postings -= ft_docs[doc].postings;
+    ft_dead_postings += ft_docs[doc].postings;
+    ft_dead_docs++;
+}
+
+/* The file of name index entry ent is gone: its document dies and any
+ * pending reindex is cancelled. Called when the entry is freed. */
+static void ft_forget(uint32_t ent)
+{
+    if (!ft_ready || ent >= ft_ent_cap) return;
+    ft_doc_retire(ft_ent_doc[ent] & ~FT_PENDING);
+    ft_ent_doc[ent] = 0;
+}
+
+/* Queue the file of name index entry ent to be indexed again. */
+static void ft_touch(uint32_t ent)
+{
+    if (!ft_ready || !ent) return;
+    if (ft_reserve(&ft_ent_doc, &ft_ent_cap, ni_cap) != 0 ||
+        ft_reserve(&ft_queue, &ft_queue_cap, ft_queue_len + 1) != 0) {
+        /* cannot track the change: rebuild on the next search */
+        ft_ready = 0;
+        return;
+    }
+    if (ft_ent_doc[ent] & FT_PENDING) return;
+    ft_ent_doc[ent] |= FT_PENDING;
+    ft_queue[ft_queue_len++] = ent;
+}
+
+struct ft_adder {
+    uint32_t doc;
+    uint32_t pos;
+};
+
+static int ft_add_word(const char *word, size_t len, void *arg)
+{
+    struct ft_adder *a = arg;
+    uint32_t t = ft_term_get(word, len);
+    if (!t || ft_post(t, a->doc, a->pos) != 0) return -1;
+    a->pos++;
+    return 0;
+}
+
+/* Index the current contents of file n as a new document for entry ent. */
+static int ft_index_file(uint32_t ent, const struct ram_node *n)
+{
+    if (ft_reserve(&ft_ent_doc, &ft_ent_cap, ni_cap) != 0) return -1;
+    ft_doc_retire(ft_ent_doc[ent] & ~FT_PENDING);
+    ft_ent_doc[ent] = 0;
+    if (ft_ndocs >= ft_doc_cap) {
+        uint32_t ncap = ft_doc_cap ? ft_doc_cap * 2 : HEAP_BLOCK_SIZE / sizeof(struct ft_doc);
+        struct ft_doc *nd = krealloc(ft_docs, ft_doc_cap * sizeof(*nd), ncap * sizeof(*nd));
+        if (!nd) return -1;
+        ft_docs = nd;
+        ft_doc_cap = ncap;
+    }
+    struct ft_adder a = { ft_ndocs++, 0 };
+    struct ft_scanner sc;
+    sc.len = 0;
+    sc.in_word = 0;
+    sc.fn = ft_add_word;
+    sc.arg = &a;
+    uint8_t buf[RAM_PAGE_SIZE];
+    size_t size = node_size(n);
+    int r = 0;
+    for (size_t off = 0; off < size && r == 0; off += sizeof(buf)) {
+        size_t got = file_read_at(n, off, buf, sizeof(buf));
+        r = ft_scan(&sc, buf, got, off + got >= size);
+    }
+    ft_docs[a.doc].ent = ent;
+    ft_docs[a.doc].postings = a.pos;
+    ft_live_postings += a.pos;
+    ft_ent_doc[ent] = a.doc;
+    return r;
+}
+
+static int ft_index_dir(uint32_t dir)
+{
+    dir_materialize(dir);
+    uint32_t de = node_usage(rn(dir))->name_ent;
+    for (uint32_t c = rn(dir)->first_child; c != RAM_NIL; c = rn(c)->next_sibling) {
+        const struct ram_node *n = rn(c);
+        if (n->flags & RN_DIR) {
+            if (ft_index_dir(c) != 0) return -1;
+            continue;
+        }
+        uint32_t e = ni_find(de, node_name(n), n->name_len);
+        if (e && ft_index_file(e, n) != 0) return -1;
+    }
+    return 0;
+}
+
+/* (Re)build the index from the live tree; the name index must be ready. */
+static int ft_build(void)
+{
+    for (uint32_t b = 1; b < ft_block_next; ++b) ft_block(b)->next = 0;
+    ft_block_next = 1;
+    ft_block_free = 0;
+    ft_nterms = 1;
+    if (ft_heads) memset(ft_heads, 0, ft_hsize * sizeof(uint32_t));
+    ft_ndocs = 1;
+    ft_dead_docs = 0;
+    if (ft_ent_doc) memset(ft_ent_doc, 0, ft_ent_cap * sizeof(uint32_t));
+    ft_queue_len = 0;
+    ft_live_postings = 0;
+    ft_dead_postings = 0;
+    ft_ready = 1;
+    if (ft_index_dir(ram_root) != 0) {
+        ft_ready = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Index the queued files. */
+static int ft_flush(void)
+{
+    for (uint32_t i = 0; i < ft_queue_len; ++i) {
+        uint32_t e = ft_queue[i];
+        if (!(ft_ent_doc[e] & FT_PENDING)) continue;
+        ft_ent_doc[e] &= ~FT_PENDING;
+        uint32_t n = find_node_by_path(ni_path(e));
+        if (n == RAM_NIL || (rn(n)->flags & RN_DIR)) {
+            ft_forget(e);
+        } else if (ft_index_file(e, rn(n)) != 0) {
+            ft_ready = 0;
+            return -1;
+        }
+    }
+    ft_queue_len = 0;
+    return 0;
+}
+
+/* Drop the postings of dead documents and renumber the live ones densely,
+ * keeping their order so the posting lists stay sorted. */
+static void ft_purge(void)
+{
+    uint32_t *remap = kmalloc(ft_ndocs * sizeof(uint32_t));
+    if (!remap) return;
+    uint32_t nd = 1;
+    for (uint32_t d = 1; d < ft_ndocs; ++d) {
+        if (!ft_docs[d].ent) { remap[d] = 0; continue; }
+        remap[d] = nd;
+        ft_docs[nd] = ft_docs[d];
+        ft_ent_doc[ft_docs[nd].ent] = nd | (ft_ent_doc[ft_docs[nd].ent] & FT_PENDING);
+        nd++;
+    }
+    ft_ndocs = nd;
+    for (uint32_t t = 1; t < ft_nterms; ++t) {
+        /* compact the chain in place: the write position never passes the
+         * read position */
+        uint32_t wb = ft_terms[t].head, wn = 0;
+        for (uint32_t rb = ft_terms[t].head; rb; ) {
+            const struct ft_block *r = ft_block(rb);
+            uint32_t count = r->n, next = r->next;
+            for (uint32_t i = 0; i < count; ++i) {
+                struct ft_posting p = r->p[i];
+                if (!remap[p.doc]) continue;
+                if (wn == FT_BLOCK_POSTINGS) {
+                    ft_block(wb)->n = wn;
+                    wb = ft_block(wb)->next;
+                    wn = 0;
+                }
+                ft_block(wb)->p[wn].doc = remap[p.doc];
+                ft_block(wb)->p[wn].pos = p.pos;
+                wn++;
+            }
+            rb = next;
+        }
+        uint32_t rest;
+        if (wn == 0) {
+            rest = ft_terms[t].head;
+            ft_terms[t].head = ft_terms[t].tail = 0;
+        } else {
+            ft_block(wb)->n = wn;
+            rest = ft_block(wb)->next;
+            ft_block(wb)->next = 0;
+            ft_terms[t].tail = wb;
+        }
+        while (rest) {
+            uint32_t next = ft_block(rest)->next;
+            ft_block_release(rest);
+            rest = next;
+        }
+    }
+    kfree(remap);
+    ft_dead_docs = 0;
+    ft_dead_postings = 0;
+}
+
+/* Position in a posting list. */
+struct ft_cursor {
+    uint32_t blk;
+    uint32_t i;
+};
+
+static inline const struct ft_posting *ft_at(const struct ft_cursor *c)
+{
+    return c->blk ? &ft_block(c->blk)->p[c->i] : NULL;
+}
+
+static void ft_next(struct ft_cursor *c)
+{
+    if (++c->i >= ft_block(c->blk)->n) {
+        c->blk = ft_block(c->blk)->next;
+        c->i = 0;
+    }
+}
+
+/* Advance to the first posting of a document >= doc, skipping whole
+ * blocks where possible. */
+static void ft_seek(struct ft_cursor *c, uint32_t doc)
+{
+    while (c->blk) {
+        const struct ft_block *b = ft_block(c->blk);
+        if (b->p[b->n - 1].doc >= doc) break;
+        c->blk = b->next;
+        c->i = 0;
+    }
+    const struct ft_posting *p;
+    while ((p = ft_at(c)) && p->doc < doc) ft_next(c);
+}
+
+/* Whether the m terms at c, all positioned on document doc, occur there
+ * as consecutive words. */
+static int ft_phrase(const struct ft_cursor *c, int m, uint32_t doc)
+{
+    struct ft_cursor k[FT_MAX_QUERY_TERMS];
+    for (int j = 0; j < m; ++j) k[j] = c[j];
+    for (const struct ft_posting *p0; (p0 = ft_at(&k[0])) && p0->doc == doc; ft_next(&k[0])) {
+        int j;
+        for (j = 1; j < m; ++j) {
+            uint32_t want = p0->pos + (uint32_t)j;
+            const struct ft_posting *p;
+            while ((p = ft_at(&k[j])) && p->doc == doc && p->pos < want) ft_next(&k[j]);
+            if (!p || p->doc != doc) return 0;
+            if (p->pos != want) break;
+        }
+        if (j == m) return 1;
+    }
+    return 0;
+}
+
+/* Parsed query: the words of all clauses in order; a clause is a quoted
+ * phrase or one unquoted argument. */
+struct ft_query {
+    uint32_t term[FT_MAX_QUERY_TERMS];
+    int clause_len[FT_MAX_QUERY_TERMS + 1];
+    int nterms;
+    int nclauses;
+    int missing; /* a word occurs in no file */
+    int overflow;
+};
+
+static int ft_query_word(const char *word, size_t len, void *arg)
+{
+    struct ft_query *q = arg;
+    if (q->nterms >= FT_MAX_QUERY_TERMS) { q->overflow = 1; return -1; }
+    uint32_t t = ft_term_find(word, len);
+    if (!t || !ft_terms[t].head) q->missing = 1;
+    q->term[q->nterms++] = t;
+    q->clause_len[q->nclauses]++;
+    return 0;
+}
+
+static void ft_parse(const char *s, struct ft_query *q)
+{
+    memset(q, 0, sizeof(*q));
+    struct ft_scanner sc;
+    sc.len = 0;
+    sc.in_word = 0;
+    sc.fn = ft_query_word;
+    sc.arg = q;
+    while (*s && !q->overflow) {
+        while (*s == ' ') s++;
+        if (!*s) break;
+        const char *end;
+        if (*s == '"') {
+            s++;
+            end = strchr(s, '"');
+            if (!end) end = s + strlen(s);
+        } else {
+            end = s;
+            while (*end && *end != ' ') end++;
+        }
+        ft_scan(&sc, (const uint8_t *)s, (size_t)(end - s), 1);
+        if (q->clause_len[q->nclauses]) q->nclauses++;
+        s = *end ? end + 1 : end;
+    }
+}
+
+/* Open files: the backend data of ramfs vnodes (see vfs.h) */
+#define MAX_FDS 16
+struct open_file {
+    uint32_t node;
+    int flags;
+    int used;
+    int written; /* tail page may still be private */
+    int stale;   /* file discarded by fs_restore or lost: calls fail with FS_ESTALE */
+    char path[256]; /* to find the node again after path copying */
+    struct ram_walk walk; /* directories above node for writes, depth < 0 if unknown */
+    uint32_t stamp;  /* ram_tree_stamp when walk was taken */
+    uint32_t ft_ent; /* name index entry, once looked up for the full-text index */
+};
+
+static struct open_file fd_table[MAX_FDS];
+
+/* Node behind an open descriptor. A node frozen by a snapshot may since have
+ * been replaced by a copy in the live tree, so such descriptors are resolved
+ * again by path. Writers also get the node made writable and the walk above
+ * it cached for usage accounting until the tree changes shape. */
+static uint32_t fd_node(struct open_file *of, int writable)
+{
+    if (writable) {
+        if (node_frozen(of->node) || of->walk.depth < 0 || of->stamp != ram_tree_stamp) {
+            uint32_t n = find_node_writable(of->path, &of->walk);
+            if (n == RAM_NIL) { of->walk.depth = -1; return RAM_NIL; }
+            of->node = n;
+            of->stamp = ram_tree_stamp;
+            of->ft_ent = 0;
+        }
+    } else if (node_frozen(of->node)) {
+        uint32_t n = find_node_by_path(of->path);
+        if (n == RAM_NIL) return RAM_NIL;
+        of->node = n;
+    }
+    return of->node;
+}
+
+/* Point every descriptor at the live node for its path, marking those whose
+ * file no longer exists stale. Needed before nodes are collected. */
+static void fd_revalidate(void)
+{
+    for (int i = 0; i < MAX_FDS; ++i) {
+        if (!fd_table[i].used || fd_table[i].stale) continue;
+        uint32_t n = find_node_by_path(fd_table[i].path);
+        if (n == RAM_NIL) fd_table[i].stale = 1;
+        else fd_table[i].node = n;
+    }
+}
+
+/* Mark a node, its subtree and the siblings that follow it. Shared subtrees
+ * and list tails are visited once. */
+static void gc_mark(uint32_t idx)
+{
+    while (idx != RAM_NIL && !(rn(idx)->flags & RN_MARK)) {
+        rn(idx)->flags |= RN_MARK;
+        gc_mark(rn(idx)->first_child);
+        idx = rn(idx)->next_sibling;
+    }
+}
+
+/* Free every node unreachable from the live tree and the kept snapshots. */
+static void ram_gc(void)
+{
+    gc_mark(ram_root);
+    for (int i = 0; i < RAM_MAX_SNAPSHOTS; ++i) {
+        if (snapshots[i].used) gc_mark(snapshots[i].root);
+    }
+    for (uint32_t i = 1; i < node_next_unused; ++i) {
+        struct ram_node *n = rn(i);
+        if (!(n->flags & RN_USED)) continue;
+        if (n->flags & RN_MARK) {
+            n->flags &= ~RN_MARK;
+        } else {
+            pages_put(n->pages);
+            node_release(i);
+        }
+    }
+}
+
+int fs_mount_initrd_embedded(void)
+{
+    /* clear fd table */
+    for (int i = 0; i < MAX_FDS; ++i) fd_table[i].used = 0;
+    /* drop any previous tree and its snapshots; the overlay lives in the same nodes */
+    for (int i = 0; i < RAM_MAX_SNAPSHOTS; ++i) snapshots[i].used = 0;
+    frozen_gen = 0;
+    ram_root = RAM_NIL;
+    ram_gc();
+    ram_dir_stamp++;
+    ram_list_stamp++;
+    ni_ready = 0;
+    ft_ready = 0;
+    build_tree_from_initrd_if_needed();
+    /* sanity check: at least zero files ok */
+    return FS_OK;
+}
+
+static int ramfs_open(void *fs, const char *path, int flags, struct vnode *vn)
+{
+    (void)fs;
+    /* the path is kept to find the node again, so it must fit whole */
+    if (strlen(path) >= sizeof(fd_table[0].path)) return FS_EINVAL;
+    uint32_t n = find_node_by_path(path);
+    if (n == RAM_NIL) return FS_ENOENT;
+    for (int i = 0; i < MAX_FDS; ++i) {
+        if (!fd_table[i].used) {
+            fd_table[i].used = 1;
+            fd_table[i].stale = 0;
+            fd_table[i].node = n;
+            fd_table[i].flags = flags;
+            fd_table[i].written = 0;
+            strcpy(fd_table[i].path, path);
+            fd_table[i].walk.depth = -1;
+            fd_table[i].ft_ent = 0;
+            /* nodes are replaced when they are copied on write, so vn->id
+             * stays 0: there is no stable identity to share vnodes by */
+            vn->priv = &fd_table[i];
+            return FS_OK;
+        }
+    }
+    return FS_EMFILE; /* no descriptors */
+}
+
+/* Phase 2: create a file in the overlay. Overwrites if exists. */
+static int ramfs_create(void *fs, const char *path, const uint8_t *data, size_t size)
+{
+    (void)fs;
+    char base[128];
+    struct ram_walk w;
+    uint32_t parent = find_parent_by_path(path, base, 1, &w);
+    if (parent == RAM_NIL) return FS_EINVAL;
+    uint32_t idx = find_child(parent, base);
+    if (idx != RAM_NIL && (rn(idx)->flags & RN_DIR)) return FS_EINVAL;
+    size_t old = idx != RAM_NIL ? node_size(rn(idx)) : 0;
+    if (size > old && !usage_fits(&w, 0, size - old)) return FS_EDQUOT;
+    unsigned int ev = idx == RAM_NIL ? FS_EV_CREATE | FS_EV_WRITE : FS_EV_WRITE;
+    if (idx == RAM_NIL) {
+        idx = node_create(base, 0);
+        if (idx == RAM_NIL) return FS_EMFILE;
+        attach_node(parent, idx);
+        usage_add(&w, 0, 0, 1);
+        if (ni_ready) ni_add(node_usage(rn(parent))->name_ent, base, strlen(base), 0, 0);
+    } else {
+        idx = child_writable(parent, idx);
+        if (idx == RAM_NIL) return FS_EMFILE;
+    }
+    struct ram_node *n = rn(idx);
+    pages_put(n->pages);
+    n->pages = NULL;
+    n->size = 0;
+    n->flags |= RN_OVERLAY;
+    usage_sub(&w, 0, old, 0);
+    int r = (size && file_write_at(n, 0, data, size) != 0) ? FS_EIO : FS_OK;
+    usage_add(&w, 0, n->size, 0);
+    /* the whole content is known: the partial tail page can be shared too */
+    if (n->pages) pages_dedup(n->pages, 0, n->pages->cap);
+    if (ft_ready) ft_touch(ni_find(node_usage(rn(parent))->name_ent, base, strlen(base)));
+    if (r == FS_OK) journal_log(JOURNAL_CREATE, path, NULL, data, size, 0, 0);
+    fs_notify(ev, path, NULL);
+    return r;
+}
+
+/* write to an open file descriptor (append). */
+static int ramfs_write(struct vnode *vn, const void *buf, size_t count, size_t *end)
+{
+    struct open_file *of = vn->priv;
+    if (!of->used) return FS_EINVAL;
+    if (of->stale) return FS_ESTALE;
+    uint32_t idx = fd_node(of, 1);
+    if (idx == RAM_NIL) return FS_EIO;
+    struct ram_node *n = rn(idx);
+    /* only overlay files are writable */
+    if (!(n->flags & RN_USED) || !(n->flags & RN_OVERLAY) || (n->flags & RN_DIR)) return FS_EIO;
+    const struct ram_walk *w = &of->walk;
+    if (!usage_fits(w, 0, count)) return FS_EDQUOT;
+    size_t old = n->size;
+    int r = file_write_at(n, n->size, buf, count);
+    usage_add(w, 0, n->size - old, 0);
+    if (r != 0) return FS_EIO;
+    *end = n->size;
+    of->written = 1;
+    if (ft_ready) {
+        if (!of->ft_ent) of->ft_ent = ni_lookup(of->path);
+        ft_touch(of->ft_ent);
+    }
+    journal_log(JOURNAL_APPEND, of->path, NULL, buf, count, 0, 0);
+    fs_notify(FS_EV_WRITE, of->path, NULL);
+    return (int)count;
+}
+
+/* Zeros fed to a transform for the holes of a spliced file. */
+static const uint8_t zero_page[RAM_PAGE_SIZE];
+
+/* Append page pg of s to d, which ends on a page boundary, by reference. */
+static int page_append_shared(struct ram_node *d, const struct ram_node *s, uint32_t pg, size_t bytes)
+{
+    uint32_t dpg = (uint32_t)(d->size / RAM_PAGE_SIZE);
+    if (pages_reserve(d, dpg + 1) != 0 || d->pages->pg[dpg]) return -1;
+    uintptr_t e = pte_share(s->pages, pg);
+    if (!e) return -1;
+    d->pages->pg[dpg] = e;
+    d->pages->allocated++;
+    d->size += (uint32_t)bytes;
+    return 0;
+}
+
+/* Append part of one file to another (see fs_splice) without staging the
+ * data anywhere in between. Untransformed whole pages are shared when the
+ * destination ends on a page boundary and holes stay holes; anything else
+ * is copied or transformed from the source page straight into the
+ * destination page, so no byte is touched more than once. */
+static int ramfs_splice(struct vnode *src, size_t *pos, struct vnode *dst, size_t len,
+                        const struct fs_transform *t, size_t *end)
+{
+    struct open_file *sf = src->priv, *df = dst->priv;
+    if (!sf->used || !df->used) return FS_EINVAL;
+    if (sf->stale || df->stale) return FS_ESTALE;
+    uint32_t didx = fd_node(df, 1);
+    uint32_t sidx = fd_node(sf, 0);
+    if (didx == RAM_NIL || sidx == RAM_NIL) return FS_EIO;
+    /* a file spliced onto itself would read back what it writes */
+    if (sidx == didx) return FS_EINVAL;
+    struct ram_node *d = rn(didx);
+    const struct ram_node *s = rn(sidx);
+    if (!(d->flags & RN_USED) || !(d->flags & RN_OVERLAY) || (d->flags & RN_DIR)) return FS_EIO;
+    if (!(s->flags & RN_USED)) return FS_EIO;
+    size_t size = node_size(s);
+    if (*pos >= size) len = 0;
+    else if (len > size - *pos) len = size - *pos;
+    const uint8_t *flat = node_data(s);
+    unsigned int expand = t && t->expand ? t->expand : 1;
+    const struct ram_walk *w = &df->walk;
+    size_t old = d->size, done = 0;
+    int r = FS_OK;
+    while (done < len) {
+        size_t off = *pos + done;
+        uint32_t pg = (uint32_t)(off / RAM_PAGE_SIZE);
+        size_t pgoff = off % RAM_PAGE_SIZE;
+        size_t chunk = RAM_PAGE_SIZE - pgoff;
+        if (chunk > len - done) chunk = len - done;
+        const uint8_t *in = flat ? flat + off : NULL;
+        if (!flat && s->pages && pg < s->pages->cap && s->pages->pg[pg]) in = pte_page(s->pages->pg[pg]) + pgoff;
+        size_t before = d->size;
+        const uint8_t *logged = in;
+        if (!t) {
+            if (!usage_fits(w, 0, chunk)) { r = FS_EDQUOT; break; }
+            if (!in) {
+                /* past the end of d is all zeros, so a hole stays a hole */
+                d->size += (uint32_t)chunk;
+            } else if (flat || pgoff || d->size % RAM_PAGE_SIZE || (chunk < RAM_PAGE_SIZE && off + chunk < size) ||
+                       page_append_shared(d, s, pg, chunk) != 0) {
+                if (file_write_at(d, d->size, in, chunk) != 0) { r = FS_EIO; break; }
+            }
+        } else {
+            /* an expanding transform only gets what is sure to fit the
+             * destination page, or goes through a few bytes on the stack */
+            uint8_t small[64];
+            uint8_t *out = small;
+            size_t room = RAM_PAGE_SIZE - d->size % RAM_PAGE_SIZE;
+            size_t k = (room >= expand ? room : sizeof(small)) / expand;
+            if (k < chunk) chunk = k;
+            if (!usage_fits(w, 0, chunk * expand)) { r = FS_EDQUOT; break; }
+            if (room >= expand) {
+                uint32_t dpg = (uint32_t)(d->size / RAM_PAGE_SIZE);
+                uint8_t *page = pages_reserve(d, dpg + 1) == 0 ? page_writable(d->pages, dpg) : NULL;
+                if (!page) { r = FS_EIO; break; }
+                out = page + d->size % RAM_PAGE_SIZE;
+            }
+            int n = t->run(t->arg, in ? in : zero_page + pgoff, chunk, out);
+            if (n < 0) { r = n; break; }
+            if (out != small) d->size += (uint32_t)n;
+            else if (file_write_at(d, d->size, small, (size_t)n) != 0) { r = FS_EIO; break; }
+            logged = out;
+        }
+        usage_add(w, 0, d->size - before, 0);
+        if (logged) journal_log(JOURNAL_APPEND, df->path, NULL, logged, d->size - before, 0, 0);
+        else journal_log(JOURNAL_TRUNCATE, df->path, NULL, NULL, 0, d->size, 0);
+        done += chunk;
+    }
+    *pos += done;
+    *end = d->size;
+    if (d->size == old) return r;
+    /* pages filled by a transform are complete now */
+    pages_dedup(d->pages, (uint32_t)(old / RAM_PAGE_SIZE), (uint32_t)(d->size / RAM_PAGE_SIZE));
+    df->written = 1;
+    if (ft_ready) {
+        if (!df->ft_ent) df->ft_ent = ni_lookup(df->path);
+        ft_touch(df->ft_ent);
+    }
+    fs_notify(FS_EV_WRITE, df->path, NULL);
+    return r < 0 ? r : (int)(d->size - old);
+}
+
+static int ramfs_unlink(void *fs, const char *path)
+{
+    (void)fs;
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL || idx == ram_root) return FS_ENOENT;
+    if (!(rn(idx)->flags & RN_OVERLAY)) return FS_ENOENT;
+    char base[128];
+    struct ram_walk w;
+    uint32_t parent = find_parent_by_path(path, base, 0, &w);
+    if (parent == RAM_NIL) return FS_EIO;
+    idx = find_child(parent, base);
+    uint64_t bytes;
+    uint32_t files;
+    node_contrib(rn(idx), &bytes, &files);
+    ram_tree_stamp++;
+    if (ni_ready && !node_packaged(rn(idx))) {
+        if (rn(idx)->flags & RN_DIR) ni_remove(node_usage(rn(idx))->name_ent);
+        else ni_remove(ni_find(node_usage(rn(parent))->name_ent, base, strlen(base)));
+    }
+    /* if packaged exists, restore packaged backing; otherwise remove node */
+    if (node_packaged(rn(idx))) {
+        idx = child_writable(parent, idx);
+        if (idx == RAM_NIL) return FS_EIO;
+        struct ram_node *n = rn(idx);
+        pages_put(n->pages);
+        n->pages = NULL;
+        n->size = 0;
+        n->flags &= ~RN_OVERLAY;
+        usage_sub(&w, 0, bytes, 0);
+        usage_add(&w, 0, node_size(n), 0);
+        if (ft_ready) ft_touch(ni_find(node_usage(rn(parent))->name_ent, base, strlen(base)));
+    } else {
+        if (rn(idx)->flags & RN_DIR) ram_dir_stamp++;
+        remove_node(parent, idx);
+        usage_sub(&w, 0, bytes, files);
+    }
+    journal_log(JOURNAL_UNLINK, path, NULL, NULL, 0, 0, 0);
+    fs_notify(FS_EV_UNLINK, path, NULL);
+    return FS_OK;
+}
+
+static int ramfs_mkdir(void *fs, const char *path)
+{
+    (void)fs;
+    char base[128];
+    struct ram_walk w;
+    uint32_t parent = find_parent_by_path(path, base, 1, &w);
+    if (parent == RAM_NIL) return FS_EINVAL;
+    int existed = find_child(parent, base) != RAM_NIL;
+    uint32_t idx = insert_child(parent, base, 1);
+    if (idx == RAM_NIL) return FS_EMFILE;
+    if (!(rn(idx)->flags & RN_DIR)) return FS_EINVAL;
+    if (rn(idx)->flags & RN_OVERLAY) return FS_OK;
+    idx = child_writable(parent, idx);
+    if (idx == RAM_NIL) return FS_EMFILE;
+    rn(idx)->flags |= RN_OVERLAY;
+    journal_log(JOURNAL_MKDIR, path, NULL, NULL, 0, 0, 0);
+    if (!existed) fs_notify(FS_EV_CREATE, path, NULL);
+    return FS_OK;
+}
+
+static int ramfs_read(struct vnode *vn, size_t pos, void *buf, size_t count)
+{
+    struct open_file *of = vn->priv;
+    if (!of->used) return FS_EINVAL;
+    if (of->stale) return FS_ESTALE;
+    uint32_t idx = fd_node(of, 0);
+    if (idx == RAM_NIL) return FS_EIO;
+    const struct ram_node *n = rn(idx);
+    if (!(n->flags & RN_USED)) return FS_EIO;
+    return (int)file_read_at(n, pos, buf, count);
+}
+
+static int ramfs_release(struct vnode *vn)
+{
+    struct open_file *of = vn->priv;
+    if (!of->used) return FS_EINVAL;
+    uint32_t idx = of->written && !of->stale ? fd_node(of, 0) : RAM_NIL;
+    if (idx != RAM_NIL) {
+        /* writer is done: the partial last page is stable now. Sharing
+         * pages does not change the content, so a table also referenced
+         * by a snapshot may be deduplicated in place. */
+        struct ram_node *n = rn(idx);
+        if ((n->flags & RN_USED) && n->pages) pages_dedup(n->pages, 0, n->pages->cap);
+    }
+    of->used = 0;
+    return FS_OK;
+}
+
+static int ramfs_stat(void *fs, const char *path, struct fs_stat *st)
+{
+    (void)fs;
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL) return FS_ENOENT;
+    if (st) {
+        const struct ram_node *n = rn(idx);
+        st->size = (n->flags & RN_DIR) ? 0 : node_size(n);
+        st->allocated = node_allocated(n);
+        st->is_dir = (n->flags & RN_DIR) ? 1 : 0;
+        st->uid = n->uid; st->gid = n->gid;
+        st->mode = n->mode | (st->is_dir ? FS_S_IFDIR : 0);
+    }
+    return FS_OK;
+}
+
+static int ramfs_chmod(void *fs, const char *path, unsigned int mode)
+{
+    (void)fs;
+    if (mode & ~07777u) return FS_EINVAL;
+    if (find_node_by_path(path) == RAM_NIL) return FS_ENOENT;
+    struct ram_walk w;
+    uint32_t idx = find_node_writable(path, &w);
+    if (idx == RAM_NIL) return FS_EIO;
+    rn(idx)->mode = (uint16_t)mode; /* checked against 07777 above */
+    journal_log(JOURNAL_CHMOD, path, NULL, NULL, 0, mode, 0);
+    fs_notify(FS_EV_CHMOD, path, NULL);
+    return FS_OK;
+}
+
+static int ramfs_chown(void *fs, const char *path, unsigned int uid, unsigned int gid)
+{
+    (void)fs;
+    if (find_node_by_path(path) == RAM_NIL) return FS_ENOENT;
+    struct ram_walk w;
+    uint32_t idx = find_node_writable(path, &w);
+    if (idx == RAM_NIL) return FS_EIO;
+    rn(idx)->uid = uid;
+    rn(idx)->gid = gid;
+    journal_log(JOURNAL_CHOWN, path, NULL, NULL, 0, uid, gid);
+    fs_notify(FS_EV_CHMOD, path, NULL);
+    return FS_OK;
+}
+
+/* Depth-first search of the expanded part of the live tree for the index-th
+ * overlay node. path holds the path of dir (len bytes, "" for the root) and
+ * receives the path of the node found. Unexpanded directories only contain
+ * packaged entries and are not entered. */
+static uint32_t overlay_nth(uint32_t dir, char *path, size_t len, unsigned int *index)
+{
+    if (!(rn(dir)->flags & RN_LOADED)) return RAM_NIL;
+    for (uint32_t c = rn(dir)->first_child; c != RAM_NIL; c = rn(c)->next_sibling) {
+        const struct ram_node *n = rn(c);
+        size_t nlen = len + 1 + n->name_len;
+        if (nlen >= 1024) continue;
+        path[len] = '/';
+        memcpy(path + len + 1, node_name(n), n->name_len + 1);
+        if (n->flags & RN_OVERLAY) {
+            if (*index == 0) return c;
+            (*index)--;
+        }
+        if (n->flags & RN_DIR) {
+            uint32_t r = overlay_nth(c, path, nlen, index);
+            if (r != RAM_NIL) return r;
+        }
+    }
+    return RAM_NIL;
+}
+
+static int overlay_walk(uint32_t dir, char *path, size_t len, fs_overlay_cb cb, void *arg)
+{
+    if (!(rn(dir)->flags & RN_LOADED)) return FS_OK;
+    for (uint32_t c = rn(dir)->first_child; c != RAM_NIL; c = rn(c)->next_sibling) {
+        const struct ram_node *n = rn(c);
+        size_t nlen = len + 1 + n->name_len;
+        if (nlen >= 1024) continue;
+        path[len] = '/';
+        memcpy(path + len + 1, node_name(n), n->name_len + 1);
+        int r;
+        if (n->flags & RN_OVERLAY) {
+            struct fs_file f;
+            r = cb(node_as_file(c, path, &f), arg);
+            if (r) return r;
+        }
+        if (n->flags & RN_DIR) {
+            r = overlay_walk(c, path, nlen, cb, arg);
+            if (r) return r;
+        }
+    }
+    return FS_OK;
+}
+
+int fs_overlay_walk(fs_overlay_cb cb, void *arg)
+{
+    static char path[1024];
+    build_tree_from_initrd_if_needed();
+    if (ram_root == RAM_NIL) return FS_OK;
+    return overlay_walk(ram_root, path, 0, cb, arg);
+}
+
+int fs_readdir(unsigned int index, const struct fs_file **out)
+{
+    /* first return packaged initrd entries */
+    if (index < initrd_files_count) {
+        if (out) *out = &initrd_files[index];
+        return FS_OK;
+    }
+    /* then overlay entries of the live tree */
+    unsigned int idx = index - initrd_files_count;
+    static struct fs_file temp;
+    static char path[1024];
+    build_tree_from_initrd_if_needed();
+    if (ram_root == RAM_NIL) return FS_ENOENT;
+    uint32_t n = overlay_nth(ram_root, path, 0, &idx);
+    if (n == RAM_NIL) return FS_ENOENT;
+    if (out) *out = node_as_file(n, path, &temp);
+    return FS_OK;
+}
+
+/* Phase 3: list directory entries under `path`. Index enumerates the
+ * immediate children of the directory node (non-recursive).
+ */
+static int ramfs_listdir(void *fs, const char *path, unsigned int index, const struct fs_file **out)
+{
+    (void)fs;
+    uint32_t d = find_node_by_path(path);
+    if (d == RAM_NIL) return FS_ENOENT;
+    if (!(rn(d)->flags & RN_DIR)) return FS_ENOENT;
     static struct fs_file temp;
+    static char name[1024];
+    /* listings ask for index 0, 1, 2...: resume after the previous entry
+     * while the directory is unchanged, so a full listing is linear */
+    static struct { uint32_t dir, child, stamp; unsigned int index; } cursor;
     unsigned int found = 0;
-    struct ram_node *c = d->first_child;
-    while (c) {
+    dir_materialize(d);
+    uint32_t c = rn(d)->first_child;
+    if (cursor.dir == d && cursor.stamp == ram_list_stamp && cursor.index <= index && cursor.child != RAM_NIL) {
+        found = cursor.index;
+        c = cursor.child;
+    }
+    while (c != RAM_NIL) {
         if (found == index) {
-            temp.name = (char *)node_fullpath(c);
-            if (c->data) {
-                temp.data = c->data;
-                temp.size = c->size;
-            } else if (c->packaged) {
-                temp.data = c->packaged->data;
-                temp.size = c->packaged->size;
-            } else {
-                /* directory or placeholder */
-                temp.data = NULL;
-                temp.size = 0;
-            }
-            if (out) *out = &temp;
+            cursor.dir = d;
+            cursor.child = c;
+            cursor.index = index;
+            cursor.stamp = ram_list_stamp;
+            size_t len = strlen(path);
+            while (len > 0 && path[len-1] == '/') len--;
+            if (len + 1 + rn(c)->name_len >= sizeof(name)) return FS_EINVAL;
+            memcpy(name, path, len);
+            name[len] = '/';
+            strcpy(name + len + 1, node_name(rn(c)));
+            if (out) *out = node_as_file(c, name, &temp);
             return FS_OK;
         }
         found++;
-        c = c->next_sibling;
+        c = rn(c)->next_sibling;
     }
     return FS_ENOENT;
 }
 
-int fs_rename(const char *oldpath, const char *newpath)
+static int ramfs_rename(void *fs, const char *oldpath, const char *newpath)
 {
+    (void)fs;
     /* Only allow renaming overlay-backed entries (packaged files are read-only). */
-    int oi = overlay_find(oldpath);
-    if (oi < 0) return FS_ENOENT;
-    /* ensure no existing destination */
-    int di = overlay_find(newpath);
-    if (di >= 0) return FS_EINVAL;
-    /* update overlay name */
-    char *newname = kstrdup(newpath);
-    if (!newname) return FS_EIO;
-    kfree(overlay[oi].name);
-    overlay[oi].name = newname;
-    /* update node tree if present */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(oldpath);
-    if (n) {
-        /* detach from old parent */
-        detach_node(n);
-        /* set new local name and attach under new parent */
-        /* derive new parent path and basename */
-        char comps[32][128];
-        int c = path_to_components(newpath, comps, 32);
-        if (c <= 0) {
-            /* renaming to root not allowed */
-            return FS_EINVAL;
-        }
-        char *basename = comps[c-1];
-        /* find or create parent node */
-        struct ram_node *parent = ram_root;
-        for (int i = 0; i < c-1; ++i) {
-            struct ram_node *ch = find_child(parent, comps[i]);
-            if (!ch) {
-                /* cannot create intermediate dirs during rename */
-                /* restore original parent by inserting back under old path */
-                insert_child(parent, basename, n->is_dir);
-                return FS_EINVAL;
-            }
-            parent = ch;
+    uint32_t idx = find_node_by_path(oldpath);
+    if (idx == RAM_NIL || idx == ram_root) return FS_ENOENT;
+    if (!(rn(idx)->flags & RN_OVERLAY)) return FS_ENOENT;
+    /* a packaged path cannot go away: the packaged entry would come back
+     * when a checkpoint image is replayed over the initrd */
+    if (pk_path(oldpath)) return FS_EINVAL;
+    /* refuse to move a directory below itself */
+    if (path_within(newpath, oldpath)) return FS_EINVAL;
+    /* ensure no existing destination; intermediate dirs are not created */
+    char base[128];
+    struct ram_walk nw, ow;
+    uint32_t parent = find_parent_by_path(newpath, base, 0, &nw);
+    if (parent == RAM_NIL) return FS_EINVAL;
+    if (find_child(parent, base) != RAM_NIL) return FS_EINVAL;
+    /* making the old parent writable only copies frozen nodes, so the
+     * already writable destination directory stays valid */
+    char obase[128];
+    uint32_t oparent = find_parent_by_path(oldpath, obase, 0, &ow);
+    if (oparent == RAM_NIL) return FS_EIO;
+    idx = child_writable(oparent, find_child(oparent, obase));
+    if (idx == RAM_NIL) return FS_EIO;
+    /* usage only moves between the directories below the common ancestor */
+    int common = 0;
+    while (common < ow.depth && common < nw.depth && ow.dir[common] == nw.dir[common]) common++;
+    uint64_t bytes;
+    uint32_t files;
+    node_contrib(rn(idx), &bytes, &files);
+    if (!usage_fits(&nw, common, bytes)) return FS_EDQUOT;
+    if (detach_node(oparent, idx) != 0) return FS_EIO;
+    if (node_set_name(rn(idx), base) != 0) {
+        attach_node(oparent, idx); /* still under its old name */
+        return FS_EIO;
+    }
+    attach_node(parent, idx);
+    if (ni_ready) {
+        uint32_t e = (rn(idx)->flags & RN_DIR) ? node_usage(rn(idx))->name_ent
+                   : ni_find(node_usage(rn(oparent))->name_ent, obase, strlen(obase));
+        ni_move(e, node_usage(rn(parent))->name_ent, base);
+    }
+    usage_sub(&ow, common, bytes, files);
+    usage_add(&nw, common, bytes, files);
+    ram_tree_stamp++;
+    if (rn(idx)->flags & RN_DIR) ram_dir_stamp++;
+    /* keep descriptors open below the old path pointing at their files */
+    for (int i = 0; i < MAX_FDS; ++i) {
+        const char *rest = fd_table[i].used ? path_within(fd_table[i].path, oldpath) : NULL;
+        if (!rest) continue;
+        char moved[256];
+        if (strlen(newpath) + strlen(rest) >= sizeof(moved)) {
+            fd_table[i].stale = 1; /* the new path does not fit */
+            continue;
         }
-        /* update name */
-        if (n->name) kfree(n->name);
-        n->name = kstrdup(basename);
-        /* attach */
-        n->next_sibling = parent->first_child;
-        parent->first_child = n;
-        n->parent = parent;
+        strcpy(moved, newpath);
+        strcat(moved, rest);
+        strcpy(fd_table[i].path, moved);
     }
+    journal_log(JOURNAL_RENAME, oldpath, newpath, NULL, 0, 0, 0);
+    fs_notify(FS_EV_RENAME, newpath, oldpath);
     return FS_OK;
 }
 
-int fs_truncate(const char *path, size_t size)
+/* Directories still to be copied by fs_copy: source and new directory. */
+struct copy_pair {
+    uint32_t from, to;
+};
+static struct copy_pair *copy_stack = NULL;
+static uint32_t copy_cap = 0;
+
+static int copy_push(uint32_t *depth, uint32_t from, uint32_t to)
 {
-    int oi = overlay_find(path);
-    if (oi >= 0) {
-        if (size == overlay[oi].size) return FS_OK;
-        if (size == 0) {
-            kfree(overlay[oi].data);
-            overlay[oi].data = NULL;
-            overlay[oi].size = 0;
-            /* update node if present */
-            build_tree_from_initrd_if_needed();
-            struct ram_node *n = find_node_by_path(path);
-            if (n) { n->data = NULL; n->size = 0; }
-            return FS_OK;
+    if (*depth >= copy_cap) {
+        uint32_t ncap = copy_cap ? copy_cap * 2 : HEAP_BLOCK_SIZE / sizeof(struct copy_pair);
+        struct copy_pair *ns = krealloc(copy_stack, copy_cap * sizeof(*ns), ncap * sizeof(*ns));
+        if (!ns) return -1;
+        copy_stack = ns;
+        copy_cap = ncap;
+    }
+    copy_stack[*depth].from = from;
+    copy_stack[(*depth)++].to = to;
+    return 0;
+}
+
+static int ramfs_copy(void *fs, const char *src, const char *dst)
+{
+    (void)fs;
+    uint32_t s = find_node_by_path(src);
+    if (s == RAM_NIL || s == ram_root) return FS_ENOENT;
+    /* refuse to copy a directory into itself */
+    if (path_within(dst, src)) return FS_EINVAL;
+    char base[128];
+    struct ram_walk w;
+    uint32_t parent = find_parent_by_path(dst, base, 0, &w);
+    if (parent == RAM_NIL) return FS_EINVAL;
+    if (find_child(parent, base) != RAM_NIL) return FS_EINVAL;
+    uint64_t bytes;
+    uint32_t files;
+    dir_materialize(s);
+    node_contrib(rn(s), &bytes, &files);
+    if (!usage_fits(&w, 0, bytes)) return FS_EDQUOT;
+
+    uint32_t top = node_copy(s, base);
+    if (top == RAM_NIL) return FS_EMFILE;
+    int is_dir = (rn(top)->flags & RN_DIR) != 0;
+    uint32_t ent = ni_ready ? ni_add(node_usage(rn(parent))->name_ent, base, strlen(base), is_dir, 0) : 0;
+    if (is_dir) node_usage(rn(top))->name_ent = ent;
+    else if (ft_ready) ft_touch(ent);
+
+    /* one pass over the source tree; children keep their order */
+    uint32_t depth = 0;
+    int r = (is_dir && copy_push(&depth, s, top) != 0) ? FS_EIO : FS_OK;
+    while (depth > 0 && r == FS_OK) {
+        struct copy_pair pair = copy_stack[--depth];
+        dir_materialize(pair.from);
+        uint32_t *tail = &rn(pair.to)->first_child;
+        for (uint32_t c = rn(pair.from)->first_child; c != RAM_NIL; c = rn(c)->next_sibling) {
+            uint32_t nc = node_copy(c, NULL);
+            if (nc == RAM_NIL) { r = FS_EMFILE; break; }
+            *tail = nc;
+            tail = &rn(nc)->next_sibling;
+            int sub = (rn(nc)->flags & RN_DIR) != 0;
+            if (ni_ready) {
+                const struct ram_node *n = rn(nc);
+                uint32_t e = ni_add(node_usage(rn(pair.to))->name_ent, node_name(n), n->name_len, sub, 0);
+                if (sub) node_usage(rn(nc))->name_ent = e;
+                else if (ft_ready) ft_touch(e);
+            }
+            if (sub && copy_push(&depth, c, nc) != 0) { r = FS_EIO; break; }
         }
-        uint8_t *nptr = krealloc(overlay[oi].data, overlay[oi].size, size);
-        if (!nptr) return FS_EIO;
-        if (size > overlay[oi].size) memset(nptr + overlay[oi].size, 0, size - overlay[oi].size);
-        overlay[oi].data = nptr;
-        overlay[oi].size = size;
-        build_tree_from_initrd_if_needed();
-        struct ram_node *rn = find_node_by_path(path);
-        if (rn) { rn->data = overlay[oi].data; rn->size = overlay[oi].size; }
-        return FS_OK;
     }
-    /* not an overlay file: create overlay copy from packaged and then truncate */
-    const struct fs_file *f = find_file(path);
-    if (!f) return FS_ENOENT;
-    int idx = overlay_alloc(path, f->data, f->size, 0);
-    if (idx < 0) return FS_EIO;
-    /* Now perform truncate on new overlay entry */
-    if (size == 0) {
-        kfree(overlay[idx].data);
-        overlay[idx].data = NULL;
-        overlay[idx].size = 0;
-    } else {
-        uint8_t *n2 = krealloc(overlay[idx].data, overlay[idx].size, size);
-        if (!n2) return FS_EIO;
-        if (size > overlay[idx].size) memset(n2 + overlay[idx].size, 0, size - overlay[idx].size);
-        overlay[idx].data = n2;
-        overlay[idx].size = size;
+    if (r != FS_OK) {
+        node_free_recursive(top);
+        /* the indexes may hold entries of the partial copy */
+        ni_ready = 0;
+        ft_ready = 0;
+        return r;
     }
-    insert_overlay_node_for_index(path, idx, 0);
+    attach_node(parent, top);
+    usage_add(&w, 0, bytes, files);
+    journal_log(JOURNAL_COPY, src, dst, NULL, 0, 0, 0);
+    fs_notify(FS_EV_CREATE, dst, NULL);
+    return FS_OK;
+}
+
+static int ramfs_truncate(void *fs, const char *path, size_t size)
+{
+    (void)fs;
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL) return FS_ENOENT;
+    if (rn(idx)->flags & RN_DIR) return FS_EINVAL;
+    struct ram_walk w;
+    idx = find_node_writable(path, &w);
+    if (idx == RAM_NIL) return FS_EIO;
+    size_t old = node_size(rn(idx));
+    if (size > old && !usage_fits(&w, 0, size - old)) return FS_EDQUOT;
+    /* packaged file: create overlay copy and then truncate */
+    if (node_make_overlay(idx) != 0) return FS_EIO;
+    struct ram_node *n = rn(idx);
+    if (size == n->size) return FS_OK;
+    /* extending leaves a hole: no memory is committed for the new range */
+    if (file_resize(n, size) != 0) return FS_EIO;
+    if (size > old) usage_add(&w, 0, size - old, 0);
+    else usage_sub(&w, 0, old - size, 0);
+    if (ft_ready) ft_touch(ni_lookup(path));
+    journal_log(JOURNAL_TRUNCATE, path, NULL, NULL, 0, (uint32_t)size, 0);
+    fs_notify(FS_EV_WRITE, path, NULL);
     return FS_OK;
 }
 
-int fs_rmdir(const char *path)
+static int ramfs_rmdir(void *fs, const char *path)
 {
+    (void)fs;
     /* Use node tree semantics: only allow removing overlay-created directories that are empty. */
-    build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (!n) return FS_ENOENT;
-    if (!n->is_dir) return FS_EINVAL;
-    /* If node has children, cannot remove */
-    if (n->first_child) return FS_EINVAL;
-    /* If overlay entry exists, remove it */
-    int oi = overlay_find(path);
-    if (oi >= 0 && overlay[oi].is_dir) {
-        overlay_free(oi);
-        /* remove node from tree */
-        remove_node(n);
-        return FS_OK;
-    }
-    /* If only packaged directory existed (no overlay), do not allow removal */
-    return FS_EINVAL;
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL) return FS_ENOENT;
+    if (!(rn(idx)->flags & RN_DIR) || idx == ram_root) return FS_EINVAL;
+    /* If node has children (packaged ones included), cannot remove */
+    dir_materialize(idx);
+    if (rn(idx)->first_child != RAM_NIL) return FS_EINVAL;
+    /* If only packaged directory existed (no overlay), do not allow removal;
+     * nor once it was changed, as with fs_rename */
+    if (!(rn(idx)->flags & RN_OVERLAY) || pk_path(path)) return FS_EINVAL;
+    char base[128];
+    struct ram_walk w;
+    uint32_t parent = find_parent_by_path(path, base, 0, &w);
+    if (parent == RAM_NIL) return FS_EIO;
+    /* an empty directory adds nothing to the usage above it */
+    idx = find_child(parent, base);
+    if (ni_ready) ni_remove(node_usage(rn(idx))->name_ent);
+    remove_node(parent, idx);
+    ram_tree_stamp++;
+    ram_dir_stamp++;
+    journal_log(JOURNAL_RMDIR, path, NULL, NULL, 0, 0, 0);
+    fs_notify(FS_EV_UNLINK, path, NULL);
+    return FS_OK;
+}
+
+const struct vfs_ops ramfs_ops = {
+    .type = "ramfs",
+    .open = ramfs_open,
+    .release = ramfs_release,
+    .read = ramfs_read,
+    .write = ramfs_write,
+    .splice = ramfs_splice,
+    .stat = ramfs_stat,
+    .listdir = ramfs_listdir,
+    .create = ramfs_create,
+    .unlink = ramfs_unlink,
+    .mkdir = ramfs_mkdir,
+    .rmdir = ramfs_rmdir,
+    .rename = ramfs_rename,
+    .truncate = ramfs_truncate,
+    .chmod = ramfs_chmod,
+    .chown = ramfs_chown,
+    .copy = ramfs_copy,
+};
+
+const uint8_t *fs_map(const char *path, size_t *size)
+{
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL || (rn(idx)->flags & RN_DIR)) return NULL;
+    const uint8_t *data = node_data(rn(idx));
+    if (data && size) *size = node_size(rn(idx));
+    return data;
 }
 
 int fs_is_overlay(const char *path)
 {
-    if (overlay_find(path) >= 0) return 1;
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL) return 0;
+    return (rn(idx)->flags & RN_OVERLAY) ? 1 : 0;
+}
+
+int fs_dedup_enable(int on)
+{
+    dd_enabled = on ? 1 : 0;
+    return FS_OK;
+}
+
+int fs_dedup_stats(struct fs_dedup_stats *st)
+{
+    if (!st) return FS_EINVAL;
+    st->enabled = dd_enabled;
+    st->unique_blocks = dd_unique;
+    st->block_refs = dd_refs;
+    st->block_size = RAM_PAGE_SIZE;
+    st->bytes_saved = (size_t)(dd_refs - dd_unique) * RAM_PAGE_SIZE;
+    return FS_OK;
+}
+
+/* Phase 4: snapshots. Taking one is O(1): the current root is recorded and
+ * everything reachable from it becomes frozen, to be copied lazily by the
+ * next mutation on each path. */
+int fs_snapshot(void)
+{
     build_tree_from_initrd_if_needed();
-    struct ram_node *n = find_node_by_path(path);
-    if (n && n->data) return 1;
-    return 0;
+    if (ram_root == RAM_NIL) return FS_EIO;
+    for (int i = 0; i < RAM_MAX_SNAPSHOTS; ++i) {
+        if (snapshots[i].used) continue;
+        snapshots[i].used = 1;
+        snapshots[i].root = ram_root;
+        snapshots[i].gen = fs_epoch;
+        frozen_gen = fs_epoch++;
+        return i + 1;
+    }
+    return FS_EMFILE;
+}
+
+static struct ram_snapshot *snapshot_get(int id)
+{
+    if (id < 1 || id > RAM_MAX_SNAPSHOTS || !snapshots[id-1].used) return NULL;
+    return &snapshots[id-1];
+}
+
+int fs_restore(int id)
+{
+    struct ram_snapshot *s = snapshot_get(id);
+    if (!s) return FS_ENOENT;
+    /* descriptors refer to files of the discarded tree; they stay allocated
+     * until closed so their slots are not reused under them */
+    for (int i = 0; i < MAX_FDS; ++i) fd_table[i].stale = 1;
+    /* the snapshot is kept: the restored tree is frozen and copied on write */
+    ram_root = s->root;
+    ram_gc();
+    ram_dir_stamp++;
+    ram_list_stamp++;
+    /* the name and full-text indexes describe the discarded tree */
+    ni_ready = 0;
+    ft_ready = 0;
+    /* the log cannot express this: persist the whole tree */
+    journal_reset();
+    return FS_OK;
+}
+
+int fs_snapshot_drop(int id)
+{
+    struct ram_snapshot *s = snapshot_get(id);
+    if (!s) return FS_ENOENT;
+    s->used = 0;
+    frozen_gen = 0;
+    for (int i = 0; i < RAM_MAX_SNAPSHOTS; ++i) {
+        if (snapshots[i].used && snapshots[i].gen > frozen_gen) frozen_gen = snapshots[i].gen;
+    }
+    fd_revalidate();
+    ram_tree_stamp++;
+    ram_gc();
+    return FS_OK;
+}
+
+int fs_snapshot_list(unsigned int index, int *id)
+{
+    unsigned int found = 0;
+    for (int i = 0; i < RAM_MAX_SNAPSHOTS; ++i) {
+        if (!snapshots[i].used) continue;
+        if (found++ == index) {
+            if (id) *id = i + 1;
+            return FS_OK;
+        }
+    }
+    return FS_ENOENT;
+}
+
+int fs_usage(const char *path, struct fs_usage *u)
+{
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL) return FS_ENOENT;
+    if (u) {
+        const struct ram_node *n = rn(idx);
+        uint64_t bytes;
+        uint32_t files;
+        node_contrib(n, &bytes, &files);
+        u->bytes = bytes;
+        u->files = files;
+        u->quota = (n->flags & RN_DIR) ? node_usage(n)->quota : 0;
+    }
+    return FS_OK;
+}
+
+int fs_set_quota(const char *path, uint64_t bytes)
+{
+    uint32_t idx = find_node_by_path(path);
+    if (idx == RAM_NIL) return FS_ENOENT;
+    if (!(rn(idx)->flags & RN_DIR)) return FS_EINVAL;
+    struct ram_walk w;
+    idx = find_node_writable(path, &w);
+    if (idx == RAM_NIL) return FS_EIO;
+    node_usage(rn(idx))->quota = bytes;
+    journal_log(JOURNAL_QUOTA, path, NULL, NULL, 0, (uint32_t)bytes, (uint32_t)(bytes >> 32));
+    return FS_OK;
+}
+
+int fs_find(const char *dir, const char *pattern, fs_find_cb cb, void *arg)
+{
+    struct glob g;
+    if (!pattern || glob_compile(&g, pattern) != 0) return FS_EINVAL;
+    uint32_t d = find_node_by_path(dir);
+    if (d == RAM_NIL) return FS_ENOENT;
+    if (!(rn(d)->flags & RN_DIR)) return FS_EINVAL;
+    if (!ni_ready) ni_build();
+    if (!ni_ready) return FS_EIO;
+    ni_prepare();
+    uint32_t top = node_usage(rn(d))->name_ent;
+    /* only names starting with the pattern's literal prefix can match */
+    size_t plen;
+    const char *prefix = glob_prefix(&g, &plen);
+    uint32_t lo = 0, hi = ni_len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strncmp(ni_ents[ni_sorted[mid]].name, prefix, plen) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    int found = 0;
+    const char *last = NULL;
+    int last_match = 0;
+    for (uint32_t i = lo; i < ni_len; ++i) {
+        uint32_t e = ni_sorted[i];
+        const char *name = ni_ents[e].name;
+        if (strncmp(name, prefix, plen) != 0) break;
+        /* equal basenames are adjacent: match each distinct name once */
+        if (!last || strcmp(last, name) != 0) {
+            last = name;
+            last_match = glob_match(&g, name);
+        }
+        if (!last_match || !ni_below(e, top)) continue;
+        found++;
+        if (cb && cb(ni_path(e), (ni_ents[e].flags & NI_DIR) ? 1 : 0, arg)) break;
+    }
+    return found;
+}
+
+int fs_search(const char *query, fs_find_cb cb, void *arg)
+{
+    if (!query) return FS_EINVAL;
+    if (!ni_ready) ni_build();
+    if (!ni_ready) return FS_EIO;
+    /* files below removed directories are forgotten here */
+    if (ni_dead) ni_compact();
+    if (!ft_ready && ft_build() != 0) return FS_EIO;
+    if (ft_flush() != 0) return FS_EIO;
+    if (ft_dead_postings > ft_live_postings + 4096 || ft_dead_docs > ft_ndocs / 2 + 256) ft_purge();
+    struct ft_query q;
+    ft_parse(query, &q);
+    if (q.overflow || q.nterms == 0) return FS_EINVAL;
+    if (q.missing) return 0;
+    struct ft_cursor cur[FT_MAX_QUERY_TERMS];
+    for (int k = 0; k < q.nterms; ++k) {
+        cur[k].blk = ft_terms[q.term[k]].head;
+        cur[k].i = 0;
+    }
+    int found = 0;
+    for (;;) {
+        /* move every list to the highest document any of them is on */
+        uint32_t doc = 0;
+        int k;
+        for (k = 0; k < q.nterms; ++k) {
+            const struct ft_posting *p = ft_at(&cur[k]);
+            if (!p) break;
+            if (p->doc > doc) doc = p->doc;
+        }
+        if (k < q.nterms) break;
+        int agree = 1;
+        for (k = 0; k < q.nterms; ++k) {
+            ft_seek(&cur[k], doc);
+            const struct ft_posting *p = ft_at(&cur[k]);
+            if (!p) break;
+            if (p->doc != doc) agree = 0;
+        }
+        if (k < q.nterms) break;
+        if (!agree) continue;
+        int match = ft_docs[doc].ent != 0;
+        for (int c = 0, first = 0; match && c < q.nclauses; first += q.clause_len[c++]) {
+            if (q.clause_len[c] > 1) match = ft_phrase(&cur[first], q.clause_len[c], doc);
+        }
+        if (match) {
+            found++;
+            if (cb && cb(ni_path(ft_docs[doc].ent), 0, arg)) break;
+        }
+        ft_seek(&cur[0], doc + 1);
+    }
+    return found;
+}
+
+void fs_batch_begin(void)
+{
+    if (batch_depth++ == 0) dir_cache.node = RAM_NIL;
+}
+
+void fs_batch_end(void)
+{
+    if (batch_depth > 0 && --batch_depth == 0) dir_cache.node = RAM_NIL;
 }
@@ -0,0 +1,122 @@
+#include "../include/fs.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+/*
+ * Submission/completion rings for filesystem operations.
+ *
+ * The caller fills submission entries (fs_ring_get_sqe) and hands them over
+ * in one fs_ring_submit call, which runs the whole batch inside
+ * fs_batch_begin/fs_batch_end so the filesystem can reuse directory lookups
+ * between operations. Every entry produces exactly one completion, in
+ * submission order; submit never takes more entries than there is room for
+ * completions, so completions are never lost.
+ *
+ * An entry flagged FS_SQE_LINK starts or continues a chain with the next
+ * entry: once an operation in a chain fails, the rest of the chain is
+ * completed with FS_ECANCELED without running. FS_SQE_FD_LINK makes an
+ * operation use the descriptor opened earlier in its chain instead of
+ * sqe->fd, so open, write and close can be queued together. A chain may
+ * span several submit calls.
+ */
+
+int fs_ring_init(struct fs_ring *r, unsigned int entries)
+{
+    if (!r || entries == 0 || entries > FS_RING_MAX || (entries & (entries - 1))) return FS_EINVAL;
+    memset(r, 0, sizeof(*r));
+    r->sq = kmalloc(entries * sizeof(struct fs_sqe));
+    r->cq = kmalloc(entries * sizeof(struct fs_cqe));
+    if (!r->sq || !r->cq) {
+        fs_ring_free(r);
+        return FS_EIO;
+    }
+    r->entries = entries;
+    r->chain_fd = -1;
+    return FS_OK;
+}
+
+void fs_ring_free(struct fs_ring *r)
+{
+    if (!r) return;
+    if (r->sq) kfree(r->sq);
+    if (r->cq) kfree(r->cq);
+    r->sq = NULL;
+    r->cq = NULL;
+    r->entries = 0;
+}
+
+struct fs_sqe *fs_ring_get_sqe(struct fs_ring *r)
+{
+    if (r->sq_tail - r->sq_head >= r->entries) return NULL;
+    struct fs_sqe *sqe = &r->sq[r->sq_tail++ & (r->entries - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int ring_execute(struct fs_ring *r, const struct fs_sqe *sqe)
+{
+    int fd = (sqe->flags & FS_SQE_FD_LINK) ? r->chain_fd : sqe->fd;
+    switch (sqe->op) {
+    case FS_OP_NOP:
+        return FS_OK;
+    case FS_OP_OPEN: {
+        int res = fs_open(sqe->path, (int)sqe->len);
+        if (res >= 0) r->chain_fd = res;
+        return res;
+    }
+    case FS_OP_CLOSE:
+        return fs_close(fd);
+    case FS_OP_READ:
+        return fs_read(fd, sqe->buf, sqe->len);
+    case FS_OP_WRITE:
+        return fs_write(fd, sqe->buf, sqe->len);
+    case FS_OP_STAT:
+        return fs_stat(sqe->path, (struct fs_stat *)sqe->buf);
+    case FS_OP_CREATE:
+        return fs_create(sqe->path, (const uint8_t *)sqe->buf, sqe->len);
+    case FS_OP_UNLINK:
+        return fs_unlink(sqe->path);
+    case FS_OP_MKDIR:
+        return fs_mkdir(sqe->path);
+    case FS_OP_RMDIR:
+        return fs_rmdir(sqe->path);
+    case FS_OP_RENAME:
+        return fs_rename(sqe->path, (const char *)sqe->buf);
+    case FS_OP_TRUNCATE:
+        return fs_truncate(sqe->path, sqe->len);
+    case FS_OP_CHMOD:
+        return fs_chmod(sqe->path, (unsigned int)sqe->len);
+    default:
+        return FS_EINVAL;
+    }
+}
+
+int fs_ring_submit(struct fs_ring *r)
+{
+    int done = 0;
+    fs_batch_begin();
+    while (r->sq_head != r->sq_tail && r->cq_tail - r->cq_head < r->entries) {
+        const struct fs_sqe *sqe = &r->sq[r->sq_head++ & (r->entries - 1)];
+        int res = r->chain_failed ? FS_ECANCELED : ring_execute(r, sqe);
+        struct fs_cqe *cqe = &r->cq[r->cq_tail++ & (r->entries - 1)];
+        cqe->user_data = sqe->user_data;
+        cqe->res = res;
+        if (sqe->flags & FS_SQE_LINK) {
+            if (res < 0) r->chain_failed = 1;
+        } else {
+            /* end of the chain */
+            r->chain_failed = 0;
+            r->chain_fd = -1;
+        }
+        done++;
+    }
+    fs_batch_end();
+    return done;
+}
+
+int fs_ring_reap(struct fs_ring *r, struct fs_cqe *cqe)
+{
+    if (r->cq_head == r->cq_tail) return 0;
+    *cqe = r->cq[r->cq_head++ & (r->entries - 1)];
+    return 1;
+}
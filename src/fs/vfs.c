@@ -0,0 +1,326 @@
+#include "../include/vfs.h"
+#include "../include/ext2.h"
+#include "../include/procfs.h"
+#include "../include/journal.h"
+#include "../include/bcache.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+struct vfs_mount {
+    char path[128];         /* mount point, "" for the root */
+    size_t len;
+    const struct vfs_ops *ops;
+    void *fs;
+};
+
+struct vfs_file {
+    struct vnode *vn;       /* NULL when the slot is free */
+    size_t pos;
+};
+
+/* Filesystem types fs_mount knows by name. */
+static const struct vfs_ops *const fs_types[] = { &ext2_ops, &procfs_ops };
+
+/* mounts[0] is the ramfs at "/"; the others are kept in mount order. */
+static struct vfs_mount mounts[VFS_MAX_MOUNTS] = { { "", 0, &ramfs_ops, NULL } };
+static unsigned int mount_count = 1;
+
+/* Every vnode has a descriptor, so there are never more vnodes than those. */
+static struct vnode vnodes[VFS_MAX_FDS];
+static struct vfs_file files[VFS_MAX_FDS];
+
+/* The mount responsible for path, with *rest set to the part below its
+ * mount point. */
+static struct vfs_mount *mount_of(const char *path, const char **rest)
+{
+    struct vfs_mount *best = &mounts[0];
+    for (unsigned int i = 1; i < mount_count; ++i) {
+        struct vfs_mount *m = &mounts[i];
+        if (m->len <= best->len || strncmp(path, m->path, m->len) != 0) continue;
+        if (path[m->len] != '\0' && path[m->len] != '/') continue;
+        best = m;
+    }
+    *rest = path + best->len;
+    return best;
+}
+
+static struct vfs_file *file_of(fs_fd_t fd)
+{
+    if (fd < 0 || fd >= VFS_MAX_FDS || !files[fd].vn || !files[fd].vn->mnt) return NULL;
+    return &files[fd];
+}
+
+static void vnode_put(struct vnode *vn)
+{
+    if (--vn->refs > 0) return;
+    if (vn->mnt && vn->mnt->ops->release) vn->mnt->ops->release(vn);
+    vn->mnt = NULL;
+}
+
+fs_fd_t fs_open(const char *path, int flags)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    if (!m->ops->open) return FS_EINVAL;
+    int fd = -1;
+    struct vnode *vn = NULL;
+    for (int i = 0; i < VFS_MAX_FDS; ++i) {
+        if (fd < 0 && !files[i].vn) fd = i;
+        if (!vn && !vnodes[i].refs) vn = &vnodes[i];
+    }
+    if (fd < 0 || !vn) return FS_EMFILE;
+    memset(vn, 0, sizeof(*vn));
+    int r = m->ops->open(m->fs, rest, flags, vn);
+    if (r != FS_OK) return r;
+    vn->mnt = m;
+    vn->refs = 1;
+    /* a file open already keeps its vnode */
+    for (int i = 0; vn->id && i < VFS_MAX_FDS; ++i) {
+        struct vnode *o = &vnodes[i];
+        if (o == vn || !o->refs || o->mnt != m || o->id != vn->id) continue;
+        vnode_put(vn);
+        vn = o;
+        vn->refs++;
+        break;
+    }
+    files[fd].vn = vn;
+    files[fd].pos = 0;
+    return fd;
+}
+
+int fs_read(fs_fd_t fd, void *buf, size_t count)
+{
+    struct vfs_file *f = file_of(fd);
+    if (!f) return FS_EINVAL;
+    int r = f->vn->mnt->ops->read(f->vn, f->pos, buf, count);
+    if (r > 0) f->pos += (size_t)r;
+    return r;
+}
+
+int fs_write(fs_fd_t fd, const void *buf, size_t count)
+{
+    struct vfs_file *f = file_of(fd);
+    if (!f) return FS_EINVAL;
+    const struct vfs_ops *ops = f->vn->mnt->ops;
+    if (!ops->write) return FS_EINVAL;
+    size_t end = f->pos;
+    int r = ops->write(f->vn, buf, count, &end);
+    if (r >= 0) f->pos = end; /* writes append: pos moves to the end */
+    return r;
+}
+
+int fs_splice(fs_fd_t src_fd, fs_fd_t dst_fd, size_t len, const struct fs_transform *t)
+{
+    struct vfs_file *sf = file_of(src_fd), *df = file_of(dst_fd);
+    if (!sf || !df || sf->vn == df->vn) return FS_EINVAL;
+    const struct vfs_ops *ops = df->vn->mnt->ops;
+    unsigned int expand = t && t->expand ? t->expand : 1;
+    if (!ops->write || (t && !t->run) || expand > 64) return FS_EINVAL;
+    if (sf->vn->mnt == df->vn->mnt && ops->splice) {
+        size_t end = df->pos;
+        int r = ops->splice(sf->vn, &sf->pos, df->vn, len, t, &end);
+        if (r >= 0) df->pos = end;
+        return r;
+    }
+    /* through one buffer: an expanding transform writes behind the input */
+    size_t step = VFS_SPLICE_CHUNK / expand;
+    uint8_t *buf = kmalloc(expand > 1 ? VFS_SPLICE_CHUNK + step : VFS_SPLICE_CHUNK);
+    if (!buf) return FS_EIO;
+    uint8_t *out = expand > 1 ? buf + step : buf;
+    const struct vfs_ops *sops = sf->vn->mnt->ops;
+    int total = 0, r = 0;
+    while (len > 0) {
+        r = sops->read(sf->vn, sf->pos, buf, len < step ? len : step);
+        if (r <= 0) break;
+        sf->pos += (size_t)r;
+        len -= (size_t)r;
+        size_t n = (size_t)r;
+        if (t) {
+            r = t->run(t->arg, buf, n, out);
+            if (r < 0) break;
+            n = (size_t)r;
+        }
+        size_t end = df->pos;
+        r = ops->write(df->vn, out, n, &end);
+        if (r < 0) break;
+        df->pos = end;
+        total += (int)n;
+    }
+    kfree(buf);
+    return r < 0 ? r : total;
+}
+
+int fs_close(fs_fd_t fd)
+{
+    if (fd < 0 || fd >= VFS_MAX_FDS || !files[fd].vn) return FS_EINVAL;
+    vnode_put(files[fd].vn);
+    files[fd].vn = NULL;
+    return FS_OK;
+}
+
+int fs_stat(const char *path, struct fs_stat *st)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->stat ? m->ops->stat(m->fs, rest, st) : FS_ENOENT;
+}
+
+int fs_listdir(const char *path, unsigned int index, const struct fs_file **out)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->listdir ? m->ops->listdir(m->fs, rest, index, out) : FS_ENOENT;
+}
+
+int fs_create(const char *path, const uint8_t *data, size_t size)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->create ? m->ops->create(m->fs, rest, data, size) : FS_EINVAL;
+}
+
+int fs_unlink(const char *path)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    /* a mount point stays until it is unmounted */
+    if (m != &mounts[0] && !*rest) return FS_EINVAL;
+    return m->ops->unlink ? m->ops->unlink(m->fs, rest) : FS_EINVAL;
+}
+
+int fs_mkdir(const char *path)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->mkdir ? m->ops->mkdir(m->fs, rest) : FS_EINVAL;
+}
+
+int fs_rmdir(const char *path)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    if (m != &mounts[0] && !*rest) return FS_EINVAL;
+    return m->ops->rmdir ? m->ops->rmdir(m->fs, rest) : FS_EINVAL;
+}
+
+int fs_rename(const char *oldpath, const char *newpath)
+{
+    const char *orest, *nrest;
+    struct vfs_mount *m = mount_of(oldpath, &orest);
+    /* no moves between filesystems, nor of a mount point */
+    if (mount_of(newpath, &nrest) != m) return FS_EINVAL;
+    if (m != &mounts[0] && (!*orest || !*nrest)) return FS_EINVAL;
+    return m->ops->rename ? m->ops->rename(m->fs, orest, nrest) : FS_EINVAL;
+}
+
+int fs_truncate(const char *path, size_t size)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->truncate ? m->ops->truncate(m->fs, rest, size) : FS_EINVAL;
+}
+
+int fs_chmod(const char *path, unsigned int mode)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->chmod ? m->ops->chmod(m->fs, rest, mode) : FS_EINVAL;
+}
+
+int fs_chown(const char *path, unsigned int uid, unsigned int gid)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    return m->ops->chown ? m->ops->chown(m->fs, rest, uid, gid) : FS_EINVAL;
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+    const char *srest, *drest;
+    struct vfs_mount *m = mount_of(src, &srest);
+    /* trees are copied within one filesystem; files elsewhere go through read/create */
+    if (mount_of(dst, &drest) != m) return FS_EINVAL;
+    return m->ops->copy ? m->ops->copy(m->fs, srest, drest) : FS_EINVAL;
+}
+
+/* ---- mount table ---- */
+
+int fs_mount(const char *type, const char *source, const char *path)
+{
+    const struct vfs_ops *ops = NULL;
+    for (size_t i = 0; i < sizeof(fs_types) / sizeof(fs_types[0]); ++i) {
+        if (strcmp(fs_types[i]->type, type) == 0) ops = fs_types[i];
+    }
+    if (!ops) return FS_ENOENT;
+    if (!path || path[0] != '/' || path[1] == '\0' || strlen(path) >= sizeof(mounts[0].path)) return FS_EINVAL;
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    for (unsigned int i = 1; i < mount_count; ++i) {
+        if (mounts[i].len == len && strncmp(mounts[i].path, path, len) == 0) return FS_EINVAL;
+    }
+    if (mount_count >= VFS_MAX_MOUNTS) return FS_EMFILE;
+    struct vfs_mount *m = &mounts[mount_count];
+    memcpy(m->path, path, len);
+    m->path[len] = '\0';
+    m->len = len;
+    void *fs = NULL;
+    int r = ops->mount(source, m->path, &fs);
+    if (r != FS_OK) return r;
+    /* the mount point is a directory of the filesystem below, so listings
+     * of its parent show it */
+    fs_mkdir(m->path);
+    m->ops = ops;
+    m->fs = fs;
+    mount_count++;
+    return FS_OK;
+}
+
+int fs_umount(const char *path)
+{
+    const char *rest;
+    struct vfs_mount *m = mount_of(path, &rest);
+    if (m == &mounts[0] || (*rest && strcmp(rest, "/") != 0)) return FS_EINVAL;
+    /* filesystems mounted below go first */
+    for (unsigned int i = 1; i < mount_count; ++i) {
+        if (mounts[i].len > m->len && strncmp(mounts[i].path, m->path, m->len) == 0 &&
+            mounts[i].path[m->len] == '/') return FS_EINVAL;
+    }
+    /* descriptors still open on it fail from now on */
+    for (int i = 0; i < VFS_MAX_FDS; ++i) {
+        struct vnode *vn = &vnodes[i];
+        if (!vn->refs || vn->mnt != m) continue;
+        if (m->ops->release) m->ops->release(vn);
+        vn->mnt = NULL;
+    }
+    int r = m->ops->unmount ? m->ops->unmount(m->fs) : FS_OK;
+    /* vnodes point at their mount: keep the slots of the others in place */
+    unsigned int last = --mount_count;
+    if (m != &mounts[last]) {
+        for (int i = 0; i < VFS_MAX_FDS; ++i) {
+            if (vnodes[i].refs && vnodes[i].mnt == &mounts[last]) vnodes[i].mnt = m;
+        }
+        *m = mounts[last];
+    }
+    return r;
+}
+
+int fs_mount_info(unsigned int index, const char **path, const char **type)
+{
+    if (index >= mount_count) return FS_ENOENT;
+    if (path) *path = index ? mounts[index].path : "/";
+    if (type) *type = mounts[index].ops->type;
+    return FS_OK;
+}
+
+int fs_sync(void)
+{
+    int err = FS_OK;
+    for (unsigned int i = 0; i < mount_count; ++i) {
+        if (mounts[i].ops->sync && mounts[i].ops->sync(mounts[i].fs) != FS_OK) err = FS_EIO;
+    }
+    /* the ramfs overlay goes to its journal */
+    if (fs_journal_commit() < 0) err = FS_EIO;
+    int written = bcache_sync(NULL);
+    if (written < 0) return FS_EIO;
+    return err == FS_OK ? written : err;
+}
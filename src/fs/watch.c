@@ -0,0 +1,167 @@
+#include "../include/fs.h"
+#include "../include/string.h"
+
+/*
+ * Change notification for filesystem paths.
+ *
+ * Filesystem operations report what they changed through fs_notify(). Each
+ * watch whose path covers the changed path gets an event queued in one
+ * bounded ring shared by all watches. While an event is still queued, more
+ * changes to the same path for the same watch are merged into it by OR-ing
+ * their masks, so a stream of writes costs one slot. When the ring is full,
+ * new events are dropped and the watch that lost them gets a single
+ * FS_EV_OVERFLOW event before its next queued one, telling it to rescan.
+ *
+ * Nothing runs inside the filesystem operation itself: consumers either
+ * pull their events with fs_watch_read() or have their callbacks run by
+ * fs_watch_dispatch(), which the shell calls between commands.
+ */
+#define MAX_WATCHES 16
+#define WATCH_RING 64
+
+struct watch {
+    int used;
+    unsigned int mask;
+    char path[FS_EVENT_PATH];
+    fs_watch_cb cb;
+    void *arg;
+    int overflow; /* events were dropped since the last delivery */
+};
+
+static struct watch watches[MAX_WATCHES];
+static struct fs_event ring[WATCH_RING];
+static unsigned int ring_head = 0;  /* oldest queued event */
+static unsigned int ring_count = 0;
+
+/* Whether path is dir itself or lies below it. */
+static int watch_covers(const char *dir, const char *path)
+{
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len-1] == '/') len--;
+    if (len == 1 && dir[0] == '/') return path[0] == '/';
+    return strncmp(dir, path, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static void copy_path(char *dst, const char *src)
+{
+    strncpy(dst, src ? src : "", FS_EVENT_PATH - 1);
+    dst[FS_EVENT_PATH - 1] = '\0';
+}
+
+static void queue_event(int wd, unsigned int mask, const char *path, const char *from)
+{
+    /* merge with the newest event still queued for the same change target */
+    for (unsigned int i = ring_count; i-- > 0; ) {
+        struct fs_event *ev = &ring[(ring_head + i) % WATCH_RING];
+        if (ev->wd != wd || strncmp(ev->path, path, FS_EVENT_PATH - 1) != 0) continue;
+        if (strncmp(ev->from, from ? from : "", FS_EVENT_PATH - 1) != 0) break;
+        ev->mask |= mask;
+        return;
+    }
+    if (ring_count == WATCH_RING) {
+        watches[wd].overflow = 1;
+        return;
+    }
+    struct fs_event *ev = &ring[(ring_head + ring_count++) % WATCH_RING];
+    ev->wd = wd;
+    ev->mask = mask;
+    copy_path(ev->path, path);
+    copy_path(ev->from, from);
+}
+
+void fs_notify(unsigned int mask, const char *path, const char *from)
+{
+    if (!path) return;
+    for (int i = 0; i < MAX_WATCHES; ++i) {
+        const struct watch *w = &watches[i];
+        if (!w->used || !(w->mask & mask)) continue;
+        if (watch_covers(w->path, path) || (from && watch_covers(w->path, from)))
+            queue_event(i, mask & w->mask, path, from);
+    }
+}
+
+int fs_watch(const char *path, unsigned int mask, fs_watch_cb cb, void *arg)
+{
+    if (!path || path[0] != '/' || strlen(path) >= FS_EVENT_PATH || !(mask & FS_EV_ALL)) return FS_EINVAL;
+    for (int i = 0; i < MAX_WATCHES; ++i) {
+        if (watches[i].used) continue;
+        watches[i].used = 1;
+        watches[i].mask = mask & FS_EV_ALL;
+        strcpy(watches[i].path, path);
+        watches[i].cb = cb;
+        watches[i].arg = arg;
+        watches[i].overflow = 0;
+        return i;
+    }
+    return FS_EMFILE;
+}
+
+int fs_unwatch(int wd)
+{
+    if (wd < 0 || wd >= MAX_WATCHES || !watches[wd].used) return FS_EINVAL;
+    watches[wd].used = 0;
+    /* drop its queued events, keeping the order of the others */
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < ring_count; ++i) {
+        const struct fs_event *ev = &ring[(ring_head + i) % WATCH_RING];
+        if (ev->wd != wd) ring[(ring_head + kept++) % WATCH_RING] = *ev;
+    }
+    ring_count = kept;
+    return FS_OK;
+}
+
+/* Remove the oldest queued event of watch wd into ev. */
+static int take_event(int wd, struct fs_event *ev)
+{
+    if (watches[wd].overflow) {
+        watches[wd].overflow = 0;
+        ev->wd = wd;
+        ev->mask = FS_EV_OVERFLOW;
+        ev->path[0] = '\0';
+        ev->from[0] = '\0';
+        return 1;
+    }
+    for (unsigned int i = 0; i < ring_count; ++i) {
+        if (ring[(ring_head + i) % WATCH_RING].wd != wd) continue;
+        *ev = ring[(ring_head + i) % WATCH_RING];
+        for (unsigned int j = i; j > 0; --j)
+            ring[(ring_head + j) % WATCH_RING] = ring[(ring_head + j - 1) % WATCH_RING];
+        ring_head = (ring_head + 1) % WATCH_RING;
+        ring_count--;
+        return 1;
+    }
+    return 0;
+}
+
+int fs_watch_read(int wd, struct fs_event *ev)
+{
+    if (wd < 0 || wd >= MAX_WATCHES || !watches[wd].used || !ev) return FS_EINVAL;
+    return take_event(wd, ev);
+}
+
+int fs_watch_info(int wd, const char **path, unsigned int *mask)
+{
+    if (wd < 0 || wd >= MAX_WATCHES || !watches[wd].used) return FS_EINVAL;
+    if (path) *path = watches[wd].path;
+    if (mask) *mask = watches[wd].mask;
+    return FS_OK;
+}
+
+void fs_watch_dispatch(void)
+{
+    /* callbacks may change files and queue more events; those are
+     * delivered too, but a callback that keeps retriggering itself cannot
+     * hold the shell forever */
+    struct fs_event ev;
+    int again = 1;
+    for (int round = 0; again && round < WATCH_RING; ++round) {
+        again = 0;
+        for (int i = 0; i < MAX_WATCHES; ++i) {
+            if (!watches[i].used || !watches[i].cb) continue;
+            if (take_event(i, &ev)) {
+                watches[i].cb(&ev, watches[i].arg);
+                again = 1;
+            }
+        }
+    }
+}
@@ -0,0 +1,274 @@
+#include "../include/glob.h"
+#include "../include/fs.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+enum { GT_LIT, GT_ANY, GT_CLASS, GT_STAR };
+
+static void class_set(uint8_t *set, unsigned char c)
+{
+    set[c >> 3] |= (uint8_t)(1u << (c & 7));
+}
+
+static int class_has(const uint8_t *set, unsigned char c)
+{
+    return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+/* Parse a bracket expression starting after '['. Returns the position after
+ * the closing ']' or NULL if it is not terminated. */
+static const char *parse_class(const char *p, uint8_t *set)
+{
+    int negate = 0;
+    if (*p == '!' || *p == '^') { negate = 1; p++; }
+    memset(set, 0, 32);
+    int first = 1;
+    while (*p && (*p != ']' || first)) {
+        unsigned char lo = (unsigned char)*p++;
+        if (lo == '\\' && *p) lo = (unsigned char)*p++;
+        unsigned char hi = lo;
+        if (p[0] == '-' && p[1] && p[1] != ']') {
+            hi = (unsigned char)p[1];
+            p += 2;
+            if (hi == '\\' && *p) hi = (unsigned char)*p++;
+        }
+        for (unsigned int c = lo; c <= hi; ++c) class_set(set, (unsigned char)c);
+        first = 0;
+    }
+    if (*p != ']') return NULL;
+    if (negate) {
+        for (int i = 0; i < 32; ++i) set[i] = (uint8_t)~set[i];
+    }
+    set[0] &= (uint8_t)~1u; /* never match the terminator */
+    return p + 1;
+}
+
+int glob_compile(struct glob *g, const char *pattern)
+{
+    const char *p = pattern;
+    int literal_run = 1;
+    g->ntok = 0;
+    g->nclasses = 0;
+    g->prefix_len = 0;
+    while (*p) {
+        if (g->ntok >= GLOB_MAX_TOKENS) return -1;
+        uint8_t t = g->ntok;
+        if (*p == '*') {
+            p++;
+            literal_run = 0;
+            /* "**" is the same as "*" */
+            if (t > 0 && g->type[t-1] == GT_STAR) continue;
+            g->type[t] = GT_STAR;
+        } else if (*p == '?') {
+            p++;
+            literal_run = 0;
+            g->type[t] = GT_ANY;
+        } else if (*p == '[') {
+            if (g->nclasses >= GLOB_MAX_CLASSES) return -1;
+            const char *end = parse_class(p + 1, g->classes[g->nclasses]);
+            if (!end) return -1;
+            p = end;
+            literal_run = 0;
+            g->type[t] = GT_CLASS;
+            g->arg[t] = g->nclasses++;
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            g->type[t] = GT_LIT;
+            g->arg[t] = (uint8_t)*p++;
+            if (literal_run) g->prefix[g->prefix_len++] = (char)g->arg[t];
+        }
+        g->ntok++;
+    }
+    g->prefix[g->prefix_len] = '\0';
+    return 0;
+}
+
+/* Add the states reachable without consuming input: a '*' may match the
+ * empty string, so a state sitting before one also sits after it. */
+static uint64_t closure(const struct glob *g, uint64_t s)
+{
+    for (int i = 0; i < g->ntok; ++i) {
+        if (((s >> i) & 1) && g->type[i] == GT_STAR) s |= (uint64_t)1 << (i + 1);
+    }
+    return s;
+}
+
+int glob_match(const struct glob *g, const char *name)
+{
+    /* bit i set: the first i tokens match the input consumed so far */
+    uint64_t s = closure(g, 1);
+    for (const unsigned char *c = (const unsigned char *)name; *c && s; ++c) {
+        uint64_t next = 0;
+        for (int i = 0; i < g->ntok; ++i) {
+            if (!((s >> i) & 1)) continue;
+            switch (g->type[i]) {
+            case GT_STAR:
+                next |= (uint64_t)1 << i;
+                break;
+            case GT_ANY:
+                next |= (uint64_t)1 << (i + 1);
+                break;
+            case GT_CLASS:
+                if (class_has(g->classes[g->arg[i]], *c)) next |= (uint64_t)1 << (i + 1);
+                break;
+            default:
+                if (*c == g->arg[i]) next |= (uint64_t)1 << (i + 1);
+                break;
+            }
+        }
+        s = closure(g, next);
+        if (!s) return 0;
+    }
+    return (s >> g->ntok) & 1;
+}
+
+const char *glob_prefix(const struct glob *g, size_t *len)
+{
+    if (len) *len = g->prefix_len;
+    return g->prefix;
+}
+
+int glob_has_magic(const char *s)
+{
+    for (; *s; ++s) {
+        if (*s == '*' || *s == '?' || *s == '[') return 1;
+    }
+    return 0;
+}
+
+void glob_argv_reset(struct glob_argv *av)
+{
+    av->argc = 0;
+    av->used = 0;
+    if (av->argv) av->argv[0] = NULL;
+}
+
+void glob_argv_free(struct glob_argv *av)
+{
+    if (av->argv) kfree(av->argv);
+    if (av->strings) kfree(av->strings);
+    memset(av, 0, sizeof(*av));
+}
+
+int glob_argv_push(struct glob_argv *av, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    if (av->argc + 2 > av->cap) {
+        unsigned int cap = av->cap ? av->cap * 2 : 64;
+        char **argv = kmalloc(cap * sizeof(char *));
+        if (!argv) return -1;
+        if (av->argv) {
+            memcpy(argv, av->argv, av->argc * sizeof(char *));
+            kfree(av->argv);
+        }
+        av->argv = argv;
+        av->cap = cap;
+    }
+    if (av->used + len > av->size) {
+        size_t size = av->size ? av->size * 2 : 4096;
+        while (size < av->used + len) size *= 2;
+        char *strings = kmalloc(size);
+        if (!strings) return -1;
+        if (av->strings) {
+            memcpy(strings, av->strings, av->used);
+            /* the arguments move along with their storage */
+            for (unsigned int i = 0; i < av->argc; ++i) av->argv[i] = strings + (av->argv[i] - av->strings);
+            kfree(av->strings);
+        }
+        av->strings = strings;
+        av->size = size;
+    }
+    memcpy(av->strings + av->used, s, len);
+    av->argv[av->argc++] = av->strings + av->used;
+    av->argv[av->argc] = NULL;
+    av->used += len;
+    return 0;
+}
+
+/* Heap sort of argv[0, n) by strcmp. */
+static void sort_args(char **argv, unsigned int n)
+{
+    unsigned int start = n / 2, end = n;
+    while (end > 1) {
+        if (start > 0) {
+            start--;
+        } else {
+            end--;
+            char *t = argv[0]; argv[0] = argv[end]; argv[end] = t;
+        }
+        unsigned int root = start;
+        for (;;) {
+            unsigned int child = 2 * root + 1;
+            if (child >= end) break;
+            if (child + 1 < end && strcmp(argv[child + 1], argv[child]) > 0) child++;
+            if (strcmp(argv[root], argv[child]) >= 0) break;
+            char *t = argv[root]; argv[root] = argv[child]; argv[child] = t;
+            root = child;
+        }
+    }
+}
+
+/* Candidate paths of the components expanded so far; kept between calls. */
+static struct glob_argv level[2];
+
+int glob_expand(struct glob_argv *av, const char *pattern)
+{
+    if (!pattern || pattern[0] != '/') return -1;
+    struct glob_argv *cur = &level[0], *next = &level[1];
+    glob_argv_reset(cur);
+    if (glob_argv_push(cur, "") != 0) return -1;
+    char comp[128];
+    char path[256];
+    struct glob g;
+    int unchecked = 0; /* literal components were appended without a lookup */
+    const char *p = pattern;
+    for (;;) {
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+        size_t len = 0;
+        while (p[len] && p[len] != '/') len++;
+        if (len >= sizeof(comp)) return -1;
+        memcpy(comp, p, len);
+        comp[len] = '\0';
+        p += len;
+        while (*p == '/') p++;
+        int last = *p == '\0';
+        glob_argv_reset(next);
+        int magic = glob_has_magic(comp);
+        unchecked = !magic;
+        if (magic && glob_compile(&g, comp) != 0) return -1;
+        for (unsigned int i = 0; i < cur->argc; ++i) {
+            const char *dir = cur->argv[i];
+            size_t dlen = strlen(dir);
+            if (!magic) {
+                /* existence is checked once the whole path is known */
+                if (dlen + 1 + len >= sizeof(path)) continue;
+                memcpy(path, dir, dlen);
+                path[dlen] = '/';
+                memcpy(path + dlen + 1, comp, len + 1);
+                if (glob_argv_push(next, path) != 0) return -1;
+                continue;
+            }
+            const struct fs_file *f;
+            for (unsigned int k = 0; fs_listdir(dlen ? dir : "/", k, &f) == FS_OK; ++k) {
+                const char *name = f->name + dlen + 1;
+                if (name[0] == '.' && comp[0] != '.') continue;
+                if (!last && !(f->mode & FS_S_IFDIR)) continue;
+                if (!glob_match(&g, name)) continue;
+                if (glob_argv_push(next, f->name) != 0) return -1;
+            }
+        }
+        struct glob_argv *t = cur;
+        cur = next;
+        next = t;
+    }
+    unsigned int first = av->argc;
+    struct fs_stat st;
+    for (unsigned int i = 0; i < cur->argc; ++i) {
+        const char *match = cur->argv[i][0] ? cur->argv[i] : "/";
+        if (unchecked && fs_stat(match, &st) != FS_OK) continue;
+        if (glob_argv_push(av, match) != 0) return -1;
+    }
+    sort_args(av->argv + first, av->argc - first);
+    return (int)(av->argc - first);
+}
@@ -3,6 +3,7 @@
 
 void shutdown()
 {
+    terminal_flush(); /* in case the machine stays on */
     outw(0xB004, 0x2000);
     outw(0x604, 0x2000);
     outw(0x4004, 0x3400);
@@ -12,6 +13,7 @@ void reboot()
 {
     uint8_t temp;
 
+    terminal_flush();
     asm volatile("cli"); /* disable all interrupts */
 
     /* Clear all keyboard buffers (output and command buffers) */
@@ -60,10 +62,53 @@ void outw(uint16_t port, uint16_t data)
                          : "a"(data), "d"(port));
 }
 
+uint16_t input_word(uint16_t port)
+{
+    uint16_t ret;
+    __asm__ __volatile__("inw %1, %0"
+                         : "=a"(ret)
+                         : "Nd"(port));
+    return ret;
+}
+
+uint32_t input_dword(uint16_t port)
+{
+    uint32_t ret;
+    __asm__ __volatile__("inl %1, %0"
+                         : "=a"(ret)
+                         : "Nd"(port));
+    return ret;
+}
+
+void output_dword(uint16_t port, uint32_t val)
+{
+    __asm__ __volatile__("outl %0, %1"
+                         :
+                         : "a"(val), "Nd"(port));
+}
+
+void input_words(uint16_t port, void *buf, uint32_t count)
+{
+    __asm__ __volatile__("rep insw"
+                         : "+D"(buf), "+c"(count)
+                         : "d"(port)
+                         : "memory");
+}
+
+void output_words(uint16_t port, const void *buf, uint32_t count)
+{
+    __asm__ __volatile__("rep outsw"
+                         : "+S"(buf), "+c"(count)
+                         : "d"(port)
+                         : "memory");
+}
+
 uint8_t scan(void)
 {
     unsigned char brk;
     static uint8_t key = 0;
+    /* whoever waits for a key sees everything printed so far */
+    terminal_flush();
     uint8_t read_char = input_bytes(0x60); // keyboard port
     brk = read_char & 0x80;
     read_char = read_char & 0x7f;
@@ -83,7 +128,9 @@ uint8_t scan(void)
 
 void move_cursor(int row, int col)
 {
-    unsigned short pos = (row * VGA_WIDTH) + col;
+    /* the display pans over video memory: place the cursor after it moved */
+    terminal_flush();
+    unsigned short pos = terminal_cursor_cell(col, row);
     output_bytes(FB_COMMAND_PORT, FB_LOW_BYTE_COMMAND);
     output_bytes(FB_DATA_PORT, (unsigned char)(pos & 0xFF));
     output_bytes(FB_COMMAND_PORT, FB_HIGH_BYTE_COMMAND);
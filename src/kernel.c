@@ -21,6 +21,16 @@
 #include "../include/netsec.h"
 #include "../include/encrypt.h"
 #include "../include/compress.h"
+#include "../include/multiboot.h"
+#include "../include/tar.h"
+#include "../include/glob.h"
+#include "../include/timer.h"
+#include "../include/blk.h"
+#include "../include/ata.h"
+#include "../include/ahci.h"
+#include "../include/virtio.h"
+#include "../include/bcache.h"
+#include "../include/journal.h"
 
 #define DEBUG false
 
@@ -116,6 +126,200 @@ static int resolve_path(const char *input, char *out, size_t outsz)
 	return 0;
 }
 
+/* Print a byte count in a readable unit; printk has no 64-bit conversions. */
+static void print_bytes(uint64_t bytes)
+{
+	if (bytes < 10240) printk("%d B", (int)bytes);
+	else if (bytes < ((uint64_t)10240 << 10)) printk("%d KiB", (int)(bytes >> 10));
+	else printk("%d MiB", (int)(bytes >> 20));
+}
+
+static int find_print(const char *path, int is_dir, void *arg)
+{
+	(void)arg;
+	printk("\n%s%s", path, is_dir ? "/" : "");
+	return 0;
+}
+
+/* Callback of watches set from the shell: report each change. */
+static void watch_print(const struct fs_event *ev, void *arg)
+{
+	(void)arg;
+	if (ev->mask & FS_EV_OVERFLOW) { printk("\n[watch %d] events lost", ev->wd); return; }
+	printk("\n[watch %d]", ev->wd);
+	if (ev->mask & FS_EV_CREATE) printk(" create");
+	if (ev->mask & FS_EV_WRITE) printk(" write");
+	if (ev->mask & FS_EV_UNLINK) printk(" unlink");
+	if (ev->mask & FS_EV_RENAME) printk(" rename %s ->", ev->from);
+	if (ev->mask & FS_EV_CHMOD) printk(" chmod");
+	printk(" %s", ev->path);
+}
+
+/* Wildcard expansion for commands taking paths: the first argument with
+ * wildcards is replaced by each matching path in turn and the command runs
+ * once per match. Without a match the argument is passed on unchanged. */
+static const char *const glob_commands[] = {
+	"cat", "chmod", "chown", "cp", "du", "ls", "mv", "rm", "rmdir", "stat", NULL
+};
+static struct glob_argv glob_jobs;
+static unsigned int glob_job;
+static char glob_line[BUFFER_SIZE];
+static size_t glob_arg_start, glob_arg_end;
+
+/* Expand line; returns the number of commands to run (0: run it as is). */
+static int shell_glob(const char *line)
+{
+	glob_argv_reset(&glob_jobs);
+	glob_job = 0;
+	size_t cmd_len = 0;
+	while (line[cmd_len] && line[cmd_len] != ' ') cmd_len++;
+	int known = 0;
+	for (int i = 0; glob_commands[i]; ++i)
+		if (strlen(glob_commands[i]) == cmd_len && strncmp(line, glob_commands[i], cmd_len) == 0) known = 1;
+	if (!known) return 0;
+	size_t pos = cmd_len;
+	while (line[pos]) {
+		while (line[pos] == ' ') pos++;
+		size_t end = pos;
+		while (line[end] && line[end] != ' ') end++;
+		char arg[256], rpath[256];
+		if (end > pos && end - pos < sizeof(arg)) {
+			memcpy(arg, line + pos, end - pos);
+			arg[end - pos] = '\0';
+			if (glob_has_magic(arg) && resolve_path(arg, rpath, sizeof(rpath)) == 0) {
+				if (glob_expand(&glob_jobs, rpath) <= 0) return 0;
+				strncpy(glob_line, line, BUFFER_SIZE - 1);
+				glob_line[BUFFER_SIZE - 1] = '\0';
+				glob_arg_start = pos;
+				glob_arg_end = end;
+				return (int)glob_jobs.argc;
+			}
+		}
+		pos = end;
+	}
+	return 0;
+}
+
+/* Put the next expanded command into buffer; 0 when all have run. */
+static int shell_glob_next(char *buffer)
+{
+	while (glob_job < glob_jobs.argc) {
+		const char *match = glob_jobs.argv[glob_job++];
+		size_t tail = strlen(glob_line + glob_arg_end);
+		if (glob_arg_start + strlen(match) + tail >= BUFFER_SIZE) {
+			printk("\nPath too long: %s\n", match);
+			continue;
+		}
+		memcpy(buffer, glob_line, glob_arg_start);
+		strcpy(buffer + glob_arg_start, match);
+		strcat(buffer, glob_line + glob_arg_end);
+		return 1;
+	}
+	return 0;
+}
+
+/* Parse a size with an optional K or M suffix. */
+static uint64_t parse_size(const char *s)
+{
+	uint64_t v = atoi(s);
+	while (*s >= '0' && *s <= '9') s++;
+	if (*s == 'K' || *s == 'k') v <<= 10;
+	else if (*s == 'M' || *s == 'm') v <<= 20;
+	return v;
+}
+
+/* Print a rate in bytes per second. */
+static void print_rate(uint32_t bytes_per_sec)
+{
+	if (bytes_per_sec < (10u << 20)) printk("%u KB/s", bytes_per_sec >> 10);
+	else printk("%u MB/s", bytes_per_sec >> 20);
+}
+
+#define BENCH_CHUNK 2048 /* sectors per sequential read (1 MiB) */
+#define BENCH_OPS 256    /* 4 KiB requests per random pass */
+
+/* Read-only benchmark of a block device over its first mib MiB:
+ * large sequential reads, synchronous random 4 KiB reads, the same through
+ * the request queue, and shuffled adjacent 4 KiB reads that the queue
+ * merges back into large transfers. */
+static void blk_bench(struct blk_dev *dev, uint32_t mib)
+{
+	uint64_t span = (uint64_t)mib * 2048;
+	if (span > dev->sectors) span = dev->sectors;
+	span &= ~(uint64_t)7;
+	if (span < BENCH_CHUNK) { printk("\nDevice too small\n"); return; }
+	uint8_t *buf = kmalloc((size_t)BENCH_CHUNK * BLK_SECTOR);
+	struct blk_request *reqs = kmalloc(BLK_QUEUE_MAX * sizeof(struct blk_request));
+	if (!buf || !reqs) {
+		printk("\nOut of memory\n");
+		if (buf) kfree(buf);
+		if (reqs) kfree(reqs);
+		return;
+	}
+	uint32_t seed = (uint32_t)timer_ticks() | 1;
+	uint32_t blocks = (uint32_t)(span >> 3) > 0xFFFFFFu ? 0xFFFFFFu : (uint32_t)(span >> 3);
+	int res = BLK_OK;
+
+	uint64_t t = timer_ticks();
+	uint64_t lba;
+	for (lba = 0; lba + BENCH_CHUNK <= span && res == BLK_OK; lba += BENCH_CHUNK) {
+		res = blk_read(dev, lba, BENCH_CHUNK, buf);
+	}
+	t = timer_ticks() - t;
+	printk("\nsequential 1 MiB reads:  ");
+	print_rate(timer_rate(lba * BLK_SECTOR, t));
+
+	t = timer_ticks();
+	for (unsigned int i = 0; i < BENCH_OPS && res == BLK_OK; ++i) {
+		seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+		res = blk_read(dev, (uint64_t)(seed % blocks) * 8, 8, buf);
+	}
+	t = timer_ticks() - t;
+	printk("\nrandom 4 KiB reads:      %u IOPS", timer_rate(BENCH_OPS, t));
+
+	struct blk_stats before = dev->stats;
+	t = timer_ticks();
+	for (unsigned int i = 0; i < BENCH_OPS && res == BLK_OK; i += BLK_QUEUE_MAX) {
+		for (unsigned int k = 0; k < BLK_QUEUE_MAX; ++k) {
+			seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+			reqs[k].lba = (uint64_t)(seed % blocks) * 8;
+			reqs[k].count = 8;
+			reqs[k].write = 0;
+			reqs[k].buf = buf + k * 4096;
+			blk_submit(dev, &reqs[k]);
+		}
+		blk_run(dev);
+		for (unsigned int k = 0; k < BLK_QUEUE_MAX; ++k) if (reqs[k].status != BLK_OK) res = reqs[k].status;
+	}
+	t = timer_ticks() - t;
+	printk("\nqueued random 4 KiB:     %u IOPS, %u transfers", timer_rate(BENCH_OPS, t),
+	       dev->stats.transfers - before.transfers);
+
+	before = dev->stats;
+	t = timer_ticks();
+	for (unsigned int i = 0; i < BENCH_OPS && res == BLK_OK; i += BLK_QUEUE_MAX) {
+		uint64_t base = (uint64_t)(i / BLK_QUEUE_MAX) * BLK_QUEUE_MAX * 8;
+		/* submit the adjacent requests in a scrambled order */
+		for (unsigned int k = 0; k < BLK_QUEUE_MAX; ++k) {
+			unsigned int slot = (k * 37) % BLK_QUEUE_MAX;
+			reqs[k].lba = base + (uint64_t)slot * 8;
+			reqs[k].count = 8;
+			reqs[k].write = 0;
+			reqs[k].buf = buf + slot * 4096;
+			blk_submit(dev, &reqs[k]);
+		}
+		blk_run(dev);
+		for (unsigned int k = 0; k < BLK_QUEUE_MAX; ++k) if (reqs[k].status != BLK_OK) res = reqs[k].status;
+	}
+	t = timer_ticks() - t;
+	printk("\nqueued adjacent 4 KiB:   %u IOPS, %u merged into %u transfers", timer_rate(BENCH_OPS, t),
+	       dev->stats.merged - before.merged, dev->stats.transfers - before.transfers);
+	if (res != BLK_OK) printk("\nI/O error %d", res);
+	printk("\n");
+	kfree(reqs);
+	kfree(buf);
+}
+
 static int pager_wait_key(void)
 {
 	char c = getch_blocking();
@@ -142,6 +346,12 @@ static char getch_blocking(void)
 			shift = true;
 			continue;
 		}
+		if (shift && (b == 0x49 || b == 0x51)) {
+			terminal_scrollback(b == 0x49 ? 1 : -1);
+			shift = false;
+			move_cursor(get_terminal_row(), get_terminal_col());
+			continue;
+		}
 
 		char ch;
 		if (capslock) ch = capslockmap[b];
@@ -154,7 +364,7 @@ static char getch_blocking(void)
 	}
 }
 
-int main(void)
+int main(uint32_t mb_info, uint32_t mb_magic)
 {
 	char buffer[BUFFER_SIZE];
 	uint8_t byte = 0;
@@ -173,8 +383,13 @@ int main(void)
 
 	terminal_set_colors(default_font_color, COLOR_BLACK);
 
+	/* the boot information may lie where the heap table goes */
+	int mods = multiboot_init(mb_magic, mb_info);
+
 	// initialize heap
 	heap_init();
+	timer_init();
+	if (mods > 0) printk("\nBoot modules: %d (tar x mod:<n> [dir])\n", mods);
 
 	/* Mount embedded initrd (ramfs) and print a test file if present */
 	printk("\nMounting embedded initrd...");
@@ -183,6 +398,8 @@ int main(void)
 		printk("failed: %d\n", mres);
 	} else {
 		printk("ok\n");
+		/* live statistics, rendered only when read */
+		fs_mount("proc", NULL, "/proc");
 		/* Try to list /etc to see what's there */
 		printk("\nListing /etc:\n");
 		const struct fs_file *f;
@@ -194,6 +411,32 @@ int main(void)
 		if (idx == 0) printk("\t(empty)\n");
 	}
 
+	printk("\nProbing disks...");
+	int disks = ata_init();
+	disks += ahci_init();
+	disks += virtio_blk_init();
+	printk("%d found\n", disks);
+	for (unsigned int i = 0; blk_device(i); ++i) {
+		struct blk_dev *dev = blk_device(i);
+		printk("\t%s: ", dev->name);
+		print_bytes(dev->sectors * BLK_SECTOR);
+		if (dev->queue_depth > 1) printk(", queue depth %u", dev->queue_depth);
+		printk("\n");
+	}
+	/* bring back the overlay changes journaled by the previous boot */
+	for (unsigned int i = 0; blk_device(i); ++i) {
+		struct fs_journal_stats js;
+		int jr = fs_journal_attach(blk_device(i)->name);
+		if (jr == FS_ENOENT) continue;
+		if (jr != FS_OK) {
+			printk("\tJournal on %s is damaged: %d\n", blk_device(i)->name, jr);
+			continue;
+		}
+		fs_journal_stats(&js);
+		printk("\tRestored %u changes from the journal on %s\n", js.replayed, js.dev);
+		break;
+	}
+
 	/* Initialize user database from initrd and show GUI login if available */
 	printk("\nInitializing user database...");
 	int ur = user_init_from_file("/etc/passwd");
@@ -259,9 +502,18 @@ int main(void)
 	{
 		while ((byte = scan()) != 0)
 		{
-			if (byte == ENTER)
+			if (shift && (byte == 0x49 || byte == 0x51))
+			{
+				/* Shift+PgUp/PgDn page through the scrollback */
+				terminal_scrollback(byte == 0x49 ? 1 : -1);
+				shift = false;
+			}
+			else if (byte == ENTER)
 			{
 				char cmd_copy[BUFFER_SIZE];
+				insert_at_head(&head, create_new_node(buffer));
+				if (shell_glob(buffer) > 0) shell_glob_next(buffer);
+			run_command:
 				strncpy(cmd_copy, buffer, BUFFER_SIZE-1);
 				cmd_copy[BUFFER_SIZE-1] = '\0';
 				for (int i = 0; cmd_copy[i]; i++) {
@@ -269,7 +521,6 @@ int main(void)
 						cmd_copy[i] = cmd_copy[i] - 'A' + 'a';
 					}
 				}
-				insert_at_head(&head, create_new_node(buffer));
 				if (strlen(buffer) > 0 && strncmp(cmd_copy, "ls", 2) == 0)
 				{
 					/* support: ls [path] -> list immediate children using fs_listdir */
@@ -294,7 +545,7 @@ int main(void)
 						unsigned int mode = f->mode;
 						char perms[11];
 						perms[10] = '\0';
-						perms[0] = (f->data == NULL) ? 'd' : '-';
+						perms[0] = (mode & FS_S_IFDIR) ? 'd' : '-';
 						for (int b = 0; b < 9; ++b) {
 							int shift = 8 - b;
 							unsigned int bit = (mode >> shift) & 1;
@@ -378,6 +629,7 @@ int main(void)
 					printk("\n\t math               - \tlists all mathematical functions");
 					printk("\n\t crypto             - \tlists all cryptography utilities");
 					printk("\n\t clear              - \tclears the screen");
+					printk("\n\t Shift+PgUp/PgDn    - \tscroll back through earlier output");
 					printk("\n\t fontcolor          - \tchange default font color");
 					printk("\n\t datetime           - \tdisplays current date and time");
 					printk("\n\t date               - \tdisplays current date");
@@ -403,10 +655,29 @@ int main(void)
 					printk("\n\t pwd                - \tprint working directory");
 					printk("\n\t cd <path>          - \tchange directory (limited)");
 					printk("\n\t stat <path>        - \tfile statistics");
+					printk("\n\t du [path]          - \tdisk usage of a directory");
+					printk("\n\t df                 - \tfilesystem and memory usage");
+					printk("\n\t find [dir] -name <glob>-\tfind files by name (* ? [a-z])");
+					printk("\n\t search <words>     - \tfind files containing all words");
+					printk("\n\t tar x|c ...        - \textract <archive|mod:N> [dir] / create <dir> <archive>");
+					printk("\n\t watch [path]       - \treport changes below path, or list");
+					printk("\n\t unwatch <id>       - \tstop a watch");
+					printk("\n\t quota <dir> [size|off]-\tshow or set a directory quota");
+					printk("\n\t blkbench [dev] [MiB]- \tread benchmark of a disk (MB/s, IOPS)");
+					printk("\n\t mount [-t fs] <dev> <dir>-\tmount a disk (ext2, proc) at a directory, or list mounts");
+					printk("\n\t umount <dir>       - \tdetach a mounted disk");
+					printk("\n\t sync               - \twrite cached disk blocks back");
+					printk("\n\t journal [format <dev>|checkpoint|off]-\tpersist the ramfs to a disk");
+					printk("\n\t bcache             - \tbuffer cache statistics");
 					printk("\n\t touch <path>       - \tcreate empty file");
 					printk("\n\t mkdir <path>       - \tcreate directory");
+					printk("\n\t cp [-r] <src> <dst>- \tcopy a file or a directory tree");
+					printk("\n\t rm [-r] <path>     - \tremove a file or a directory tree");
 					printk("\n\t echo <text> > <f>  - \twrite text to file");
 					printk("\n\t edit <path>        - \tview file contents");
+					printk("\n\t dedup [on|off|stats]- \tblock deduplication of file data");
+					printk("\n\t snapshot [list|drop N]-\ttake, list or drop fs snapshots");
+					printk("\n\t restore N          - \trestore fs snapshot N");
 					printk("\n\n\tEncryption/Compression:\n");
 					printk("\n\t encrypt <s> <d> <k>- \tencrypt file (XOR cipher)");
 					printk("\n\t decrypt <s> <d> <k>- \tdecrypt file (XOR cipher)");
@@ -458,12 +729,291 @@ int main(void)
 						} else {
 							printk("\nFile: %s\n", rpath);
 							printk("  Size: %u bytes\n", (unsigned)st.size);
+							printk("  Allocated: %u bytes\n", (unsigned)st.allocated);
 							printk("  Owner: uid:%u gid:%u\n", st.uid, st.gid);
 							printk("  Mode: %o\n", st.mode);
 							printk("  Type: %s\n", (st.mode & 0x4000) ? "directory" : "file");
 						}
 					}
 				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "du") == 0 || strncmp(buffer, "du ", 3) == 0))
+				{
+					/* per-directory totals are kept by ramfs: no subtree walk */
+					char *p = buffer + 2;
+					while (*p == ' ') p++;
+					char rpath[256];
+					struct fs_usage u;
+					if (resolve_path(*p ? p : cwd, rpath, sizeof(rpath)) != 0) { printk("\nPath too long\n"); }
+					else if (fs_usage(rpath, &u) != FS_OK) { printk("\nFile not found: %s\n", rpath); }
+					else {
+						const struct fs_file *f;
+						unsigned int idx = 0;
+						while (fs_listdir(rpath, idx++, &f) == FS_OK) {
+							struct fs_usage cu;
+							if (!(f->mode & FS_S_IFDIR) || fs_usage(f->name, &cu) != FS_OK) continue;
+							printk("\n\t");
+							print_bytes(cu.bytes);
+							printk("\t%d files\t%s", (int)cu.files, f->name);
+						}
+						printk("\n\t");
+						print_bytes(u.bytes);
+						printk("\t%d files\t%s", (int)u.files, rpath);
+						if (u.quota) { printk(" (quota "); print_bytes(u.quota); printk(")"); }
+						printk("\n");
+					}
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "find") == 0 || strncmp(buffer, "find ", 5) == 0))
+				{
+					/* find [dir] [-name <glob>] */
+					char *p = buffer + 4;
+					while (*p == ' ') p++;
+					const char *dir = cwd;
+					const char *pattern = "*";
+					if (*p && strncmp(p, "-name", 5) != 0) {
+						dir = p;
+						while (*p && *p != ' ') p++;
+						if (*p) *p++ = '\0';
+						while (*p == ' ') p++;
+					}
+					if (strncmp(p, "-name ", 6) == 0) {
+						p += 6;
+						while (*p == ' ') p++;
+						pattern = p;
+					}
+					char rpath[256];
+					if (resolve_path(dir, rpath, sizeof(rpath)) != 0) { printk("\nPath too long\n"); }
+					else {
+						int n = fs_find(rpath, pattern, find_print, NULL);
+						if (n == FS_ENOENT) printk("\nFile not found: %s", rpath);
+						else if (n < 0) printk("\nUsage: find [dir] [-name <pattern>]");
+						printk("\n");
+					}
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "search") == 0 || strncmp(buffer, "search ", 7) == 0))
+				{
+					/* search <word|"phrase">... */
+					int n = fs_search(buffer + 6, find_print, NULL);
+					if (n == 0) printk("\nNo matches");
+					else if (n < 0) printk("\nUsage: search <word|\"phrase\">...");
+					printk("\n");
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "tar") == 0 || strncmp(buffer, "tar ", 4) == 0))
+				{
+					/* tar x <archive|mod:N> [dir] | tar c <dir> <archive> */
+					char *args[3] = { NULL, NULL, NULL };
+					int argc = 0;
+					char *p = buffer + 3;
+					while (*p && argc < 3) {
+						while (*p == ' ') p++;
+						if (!*p) break;
+						args[argc++] = p;
+						while (*p && *p != ' ') p++;
+						if (*p) *p++ = '\0';
+					}
+					struct tar_stats ts;
+					char rsrc[256], rdst[256];
+					const char *err = NULL;
+					int r = FS_EINVAL;
+					if (argc >= 2 && strcmp(args[0], "x") == 0) {
+						const uint8_t *data;
+						size_t size;
+						if (resolve_path(argc == 3 ? args[2] : cwd, rdst, sizeof(rdst)) != 0) err = "Path too long";
+						else if (strncmp(args[1], "mod:", 4) == 0) {
+							if (multiboot_module(atoi(args[1] + 4), &data, &size, NULL) != 0) err = "No such boot module";
+							else r = tar_extract_mem(data, size, rdst, &ts);
+						}
+						else if (resolve_path(args[1], rsrc, sizeof(rsrc)) != 0) err = "Path too long";
+						else r = tar_extract_file(rsrc, rdst, &ts);
+					} else if (argc == 3 && strcmp(args[0], "c") == 0) {
+						if (resolve_path(args[1], rsrc, sizeof(rsrc)) != 0 || resolve_path(args[2], rdst, sizeof(rdst)) != 0) err = "Path too long";
+						else r = tar_create(rsrc, rdst, &ts);
+					} else {
+						err = "Usage: tar x <archive|mod:N> [dir] | tar c <dir> <archive>";
+					}
+					if (err) printk("\n%s\n", err);
+					else {
+						printk("\n%u files, %u dirs, ", ts.files, ts.dirs);
+						print_bytes(ts.bytes);
+						if (ts.skipped) printk(", %u skipped", ts.skipped);
+						if (r != FS_OK) printk(" (error %d)", r);
+						printk("\n");
+					}
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "watch") == 0 || strncmp(buffer, "watch ", 6) == 0))
+				{
+					/* watch [path]: without a path, list the watches */
+					char *p = buffer + 5;
+					while (*p == ' ') p++;
+					if (*p == '\0') {
+						for (int wd = 0; wd < 16; ++wd) {
+							const char *wpath;
+							if (fs_watch_info(wd, &wpath, NULL) == FS_OK) printk("\n%d\t%s", wd, wpath);
+						}
+						printk("\n");
+					} else {
+						char rpath[256];
+						if (resolve_path(p, rpath, sizeof(rpath)) != 0) { printk("\nPath too long\n"); }
+						else {
+							int wd = fs_watch(rpath, FS_EV_ALL, watch_print, NULL);
+							if (wd < 0) printk("\nwatch failed: %d\n", wd);
+							else printk("\nWatching %s (id %d)\n", rpath, wd);
+						}
+					}
+				}
+				else if (strlen(buffer) > 0 && strncmp(buffer, "unwatch ", 8) == 0)
+				{
+					if (fs_unwatch((int)atoi(buffer + 8)) != FS_OK) printk("\nNo such watch\n");
+					else printk("\n");
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "blkbench") == 0 || strncmp(buffer, "blkbench ", 9) == 0))
+				{
+					/* blkbench [dev] [MiB] */
+					char *p = buffer + 8;
+					while (*p == ' ') p++;
+					struct blk_dev *dev = blk_device(0);
+					if (*p && !(*p >= '0' && *p <= '9')) {
+						char *end = strchr(p, ' ');
+						if (end) *end++ = '\0';
+						dev = blk_find(p);
+						p = end ? end : p + strlen(p);
+						while (*p == ' ') p++;
+					}
+					uint32_t mib = *p ? (uint32_t)atoi(p) : 64;
+					if (!dev) printk("\nNo such block device\n");
+					else if (mib == 0) printk("\nUsage: blkbench [dev] [MiB]\n");
+					else blk_bench(dev, mib);
+				}
+				else if (strlen(buffer) > 0 && strcmp(buffer, "mount") == 0)
+				{
+					const char *mpath, *mtype;
+					for (unsigned int i = 0; fs_mount_info(i, &mpath, &mtype) == FS_OK; ++i) {
+						printk("\n%s on %s", mtype, mpath);
+					}
+					printk("\n");
+				}
+				else if (strlen(buffer) > 0 && strncmp(buffer, "mount ", 6) == 0)
+				{
+					/* mount [-t <type>] <dev> <dir> */
+					const char *type = "ext2";
+					char *dev = buffer + 6;
+					while (*dev == ' ') dev++;
+					if (strncmp(dev, "-t ", 3) == 0) {
+						type = dev + 3;
+						while (*type == ' ') type++;
+						dev = strchr(type, ' ');
+						if (dev) {
+							*dev++ = '\0';
+							while (*dev == ' ') dev++;
+						}
+					}
+					char *dir = dev ? strchr(dev, ' ') : NULL;
+					if (dir) {
+						*dir++ = '\0';
+						while (*dir == ' ') dir++;
+					}
+					char rpath[256];
+					if (!dir || !*dir) printk("\nUsage: mount [-t <type>] <dev> <dir>\n");
+					else if (resolve_path(dir, rpath, sizeof(rpath)) != 0) printk("\nPath too long\n");
+					else {
+						int r = fs_mount(type, dev, rpath);
+						if (r == FS_ENOENT) printk("\nNo such block device or filesystem type\n");
+						else if (r != FS_OK) printk("\nmount failed: %d\n", r);
+						else printk("\n%s mounted on %s\n", dev, rpath);
+					}
+				}
+				else if (strlen(buffer) > 0 && strncmp(buffer, "umount ", 7) == 0)
+				{
+					char rpath[256];
+					if (resolve_path(buffer + 7, rpath, sizeof(rpath)) != 0) printk("\nPath too long\n");
+					else if (fs_umount(rpath) != FS_OK) printk("\numount failed\n");
+					else printk("\n");
+				}
+				else if (strlen(buffer) > 0 && strcmp(buffer, "sync") == 0)
+				{
+					int r = fs_sync();
+					if (r < 0) printk("\nsync failed: %d\n", r);
+					else printk("\n%d blocks written\n", r);
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "journal") == 0 || strncmp(buffer, "journal ", 8) == 0))
+				{
+					/* journal [format <dev>|checkpoint|off] */
+					char *arg = buffer + 7;
+					while (*arg == ' ') arg++;
+					int r = FS_OK, usage = 0;
+					if (strncmp(arg, "format ", 7) == 0) r = fs_journal_format(arg + 7);
+					else if (strcmp(arg, "checkpoint") == 0) r = fs_journal_checkpoint();
+					else if (strcmp(arg, "off") == 0) r = fs_journal_detach();
+					else if (*arg) usage = 1;
+					struct fs_journal_stats js;
+					fs_journal_stats(&js);
+					if (usage) printk("\nUsage: journal [format <dev>|checkpoint|off]\n");
+					else if (r == FS_ENOENT) printk("\nNo such block device\n");
+					else if (r < 0) printk("\njournal: failed: %d\n", r);
+					else if (!js.dev) printk("\nNot journaling; changes to the ramfs are lost on reboot\n");
+					else {
+						printk("\njournal on %s, generation %u", js.dev, js.generation);
+						printk("\nlog: %u of %u sectors used, %u commits, %u records (%u pending), ",
+						       js.log_used, js.log_size, js.commits, js.records, js.pending);
+						print_bytes(js.bytes);
+						printk("\nimage: %u of %u sectors, %u checkpoints\n", js.image_size, js.image_max, js.checkpoints);
+					}
+				}
+				else if (strlen(buffer) > 0 && strcmp(buffer, "bcache") == 0)
+				{
+					struct bcache_stats bs;
+					bcache_stats(&bs);
+					unsigned int hits = bs.hits, lookups = bs.hits + bs.misses;
+					/* keep hits * 100 in 32 bits */
+					while (hits > 42949672u) { hits >>= 1; lookups >>= 1; }
+					printk("\nbuffers: %u cached of %u, %u dirty", bs.cached, bs.capacity, bs.dirty);
+					printk("\nhits: %u  misses: %u (%u recently evicted)  hit rate: %u%%",
+					       bs.hits, bs.misses, bs.ghost_hits, lookups ? hits * 100 / lookups : 0);
+					printk("\nevictions: %u  blocks written back: %u", bs.evictions, bs.writebacks);
+					printk("\nread ahead: %u blocks, %u used\n", bs.readahead, bs.ra_hits);
+				}
+				else if (strlen(buffer) > 0 && strcmp(buffer, "df") == 0)
+				{
+					struct fs_usage u;
+					uint32_t used = heap_used_blocks();
+					uint32_t total = HEAP_SIZE_BYTES / HEAP_BLOCK_SIZE;
+					fs_usage("/", &u);
+					printk("\nFilesystem  Size      Used      Avail     Use%%");
+					printk("\nramfs       ");
+					print_bytes((uint64_t)total * HEAP_BLOCK_SIZE);
+					printk("   ");
+					print_bytes((uint64_t)used * HEAP_BLOCK_SIZE);
+					printk("   ");
+					print_bytes((uint64_t)(total - used) * HEAP_BLOCK_SIZE);
+					printk("   %d%%", (int)(used / (total / 100)));
+					printk("\nFiles: %d, logical size ", (int)u.files);
+					print_bytes(u.bytes);
+					printk("\n");
+				}
+				else if (strlen(buffer) > 0 && strncmp(buffer, "quota ", 6) == 0)
+				{
+					char *p = buffer + 6;
+					while (*p == ' ') p++;
+					char *arg = strchr(p, ' ');
+					if (arg) { *arg++ = '\0'; while (*arg == ' ') arg++; }
+					char rpath[256];
+					struct fs_usage u;
+					if (*p == '\0') { printk("\nUsage: quota <dir> [size[K|M]|off]\n"); }
+					else if (resolve_path(p, rpath, sizeof(rpath)) != 0) { printk("\nPath too long\n"); }
+					else if (arg && *arg) {
+						uint64_t limit = strcmp(arg, "off") == 0 ? 0 : parse_size(arg);
+						int r = fs_set_quota(rpath, limit);
+						if (r == FS_OK) printk("\n(quota) %s set\n", rpath);
+						else printk("\n(quota) failed: error %d\n", r);
+					}
+					else if (fs_usage(rpath, &u) != FS_OK) { printk("\nFile not found: %s\n", rpath); }
+					else {
+						printk("\n%s: ", rpath);
+						print_bytes(u.bytes);
+						printk(" used, quota ");
+						if (u.quota) print_bytes(u.quota); else printk("none");
+						printk("\n");
+					}
+				}
 				else if (strlen(buffer) > 0 && strncmp(buffer, "touch ", 6) == 0)
 				{
 					char *path = buffer + 6; while (*path == ' ') path++;
@@ -537,10 +1087,14 @@ int main(void)
 				else if (strlen(buffer) > 0 && strncmp(buffer, "rm ", 3) == 0)
 				{
 					char *path = buffer + 3; while (*path == ' ') path++;
-					if (*path == '\0') { printk("\nUsage: rm <path>\n"); }
+					int recursive = 0;
+					if (strncmp(path, "-r ", 3) == 0) { recursive = 1; path += 3; while (*path == ' ') path++; }
+					struct fs_stat st;
+					if (*path == '\0') { printk("\nUsage: rm [-r] <path>\n"); }
 					else {
 						char rpath[256];
 						if (resolve_path(path, rpath, sizeof(rpath)) != 0) { printk("\nPath too long\n"); }
+						else if (!recursive && fs_stat(rpath, &st) == FS_OK && st.is_dir) { printk("\n%s is a directory (use rm -r)\n", rpath); }
 						else {
 							int r = fs_unlink(rpath);
 							if (r == FS_OK) printk("\nRemoved: %s\n", rpath);
@@ -647,33 +1201,48 @@ int main(void)
 				{
 					char *p = buffer + 3;
 					while (*p == ' ') p++;
+					int recursive = 0;
+					if (strncmp(p, "-r ", 3) == 0) { recursive = 1; p += 3; while (*p == ' ') p++; }
 					char *q = strchr(p, ' ');
-					if (!q) { printk("\nUsage: cp <src> <dst>\n"); }
+					if (!q) { printk("\nUsage: cp [-r] <src> <dst>\n"); }
 					else {
 						*q = '\0';
 						char *src = p; char *dst = q + 1; while (*dst == ' ') dst++;
 						char rsrc[256], rdst[256];
 						if (resolve_path(src, rsrc, sizeof(rsrc)) != 0) { printk("\nPath too long\n"); continue; }
 						if (resolve_path(dst, rdst, sizeof(rdst)) != 0) { printk("\nPath too long\n"); continue; }
-						struct fs_stat st;
+						struct fs_stat st, dst_st;
 						if (fs_stat(rsrc, &st) != FS_OK) { printk("\n(cp) source not found\n"); }
+						else if (st.is_dir && !recursive) { printk("\n(cp) %s is a directory (use cp -r)\n", rsrc); }
+						else if (st.is_dir) {
+							/* copying onto an existing directory puts the tree inside it */
+							if (fs_stat(rdst, &dst_st) == FS_OK && dst_st.is_dir) {
+								const char *name = rsrc;
+								for (const char *c = rsrc; *c; ++c) if (*c == '/' && c[1]) name = c + 1;
+								size_t len = strlen(rdst);
+								if (len + 1 + strlen(name) >= sizeof(rdst)) { printk("\nPath too long\n"); continue; }
+								if (len > 1) rdst[len++] = '/';
+								strcpy(rdst + len, name);
+							}
+							int c = fs_copy(rsrc, rdst);
+							if (c == FS_OK) printk("\n(cp) %s -> %s\n", rsrc, rdst);
+							else printk("\n(cp) copy failed: %d\n", c);
+						}
 						else {
-							char *buf = kmalloc(st.size);
-							if (!buf) { printk("\n(cp) oom\n"); }
+							/* the data goes from file to file without a copy of the whole file in between */
+							fs_fd_t r = strcmp(rsrc, rdst) == 0 ? FS_EINVAL : fs_open(rsrc, FS_O_RDONLY);
+							if (r < 0) { printk("\n(cp) open read failed\n"); }
 							else {
-								fs_fd_t r = fs_open(rsrc, FS_O_RDONLY);
-								if (r < 0) { printk("\n(cp) open read failed\n"); kfree(buf); }
+								int c = fs_create(rdst, (const uint8_t *)"", 0);
+								fs_fd_t w = c == FS_OK ? fs_open(rdst, FS_O_RDONLY) : c;
+								if (w < 0) printk("\n(cp) create failed: %d\n", w);
 								else {
-									int got = fs_read(r, buf, st.size);
-									fs_close(r);
-									if (got < 0) { printk("\n(cp) read failed\n"); kfree(buf); }
-									else {
-										int c = fs_create(rdst, (const uint8_t *)buf, (size_t)got);
-										if (c == FS_OK) printk("\n(cp) %s -> %s\n", rsrc, rdst);
-										else printk("\n(cp) create failed: %d\n", c);
-										kfree(buf);
-									}
+									c = fs_splice(r, w, (size_t)-1, NULL);
+									fs_close(w);
+									if (c >= 0) printk("\n(cp) %s -> %s\n", rsrc, rdst);
+									else printk("\n(cp) copy failed: %d\n", c);
 								}
+								fs_close(r);
 							}
 						}
 					}
@@ -957,6 +1526,59 @@ int main(void)
 						}
 					}
 				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "dedup") == 0 || strncmp(buffer, "dedup ", 6) == 0))
+				{
+					char *p = buffer + 5;
+					while (*p == ' ') p++;
+					if (strcmp(p, "on") == 0) {
+						fs_dedup_enable(1);
+						printk("\n(dedup) enabled\n");
+					} else if (strcmp(p, "off") == 0) {
+						fs_dedup_enable(0);
+						printk("\n(dedup) disabled\n");
+					} else if (*p == '\0' || strcmp(p, "stats") == 0) {
+						struct fs_dedup_stats ds;
+						fs_dedup_stats(&ds);
+						/* ratio = referenced blocks / stored blocks, two decimals */
+						unsigned int ratio = ds.unique_blocks ? ds.block_refs * 100 / ds.unique_blocks : 100;
+						printk("\n(dedup) %s, block size %d bytes", ds.enabled ? "on" : "off", (int)ds.block_size);
+						printk("\n  stored blocks: %d, referenced: %d", (int)ds.unique_blocks, (int)ds.block_refs);
+						printk("\n  ratio: %d.%d%d, saved: %d bytes\n", (int)(ratio / 100), (int)(ratio / 10 % 10), (int)(ratio % 10), (int)ds.bytes_saved);
+					} else {
+						printk("\nUsage: dedup [on|off|stats]\n");
+					}
+				}
+				else if (strlen(buffer) > 0 && (strcmp(buffer, "snapshot") == 0 || strncmp(buffer, "snapshot ", 9) == 0))
+				{
+					char *p = buffer + 8;
+					while (*p == ' ') p++;
+					if (*p == '\0') {
+						int id = fs_snapshot();
+						if (id > 0) printk("\n(snapshot) created snapshot %d\n", id);
+						else printk("\n(snapshot) failed: error %d\n", id);
+					} else if (strcmp(p, "list") == 0) {
+						int id;
+						unsigned int idx = 0;
+						while (fs_snapshot_list(idx, &id) == FS_OK) {
+							printk("\n\tsnapshot %d", id);
+							idx++;
+						}
+						if (idx == 0) printk("\n\t(no snapshots)");
+						printk("\n");
+					} else if (strncmp(p, "drop ", 5) == 0) {
+						int id = atoi(p + 5);
+						if (fs_snapshot_drop(id) == FS_OK) printk("\n(snapshot) dropped snapshot %d\n", id);
+						else printk("\n(snapshot) no snapshot %d\n", id);
+					} else {
+						printk("\nUsage: snapshot [list|drop N]\n");
+					}
+				}
+				else if (strlen(buffer) > 0 && strncmp(buffer, "restore ", 8) == 0)
+				{
+					int id = atoi(buffer + 8);
+					if (fs_restore(id) == FS_OK) printk("\n(restore) restored snapshot %d\n", id);
+					else printk("\n(restore) no snapshot %d\n", id);
+				}
 				else if (strlen(buffer) > 0 && strcmp(buffer, "clear") == 0)
 				{
 					terminal_initialize(default_font_color, COLOR_BLACK);
@@ -1105,6 +1727,14 @@ int main(void)
 				{
 					printk("\n'%s' is not a recognized command. ", buffer);
 				}
+				/* the next path a wildcard argument matched */
+				if (shell_glob_next(buffer)) goto run_command;
+				/* deliver file change events caused by the command */
+				fs_watch_dispatch();
+				/* commit the command's changes to the ramfs as one batch */
+				fs_journal_tick();
+				/* write back disk blocks that have been dirty for a while */
+				bcache_tick();
 				print_prompt();
 				memset(buffer, 0, BUFFER_SIZE);
 				strcpy(&buffer[strlen(buffer)], "");
@@ -215,6 +215,18 @@ void heap_free(struct heap *heap, void *ptr)
     heap_mark_blocks_free(heap, heap_address_to_block(heap, ptr));
 }
 
+/* Number of heap blocks currently allocated. */
+uint32_t heap_used_blocks(void)
+{
+    uint32_t used = 0;
+    for (size_t i = 0; i < kernel_heap_table.total; i++)
+    {
+        if (heap_get_entry_type(kernel_heap_table.entries[i]) == HEAP_BLOCK_TABLE_ENTRY_TAKEN)
+            used++;
+    }
+    return used;
+}
+
 void *kmalloc(size_t size)
 {
     return heap_malloc(&kernel_heap, size);
@@ -0,0 +1,55 @@
+#include "../include/multiboot.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+struct module {
+    const uint8_t *data;
+    size_t size;
+    char cmdline[MULTIBOOT_CMDLINE_MAX];
+};
+
+static struct module modules[MULTIBOOT_MAX_MODULES];
+static unsigned int module_count = 0;
+
+/* Whether [start, end) overlaps memory the kernel hands out later. */
+static int overlaps_heap(uint32_t start, uint32_t end)
+{
+    uint32_t table_end = HEAP_TABLE_ADRESS + HEAP_SIZE_BYTES / HEAP_BLOCK_SIZE;
+    if (start < table_end && end > HEAP_TABLE_ADRESS) return 1;
+    return start < (uint32_t)HEAP_ADDRESS + HEAP_SIZE_BYTES && end > HEAP_ADDRESS;
+}
+
+int multiboot_init(uint32_t magic, uint32_t info_addr)
+{
+    module_count = 0;
+    if (magic != MULTIBOOT_BOOTLOADER_MAGIC || !info_addr) return 0;
+    const struct multiboot_info *info = (const struct multiboot_info *)(uintptr_t)info_addr;
+    if (!(info->flags & MULTIBOOT_INFO_MODS)) return 0;
+    const struct multiboot_mod *mods = (const struct multiboot_mod *)(uintptr_t)info->mods_addr;
+    for (uint32_t i = 0; i < info->mods_count && module_count < MULTIBOOT_MAX_MODULES; ++i) {
+        if (mods[i].mod_end < mods[i].mod_start || overlaps_heap(mods[i].mod_start, mods[i].mod_end)) continue;
+        struct module *m = &modules[module_count++];
+        m->data = (const uint8_t *)(uintptr_t)mods[i].mod_start;
+        m->size = mods[i].mod_end - mods[i].mod_start;
+        m->cmdline[0] = '\0';
+        if (mods[i].cmdline) {
+            strncpy(m->cmdline, (const char *)(uintptr_t)mods[i].cmdline, MULTIBOOT_CMDLINE_MAX - 1);
+            m->cmdline[MULTIBOOT_CMDLINE_MAX - 1] = '\0';
+        }
+    }
+    return (int)module_count;
+}
+
+unsigned int multiboot_module_count(void)
+{
+    return module_count;
+}
+
+int multiboot_module(unsigned int index, const uint8_t **data, size_t *size, const char **cmdline)
+{
+    if (index >= module_count) return -1;
+    if (data) *data = modules[index].data;
+    if (size) *size = modules[index].size;
+    if (cmdline) *cmdline = modules[index].cmdline;
+    return 0;
+}
@@ -0,0 +1,661 @@
+#include "../include/tar.h"
+#include "../include/fs.h"
+#include "../include/memory.h"
+#include "../include/string.h"
+
+/*
+ * Streaming ustar import and export.
+ *
+ * Extraction makes a single pass over the archive and turns every entry into
+ * operations on one submission ring, so thousands of small files cost a few
+ * ring submissions rather than thousands of separate path walks. File
+ * contents are handed to fs_create straight from the archive bytes: an
+ * archive held in memory is never copied before it reaches the files, and an
+ * archive read through a descriptor is staged in one read buffer that is
+ * only refilled after the queued operations pointing into it have run.
+ * Files too large for the read buffer are streamed into place in chunks.
+ *
+ * The ring, the path arena and the I/O buffers are allocated on first use
+ * and kept for the next archive.
+ */
+#define TAR_BLOCK 512
+#define TAR_PATH_MAX 256
+#define TAR_RING 256
+#define TAR_ARENA (TAR_RING * TAR_PATH_MAX / 2)
+#define TAR_STAGE (256 * 1024)
+#define TAR_OUT (64 * 1024)
+
+/* completion tags: what an entry's last operation finishes */
+#define TAG_FILE 1
+#define TAG_DIR 2
+
+struct ustar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static struct fs_ring tar_ring;
+static char *tar_paths;    /* paths of queued operations */
+static uint8_t *tar_stage; /* read buffer for archives read through a descriptor */
+static uint8_t *tar_out;   /* write buffer for archives being created */
+static const uint8_t tar_zero[TAR_BLOCK];
+
+static int tar_buffers(void)
+{
+    if (!tar_ring.entries && fs_ring_init(&tar_ring, TAR_RING) != FS_OK) return FS_EIO;
+    if (!tar_paths) tar_paths = kmalloc(TAR_ARENA);
+    if (!tar_stage) tar_stage = kmalloc(TAR_STAGE);
+    if (!tar_out) tar_out = kmalloc(TAR_OUT);
+    return (tar_paths && tar_stage && tar_out) ? FS_OK : FS_EIO;
+}
+
+static size_t pad_of(size_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/* Numeric header field: octal digits, or base-256 when the top bit is set. */
+static uint64_t parse_num(const char *field, size_t width)
+{
+    const uint8_t *p = (const uint8_t *)field;
+    uint64_t v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7f;
+        for (size_t i = 1; i < width; ++i) v = (v << 8) | p[i];
+        return v;
+    }
+    size_t i = 0;
+    while (i < width && p[i] == ' ') i++;
+    for (; i < width && p[i] >= '0' && p[i] <= '7'; ++i) v = (v << 3) | (uint64_t)(p[i] - '0');
+    return v;
+}
+
+static int header_valid(const struct ustar_header *h)
+{
+    const uint8_t *p = (const uint8_t *)h;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        size_t off = i - offsetof(struct ustar_header, chksum);
+        sum += off < sizeof(h->chksum) ? ' ' : p[i];
+    }
+    return sum == parse_num(h->chksum, sizeof(h->chksum));
+}
+
+/* Copy a header string field, which lacks a terminator when full. */
+static size_t field_copy(char *dst, const char *field, size_t width)
+{
+    size_t n = 0;
+    while (n < width && field[n]) {
+        dst[n] = field[n];
+        n++;
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+/* ---- extraction ---- */
+
+struct tar_ctx {
+    const uint8_t *mem;   /* archive in memory, or NULL to read fd */
+    size_t size;          /* archive size (memory) / bytes staged (fd) */
+    size_t pos;           /* read position in mem or tar_stage */
+    int fd;
+    char dest[TAR_PATH_MAX];
+    size_t dest_len;
+    size_t arena_used;
+    struct tar_stats *st;
+    int err;
+};
+
+static void tar_fail(struct tar_ctx *c, int err)
+{
+    if (!c->err) c->err = err;
+}
+
+static void tar_complete(struct tar_ctx *c, const struct fs_cqe *cqe)
+{
+    unsigned int tag = (unsigned int)(cqe->user_data & 3);
+    if (cqe->res < 0) {
+        if (cqe->res != FS_ECANCELED) tar_fail(c, cqe->res);
+        if (tag) c->st->skipped++;
+        return;
+    }
+    if (tag == TAG_FILE) {
+        c->st->files++;
+        c->st->bytes += cqe->user_data >> 2;
+    } else if (tag == TAG_DIR) {
+        c->st->dirs++;
+    }
+}
+
+/* Run everything queued; afterwards nothing refers to the arena or to
+ * tar_stage any more. */
+static void tar_flush(struct tar_ctx *c)
+{
+    struct fs_cqe cqe;
+    while (tar_ring.sq_head != tar_ring.sq_tail) {
+        fs_ring_submit(&tar_ring);
+        while (fs_ring_reap(&tar_ring, &cqe)) tar_complete(c, &cqe);
+    }
+    c->arena_used = 0;
+}
+
+/* Make room for one entry (two operations sharing a path of len bytes). */
+static void tar_reserve(struct tar_ctx *c, size_t len)
+{
+    if (tar_ring.entries - (tar_ring.sq_tail - tar_ring.sq_head) < 2 || c->arena_used + len + 1 > TAR_ARENA)
+        tar_flush(c);
+}
+
+static const char *tar_arena_path(struct tar_ctx *c, const char *path, size_t len)
+{
+    char *p = tar_paths + c->arena_used;
+    memcpy(p, path, len + 1);
+    c->arena_used += len + 1;
+    return p;
+}
+
+static void tar_queue(uint8_t op, uint8_t flags, const char *path, const void *buf, size_t len, uint64_t tag)
+{
+    struct fs_sqe *sqe = fs_ring_get_sqe(&tar_ring);
+    sqe->op = op;
+    sqe->flags = flags;
+    sqe->path = path;
+    sqe->buf = (void *)buf;
+    sqe->len = len;
+    sqe->user_data = tag;
+}
+
+/* Return n contiguous archive bytes at the read position without consuming
+ * them, or NULL if the archive ends first. */
+static const uint8_t *src_peek(struct tar_ctx *c, size_t n)
+{
+    if (c->mem) return n <= c->size - c->pos ? c->mem + c->pos : NULL;
+    if (c->size - c->pos < n) {
+        if (n > TAR_STAGE) return NULL;
+        /* queued operations may point into the staged bytes */
+        tar_flush(c);
+        size_t keep = c->size - c->pos;
+        for (size_t i = 0; i < keep; ++i) tar_stage[i] = tar_stage[c->pos + i];
+        c->pos = 0;
+        c->size = keep;
+        while (c->size < TAR_STAGE) {
+            int r = fs_read(c->fd, tar_stage + c->size, TAR_STAGE - c->size);
+            if (r <= 0) break;
+            c->size += (size_t)r;
+        }
+        if (c->size < n) return NULL;
+    }
+    return tar_stage + c->pos;
+}
+
+/* Bytes readable in one piece at the read position (0 at the end). */
+static size_t src_avail(struct tar_ctx *c)
+{
+    if (c->pos == c->size && !c->mem) src_peek(c, 1);
+    return c->size - c->pos;
+}
+
+static int src_skip(struct tar_ctx *c, size_t n)
+{
+    while (n) {
+        size_t a = src_avail(c);
+        if (!a) return -1;
+        if (a > n) a = n;
+        c->pos += a;
+        n -= a;
+    }
+    return 0;
+}
+
+/* Turn an archive member name into a path below the destination. Returns
+ * the length, 0 for the destination itself, or -1 to skip the entry. */
+static int member_path(const struct tar_ctx *c, const char *name, char *out)
+{
+    for (;;) {
+        if (name[0] == '/') name++;
+        else if (name[0] == '.' && name[1] == '/') name += 2;
+        else break;
+    }
+    size_t len = strlen(name);
+    while (len > 0 && name[len-1] == '/') len--;
+    if (len == 0 || (len == 1 && name[0] == '.')) return 0;
+    for (size_t i = 0; i < len; ) {
+        size_t j = i;
+        while (j < len && name[j] != '/') j++;
+        if (j - i == 2 && name[i] == '.' && name[i+1] == '.') return -1;
+        i = j + 1;
+    }
+    if (c->dest_len + 1 + len >= TAR_PATH_MAX) return -1;
+    memcpy(out, c->dest, c->dest_len);
+    out[c->dest_len] = '/';
+    memcpy(out + c->dest_len + 1, name, len);
+    out[c->dest_len + 1 + len] = '\0';
+    return (int)(c->dest_len + 1 + len);
+}
+
+/* Pick the path out of pax extended header records ("len key=value\n").
+ * Returns -1 if a record's length runs past the header or does not end
+ * on its newline. */
+static int pax_path(const uint8_t *p, size_t size, char *name)
+{
+    size_t i = 0;
+    while (i < size) {
+        size_t len = 0, j = i;
+        while (j < size && p[j] >= '0' && p[j] <= '9') {
+            len = len * 10 + (p[j++] - '0');
+            if (len > size - i) return -1;
+        }
+        if (j >= size || p[j] != ' ' || len <= j - i + 1) return -1;
+        size_t end = i + len - 1; /* the newline */
+        if (p[end] != '\n') return -1;
+        j++;
+        if (end - j > 5 && memcmp(p + j, "path=", 5) == 0 && end - j - 5 < TAR_PATH_MAX) {
+            memcpy(name, p + j + 5, end - j - 5);
+            name[end - j - 5] = '\0';
+        }
+        i += len;
+    }
+    return 0;
+}
+
+/* Write a file that does not fit the read buffer through a descriptor. */
+static void extract_large(struct tar_ctx *c, const char *path, size_t size, unsigned int mode)
+{
+    tar_flush(c);
+    int r = fs_create(path, NULL, 0);
+    int fd = r == FS_OK ? fs_open(path, 0) : r;
+    size_t left = size;
+    if (fd >= 0) {
+        while (left) {
+            size_t a = src_avail(c);
+            if (!a) break;
+            if (a > left) a = left;
+            r = fs_write(fd, tar_stage + c->pos, a);
+            if (r < 0) break;
+            c->pos += a;
+            left -= a;
+        }
+        fs_close(fd);
+        if (r >= 0) r = left ? FS_EIO : fs_chmod(path, mode);
+    } else {
+        r = fd;
+    }
+    src_skip(c, left);
+    if (r < 0) {
+        tar_fail(c, r);
+        c->st->skipped++;
+        return;
+    }
+    c->st->files++;
+    c->st->bytes += size;
+}
+
+static int tar_extract(struct tar_ctx *c, const char *dest, struct tar_stats *st)
+{
+    struct tar_stats dummy;
+    c->st = st ? st : &dummy;
+    memset(c->st, 0, sizeof(*c->st));
+    c->err = FS_OK;
+    c->arena_used = 0;
+    size_t dlen = strlen(dest);
+    while (dlen > 0 && dest[dlen-1] == '/') dlen--;
+    if (dlen >= TAR_PATH_MAX) return FS_EINVAL;
+    memcpy(c->dest, dest, dlen);
+    c->dest[dlen] = '\0';
+    c->dest_len = dlen;
+    if (dlen > 0) {
+        int r = fs_mkdir(c->dest);
+        if (r != FS_OK) return r;
+    }
+
+    struct ustar_header h;
+    char name[TAR_PATH_MAX];
+    char path[TAR_PATH_MAX];
+    int long_name = 0; /* 1: name holds the next member's name; -1: it was too long */
+    for (;;) {
+        const uint8_t *p = src_peek(c, TAR_BLOCK);
+        if (!p || memcmp(p, tar_zero, TAR_BLOCK) == 0) break;
+        memcpy(&h, p, TAR_BLOCK);
+        c->pos += TAR_BLOCK;
+        if (!header_valid(&h)) {
+            tar_fail(c, FS_EINVAL);
+            break;
+        }
+        uint64_t size64 = parse_num(h.size, sizeof(h.size));
+        size_t size = (size_t)size64;
+        if (size != size64) {
+            tar_fail(c, FS_EINVAL);
+            break;
+        }
+        char type = h.typeflag;
+
+        if (type == 'L' || type == 'x') {
+            /* metadata for the next member */
+            const uint8_t *d = size < TAR_STAGE ? src_peek(c, size) : NULL;
+            long_name = -1;
+            if (d && type == 'L' && size > 0 && size <= TAR_PATH_MAX) {
+                field_copy(name, (const char *)d, size < TAR_PATH_MAX ? size : TAR_PATH_MAX - 1);
+                long_name = size < TAR_PATH_MAX || d[TAR_PATH_MAX - 1] == '\0' ? 1 : -1;
+            } else if (d && type == 'x') {
+                name[0] = '\0';
+                if (pax_path(d, size, name) != 0) {
+                    tar_fail(c, FS_EINVAL);
+                    break;
+                }
+                long_name = name[0] ? 1 : 0;
+            }
+            if (src_skip(c, size + pad_of(size)) != 0) break;
+            continue;
+        }
+        if (type == 'g' || type == 'K') {
+            if (src_skip(c, size + pad_of(size)) != 0) break;
+            continue;
+        }
+
+        if (!long_name) {
+            size_t n = 0;
+            if (h.prefix[0] && memcmp(h.magic, "ustar", 5) == 0) {
+                n = field_copy(name, h.prefix, sizeof(h.prefix));
+                name[n++] = '/';
+            }
+            field_copy(name + n, h.name, sizeof(h.name));
+        }
+        int len = long_name < 0 ? -1 : member_path(c, name, path);
+        long_name = 0;
+        unsigned int mode = (unsigned int)parse_num(h.mode, sizeof(h.mode)) & 07777;
+
+        if (type == '5' && len >= 0) {
+            if (len > 0) {
+                tar_reserve(c, (size_t)len);
+                const char *ap = tar_arena_path(c, path, (size_t)len);
+                tar_queue(FS_OP_MKDIR, FS_SQE_LINK, ap, NULL, 0, 0);
+                tar_queue(FS_OP_CHMOD, 0, ap, NULL, mode, TAG_DIR);
+            }
+        } else if ((type == '0' || type == '\0' || type == '7') && len > 0) {
+            const uint8_t *d = src_peek(c, size);
+            if (!d) {
+                if (c->mem) {
+                    tar_fail(c, FS_EINVAL); /* truncated */
+                    break;
+                }
+                extract_large(c, path, size, mode);
+            } else {
+                tar_reserve(c, (size_t)len);
+                const char *ap = tar_arena_path(c, path, (size_t)len);
+                tar_queue(FS_OP_CREATE, FS_SQE_LINK, ap, d, size, 0);
+                tar_queue(FS_OP_CHMOD, 0, ap, NULL, mode, ((uint64_t)size << 2) | TAG_FILE);
+                c->pos += size;
+            }
+            if (src_skip(c, pad_of(size)) != 0) break;
+            continue;
+        } else {
+            c->st->skipped++;
+        }
+        if (src_skip(c, size + pad_of(size)) != 0) break;
+    }
+    tar_flush(c);
+    return c->err;
+}
+
+int tar_extract_mem(const uint8_t *data, size_t size, const char *dest, struct tar_stats *st)
+{
+    if (!data || !dest) return FS_EINVAL;
+    if (tar_buffers() != FS_OK) return FS_EIO;
+    static struct tar_ctx c;
+    c.mem = data;
+    c.size = size;
+    c.pos = 0;
+    c.fd = -1;
+    return tar_extract(&c, dest, st);
+}
+
+int tar_extract_file(const char *archive, const char *dest, struct tar_stats *st)
+{
+    if (!archive || !dest) return FS_EINVAL;
+    size_t size;
+    const uint8_t *data = fs_map(archive, &size);
+    if (data) return tar_extract_mem(data, size, dest, st);
+    if (tar_buffers() != FS_OK) return FS_EIO;
+    static struct tar_ctx c;
+    c.mem = NULL;
+    c.size = 0;
+    c.pos = 0;
+    c.fd = fs_open(archive, FS_O_RDONLY);
+    if (c.fd < 0) return c.fd;
+    int r = tar_extract(&c, dest, st);
+    fs_close(c.fd);
+    return r;
+}
+
+/* ---- creation ---- */
+
+struct tar_writer {
+    int fd;
+    size_t used;
+    int err;
+};
+
+static void out_flush(struct tar_writer *w)
+{
+    if (w->used && !w->err) {
+        int r = fs_write(w->fd, tar_out, w->used);
+        if (r < 0) w->err = r;
+    }
+    w->used = 0;
+}
+
+static void out_put(struct tar_writer *w, const void *data, size_t n)
+{
+    const uint8_t *p = data;
+    if (w->used == 0 && n >= TAR_OUT) {
+        /* large contents go to the archive without a copy */
+        int r = w->err ? 0 : fs_write(w->fd, p, n);
+        if (r < 0) w->err = r;
+        return;
+    }
+    while (n) {
+        if (w->used == TAR_OUT) out_flush(w);
+        size_t k = TAR_OUT - w->used;
+        if (k > n) k = n;
+        memcpy(tar_out + w->used, p, k);
+        w->used += k;
+        p += k;
+        n -= k;
+    }
+}
+
+static void put_octal(char *field, size_t width, uint32_t value)
+{
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i-- > 0; ) {
+        field[i] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+static void put_header(struct tar_writer *w, struct ustar_header *h, char type, uint32_t size,
+                       unsigned int mode, unsigned int uid, unsigned int gid)
+{
+    put_octal(h->mode, sizeof(h->mode), mode & 07777);
+    put_octal(h->uid, sizeof(h->uid), uid);
+    put_octal(h->gid, sizeof(h->gid), gid);
+    put_octal(h->size, sizeof(h->size), size);
+    put_octal(h->mtime, sizeof(h->mtime), 0);
+    h->typeflag = type;
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    uint32_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i) sum += ((const uint8_t *)h)[i];
+    put_octal(h->chksum, 7, sum);
+    h->chksum[7] = ' ';
+    out_put(w, h, TAR_BLOCK);
+}
+
+/* Emit the header(s) for member rel, splitting long names into the ustar
+ * prefix or, failing that, a GNU long name record. */
+static void member_header(struct tar_writer *w, const char *rel, char type, uint32_t size,
+                          unsigned int mode, unsigned int uid, unsigned int gid)
+{
+    struct ustar_header h;
+    size_t len = strlen(rel);
+    memset(&h, 0, sizeof(h));
+    if (len <= sizeof(h.name)) {
+        memcpy(h.name, rel, len);
+        put_header(w, &h, type, size, mode, uid, gid);
+        return;
+    }
+    for (size_t i = len - sizeof(h.name) - 1; i < len && i <= sizeof(h.prefix); ++i) {
+        if (rel[i] != '/' || i + 1 == len) continue;
+        memcpy(h.prefix, rel, i);
+        memcpy(h.name, rel + i + 1, len - i - 1);
+        put_header(w, &h, type, size, mode, uid, gid);
+        return;
+    }
+    memcpy(h.name, "././@LongLink", 13);
+    put_header(w, &h, 'L', (uint32_t)len + 1, 0, 0, 0);
+    out_put(w, rel, len + 1);
+    out_put(w, tar_zero, pad_of(len + 1));
+    memset(&h, 0, sizeof(h));
+    memcpy(h.name, rel, sizeof(h.name));
+    put_header(w, &h, type, size, mode, uid, gid);
+}
+
+/* Directories still to be listed, as consecutive NUL-terminated paths. */
+struct dir_stack {
+    char *buf;
+    size_t used, cap;
+};
+
+static int stack_push(struct dir_stack *s, const char *path)
+{
+    size_t len = strlen(path) + 1;
+    if (s->used + len > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : HEAP_BLOCK_SIZE;
+        while (cap < s->used + len) cap *= 2;
+        char *buf = kmalloc(cap);
+        if (!buf) return FS_EIO;
+        if (s->buf) {
+            memcpy(buf, s->buf, s->used);
+            kfree(s->buf);
+        }
+        s->buf = buf;
+        s->cap = cap;
+    }
+    memcpy(s->buf + s->used, path, len);
+    s->used += len;
+    return FS_OK;
+}
+
+static int stack_pop(struct dir_stack *s, char *out)
+{
+    if (s->used == 0) return 0;
+    size_t start = s->used - 1;
+    while (start > 0 && s->buf[start - 1] != '\0') start--;
+    strcpy(out, s->buf + start);
+    s->used = start;
+    return 1;
+}
+
+/* Append the contents of a file that has to be read through a descriptor. */
+static void put_contents(struct tar_writer *w, const char *path, size_t size)
+{
+    int fd = fs_open(path, FS_O_RDONLY);
+    size_t done = 0;
+    if (fd >= 0) {
+        while (done < size) {
+            if (w->used == TAR_OUT) out_flush(w);
+            size_t want = TAR_OUT - w->used;
+            if (want > size - done) want = size - done;
+            int r = fs_read(fd, tar_out + w->used, want);
+            if (r <= 0) break;
+            w->used += (size_t)r;
+            done += (size_t)r;
+        }
+        fs_close(fd);
+    }
+    /* keep the archive consistent with the size already in the header */
+    while (done < size) {
+        size_t k = size - done < TAR_BLOCK ? size - done : TAR_BLOCK;
+        out_put(w, tar_zero, k);
+        done += k;
+    }
+}
+
+int tar_create(const char *dir, const char *archive, struct tar_stats *st)
+{
+    struct tar_stats dummy;
+    struct fs_stat ds;
+    if (!st) st = &dummy;
+    memset(st, 0, sizeof(*st));
+    if (!dir || !archive) return FS_EINVAL;
+    if (fs_stat(dir, &ds) != FS_OK || !ds.is_dir) return FS_ENOENT;
+    if (tar_buffers() != FS_OK) return FS_EIO;
+
+    char cur[TAR_PATH_MAX];
+    char path[TAR_PATH_MAX];
+    char rel[TAR_PATH_MAX + 1];
+    size_t root_len = strlen(dir);
+    while (root_len > 0 && dir[root_len-1] == '/') root_len--;
+    if (root_len >= TAR_PATH_MAX) return FS_EINVAL;
+
+    int r = fs_create(archive, NULL, 0);
+    if (r != FS_OK) return r;
+    struct tar_writer w = { fs_open(archive, 0), 0, FS_OK };
+    if (w.fd < 0) return w.fd;
+
+    struct dir_stack stack = { NULL, 0, 0 };
+    memcpy(cur, dir, root_len);
+    cur[root_len] = '\0';
+    r = stack_push(&stack, cur);
+    while (r == FS_OK && !w.err && stack_pop(&stack, cur)) {
+        const struct fs_file *f;
+        for (unsigned int i = 0; fs_listdir(cur[0] ? cur : "/", i, &f) == FS_OK; ++i) {
+            /* the listing entry is only valid until the next call */
+            struct fs_file e = *f;
+            if (strlen(f->name) >= TAR_PATH_MAX) {
+                st->skipped++;
+                continue;
+            }
+            strcpy(path, f->name);
+            if (strcmp(path, archive) == 0) continue;
+            strcpy(rel, path + root_len + 1);
+            if (e.mode & FS_S_IFDIR) {
+                strcat(rel, "/");
+                member_header(&w, rel, '5', 0, e.mode, e.uid, e.gid);
+                st->dirs++;
+                r = stack_push(&stack, path);
+                if (r != FS_OK) break;
+                continue;
+            }
+            member_header(&w, rel, '0', (uint32_t)e.size, e.mode, e.uid, e.gid);
+            if (e.data) out_put(&w, e.data, e.size);
+            else put_contents(&w, path, e.size);
+            out_put(&w, tar_zero, pad_of(e.size));
+            st->files++;
+            st->bytes += e.size;
+        }
+    }
+    if (stack.buf) kfree(stack.buf);
+    out_put(&w, tar_zero, TAR_BLOCK);
+    out_put(&w, tar_zero, TAR_BLOCK);
+    out_flush(&w);
+    fs_close(w.fd);
+    return w.err ? w.err : r;
+}
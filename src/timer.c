@@ -0,0 +1,104 @@
+#include "../include/timer.h"
+#include "../include/sleep.h"
+#include "../include/io.h"
+
+#define PIT_HZ 1193182u
+#define PIT_CH2 0x42
+#define PIT_CMD 0x43
+#define PIT_GATE 0x61
+#define CALIBRATE_MS 10u
+
+static uint32_t ticks_per_ms = 0;
+static uint64_t boot_ticks = 0;
+
+uint64_t timer_ticks(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* 64 by 32 bit division; libgcc is not linked in. */
+static uint64_t div64_32(uint64_t n, uint32_t d)
+{
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    uint32_t qhi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t qlo;
+    __asm__("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)qhi << 32) | qlo;
+}
+
+void timer_init(void)
+{
+    /* channel 2 counts down once (mode 0) while its gate is high; the
+     * speaker stays off */
+    uint32_t latch = PIT_HZ / (1000 / CALIBRATE_MS);
+    output_bytes(PIT_GATE, (input_bytes(PIT_GATE) & ~0x02) | 0x01);
+    output_bytes(PIT_CMD, 0xB0);
+    output_bytes(PIT_CH2, latch & 0xFF);
+    output_bytes(PIT_CH2, latch >> 8);
+    uint64_t start = timer_ticks();
+    uint32_t spins = 0;
+    boot_ticks = start;
+    while (!(input_bytes(PIT_GATE) & 0x20)) {
+        if (++spins > 100000000u) return; /* no PIT: stay uncalibrated */
+    }
+    uint64_t elapsed = timer_ticks() - start;
+    ticks_per_ms = (uint32_t)div64_32(elapsed, CALIBRATE_MS);
+}
+
+uint64_t timer_us(uint64_t ticks)
+{
+    if (ticks_per_ms < 1000) return 0;
+    return div64_32(ticks, ticks_per_ms / 1000);
+}
+
+uint32_t timer_ms(uint64_t ticks)
+{
+    if (!ticks_per_ms) return 0;
+    return (uint32_t)div64_32(ticks, ticks_per_ms);
+}
+
+uint32_t timer_khz(void)
+{
+    return ticks_per_ms;
+}
+
+uint32_t timer_uptime_ms(void)
+{
+    return timer_ms(timer_ticks() - boot_ticks);
+}
+
+uint32_t timer_rate(uint64_t amount, uint64_t ticks)
+{
+    uint64_t us = timer_us(ticks);
+    if (!us) return 0;
+    /* keep the divisor in 32 bits and the product below 2^64 */
+    while (us >> 32 || amount >> 44) {
+        us >>= 1;
+        amount >>= 1;
+    }
+    if (!us) return 0;
+    uint64_t rate = div64_32(amount * 1000000u, (uint32_t)us);
+    return rate >> 32 ? 0xFFFFFFFFu : (uint32_t)rate;
+}
+
+void udelay(uint32_t us)
+{
+    uint64_t start = timer_ticks();
+    if (!ticks_per_ms) {
+        /* uncalibrated: an I/O port read takes about a microsecond */
+        while (us--) input_bytes(0x80);
+        return;
+    }
+    uint64_t wait = (uint64_t)us * (ticks_per_ms / 1000);
+    while (timer_ticks() - start < wait)
+        ;
+}
+
+void sleep(uint32_t milliseconds)
+{
+    while (milliseconds--) udelay(1000);
+}
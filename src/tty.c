@@ -3,12 +3,52 @@
 #include "../include/io.h"
 #include "../include/bool.h"
 #include "../include/kbd.h"
+#include "../include/timer.h"
 
 size_t terminal_row;
 size_t terminal_column;
 static uint16_t *const VGA_MEMORY = (uint16_t *)0xb8000;
 uint8_t terminal_color;
-uint16_t *terminal_buffer;
+
+/* Text is drawn into a ring of lines in RAM: the screen is its newest
+ * VGA_HEIGHT lines and the ones before are the scrollback, so scrolling
+ * only moves the ring on. terminal_flush copies the rows changed since the
+ * last flush to video memory in one string move per run of rows: the text
+ * buffer is uncached MMIO, and storing into it a character at a time is
+ * slow, under virtualization most of all. Lines are placed in the 32 KiB
+ * text window by their number and the CRTC start address pans the display
+ * over them; only when the screen runs off the end of the window is it
+ * drawn again at the top.
+ *
+ * There is no timer interrupt, so the screen is flushed whenever the
+ * keyboard is polled or the cursor moved (the end of every command), and
+ * at newlines once FLUSH_MS have passed since the last flush. */
+#define SCROLLBACK_LINES 4096          /* a power of two */
+#define VIDEO_CELLS (0x8000 / 2)
+#define VIDEO_ROWS (VIDEO_CELLS / 80)  /* whole rows in the text window */
+#define ALL_ROWS ((1u << 25) - 1)
+#define FLUSH_MS 20
+static uint16_t lines[SCROLLBACK_LINES][80];
+static uint32_t screen_top;  /* number of the line at row 0 of the screen */
+static uint32_t view_back;   /* lines the display is scrolled back from it */
+static uint32_t vga_base;    /* line drawn at row 0 of video memory */
+static uint32_t shown_top;   /* line at the top of the display */
+static uint32_t dirty_rows;  /* bit y: display row y not yet in video memory */
+static int redraw;           /* lines out of view may have changed: no panning */
+static uint64_t last_flush;
+
+static inline uint16_t *line(uint32_t n)
+{
+    return lines[n & (SCROLLBACK_LINES - 1)];
+}
+
+static void crtc_start(uint16_t cell)
+{
+    output_bytes(FB_COMMAND_PORT, FB_START_HIGH_COMMAND);
+    output_bytes(FB_DATA_PORT, (unsigned char)(cell >> 8));
+    output_bytes(FB_COMMAND_PORT, FB_START_LOW_COMMAND);
+    output_bytes(FB_DATA_PORT, (unsigned char)(cell & 0xFF));
+}
 
 /* default font color used across the kernel; defined here to avoid
     multiple-definition issues when included from many translation units. */
@@ -33,38 +73,118 @@ void terminal_initialize(enum vga_color font_color, enum vga_color background_co
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = make_color(font_color, background_color);
-    terminal_buffer = VGA_MEMORY;
+    /* start over with an empty history */
+    screen_top = 0;
+    view_back = 0;
     size_t y;
     for (y = 0; y < VGA_HEIGHT; y++)
     {
         size_t x;
         for (x = 0; x < VGA_WIDTH; x++)
         {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = make_vgaentry(' ', terminal_color);
+            line(y)[x] = make_vgaentry(' ', terminal_color);
         }
     }
+    vga_base = 0;
+    shown_top = 0;
+    crtc_start(0);
+    dirty_rows = ALL_ROWS;
+    terminal_flush();
 }
 
-void terminal_scroll()
+void terminal_flush(void)
 {
-    int i;
-    for (i = 0; i < VGA_HEIGHT; i++)
+    uint32_t top = screen_top - view_back;
+    if (top != shown_top || redraw)
     {
-        int m;
-        for (m = 0; m < VGA_WIDTH; m++)
+        /* the display moved on: pan over lines already in video memory,
+         * or draw the whole screen again at the top of the window */
+        if (redraw || top < shown_top || top - vga_base > VIDEO_ROWS - VGA_HEIGHT)
         {
-            terminal_buffer[i * VGA_WIDTH + m] = terminal_buffer[(i + 1) * VGA_WIDTH + m];
+            vga_base = top;
+            dirty_rows = ALL_ROWS;
+            redraw = 0;
         }
-        terminal_row--;
+        crtc_start((uint16_t)((top - vga_base) * VGA_WIDTH));
+        shown_top = top;
     }
+    uint32_t rows = dirty_rows;
+    if (!rows)
+        return;
+    dirty_rows = 0;
+    last_flush = timer_ticks();
+    size_t y = 0;
+    while (y < VGA_HEIGHT)
+    {
+        if (!(rows & (1u << y)))
+        {
+            y++;
+            continue;
+        }
+        /* rows are contiguous in video memory but not always in the ring */
+        size_t first = y;
+        uint32_t slot = (top + y) & (SCROLLBACK_LINES - 1);
+        while (y < VGA_HEIGHT && (rows & (1u << y)) && (y == first || ((top + y) & (SCROLLBACK_LINES - 1))))
+            y++;
+        void *dst = VGA_MEMORY + (top - vga_base + first) * VGA_WIDTH;
+        const void *src = lines[slot];
+        uint32_t count = (y - first) * VGA_WIDTH / 2; /* two cells per dword */
+        __asm__ __volatile__("rep movsl"
+                             : "+D"(dst), "+S"(src), "+c"(count)
+                             :
+                             : "memory");
+    }
+}
+
+void terminal_scrollback(int pages)
+{
+    uint32_t most = screen_top < SCROLLBACK_LINES - VGA_HEIGHT ? screen_top : SCROLLBACK_LINES - VGA_HEIGHT;
+    uint32_t back = view_back;
+    if (pages == 0)
+        back = 0;
+    else if (pages > 0)
+        back += (uint32_t)pages * (VGA_HEIGHT - 1);
+    else
+        back = back > (uint32_t)-pages * (VGA_HEIGHT - 1) ? back - (uint32_t)-pages * (VGA_HEIGHT - 1) : 0;
+    if (back > most)
+        back = most;
+    if (back == view_back)
+        return;
+    view_back = back;
+    redraw = 1;
+}
+
+unsigned int terminal_cursor_cell(size_t x, size_t y)
+{
+    uint32_t row = screen_top + (uint32_t)y - shown_top;
+    if (row >= VGA_HEIGHT)
+        return VIDEO_CELLS - 1; /* past the last row the display can reach */
+    return (shown_top - vga_base + row) * VGA_WIDTH + x;
+}
+
+void terminal_scroll()
+{
+    if (view_back)
+        terminal_scrollback(0);
+    screen_top++;
+    uint16_t *bottom = line(screen_top + VGA_HEIGHT - 1);
+    for (size_t m = 0; m < VGA_WIDTH; m++)
+        bottom[m] = make_vgaentry(' ', terminal_color);
+    /* rows keep their place in video memory, so their dirty bits move up
+     * with them */
+    dirty_rows = (dirty_rows >> 1) | 1u << (VGA_HEIGHT - 1);
     terminal_row = VGA_HEIGHT - 1;
 }
 
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y)
 {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = make_vgaentry(c, color);
+    if (x >= VGA_WIDTH || y >= VGA_HEIGHT)
+        return;
+    /* output brings the display back to the live screen */
+    if (view_back)
+        terminal_scrollback(0);
+    line(screen_top + y)[x] = make_vgaentry(c, color);
+    dirty_rows |= 1u << y;
 }
 
 void terminal_putchar(char c)
@@ -75,6 +195,10 @@ void terminal_putchar(char c)
         terminal_row++;
         if (terminal_row == VGA_HEIGHT)
             terminal_scroll();
+        /* long running output still shows up as it goes */
+        uint32_t khz = timer_khz();
+        if (khz && timer_ticks() - last_flush > (uint64_t)khz * FLUSH_MS)
+            terminal_flush();
         return;
     }
     else if (c == '\t')
@@ -93,9 +217,7 @@ void terminal_putchar(char c)
     {
         terminal_column = 0;
         if (++terminal_row == VGA_HEIGHT)
-        {
-            terminal_row = 0;
-        }
+            terminal_scroll();
     }
 }
 
@@ -118,7 +240,6 @@ void term_putc(char c, enum vga_color char_color)
     unsigned int i = 0; // place holder for text string position
     unsigned int j = 0; // place holder for video buffer position
 
-    int index;
     switch (c)
     {
     case '\n': // Newline characters should return the column to 0, and increment the row
@@ -130,9 +251,8 @@ void term_putc(char c, enum vga_color char_color)
 
     default: // Normal characters just get displayed and then increment the column
     {
-        index = (VGA_WIDTH * terminal_row) + terminal_column; // Like before, calculate the buffer index
-        VGA_MEMORY[index] = c;
-        VGA_MEMORY[index + 1] = char_color;
+        if (terminal_row < VGA_HEIGHT) // the screen is drawn through the shadow buffer
+            terminal_putentryat(c, make_color(char_color, COLOR_BLACK), terminal_column, terminal_row);
         // terminal_column += 2;
         break;
     }
@@ -11,6 +11,8 @@
 static user_t users[MAX_USERS];
 static int user_count = 0;
 static int current = -1;
+static char passwd_path[FS_EVENT_PATH];
+static int passwd_wd = -1;
 
 /* helper: parse a line of form name:passwd:uid:gid */
 static void parse_line(char *line)
@@ -36,11 +38,12 @@ static void parse_line(char *line)
         u->passwd[0] = '\0';
     }
     u->uid = 0; u->gid = 0;
+    u->runtime = 0;
     if (fields[2]) u->uid = (unsigned int)atoi(fields[2]);
     if (fields[3]) u->gid = (unsigned int)atoi(fields[3]);
 }
 
-int user_init_from_file(const char *path)
+static int load_file(const char *path)
 {
     /* attempt to open file from embedded initrd */
     fs_fd_t fd = fs_open(path, FS_O_RDONLY);
@@ -71,6 +74,43 @@ int user_init_from_file(const char *path)
     return 0;
 }
 
+/* The passwd file changed: read it again. Users added at runtime stay, and
+ * whoever is logged in stays logged in if the file still has them. */
+static void passwd_changed(const struct fs_event *ev, void *arg)
+{
+    (void)ev; (void)arg;
+    user_t old[MAX_USERS];
+    int old_count = user_count;
+    char who[USER_NAME_MAX];
+    who[0] = '\0';
+    if (current >= 0 && current < user_count) strcpy(who, users[current].name);
+    memcpy(old, users, sizeof(users));
+    user_count = 0;
+    if (load_file(passwd_path) != 0) {
+        /* replaced by something unreadable: keep what we had */
+        memcpy(users, old, sizeof(users));
+        user_count = old_count;
+        return;
+    }
+    for (int i = 0; i < old_count && user_count < MAX_USERS; ++i) {
+        if (old[i].runtime && !user_get_by_name(old[i].name)) users[user_count++] = old[i];
+    }
+    current = -1;
+    for (int i = 0; who[0] && i < user_count; ++i) {
+        if (strcmp(users[i].name, who) == 0) current = i;
+    }
+}
+
+int user_init_from_file(const char *path)
+{
+    int r = load_file(path);
+    if (r == 0 && passwd_wd < 0 && strlen(path) < sizeof(passwd_path)) {
+        strcpy(passwd_path, path);
+        passwd_wd = fs_watch(path, FS_EV_CREATE | FS_EV_WRITE | FS_EV_RENAME, passwd_changed, NULL);
+    }
+    return r;
+}
+
 int user_login(const char *name, const char *password)
 {
     if (!name) return -1;
@@ -158,6 +198,7 @@ int user_add(const char *name, const char *password)
     /* Assign uid/gid automatically */
     u->uid = user_count;  /* Simple auto-increment */
     u->gid = user_count;
+    u->runtime = 1;
     
     return 0;
 }
@@ -42,6 +42,9 @@ def main():
             rel = '/' + rel.replace('\\', '/')
             var, size, uid, gid, mode = emit_c(full, rel)
             entries.append((rel, var, size, uid, gid, mode))
+    # ramfs expands directories lazily from ranges of this table, which
+    # relies on it being sorted by path
+    entries.sort(key=lambda e: e[0].encode('utf-8'))
     print('const struct fs_file initrd_files[] = {')
     for path, var, size, uid, gid, mode in entries:
         print(f'    {{ "{path}", {var}, {size}, {uid}, {gid}, {mode} }},')